@@ -0,0 +1,796 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 合成シーンの書き出し・読み込みを段階ごとに計測する
+// 使い方: halFBXBench [--scale N] [--repeat N] [--scene 名前,...]
+//                     [--simd scalar|sse2|avx2] [--work-dir パス] [--json パス]
+//                     [--compression deflate|store] [--level 1-9]
+//                     [--cache パス] [--weld] [--reorder]
+//                     [--lods 割合,...] [--session] [--animation フレーム数]
+//                     [--skin ボーン数] [--influences N] [--weight-bits N]
+//                     [--indexed]
+
+#include "../include/io.h"
+#include "../src/geometry_kernels.h"
+#include "../src/mesh_instances.h"
+#include "../src/parallel.h"
+#include "scene_generator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+#endif
+
+/// @brief 1つの段階の計測結果
+struct PhaseResult
+{
+    std::string name;
+    std::vector<double> seconds; // 繰り返しごとの時間
+    uint64_t bytes = 0;          // 読み書きしたファイルのバイト数
+};
+
+/// @brief 1つのシーンの計測結果
+struct SceneResult
+{
+    std::string name;
+    size_t corners = 0;
+    size_t meshes = 0;
+    size_t nodes = 0;
+    size_t materials = 0;
+    uint64_t peak_rss = 0;
+    std::vector<PhaseResult> phases;
+};
+
+/// @brief コマンドラインの設定
+struct BenchOptions
+{
+    size_t scale = 1;
+    size_t repeat = 3;
+    std::vector<std::string> scenes;
+    std::filesystem::path work_dir;
+    std::string json_path;
+    ArrayCompression compression = ARRAY_COMPRESSION_DEFLATE;
+    int compression_level = 0;
+    std::string cache_dir; // 空なら書き出しキャッシュを使わない
+    bool weld = false;     // 法線・UVの同じ値をまとめる
+    bool reorder = false;  // ポリゴンを頂点キャッシュ向けに並べ替える
+    std::vector<double> lod_ratios; // LOD1から順の残す三角形数の割合
+    IOSession* session = nullptr; // FbxManagerを使い回す場合のセッション
+    size_t animation_frames = 0;  // 全ノードに付けるアニメーションのフレーム数
+    size_t skin_bones = 0;        // 全メッシュに付けるスキンのボーン数
+    size_t max_influences = 0;    // 頂点ごとに残すボーンの影響の数
+    int weight_bits = 0;          // スキンの重みを量子化するビット数
+    bool indexed = false; // UV・法線を値とポリゴン頂点ごとの番号で読み込む
+};
+
+/// @brief メッシュに付けるスキン (Skinとそれが参照する配列を持つ)
+struct BenchSkin
+{
+    Skin skin = {};
+    std::vector<unsigned int> offsets;
+    std::vector<unsigned int> bones;
+    std::vector<float> weights;
+};
+
+/// @brief 書き出すシーン (IODataと、それが参照するビルダー・配列を持つ)
+struct BenchScene
+{
+    std::vector<MeshBuilder*> builders;
+    std::vector<Mesh*> meshes;
+    std::vector<Material> materials;
+    std::vector<std::string> material_names;
+    std::vector<std::vector<Object>> children;
+    std::vector<std::vector<Material*>> slots;
+    std::vector<std::vector<double>> animations; // ノードごとのフレームの行列
+    std::vector<std::string> bone_names;
+    std::vector<Object> bones;       // スキンのボーン (Armatureの子)
+    std::vector<Object*> bone_list;  // Skin::bonesが指す配列
+    std::vector<Object> top;         // ボーンを足したルートの子
+    std::deque<BenchSkin> skins;     // メッシュごと
+    Object root = {};
+    IOData data = {};
+
+    BenchScene() = default;
+    BenchScene(const BenchScene&) = delete;
+    BenchScene& operator=(const BenchScene&) = delete;
+    ~BenchScene()
+    {
+        for (auto builder : builders) delete_mesh_builder(builder);
+    }
+};
+
+bool parse_options(int argc, char** argv, BenchOptions& out);
+bool run_scene(const std::string& name, const BenchOptions& options,
+               SceneResult& out);
+void build_meshes(const SceneSource& source, BenchScene& scene);
+void compute_mesh_normals(const SceneSource& source, BenchScene& scene);
+void build_tree(const SceneSource& source, BenchScene& scene);
+void build_object(const SceneSource& source, size_t node, BenchScene& scene,
+                  Object& out);
+void build_animations(size_t frame_count, BenchScene& scene);
+void build_skins(size_t bone_count, BenchScene& scene);
+PhaseResult time_phase(const char* name, size_t repeat,
+                       const std::function<void()>& prepare,
+                       const std::function<void()>& fn);
+PhaseResult time_phase(const char* name, size_t repeat,
+                       const std::function<void()>& fn);
+uint64_t file_size_or_zero(const std::filesystem::path& path);
+void reset_peak_rss();
+uint64_t peak_rss_bytes();
+void print_scene(const SceneResult& result);
+bool write_json(const std::string& path, const BenchOptions& options,
+                const std::vector<SceneResult>& results);
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    if (!parse_options(argc, argv, options)) return 1;
+    std::unique_ptr<IOSession, void (*)(IOSession*)> session(
+        options.session, delete_io_session);
+
+    std::printf("simd: %s, threads: %zu, fbxsdk: %s\n",
+                simd_level_name(simd_level()),
+                ThreadPool::instance().thread_count(),
+#ifdef HALFBX_WITH_FBXSDK
+                "yes"
+#else
+                "no"
+#endif
+    );
+
+    std::vector<SceneResult> results;
+    for (auto& name : options.scenes)
+    {
+        SceneResult result;
+        if (!run_scene(name, options, result)) return 1;
+        print_scene(result);
+        results.push_back(std::move(result));
+    }
+
+    if (!options.json_path.empty() &&
+        !write_json(options.json_path, options, results))
+        return 1;
+    return 0;
+}
+
+/// @brief コマンドラインを読む
+/// @param argc 引数の数
+/// @param argv 引数
+/// @param out 設定の出力先
+/// @return 読めたかどうか (不明な引数ならfalse)
+bool parse_options(int argc, char** argv, BenchOptions& out)
+{
+    out.work_dir = std::filesystem::temp_directory_path();
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            return i + 1 < argc ? argv[++i] : "";
+        };
+        if (arg == "--scale")
+            out.scale = std::max<size_t>(1, std::stoul("0" + value()));
+        else if (arg == "--repeat")
+            out.repeat = std::max<size_t>(1, std::stoul("0" + value()));
+        else if (arg == "--work-dir")
+            out.work_dir = value();
+        else if (arg == "--json")
+            out.json_path = value();
+        else if (arg == "--scene")
+        {
+            auto list = value();
+            for (size_t begin = 0; begin <= list.size();)
+            {
+                auto end = std::min(list.find(',', begin), list.size());
+                if (end > begin)
+                    out.scenes.push_back(list.substr(begin, end - begin));
+                begin = end + 1;
+            }
+        }
+        else if (arg == "--compression")
+        {
+            auto mode = value();
+            if (mode == "deflate")
+                out.compression = ARRAY_COMPRESSION_DEFLATE;
+            else if (mode == "store")
+                out.compression = ARRAY_COMPRESSION_STORE;
+            else
+            {
+                std::cerr << "Unknown compression: " << mode << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--level")
+            out.compression_level = std::stoi("0" + value());
+        else if (arg == "--cache")
+            out.cache_dir = value();
+        else if (arg == "--weld")
+            out.weld = true;
+        else if (arg == "--reorder")
+            out.reorder = true;
+        else if (arg == "--indexed")
+            out.indexed = true;
+        else if (arg == "--session")
+        {
+            if (out.session == nullptr) out.session = create_io_session(0);
+        }
+        else if (arg == "--animation")
+            out.animation_frames = std::stoul("0" + value());
+        else if (arg == "--skin")
+            out.skin_bones = std::stoul("0" + value());
+        else if (arg == "--influences")
+            out.max_influences = std::stoul("0" + value());
+        else if (arg == "--weight-bits")
+            out.weight_bits = std::stoi("0" + value());
+        else if (arg == "--lods")
+        {
+            auto list = value();
+            for (size_t begin = 0; begin <= list.size();)
+            {
+                auto end = std::min(list.find(',', begin), list.size());
+                if (end > begin)
+                    out.lod_ratios.push_back(
+                        std::stod(list.substr(begin, end - begin)));
+                begin = end + 1;
+            }
+        }
+        else if (arg == "--simd")
+        {
+            auto level = value();
+            if (level == "scalar")
+                set_simd_level(SimdLevel::Scalar);
+            else if (level == "sse2")
+                set_simd_level(SimdLevel::SSE2);
+            else if (level == "avx2")
+                set_simd_level(SimdLevel::AVX2);
+            else
+            {
+                std::cerr << "Unknown SIMD level: " << level << std::endl;
+                return false;
+            }
+        }
+        else
+        {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    if (out.scenes.empty()) out.scenes = synthetic_scene_names();
+    return true;
+}
+
+/// @brief 1つのシーンを生成し、各段階を計測する
+/// @param name シーンの名前
+/// @param options 設定
+/// @param out 結果の出力先
+/// @return 計測できたかどうか
+bool run_scene(const std::string& name, const BenchOptions& options,
+               SceneResult& out)
+{
+    SceneSource source;
+    if (!generate_scene(name, options.scale, source))
+    {
+        std::cerr << "Unknown scene: " << name << std::endl;
+        return false;
+    }
+    reset_peak_rss();
+    out.name = name;
+    out.corners = source.corner_count();
+    out.meshes = source.meshes.size();
+    out.nodes = source.nodes.size();
+    out.materials = source.material_count;
+
+    // 組み立てと法線は繰り返すたびに作り直し、最後のものを書き出しに使う
+    std::unique_ptr<BenchScene> scene;
+    out.phases.push_back(time_phase(
+        "build", options.repeat,
+        [&] { scene = std::make_unique<BenchScene>(); },
+        [&] { build_meshes(source, *scene); }));
+    out.phases.push_back(time_phase(
+        "normals", options.repeat,
+        [&] {
+            scene = std::make_unique<BenchScene>();
+            build_meshes(source, *scene);
+        },
+        [&] { compute_mesh_normals(source, *scene); }));
+    build_tree(source, *scene);
+    build_animations(options.animation_frames, *scene);
+    build_skins(options.skin_bones, *scene);
+
+    out.phases.push_back(time_phase("instances", options.repeat, [&] {
+        MeshInstances instances(&scene->root);
+        (void)instances;
+    }));
+
+    // 書き出し時の座標系の変換 (Z-up・メートルからY-up・センチメートル)
+    double axis[16];
+    axis_conversion_matrix(100.0, true, axis);
+    std::vector<double> packed;
+    out.phases.push_back(time_phase("transform", options.repeat, [&] {
+        for (auto mesh : scene->meshes)
+        {
+            packed.resize(mesh->vertex_count * 3);
+            transform_points_packed(axis, (const float*)mesh->vertices,
+                                    packed.data(), mesh->vertex_count);
+        }
+    }));
+
+    auto native_path = options.work_dir / ("halfbx_bench_" + name + ".fbx");
+    auto native_string = native_path.string();
+    scene->data.array_compression = options.compression;
+    scene->data.compression_level = options.compression_level;
+    scene->data.cache_dir =
+        options.cache_dir.empty() ? nullptr : options.cache_dir.c_str();
+    scene->data.weld_corner_attributes = options.weld;
+    scene->data.optimize_vertex_cache = options.reorder;
+    scene->data.lod_ratios = options.lod_ratios.data();
+    scene->data.lod_count = options.lod_ratios.size();
+    scene->data.max_influences = options.max_influences;
+    scene->data.weight_bits = options.weight_bits;
+    auto export_native = time_phase("export_native", options.repeat, [&] {
+        scene->data.backend = IO_BACKEND_NATIVE;
+        if (!session_export_fbx(options.session, native_string.c_str(),
+                                &scene->data))
+            std::cerr << "Native export failed: " << name << std::endl;
+    });
+    export_native.bytes = file_size_or_zero(native_path);
+    out.phases.push_back(std::move(export_native));
+
+#ifdef HALFBX_WITH_FBXSDK
+    auto sdk_path = options.work_dir / ("halfbx_bench_" + name + "_sdk.fbx");
+    auto sdk_string = sdk_path.string();
+    auto export_sdk = time_phase("export_sdk", options.repeat, [&] {
+        scene->data.backend = IO_BACKEND_FBXSDK;
+        if (!session_export_fbx(options.session, sdk_string.c_str(),
+                                &scene->data))
+            std::cerr << "FBX SDK export failed: " << name << std::endl;
+    });
+    export_sdk.bytes = file_size_or_zero(sdk_path);
+    out.phases.push_back(std::move(export_sdk));
+    std::filesystem::remove(sdk_path);
+#endif
+
+    ImportOptions import_options = {};
+    import_options.indexed_attributes = options.indexed;
+    auto import = time_phase("import", options.repeat, [&] {
+        auto data = session_import_fbx_with_options(
+            options.session, native_string.c_str(), &import_options);
+        if (data == nullptr)
+            std::cerr << "Import failed: " << name << std::endl;
+        delete_iodata(data);
+    });
+    import.bytes = file_size_or_zero(native_path);
+    out.phases.push_back(std::move(import));
+
+    // 読み込んだポリゴン頂点数が書き出したものと一致するかも確かめる
+    size_t streamed = 0;
+    ImportCallbacks callbacks = {};
+    callbacks.user_data = &streamed;
+    callbacks.on_mesh = [](void* user_data, const size_t*, size_t,
+                           const Mesh* mesh) {
+        *(size_t*)user_data += mesh->index_count;
+    };
+    auto import_stream = time_phase("import_stream", options.repeat, [&] {
+        streamed = 0;
+        if (!session_import_fbx_stream_with_options(
+                options.session, native_string.c_str(), &callbacks,
+                &import_options))
+            std::cerr << "Streaming import failed: " << name << std::endl;
+    });
+    import_stream.bytes = file_size_or_zero(native_path);
+    out.phases.push_back(std::move(import_stream));
+    // LODを作るとその分のポリゴン頂点も読むので比べない
+    if (options.lod_ratios.empty() && streamed != out.corners)
+    {
+        std::cerr << "Corner count mismatch in " << name << ": exported "
+                  << out.corners << ", imported " << streamed << std::endl;
+    }
+
+    out.peak_rss = peak_rss_bytes();
+    std::filesystem::remove(native_path);
+    return true;
+}
+
+/// @brief Blenderからの書き出しと同じく、float32のバッファからメッシュを組み立てる
+/// @param source 生成したシーン
+/// @param scene 出力先
+void build_meshes(const SceneSource& source, BenchScene& scene)
+{
+    for (auto& mesh : source.meshes)
+    {
+        auto builder = create_mesh_builder(mesh.name.c_str(), SCALAR_FLOAT32);
+        scene.builders.push_back(builder);
+        auto corners = mesh.indices.size();
+        mesh_builder_set_positions(builder, mesh.positions.data(),
+                                   mesh.positions.size() / 3,
+                                   sizeof(float) * 3, COMPONENT_FLOAT32);
+        mesh_builder_set_indices(builder, mesh.indices.data(), corners,
+                                 sizeof(unsigned int), COMPONENT_UINT32);
+        mesh_builder_set_polys(builder, mesh.polys.data(), mesh.polys.size(),
+                               sizeof(unsigned int), COMPONENT_UINT32);
+        mesh_builder_set_material_indices(
+            builder, mesh.material_indices.data(), mesh.material_indices.size(),
+            sizeof(unsigned int), COMPONENT_UINT32);
+        for (size_t i = 0; i < mesh.uv_sets.size(); i++)
+        {
+            auto name = "UV" + std::to_string(i);
+            mesh_builder_add_uv_set(builder, name.c_str(),
+                                    mesh.uv_sets[i].data(), corners,
+                                    sizeof(float) * 2, COMPONENT_FLOAT32);
+        }
+        mesh_builder_set_smooth(builder, true, 0.5);
+        scene.meshes.push_back(mesh_builder_get_mesh(builder));
+    }
+}
+
+/// @brief 生成したシーンの指定どおりに法線セットを計算する
+/// @param source 生成したシーン
+/// @param scene 組み立て済みのメッシュ
+void compute_mesh_normals(const SceneSource& source, BenchScene& scene)
+{
+    for (size_t m = 0; m < source.meshes.size(); m++)
+    {
+        auto& modes = source.meshes[m].normal_modes;
+        for (size_t i = 0; i < modes.size(); i++)
+        {
+            auto name = "Normal" + std::to_string(i);
+            mesh_builder_compute_normals(scene.builders[m], name.c_str(),
+                                         modes[i], 0.5);
+        }
+        scene.meshes[m] = mesh_builder_get_mesh(scene.builders[m]);
+    }
+}
+
+/// @brief マテリアルとノードツリーを作成する
+/// @param source 生成したシーン
+/// @param scene 出力先 (メッシュは組み立て済み)
+void build_tree(const SceneSource& source, BenchScene& scene)
+{
+    scene.materials.resize(source.material_count);
+    scene.material_names.resize(source.material_count);
+    for (size_t i = 0; i < source.material_count; i++)
+    {
+        auto& name = scene.material_names[i];
+        name = "Material" + std::to_string(i);
+        auto& material = scene.materials[i];
+        material = {};
+        material.name = name.data();
+        material.name_length = name.size();
+        auto& surface = material.standard_surface;
+        surface.base = 1.0;
+        surface.base_color = {(double)(i % 7) / 6.0, (double)(i % 5) / 4.0,
+                              (double)(i % 3) / 2.0, 1.0};
+        surface.specular_roughness = (double)(i % 11) / 10.0;
+        surface.opacity = 1.0;
+    }
+
+    scene.children.reserve(source.nodes.size());
+    scene.slots.reserve(source.nodes.size());
+    build_object(source, 0, scene, scene.root);
+
+    scene.data = {};
+    scene.data.unit_scale = 1.0;
+    scene.data.root = &scene.root;
+    scene.data.materials = scene.materials.data();
+    scene.data.material_count = scene.materials.size();
+}
+
+/// @brief ノードとその子孫のObjectを作成する
+/// @param source 生成したシーン
+/// @param node ノードの番号
+/// @param scene 子の配列とマテリアルスロットの確保先
+/// @param out 出力先
+void build_object(const SceneSource& source, size_t node, BenchScene& scene,
+                  Object& out)
+{
+    auto& input = source.nodes[node];
+    out = {};
+    out.name = (char*)input.name.c_str();
+    out.name_length = input.name.size();
+    std::memcpy(out.matrix_local, input.matrix, sizeof(input.matrix));
+    out.mesh = input.mesh >= 0 ? scene.meshes[input.mesh] : nullptr;
+
+    scene.slots.emplace_back();
+    auto& slots = scene.slots.back();
+    for (auto slot : input.material_slots)
+        slots.push_back(&scene.materials[slot]);
+    out.material_slots = slots.data();
+    out.material_slot_count = slots.size();
+
+    scene.children.emplace_back(input.children.size());
+    auto children = scene.children.back().data();
+    out.children = children;
+    out.child_count = input.children.size();
+    for (size_t i = 0; i < input.children.size(); i++)
+        build_object(source, input.children[i], scene, children[i]);
+}
+
+/// @brief 全てのノードにモーションキャプチャのような揺れを含むアニメーションを付ける
+/// Z軸回りの回転と移動をゆっくり変化させ、キーの削減で残る程度の雑音を足す
+/// @param frame_count フレーム数 (0なら付けない)
+/// @param scene 書き出すシーン
+void build_animations(size_t frame_count, BenchScene& scene)
+{
+    if (frame_count == 0) return;
+    uint32_t seed = 12345;
+    auto noise = [&] {
+        seed = seed * 1664525u + 1013904223u;
+        return ((double)(seed >> 8) / (1 << 24) - 0.5) * 1e-3;
+    };
+    size_t node = 0;
+    for (auto& children : scene.children)
+    {
+        for (auto& object : children)
+        {
+            scene.animations.emplace_back(frame_count * 16);
+            auto& frames = scene.animations.back();
+            for (size_t f = 0; f < frame_count; f++)
+            {
+                auto m = &frames[f * 16];
+                auto angle = 0.5 * std::sin(f * 0.05 + node) + noise();
+                std::memcpy(m, object.matrix_local, sizeof(double) * 16);
+                m[0] = m[5] = std::cos(angle);
+                m[1] = std::sin(angle);
+                m[4] = -m[1];
+                m[2] = m[6] = m[8] = m[9] = 0.0;
+                m[10] = 1.0;
+                m[12] += 0.1 * std::sin(f * 0.02 + node) + noise();
+            }
+            object.animation_matrices = frames.data();
+            object.animation_frame_count = frame_count;
+            node++;
+        }
+    }
+}
+
+/// @brief 全てのメッシュにスキンを付ける
+/// ボーンはルート直下のArmatureの子としてX軸に沿って並べ、頂点ごとにX座標の
+/// 近い6本のボーンの影響を距離に応じた重みで付ける (影響の数を減らす余地を残す)
+/// @param bone_count ボーン数 (0なら付けない)
+/// @param scene 書き出すシーン (ノードツリーは作成済み)
+void build_skins(size_t bone_count, BenchScene& scene)
+{
+    if (bone_count == 0) return;
+    const int influence_count = 6;
+
+    scene.bone_names.resize(bone_count);
+    scene.bones.resize(bone_count);
+    scene.bone_list.resize(bone_count);
+    for (size_t i = 0; i < bone_count; i++)
+    {
+        auto& bone = scene.bones[i];
+        scene.bone_names[i] = "Bone" + std::to_string(i);
+        bone = {};
+        bone.name = scene.bone_names[i].data();
+        bone.name_length = scene.bone_names[i].size();
+        for (auto j = 0; j < 4; j++) bone.matrix_local[j * 5] = 1.0;
+        bone.matrix_local[12] = (double)i;
+        scene.bone_list[i] = &bone;
+    }
+    Object armature = {};
+    armature.name = (char*)"Armature";
+    armature.name_length = 8;
+    for (auto j = 0; j < 4; j++) armature.matrix_local[j * 5] = 1.0;
+    armature.children = scene.bones.data();
+    armature.child_count = bone_count;
+    scene.top.assign(scene.root.children,
+                     scene.root.children + scene.root.child_count);
+    scene.top.push_back(armature);
+    scene.root.children = scene.top.data();
+    scene.root.child_count = scene.top.size();
+
+    for (auto mesh : scene.meshes)
+    {
+        auto& skin = scene.skins.emplace_back();
+        auto points = (const float*)mesh->vertices;
+        auto low = INFINITY, high = -INFINITY;
+        for (size_t v = 0; v < mesh->vertex_count; v++)
+        {
+            low = std::min(low, points[v * 3]);
+            high = std::max(high, points[v * 3]);
+        }
+        auto span = high > low ? high - low : 1.0f;
+        skin.offsets.resize(mesh->vertex_count + 1);
+        for (size_t v = 0; v < mesh->vertex_count; v++)
+        {
+            auto t = (points[v * 3] - low) / span * (float)(bone_count - 1);
+            auto first = (long)std::floor(t) - influence_count / 2 + 1;
+            for (auto k = 0; k < influence_count; k++)
+            {
+                auto bone = std::clamp<long>(first + k, 0, bone_count - 1);
+                auto distance = t - (float)bone;
+                skin.bones.push_back((unsigned int)bone);
+                skin.weights.push_back(1.0f / (1.0f + distance * distance));
+            }
+            skin.offsets[v + 1] = (unsigned int)skin.bones.size();
+        }
+        skin.skin.bones = scene.bone_list.data();
+        skin.skin.bone_count = bone_count;
+        for (auto j = 0; j < 4; j++) skin.skin.mesh_bind_matrix[j * 5] = 1.0;
+        skin.skin.influence_offsets = skin.offsets.data();
+        skin.skin.influence_bones = skin.bones.data();
+        skin.skin.influence_weights = skin.weights.data();
+        mesh->skin = &skin.skin;
+    }
+}
+
+/// @brief 処理を繰り返し実行して時間を測る
+/// @param name 段階の名前
+/// @param repeat 繰り返す回数
+/// @param prepare 毎回の処理の前に行う準備 (時間に含めない)
+/// @param fn 処理
+/// @return 計測結果
+PhaseResult time_phase(const char* name, size_t repeat,
+                       const std::function<void()>& prepare,
+                       const std::function<void()>& fn)
+{
+    PhaseResult result;
+    result.name = name;
+    for (size_t i = 0; i < repeat; i++)
+    {
+        prepare();
+        auto begin = std::chrono::steady_clock::now();
+        fn();
+        auto end = std::chrono::steady_clock::now();
+        result.seconds.push_back(
+            std::chrono::duration<double>(end - begin).count());
+    }
+    return result;
+}
+
+PhaseResult time_phase(const char* name, size_t repeat,
+                       const std::function<void()>& fn)
+{
+    return time_phase(name, repeat, [] {}, fn);
+}
+
+uint64_t file_size_or_zero(const std::filesystem::path& path)
+{
+    std::error_code error;
+    auto size = std::filesystem::file_size(path, error);
+    return error ? 0 : size;
+}
+
+/// @brief 最大メモリ使用量の記録をリセットする (Linuxのみ、他は何もしない)
+void reset_peak_rss()
+{
+#ifdef __linux__
+    std::ofstream clear("/proc/self/clear_refs");
+    clear << "5";
+#endif
+}
+
+/// @brief プロセスの最大メモリ使用量 (バイト)
+uint64_t peak_rss_bytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                              sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    #ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+    #else
+    return (uint64_t)usage.ru_maxrss * 1024;
+    #endif
+#endif
+}
+
+double min_seconds(const PhaseResult& phase)
+{
+    return *std::min_element(phase.seconds.begin(), phase.seconds.end());
+}
+
+double median_seconds(const PhaseResult& phase)
+{
+    auto seconds = phase.seconds;
+    std::sort(seconds.begin(), seconds.end());
+    return seconds[seconds.size() / 2];
+}
+
+/// @brief 1秒あたりの量 (最短の時間で割る)
+double per_second(double amount, const PhaseResult& phase)
+{
+    auto seconds = min_seconds(phase);
+    return seconds > 0.0 ? amount / seconds : 0.0;
+}
+
+void print_scene(const SceneResult& result)
+{
+    std::printf("\n%s: %zu corners, %zu meshes, %zu nodes, %zu materials, "
+                "peak RSS %.1f MB\n",
+                result.name.c_str(), result.corners, result.meshes,
+                result.nodes, result.materials,
+                (double)result.peak_rss / (1 << 20));
+    for (auto& phase : result.phases)
+    {
+        std::printf("  %-14s %10.3f ms (median %10.3f ms) %10.2f Mcorners/s",
+                    phase.name.c_str(), min_seconds(phase) * 1e3,
+                    median_seconds(phase) * 1e3,
+                    per_second((double)result.corners, phase) / 1e6);
+        if (phase.bytes > 0)
+            std::printf(" %10.1f MB/s",
+                        per_second((double)phase.bytes, phase) / (1 << 20));
+        std::printf("\n");
+    }
+}
+
+/// @brief 計測結果をJSONで書き出す (回帰の追跡用)
+/// @param path 出力先 ("-"なら標準出力)
+/// @param options 設定
+/// @param results 計測結果
+/// @return 書き出せたかどうか
+bool write_json(const std::string& path, const BenchOptions& options,
+                const std::vector<SceneResult>& results)
+{
+    std::ofstream file;
+    if (path != "-")
+    {
+        file.open(std::filesystem::path((const char8_t*)path.c_str()));
+        if (!file)
+        {
+            std::cerr << "An error occurred while opening the file..."
+                      << std::endl;
+            return false;
+        }
+    }
+    std::ostream& out = path == "-" ? std::cout : file;
+
+    out << "{\n";
+    out << "  \"scale\": " << options.scale << ",\n";
+    out << "  \"repeat\": " << options.repeat << ",\n";
+    out << "  \"simd\": \"" << simd_level_name(simd_level()) << "\",\n";
+    out << "  \"threads\": " << ThreadPool::instance().thread_count() << ",\n";
+#ifdef HALFBX_WITH_FBXSDK
+    out << "  \"fbxsdk\": true,\n";
+#else
+    out << "  \"fbxsdk\": false,\n";
+#endif
+    out << "  \"scenes\": [";
+    for (size_t s = 0; s < results.size(); s++)
+    {
+        auto& result = results[s];
+        out << (s ? ",\n" : "\n") << "    {\n";
+        out << "      \"name\": \"" << result.name << "\",\n";
+        out << "      \"corners\": " << result.corners << ",\n";
+        out << "      \"meshes\": " << result.meshes << ",\n";
+        out << "      \"nodes\": " << result.nodes << ",\n";
+        out << "      \"materials\": " << result.materials << ",\n";
+        out << "      \"peak_rss_bytes\": " << result.peak_rss << ",\n";
+        out << "      \"phases\": [";
+        for (size_t p = 0; p < result.phases.size(); p++)
+        {
+            auto& phase = result.phases[p];
+            out << (p ? ",\n" : "\n") << "        {\"name\": \"" << phase.name
+                << "\", \"seconds_min\": " << min_seconds(phase)
+                << ", \"seconds_median\": " << median_seconds(phase)
+                << ", \"corners_per_second\": "
+                << per_second((double)result.corners, phase)
+                << ", \"bytes\": " << phase.bytes << ", \"bytes_per_second\": "
+                << per_second((double)phase.bytes, phase) << "}";
+        }
+        out << "\n      ]\n    }";
+    }
+    out << "\n  ]\n}\n";
+    return (bool)out;
+}
@@ -0,0 +1,324 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "scene_generator.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+/// @brief 固定のシードで生成する乱数 (環境によらず同じ値になる)
+struct SceneRandom
+{
+    uint64_t state = 0x853c49e6748fea9bull;
+
+    /// @brief [-1, 1) の乱数
+    float next()
+    {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return (float)((state >> 40) * (1.0 / (1ull << 24))) * 2.0f - 1.0f;
+    }
+};
+
+size_t add_scene_node(SceneSource& scene, size_t parent, std::string name,
+                      int mesh, double x, double y, double z);
+MeshSource make_grid(std::string name, size_t nx, size_t ny, float size);
+MeshSource make_icosphere(std::string name, size_t level);
+MeshSource make_cube(std::string name, SceneRandom& random);
+void add_grid_uvs(MeshSource& mesh, size_t set_count);
+size_t scaled_side(size_t side, size_t scale);
+
+/// @brief 生成できるシーンの名前
+const std::vector<std::string>& synthetic_scene_names()
+{
+    static const std::vector<std::string> names = {
+        "grid", "sphere", "hierarchy", "small_objects", "layers", "materials"};
+    return names;
+}
+
+/// @brief シーン全体のポリゴン頂点数 (メッシュごとに1回数える)
+size_t SceneSource::corner_count() const
+{
+    size_t count = 0;
+    for (auto& mesh : meshes) count += mesh.indices.size();
+    return count;
+}
+
+/// @brief 合成シーンを生成する
+/// @param name シーンの名前 (synthetic_scene_namesのいずれか)
+/// @param scale 大きさの倍率 (1でポリゴン頂点数がおよそ100万)
+/// @param out 出力先
+/// @return 生成できたかどうか (名前が不明ならfalse)
+bool generate_scene(const std::string& name, size_t scale, SceneSource& out)
+{
+    out = SceneSource();
+    out.name = name;
+    scale = std::max<size_t>(scale, 1);
+    add_scene_node(out, SIZE_MAX, "root", -1, 0, 0, 0);
+    SceneRandom random;
+
+    if (name == "grid")
+    {
+        // 1枚の大きな平面 (四角形ポリゴン)
+        auto side = scaled_side(512, scale);
+        out.meshes.push_back(make_grid("Grid", side, side, 10.0f));
+        add_grid_uvs(out.meshes.back(), 1);
+        add_scene_node(out, 0, "Grid", 0, 0, 0, 0);
+    }
+    else if (name == "sphere")
+    {
+        // 正二十面体を分割した球 (三角形ポリゴン)
+        size_t level = 7;
+        for (auto s = scale; s >= 4; s /= 4) level++;
+        out.meshes.push_back(make_icosphere("Sphere", level));
+        add_scene_node(out, 0, "Sphere", 0, 0, 0, 0);
+    }
+    else if (name == "hierarchy")
+    {
+        // 1本の深い親子関係 (メッシュは大きさを変えて全て別の内容にする)
+        auto depth = 512 * scale;
+        size_t parent = 0;
+        for (size_t i = 0; i < depth; i++)
+        {
+            auto node_name = "Link" + std::to_string(i);
+            out.meshes.push_back(
+                make_grid(node_name, 16, 16, 1.0f + (float)i * 0.001f));
+            parent = add_scene_node(out, parent, node_name,
+                                    (int)out.meshes.size() - 1, 0, 0.1, 0);
+        }
+    }
+    else if (name == "small_objects")
+    {
+        // 多数の小さなオブジェクト (頂点を揺らして全て別の内容にする)
+        auto count = 8192 * scale;
+        auto columns = (size_t)std::ceil(std::sqrt((double)count));
+        for (size_t i = 0; i < count; i++)
+        {
+            auto node_name = "Cube" + std::to_string(i);
+            out.meshes.push_back(make_cube(node_name, random));
+            add_scene_node(out, 0, node_name, (int)out.meshes.size() - 1,
+                           (double)(i % columns) * 3.0,
+                           (double)(i / columns) * 3.0, 0);
+        }
+    }
+    else if (name == "layers")
+    {
+        // UVセット・法線セットを多く持つメッシュ
+        auto side = scaled_side(256, scale);
+        out.meshes.push_back(make_grid("Layers", side, side, 10.0f));
+        auto& mesh = out.meshes.back();
+        add_grid_uvs(mesh, 8);
+        mesh.normal_modes = {NORMAL_MODE_FLAT, NORMAL_MODE_SMOOTH_ANGLE,
+                             NORMAL_MODE_SMOOTH_AREA, NORMAL_MODE_AUTO_SMOOTH};
+        add_scene_node(out, 0, "Layers", 0, 0, 0, 0);
+    }
+    else if (name == "materials")
+    {
+        // 多数のマテリアルをポリゴンごとに割り当てる
+        out.material_count = 256 * scale;
+        for (size_t i = 0; i < 64; i++)
+        {
+            auto node_name = "Painted" + std::to_string(i);
+            out.meshes.push_back(
+                make_grid(node_name, 64, 64, 1.0f + (float)i * 0.01f));
+            auto& mesh = out.meshes.back();
+            for (size_t p = 0; p < mesh.material_indices.size(); p++)
+            {
+                mesh.material_indices[p] =
+                    (unsigned int)((p * 7 + i) % out.material_count);
+            }
+            auto node = add_scene_node(out, 0, node_name,
+                                       (int)out.meshes.size() - 1,
+                                       (double)i * 12.0, 0, 0);
+            for (size_t m = 0; m < out.material_count; m++)
+                out.nodes[node].material_slots.push_back(m);
+        }
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/// @brief ノードを追加する
+/// @param scene シーン
+/// @param parent 親の番号 (ルートならSIZE_MAX)
+/// @param name 名前
+/// @param mesh メッシュの番号 (無ければ-1)
+/// @param x 親からの移動量
+/// @param y 親からの移動量
+/// @param z 親からの移動量
+/// @return 追加したノードの番号
+size_t add_scene_node(SceneSource& scene, size_t parent, std::string name,
+                      int mesh, double x, double y, double z)
+{
+    NodeSource node;
+    node.name = std::move(name);
+    node.mesh = mesh;
+    const double identity[16] = {1, 0, 0, 0, 0, 1, 0, 0,
+                                 0, 0, 1, 0, x, y, z, 1};
+    std::memcpy(node.matrix, identity, sizeof(identity));
+    scene.nodes.push_back(std::move(node));
+    auto index = scene.nodes.size() - 1;
+    if (parent != SIZE_MAX) scene.nodes[parent].children.push_back(index);
+    return index;
+}
+
+/// @brief 倍率をかけた平面の一辺の分割数 (面積が倍率に比例する)
+size_t scaled_side(size_t side, size_t scale)
+{
+    return (size_t)std::lround((double)side * std::sqrt((double)scale));
+}
+
+/// @brief XY平面上の格子 (四角形ポリゴン)
+/// @param name 名前
+/// @param nx X方向の分割数
+/// @param ny Y方向の分割数
+/// @param size 一辺の長さ
+MeshSource make_grid(std::string name, size_t nx, size_t ny, float size)
+{
+    MeshSource mesh;
+    mesh.name = std::move(name);
+    mesh.positions.reserve((nx + 1) * (ny + 1) * 3);
+    for (size_t y = 0; y <= ny; y++)
+    {
+        for (size_t x = 0; x <= nx; x++)
+        {
+            mesh.positions.push_back(size * (float)x / (float)nx);
+            mesh.positions.push_back(size * (float)y / (float)ny);
+            mesh.positions.push_back(0.0f);
+        }
+    }
+
+    mesh.indices.reserve(nx * ny * 4);
+    mesh.polys.reserve(nx * ny);
+    for (size_t y = 0; y < ny; y++)
+    {
+        for (size_t x = 0; x < nx; x++)
+        {
+            auto v = (unsigned int)(y * (nx + 1) + x);
+            mesh.polys.push_back((unsigned int)mesh.indices.size());
+            mesh.indices.insert(mesh.indices.end(),
+                                {v, v + 1, v + 1 + (unsigned int)(nx + 1),
+                                 v + (unsigned int)(nx + 1)});
+        }
+    }
+    mesh.material_indices.assign(mesh.polys.size(), 0);
+    mesh.normal_modes = {NORMAL_MODE_SMOOTH_ANGLE};
+    return mesh;
+}
+
+/// @brief 格子のポリゴン頂点に、頂点のXY座標からUVセットを付ける
+/// @param mesh make_gridで作ったメッシュ
+/// @param set_count UVセットの数 (セットごとに拡大率を変える)
+void add_grid_uvs(MeshSource& mesh, size_t set_count)
+{
+    for (size_t s = 0; s < set_count; s++)
+    {
+        std::vector<float> uv(mesh.indices.size() * 2);
+        for (size_t i = 0; i < mesh.indices.size(); i++)
+        {
+            auto p = &mesh.positions[mesh.indices[i] * 3];
+            uv[i * 2] = p[0] * (float)(s + 1);
+            uv[i * 2 + 1] = p[1] * (float)(s + 1);
+        }
+        mesh.uv_sets.push_back(std::move(uv));
+    }
+}
+
+/// @brief 正二十面体を分割した単位球
+/// @param name 名前
+/// @param level 分割回数 (三角形は20 * 4^level個)
+MeshSource make_icosphere(std::string name, size_t level)
+{
+    const float t = (1.0f + std::sqrt(5.0f)) / 2.0f;
+    std::vector<std::array<float, 3>> points = {
+        {-1, t, 0}, {1, t, 0}, {-1, -t, 0}, {1, -t, 0},
+        {0, -1, t}, {0, 1, t}, {0, -1, -t}, {0, 1, -t},
+        {t, 0, -1}, {t, 0, 1}, {-t, 0, -1}, {-t, 0, 1}};
+    std::vector<std::array<unsigned int, 3>> faces = {
+        {0, 11, 5}, {0, 5, 1},  {0, 1, 7},   {0, 7, 10}, {0, 10, 11},
+        {1, 5, 9},  {5, 11, 4}, {11, 10, 2}, {10, 7, 6}, {7, 1, 8},
+        {3, 9, 4},  {3, 4, 2},  {3, 2, 6},   {3, 6, 8},  {3, 8, 9},
+        {4, 9, 5},  {2, 4, 11}, {6, 2, 10},  {8, 6, 7},  {9, 8, 1}};
+    auto normalize = [](std::array<float, 3> p) {
+        auto length = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+        return std::array<float, 3>{p[0] / length, p[1] / length,
+                                    p[2] / length};
+    };
+    for (auto& p : points) p = normalize(p);
+
+    // 辺の中点は隣り合う三角形で共有する
+    for (size_t l = 0; l < level; l++)
+    {
+        std::unordered_map<uint64_t, unsigned int> midpoints;
+        auto midpoint = [&](unsigned int a, unsigned int b) {
+            auto key = ((uint64_t)std::min(a, b) << 32) | std::max(a, b);
+            auto found = midpoints.find(key);
+            if (found != midpoints.end()) return found->second;
+            auto& pa = points[a];
+            auto& pb = points[b];
+            points.push_back(normalize({(pa[0] + pb[0]) * 0.5f,
+                                        (pa[1] + pb[1]) * 0.5f,
+                                        (pa[2] + pb[2]) * 0.5f}));
+            auto index = (unsigned int)points.size() - 1;
+            midpoints.emplace(key, index);
+            return index;
+        };
+        std::vector<std::array<unsigned int, 3>> next;
+        next.reserve(faces.size() * 4);
+        for (auto& f : faces)
+        {
+            auto a = midpoint(f[0], f[1]);
+            auto b = midpoint(f[1], f[2]);
+            auto c = midpoint(f[2], f[0]);
+            next.push_back({f[0], a, c});
+            next.push_back({f[1], b, a});
+            next.push_back({f[2], c, b});
+            next.push_back({a, b, c});
+        }
+        faces = std::move(next);
+    }
+
+    MeshSource mesh;
+    mesh.name = std::move(name);
+    mesh.positions.reserve(points.size() * 3);
+    for (auto& p : points)
+        mesh.positions.insert(mesh.positions.end(), p.begin(), p.end());
+    mesh.indices.reserve(faces.size() * 3);
+    mesh.polys.reserve(faces.size());
+    for (auto& f : faces)
+    {
+        mesh.polys.push_back((unsigned int)mesh.indices.size());
+        mesh.indices.insert(mesh.indices.end(), f.begin(), f.end());
+    }
+    mesh.material_indices.assign(mesh.polys.size(), 0);
+    mesh.normal_modes = {NORMAL_MODE_SMOOTH_ANGLE};
+    return mesh;
+}
+
+/// @brief 頂点を少し揺らした立方体
+/// @param name 名前
+/// @param random 乱数
+MeshSource make_cube(std::string name, SceneRandom& random)
+{
+    MeshSource mesh;
+    mesh.name = std::move(name);
+    for (unsigned int i = 0; i < 8; i++)
+    {
+        mesh.positions.push_back((float)(i & 1) + random.next() * 0.05f);
+        mesh.positions.push_back((float)((i >> 1) & 1) + random.next() * 0.05f);
+        mesh.positions.push_back((float)((i >> 2) & 1) + random.next() * 0.05f);
+    }
+    mesh.indices = {0, 2, 3, 1, 4, 5, 7, 6, 0, 1, 5, 4,
+                    2, 6, 7, 3, 0, 4, 6, 2, 1, 3, 7, 5};
+    mesh.polys = {0, 4, 8, 12, 16, 20};
+    mesh.material_indices.assign(6, 0);
+    mesh.uv_sets.emplace_back(mesh.indices.size() * 2, 0.5f);
+    mesh.normal_modes = {NORMAL_MODE_FLAT};
+    return mesh;
+}
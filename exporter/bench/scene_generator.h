@@ -0,0 +1,49 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// ベンチマーク用の合成シーン (乱数は固定のシードで生成し、毎回同じ内容になる)
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// @brief 生成したメッシュ (Blenderから渡されるのと同じfloat32のバッファ)
+struct MeshSource
+{
+    std::string name;
+    std::vector<float> positions; // xyz
+    std::vector<unsigned int> indices;
+    std::vector<unsigned int> polys;
+    std::vector<unsigned int> material_indices;
+    std::vector<std::vector<float>> uv_sets; // ポリゴン頂点ごとのuv
+    std::vector<NormalMode> normal_modes;    // 計算する法線セット
+};
+
+/// @brief 生成したノード (nodes[0]がルート)
+struct NodeSource
+{
+    std::string name;
+    double matrix[16];
+    int mesh = -1; // メッシュを持たなければ-1
+    std::vector<size_t> children;
+    std::vector<size_t> material_slots;
+};
+
+/// @brief 生成したシーン
+struct SceneSource
+{
+    std::string name;
+    std::vector<MeshSource> meshes;
+    std::vector<NodeSource> nodes;
+    size_t material_count = 0;
+
+    size_t corner_count() const;
+};
+
+const std::vector<std::string>& synthetic_scene_names();
+bool generate_scene(const std::string& name, size_t scale, SceneSource& out);
@@ -1,6 +1,13 @@
 ﻿#pragma once
 
-#define DLLEXPORT(type) __declspec(dllexport) type __stdcall
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+    #define DLLEXPORT(type) __declspec(dllexport) type __stdcall
+#else
+    #define DLLEXPORT(type) __attribute__((visibility("default"))) type
+#endif
 
 extern "C"
 {
@@ -65,11 +72,25 @@ extern "C"
         StandardSurface standard_surface;
     };
 
+    // Meshの頂点座標・法線・UVの格納形式
+    enum ScalarType : int
+    {
+        SCALAR_FLOAT64 = 0, // Vector4 (xyzw) / Vector2 の配列
+        SCALAR_FLOAT32 = 1, // floatのxyz / uvを詰めた配列 (ポインタはfloat*として扱う)
+    };
+
+    // UV・法線セットの値はindicesがnullptrならポリゴン頂点ごと (index_count個)
+    // ImportOptions::indexed_attributesで読み込んだ場合は重複の無い値
+    // (value_count個) で、ポリゴン頂点ごとの値の番号をindicesに持つ
+    // 書き出しではindicesをnullptrにすること (indicesを持つメッシュがあると
+    // 書き出しは失敗する、value_countは読み込みでだけ設定する)
     struct UV
     {
         char* name;
         size_t name_length;
         Vector2* uv;
+        unsigned int* indices; // ポリゴン頂点ごとのuvの番号 (index_count個)
+        size_t value_count;    // uvの要素数
     };
 
     struct Normal
@@ -77,6 +98,25 @@ extern "C"
         char* name;
         size_t name_length;
         Vector4* normal;
+        unsigned int* indices; // ポリゴン頂点ごとのnormalの番号 (index_count個)
+        size_t value_count;    // normalの要素数
+    };
+
+    struct Object;
+
+    // メッシュのスキン (頂点ごとのボーンの影響をCSR形式で持つ)
+    // 頂点vの影響はinfluence_offsets[v]からinfluence_offsets[v + 1]の手前まで
+    struct Skin
+    {
+        Object** bones; // ボーンにするオブジェクト (書き出すツリーの中のもの)
+        size_t bone_count;
+        // ボーンごとのバインド時のワールド行列 (matrix_localと同じ並びの16要素を
+        // bone_count個並べたもの、nullptrなら単位行列)
+        const double* bind_matrices;
+        double mesh_bind_matrix[16]; // バインド時のメッシュのワールド行列
+        const unsigned int* influence_offsets; // vertex_count + 1 要素
+        const unsigned int* influence_bones;   // bonesの番号
+        const float* influence_weights;
     };
 
     struct Mesh
@@ -95,6 +135,9 @@ extern "C"
         Normal* normal_sets;
         size_t normal_set_count;
         bool is_smooth;
+        double smooth_angle; // is_smoothの場合の自動スムーズの角度 (ラジアン)
+        ScalarType scalar_type; // vertices, uv_sets, normal_setsの格納形式
+        const Skin* skin;       // nullptr if not skinned
     };
 
     struct Object
@@ -107,25 +150,287 @@ extern "C"
         Mesh* mesh; // nullptr if not a mesh
         Material** material_slots;
         size_t material_slot_count;
+        // フレームごとのmatrix_local (matrix_localと同じ並びの16要素を
+        // animation_frame_count個並べたもの、アニメーションが無ければnullptr)
+        const double* animation_matrices;
+        size_t animation_frame_count;
+    };
+
+    // 入出力に使用するバックエンド
+    enum IOBackend : int
+    {
+        IO_BACKEND_FBXSDK = 0, // FBX SDK
+        IO_BACKEND_NATIVE = 1, // FBX SDKを使用しないバイナリFBXの読み書き
+                               // (書き出しはバイナリのみで、is_asciiなら失敗する)
+    };
+
+    // 頂点法線の計算方法
+    enum NormalMode : int
+    {
+        NORMAL_MODE_FLAT = 0,           // 面法線をそのまま使う
+        NORMAL_MODE_SMOOTH_ANGLE = 1,   // 角の角度で重み付けして平均する
+        NORMAL_MODE_SMOOTH_AREA = 2,    // 面の面積で重み付けして平均する
+        NORMAL_MODE_AUTO_SMOOTH = 3,    // 角度が閾値以下の面の間だけ平均する
+    };
+
+    // メッシュビルダーに渡すバッファの成分の型
+    enum ComponentType : int
+    {
+        COMPONENT_FLOAT32 = 0,
+        COMPONENT_FLOAT64 = 1,
+        COMPONENT_INT32 = 2,
+        COMPONENT_UINT32 = 3,
+    };
+
+    // 呼び出し元のバッファ (要素の間隔と成分の型を指定) からMeshを組み立てる
+    // Meshと同じ並びのバッファはコピーせずに参照するので、
+    // 書き出しが終わるまで呼び出し元で保持すること
+    struct MeshBuilder;
+
+    // ネイティブライタの配列の圧縮 (FBX SDKでは無視する)
+    enum ArrayCompression : int
+    {
+        ARRAY_COMPRESSION_DEFLATE = 0, // 閾値以上の配列をzlibで圧縮する
+        ARRAY_COMPRESSION_STORE = 1,   // 圧縮しない (一時的な書き出し用)
     };
 
     struct IOData
     {
-        bool is_ascii;
+        bool is_ascii; // ASCII形式で書き出すかどうか (IO_BACKEND_FBXSDKのみ)
         double unit_scale; // 1.0 for meters, 0.01 for centimeters, 0.0254 for
                            // inches
         Object* root;
         Material* materials;
         size_t material_count;
+        IOBackend backend;
+        void* arena; // インポート結果の確保領域 (delete_iodataで解放する)
+                     // 書き出しではnullptr
+        bool merge_materials; // 書き出し時にStandardSurfaceが同一のマテリアルを
+                              // 1つにまとめるかどうか
+        ArrayCompression array_compression;
+        int compression_level; // 1-9 (0なら6)
+        size_t compression_threshold; // これより小さい配列 (バイト) は圧縮しない
+                                      // (0なら4096)
+        const char* cache_dir; // 書き出しキャッシュの置き場所 (UTF-8、ネイティブ
+                               // ライタのみ、nullptrなら使わない)
+        bool weld_corner_attributes; // 法線・UVの同じ値を1つにまとめて
+                                     // IndexToDirectで書き出すかどうか
+        bool optimize_vertex_cache; // ポリゴンを頂点キャッシュに載りやすい順に
+                                    // 並べ替えて書き出すかどうか
+        const double* lod_ratios; // LOD1から順の残す三角形数の割合 (0-1]
+                                  // (メッシュを持つノードをLODグループにする)
+        size_t lod_count; // lod_ratiosの要素数 (0ならLODを作らない)
+        double frame_rate;      // アニメーションの1秒あたりのフレーム数 (0なら30)
+        double animation_start; // 最初のフレームの時刻 (秒)
+        double key_tolerance; // キーを減らす許容誤差の既定値に対する倍率
+                              // (0なら1、負ならキーを減らさない)
+        size_t max_influences; // 頂点ごとに残すボーンの影響の数 (重みの大きい順、
+                               // 0なら減らさない、残した重みは合計1に正規化する)
+        int weight_bits; // スキンの重みを量子化するビット数 (1-16、0ならしない)
+                         // 重みは1/(2^bits-1)の倍数で合計がちょうど1になる
+    };
+
+    // 読み込みに使用するバックエンド
+    enum ImportBackend : int
+    {
+        IMPORT_BACKEND_AUTO = 0,   // バイナリFBX 7.xはネイティブ、それ以外はFBX SDK
+        IMPORT_BACKEND_NATIVE = 1, // ネイティブのみ (バイナリFBX 7.x以外は失敗する)
+        IMPORT_BACKEND_FBXSDK = 2, // FBX SDKのみ (FBX SDK無しのビルドでは失敗する)
+    };
+
+    // 読み込みの設定 (nullptrなら全て既定値)
+    struct ImportOptions
+    {
+        // UV・法線セットをポリゴン頂点ごとに展開せず、値とポリゴン頂点ごとの
+        // 番号で返す (ファイルのIndexToDirectの値をそのまま使い、Directで
+        // ポリゴン頂点ごとの値はビット列が同じものを1つにまとめる)
+        bool indexed_attributes;
+        ImportBackend backend;
+    };
+
+    // ストリーミング読み込みのコールバック (import_fbx_streamを呼んだスレッドで順に呼ぶ)
+    // マテリアルを全て渡した後にノードを親から順に渡し、最後にメッシュを読み込めた順に渡す
+    struct ImportCallbacks
+    {
+        void* user_data;
+        // materialはimport_fbx_streamから戻るまで有効
+        // (ノードのmaterial_slotsはこのポインタを指す)
+        void (*on_material)(void* user_data, size_t index,
+                            const Material* material);
+        // ノードの番号は渡した順の通し番号、parentはルート直下ならSIZE_MAX
+        // objectのchildrenはnullptr、meshは名前だけで中身はon_meshで渡す
+        // (同じメッシュを使うノードは同じポインタになる)
+        void (*on_object)(void* user_data, size_t index, size_t parent,
+                          const Object* object);
+        // object_indicesはメッシュを使うノードの番号
+        // meshとその配列はコールバックから戻ると解放される
+        void (*on_mesh)(void* user_data, const size_t* object_indices,
+                        size_t object_count, const Mesh* mesh);
+    };
+
+    // 非同期の書き出しの段階
+    enum ExportPhase : int
+    {
+        EXPORT_PHASE_PENDING = 0,   // スレッドの開始待ち
+        EXPORT_PHASE_PREPARING = 1, // メッシュの変換 (項目数はメッシュ数、
+                                    // LODを作る場合は先にLODの数で1回、
+                                    // スキンがあればそのメッシュ数で1回、
+                                    // アニメーションがあれば最後にその
+                                    // オブジェクト数で1回)
+        EXPORT_PHASE_BUILDING = 2,  // シーン・ノードツリーの構築と配列の圧縮
+                                    // (項目数は圧縮する塊の数)
+        EXPORT_PHASE_WRITING = 3,   // ファイルへの書き出し
+        EXPORT_PHASE_FINISHED = 4,
+        EXPORT_PHASE_FAILED = 5,
+        EXPORT_PHASE_CANCELLED = 6, // 書きかけのファイルは削除済み
+    };
+
+    // 非同期の書き出しの進捗
+    struct ExportProgress
+    {
+        ExportPhase phase;
+        size_t items_done; // 現在の段階で処理した項目数
+        size_t item_count; // 現在の段階の項目数 (分からなければ0)
+        uint64_t bytes_written; // ファイルに書き出したバイト数
+        uint64_t bytes_total; // 書き出すバイト数 (FBX SDKでは終わるまで0)
+    };
+
+    // バックグラウンドのスレッドで実行中の書き出し
+    // 渡したIODataとその中身は、wait_exportかdelete_export_jobが
+    // 戻るまで呼び出し元で保持すること
+    struct ExportJob;
+
+    // FbxManagerを使い回す入出力のセッション (session_付きの関数に渡す)
+    // FBX SDKで読み書きする間だけ空いているマネージャを貸し出し、同時に貸し出す数は
+    // create_io_sessionで指定した数までにする (全て使用中なら空くまで待つ)
+    // 別々のスレッドから同時に呼んでよい。sessionがnullptrの場合と
+    // session_付きでない関数は、呼び出しごとにマネージャを作って破棄する
+    struct IOSession;
+
+    // 統計を取る段階
+    enum StatsPhase : int
+    {
+        STATS_PHASE_MATERIALS = 0, // マテリアルの作成・読み込み
+        STATS_PHASE_NODES = 1,     // ノードツリーの作成・読み込み
+        STATS_PHASE_MESHES = 2,    // 頂点座標・ポリゴンの変換
+        STATS_PHASE_LAYERS = 3,    // 法線・UV・マテリアル番号の変換
+        STATS_PHASE_SERIALIZE = 4, // ファイルの書き出し・解析
+        STATS_PHASE_COPY_OUT = 5,  // import_fbx_streamのコールバック
+        STATS_PHASE_COUNT = 6,
+    };
+
+    // 段階ごとの時間 (並列処理の経過時間はCPU時間の比で分ける)
+    struct PhaseStats
+    {
+        double wall_seconds;
+        double cpu_seconds; // 全スレッドの合計
+    };
+
+    // 1回の入出力の統計
+    // get_last_statsは呼び出したスレッドで最後に終わった入出力の統計を返す
+    // (別のスレッドの入出力では上書きされない)。start_export_fbxは
+    // バックグラウンドのスレッドで書き出すので、get_export_job_statsで取得する
+    struct IOStats
+    {
+        PhaseStats phases[STATS_PHASE_COUNT];
+        double wall_seconds; // 呼び出し全体の経過時間
+        double cpu_seconds;  // 各段階のCPU時間の合計
+        size_t node_count;   // ルートを除くノード数
+        size_t mesh_count;   // 共有されたメッシュは1回だけ数える
+        size_t corner_count; // ポリゴン頂点数
+        size_t material_count;
+        uint64_t bytes_read;
+        uint64_t bytes_written;
+        // このライブラリが確保した主なバッファの最大 (FBX SDK内部は含まない)
+        uint64_t peak_allocated_bytes;
+        bool succeeded;
     };
 
     DLLEXPORT(IOData*) import_fbx(const char* import_path);
+    DLLEXPORT(IOData*)
+    import_fbx_with_options(const char* import_path,
+                            const ImportOptions* options);
+    DLLEXPORT(bool)
+    import_fbx_stream(const char* import_path,
+                      const ImportCallbacks* callbacks);
+    DLLEXPORT(bool)
+    import_fbx_stream_with_options(const char* import_path,
+                                   const ImportCallbacks* callbacks,
+                                   const ImportOptions* options);
     DLLEXPORT(bool)
     export_fbx(const char* export_path, const IOData* export_data);
+    DLLEXPORT(ExportJob*)
+    start_export_fbx(const char* export_path, const IOData* export_data);
+    DLLEXPORT(void)
+    get_export_progress(const ExportJob* job, ExportProgress* out_progress);
+    DLLEXPORT(void) cancel_export(ExportJob* job);
+    DLLEXPORT(bool) wait_export(ExportJob* job);
+    DLLEXPORT(void) delete_export_job(ExportJob* job);
+    DLLEXPORT(bool)
+    get_export_job_stats(const ExportJob* job, IOStats* out_stats);
+    DLLEXPORT(bool) get_last_stats(IOStats* out_stats);
+    DLLEXPORT(IOSession*) create_io_session(size_t max_managers);
+    DLLEXPORT(void) delete_io_session(IOSession* session);
+    DLLEXPORT(IOData*)
+    session_import_fbx(IOSession* session, const char* import_path);
+    DLLEXPORT(IOData*)
+    session_import_fbx_with_options(IOSession* session,
+                                    const char* import_path,
+                                    const ImportOptions* options);
+    DLLEXPORT(bool)
+    session_import_fbx_stream(IOSession* session, const char* import_path,
+                              const ImportCallbacks* callbacks);
+    DLLEXPORT(bool)
+    session_import_fbx_stream_with_options(IOSession* session,
+                                           const char* import_path,
+                                           const ImportCallbacks* callbacks,
+                                           const ImportOptions* options);
+    DLLEXPORT(bool)
+    session_export_fbx(IOSession* session, const char* export_path,
+                       const IOData* export_data);
+    DLLEXPORT(ExportJob*)
+    session_start_export_fbx(IOSession* session, const char* export_path,
+                             const IOData* export_data);
     DLLEXPORT(void)
     vnrm_from_pnrm(const unsigned int* indices, size_t index_count,
                    const unsigned int* polys, size_t poly_count,
                    const Vector4* poly_normals, Vector4* out_vertex_normals);
     DLLEXPORT(void) fix_normal_rot(Vector4* normals, size_t normal_count);
+    DLLEXPORT(bool)
+    compute_normals(const Mesh* mesh, NormalMode mode, double crease_angle,
+                    Normal* out_normal);
     DLLEXPORT(void) delete_iodata(IOData* data);
+
+    DLLEXPORT(MeshBuilder*)
+    create_mesh_builder(const char* name, ScalarType scalar_type);
+    DLLEXPORT(bool)
+    mesh_builder_set_positions(MeshBuilder* builder, const void* data,
+                               size_t count, size_t stride,
+                               ComponentType type);
+    DLLEXPORT(bool)
+    mesh_builder_set_indices(MeshBuilder* builder, const void* data,
+                             size_t count, size_t stride, ComponentType type);
+    DLLEXPORT(bool)
+    mesh_builder_set_polys(MeshBuilder* builder, const void* data, size_t count,
+                           size_t stride, ComponentType type);
+    DLLEXPORT(bool)
+    mesh_builder_set_material_indices(MeshBuilder* builder, const void* data,
+                                      size_t count, size_t stride,
+                                      ComponentType type);
+    DLLEXPORT(bool)
+    mesh_builder_add_uv_set(MeshBuilder* builder, const char* name,
+                            const void* data, size_t count, size_t stride,
+                            ComponentType type);
+    DLLEXPORT(bool)
+    mesh_builder_add_normal_set(MeshBuilder* builder, const char* name,
+                                const void* data, size_t count, size_t stride,
+                                ComponentType type);
+    DLLEXPORT(bool)
+    mesh_builder_compute_normals(MeshBuilder* builder, const char* name,
+                                 NormalMode mode, double crease_angle);
+    DLLEXPORT(void)
+    mesh_builder_set_smooth(MeshBuilder* builder, bool is_smooth,
+                            double smooth_angle);
+    DLLEXPORT(Mesh*) mesh_builder_get_mesh(MeshBuilder* builder);
+    DLLEXPORT(void) delete_mesh_builder(MeshBuilder* builder);
 }
@@ -0,0 +1,277 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "animation_curves.h"
+#include "export_job.h"
+#include "fbx_binary.h"
+#include "io_stats.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+// フレームレートを指定しない場合の値
+constexpr double ANIMATION_DEFAULT_FRAME_RATE = 30.0;
+// 既定の許容誤差 (移動はmatrix_localの単位、回転は度、拡縮は倍率)
+constexpr double ANIMATION_TRANSLATION_TOLERANCE = 1e-4;
+constexpr double ANIMATION_ROTATION_TOLERANCE = 1e-2;
+constexpr double ANIMATION_SCALING_TOLERANCE = 1e-4;
+// オブジェクトごとの並列処理の単位 (移動XYZ、回転、拡縮XYZ)
+constexpr int ANIMATION_TASKS_PER_OBJECT = 7;
+
+double matrix_scale(const double* m, int axis);
+void filter_euler(const double* previous, double* r);
+double wrap_degrees(double angle, double reference);
+
+SceneAnimation::SceneAnimation(const IOData* export_data, const Object* root)
+    : rate(export_data->frame_rate > 0.0 ? export_data->frame_rate
+                                         : ANIMATION_DEFAULT_FRAME_RATE),
+      start_seconds(export_data->animation_start),
+      tolerance(export_data->key_tolerance != 0.0 ? export_data->key_tolerance
+                                                  : 1.0)
+{
+    for (size_t i = 0; i < root->child_count; i++) collect(&root->children[i]);
+
+    size_t frame_count = 0;
+    for (auto& animation : animations)
+    {
+        frame_count =
+            std::max(frame_count, animation.object->animation_frame_count);
+    }
+    start = frame_time(0);
+    stop = frame_count > 0 ? frame_time(frame_count - 1) : start;
+}
+
+/// @brief アニメーションを持つオブジェクトを親から順に集める
+/// @param object オブジェクト
+void SceneAnimation::collect(const Object* object)
+{
+    if (object->animation_matrices != nullptr &&
+        object->animation_frame_count > 0)
+    {
+        indices.emplace(object, animations.size());
+        animations.push_back({object});
+    }
+    for (size_t i = 0; i < object->child_count; i++)
+        collect(&object->children[i]);
+}
+
+/// @brief 全てのオブジェクトのカーブを並列にベイクする
+/// @param monitor 進捗の報告先 (オブジェクトごとにadvanceする)
+/// @param stats 統計の記録先 (ノードツリーの段階に足す)
+/// @return ベイクできたかどうか (中断を要求された場合はfalse)
+bool SceneAnimation::bake(ExportMonitor& monitor, StatsRecorder& stats)
+{
+    if (!enabled()) return true;
+
+    std::vector<std::atomic<int>> remaining(animations.size());
+    for (auto& count : remaining) count = ANIMATION_TASKS_PER_OBJECT;
+    monitor.begin_phase(EXPORT_PHASE_PREPARING, animations.size());
+    {
+        StatsParallelScope scope(stats, {STATS_PHASE_NODES});
+        parallel_for(
+            animations.size() * ANIMATION_TASKS_PER_OBJECT,
+            [&](size_t i) {
+                if (monitor.cancelled()) return;
+                StatsScope task(stats, STATS_PHASE_NODES, STATS_PHASE_COUNT,
+                                true);
+                auto index = i / ANIMATION_TASKS_PER_OBJECT;
+                bake_channel(animations[index],
+                             (int)(i % ANIMATION_TASKS_PER_OBJECT));
+                if (--remaining[index] == 0) monitor.advance();
+            },
+            1);
+    }
+    if (monitor.cancelled()) return false;
+
+    int64_t bytes = 0;
+    for (auto& animation : animations)
+    {
+        for (auto& curve : animation.curves)
+        {
+            bytes += curve.times.capacity() * sizeof(int64_t) +
+                     curve.values.capacity() * sizeof(float);
+        }
+    }
+    stats.track_allocation(bytes);
+    return true;
+}
+
+/// @brief 1つの成分 (回転は3成分) をサンプリングしてキーを減らす
+/// @param animation 出力先
+/// @param channel 0-2は移動XYZ、3は回転、4-6は拡縮XYZ
+void SceneAnimation::bake_channel(ObjectAnimation& animation, int channel) const
+{
+    auto matrices = animation.object->animation_matrices;
+    auto count = animation.object->animation_frame_count;
+    std::vector<double> samples;
+
+    // オイラー角は前のフレームに近い方の表し方を選び、360度の飛びを無くす
+    if (channel == 3)
+    {
+        samples.resize(count * 3);
+        double previous[3];
+        for (size_t i = 0; i < count; i++)
+        {
+            double t[3], r[3], s[3];
+            decompose_matrix(matrices + i * 16, t, r, s);
+            if (i > 0) filter_euler(previous, r);
+            for (auto j = 0; j < 3; j++)
+            {
+                samples[j * count + i] = r[j];
+                previous[j] = r[j];
+            }
+        }
+        for (auto j = 0; j < 3; j++)
+        {
+            store_curve(&samples[j * count], count,
+                        ANIMATION_ROTATION_TOLERANCE * tolerance,
+                        animation.curves[ANIMATION_ROTATION + j]);
+        }
+        return;
+    }
+
+    samples.resize(count);
+    if (channel < 3)
+    {
+        for (size_t i = 0; i < count; i++)
+            samples[i] = matrices[i * 16 + 12 + channel];
+        store_curve(samples.data(), count,
+                    ANIMATION_TRANSLATION_TOLERANCE * tolerance,
+                    animation.curves[ANIMATION_TRANSLATION + channel]);
+    }
+    else
+    {
+        auto axis = channel - 4;
+        for (size_t i = 0; i < count; i++)
+            samples[i] = matrix_scale(matrices + i * 16, axis);
+        store_curve(samples.data(), count,
+                    ANIMATION_SCALING_TOLERANCE * tolerance,
+                    animation.curves[ANIMATION_SCALING + axis]);
+    }
+}
+
+/// @brief キーを減らしてカーブに格納する
+/// @param samples フレームごとの値
+/// @param count フレーム数
+/// @param tolerance 許容誤差 (負ならキーを減らさない)
+/// @param curve 出力先
+void SceneAnimation::store_curve(const double* samples, size_t count,
+                                 double tolerance, AnimationCurve& curve) const
+{
+    std::vector<uint32_t> keys;
+    reduce_curve_keys(samples, count, tolerance, keys);
+    curve.times.resize(keys.size());
+    curve.values.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        curve.times[i] = frame_time(keys[i]);
+        curve.values[i] = (float)samples[keys[i]];
+    }
+}
+
+/// @brief フレームの時刻をFBXの時間にする
+int64_t SceneAnimation::frame_time(size_t frame) const
+{
+    return std::llround((start_seconds + (double)frame / rate) *
+                        (double)FBX_TICKS_PER_SECOND);
+}
+
+/// @brief キーの間を直線補間した値が全てのフレームで許容誤差に収まるようにキーを選ぶ
+/// キーから始めて、次のキーまでの傾きが取りうる範囲を1フレームずつ狭めながら
+/// 最も遠くまで届くフレームを次のキーにする (最初と最後のフレームは必ずキーにする)
+/// 全てのフレームが最初の値から許容誤差に収まる場合はキーを1つにする
+/// @param samples フレームごとの値
+/// @param count フレーム数
+/// @param tolerance 許容誤差 (負なら全てのフレームをキーにする)
+/// @param keys キーにするフレームの番号の出力先 (昇順)
+void reduce_curve_keys(const double* samples, size_t count, double tolerance,
+                       std::vector<uint32_t>& keys)
+{
+    keys.clear();
+    if (count == 0) return;
+    if (tolerance < 0.0)
+    {
+        keys.resize(count);
+        for (size_t i = 0; i < count; i++) keys[i] = (uint32_t)i;
+        return;
+    }
+
+    keys.push_back(0);
+    auto first = samples[0];
+    auto constant = std::all_of(samples, samples + count, [&](double value) {
+        return std::abs(value - first) <= tolerance;
+    });
+    if (constant) return;
+
+    const auto infinity = std::numeric_limits<double>::infinity();
+    size_t anchor = 0;
+    while (anchor + 1 < count)
+    {
+        auto base = samples[anchor];
+        auto lo = -infinity;
+        auto hi = infinity;
+        auto end = anchor + 1;
+        for (auto i = anchor + 1; i < count; i++)
+        {
+            // 間のフレームが全て収まる傾きなら、このフレームまで1本の直線で届く
+            auto distance = (double)(i - anchor);
+            auto slope = (samples[i] - base) / distance;
+            if (slope >= lo && slope <= hi) end = i;
+            lo = std::max(lo, (samples[i] - tolerance - base) / distance);
+            hi = std::min(hi, (samples[i] + tolerance - base) / distance);
+            if (lo > hi) break;
+        }
+        keys.push_back((uint32_t)end);
+        anchor = end;
+    }
+}
+
+/// @brief 行列の軸の拡縮 (decompose_matrixと同じく、行列式が負なら負にする)
+/// @param m 行列 (FbxAMatrixと同じ並び)
+/// @param axis 軸 (0-2)
+double matrix_scale(const double* m, int axis)
+{
+    auto det = m[0] * (m[5] * m[10] - m[6] * m[9]) -
+               m[1] * (m[4] * m[10] - m[6] * m[8]) +
+               m[2] * (m[4] * m[9] - m[5] * m[8]);
+    auto row = &m[axis * 4];
+    auto length =
+        std::sqrt(row[0] * row[0] + row[1] * row[1] + row[2] * row[2]);
+    return det < 0 ? -length : length;
+}
+
+/// @brief XYZオイラー角を前のフレームに最も近い同じ回転の角度に直す
+/// (x, y, z) と (x+180, 180-y, z+180) は同じ回転を表すので、それぞれの成分を
+/// 前のフレームに近づくよう360度ずつずらし、差の合計が小さい方を選ぶ
+/// @param previous 前のフレームの角度 (度)
+/// @param r 角度 (度、書き換える)
+void filter_euler(const double* previous, double* r)
+{
+    double candidates[2][3] = {{r[0], r[1], r[2]},
+                               {r[0] + 180.0, 180.0 - r[1], r[2] + 180.0}};
+    auto best = std::numeric_limits<double>::infinity();
+    for (auto& candidate : candidates)
+    {
+        double distance = 0.0;
+        for (auto i = 0; i < 3; i++)
+        {
+            candidate[i] = wrap_degrees(candidate[i], previous[i]);
+            distance += std::abs(candidate[i] - previous[i]);
+        }
+        if (distance < best)
+        {
+            best = distance;
+            std::copy(candidate, candidate + 3, r);
+        }
+    }
+}
+
+/// @brief 角度を基準に最も近くなるよう360度の倍数だけずらす
+double wrap_degrees(double angle, double reference)
+{
+    return angle + 360.0 * std::round((reference - angle) / 360.0);
+}
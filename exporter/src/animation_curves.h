@@ -0,0 +1,97 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 書き出し時のアニメーションのベイク
+// フレームごとのローカル行列を移動・回転・拡縮のカーブに分解し、直線補間で
+// 許容誤差に収まる範囲でキーを減らす
+// FBX SDKでの書き出しとネイティブライタで共有する
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class ExportMonitor;
+class StatsRecorder;
+
+// FBXの時間の1秒あたりの単位数 (KTime)
+constexpr int64_t FBX_TICKS_PER_SECOND = 46186158000;
+
+// オブジェクトごとのカーブの並び (移動XYZ、回転XYZ、拡縮XYZ)
+enum AnimationChannel : int
+{
+    ANIMATION_TRANSLATION = 0,
+    ANIMATION_ROTATION = 3,
+    ANIMATION_SCALING = 6,
+    ANIMATION_CURVE_COUNT = 9,
+};
+
+/// @brief 1成分のカーブ (キーの間は直線補間)
+struct AnimationCurve
+{
+    std::vector<int64_t> times; // FBXの時間
+    std::vector<float> values;  // 回転は度
+};
+
+/// @brief 1つのオブジェクトのカーブ
+struct ObjectAnimation
+{
+    const Object* object = nullptr;
+    AnimationCurve curves[ANIMATION_CURVE_COUNT] = {};
+};
+
+/// @brief 書き出すオブジェクトツリーのアニメーション
+/// Object::animation_frame_countが0でないオブジェクトだけをベイクする
+/// 移動・拡縮は成分ごと、回転は3成分をまとめて (オイラー角のフィルタが
+/// 成分をまたぐため) 並列にベイクする
+class SceneAnimation
+{
+  public:
+    /// @param export_data エクスポートするデータ (フレームレートと許容誤差)
+    /// @param root 書き出すオブジェクトツリーのルート (ルート自体は含めない)
+    SceneAnimation(const IOData* export_data, const Object* root);
+    SceneAnimation(const SceneAnimation&) = delete;
+    SceneAnimation& operator=(const SceneAnimation&) = delete;
+
+    /// @brief アニメーションを書き出すかどうか
+    bool enabled() const { return !animations.empty(); }
+
+    /// @brief ベイクしたカーブ (ツリーを親から順にたどった順)
+    const std::vector<ObjectAnimation>& objects() const { return animations; }
+
+    /// @brief オブジェクトのカーブ (アニメーションが無ければnullptr)
+    const ObjectAnimation* find(const Object* object) const
+    {
+        auto found = indices.find(object);
+        return found != indices.end() ? &animations[found->second] : nullptr;
+    }
+
+    int64_t start_time() const { return start; }
+    int64_t stop_time() const { return stop; }
+    double frame_rate() const { return rate; }
+
+    bool bake(ExportMonitor& monitor, StatsRecorder& stats);
+
+  private:
+    void collect(const Object* object);
+    void bake_channel(ObjectAnimation& animation, int channel) const;
+    void store_curve(const double* samples, size_t count, double tolerance,
+                     AnimationCurve& curve) const;
+    int64_t frame_time(size_t frame) const;
+
+    std::vector<ObjectAnimation> animations;
+    std::unordered_map<const Object*, size_t> indices;
+    double rate;          // 1秒あたりのフレーム数
+    double start_seconds; // 最初のフレームの時刻
+    double tolerance;     // 既定の許容誤差の倍率 (負ならキーを減らさない)
+    int64_t start = 0;
+    int64_t stop = 0;
+};
+
+void reduce_curve_keys(const double* samples, size_t count, double tolerance,
+                       std::vector<uint32_t>& keys);
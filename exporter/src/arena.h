@@ -0,0 +1,105 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+/// @brief インポート結果をまとめて確保するための領域
+/// 確保は先頭から詰めていくだけで、個別には解放せず領域ごと解放する
+/// 複数のスレッドから同時に確保してもよい
+class Arena
+{
+  public:
+    /// @param reserve 最初に確保しておく大きさ (バイト)
+    explicit Arena(size_t reserve) { add_block(reserve); }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    /// @brief 0で初期化された配列を確保する
+    /// @param count 要素数
+    /// @return 確保した配列 (countが0ならnullptr)
+    template <typename T> T* allocate(size_t count = 1)
+    {
+        static_assert(std::is_trivially_destructible_v<T>,
+                      "Arena does not run destructors.");
+        if (count == 0) return nullptr;
+        auto memory = (T*)allocate_bytes(count * sizeof(T), alignof(T));
+        std::uninitialized_value_construct_n(memory, count);
+        return memory;
+    }
+
+    /// @brief 名前をコピーする
+    /// @param name 名前
+    /// @param out_length 名前の長さの出力先 (nullptrなら出力しない)
+    /// @return コピーした名前 (NULL終端)
+    char* copy_name(std::string_view name, size_t* out_length = nullptr)
+    {
+        auto result = allocate<char>(name.size() + 1);
+        if (result != nullptr && !name.empty())
+            std::memcpy(result, name.data(), name.size());
+        if (out_length != nullptr) *out_length = name.size();
+        return result;
+    }
+
+    /// @brief 確保済みの領域の合計 (バイト)
+    size_t capacity() const
+    {
+        std::lock_guard lock(mutex);
+        return total;
+    }
+
+  private:
+    static constexpr size_t MIN_BLOCK_SIZE = 64 * 1024;
+
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<std::byte[]>> blocks;
+    size_t used = 0;
+    size_t block_size = 0;
+    size_t total = 0;
+
+    void add_block(size_t size)
+    {
+        size = std::max(size, MIN_BLOCK_SIZE);
+        blocks.push_back(std::make_unique_for_overwrite<std::byte[]>(size));
+        used = 0;
+        block_size = size;
+        total += size;
+    }
+
+    void* allocate_bytes(size_t bytes, size_t align)
+    {
+        std::lock_guard lock(mutex);
+        auto offset = (used + align - 1) & ~(align - 1);
+        if (offset + bytes > block_size)
+        {
+            // 見積もりを超えた分は、それまでの合計と同じ大きさずつ増やす
+            add_block(std::max(bytes + align, total));
+            offset = 0;
+        }
+        used = offset + bytes;
+        return blocks.back().get() + offset;
+    }
+};
+
+/// @brief 領域の中にIODataを確保する (delete_iodataで領域ごと解放される)
+/// @param reserve 最初に確保しておく大きさ (バイト)
+/// @return 確保したIOData
+inline IOData* create_arena_iodata(size_t reserve)
+{
+    auto arena = new Arena(reserve + sizeof(IOData));
+    auto data = arena->allocate<IOData>();
+    data->arena = arena;
+    return data;
+}
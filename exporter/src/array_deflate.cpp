@@ -0,0 +1,224 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "array_deflate.h"
+#include "export_job.h"
+#include "io_stats.h"
+#include "parallel.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+
+// deflateの窓の大きさ (塊の直前のこの分の入力を辞書にする)
+constexpr size_t DEFLATE_WINDOW_SIZE = 32768;
+
+/// @brief 配列の一部を圧縮した塊
+/// 最後の塊以外はZ_SYNC_FLUSHでバイト境界に揃え、そのまま連結できるようにする
+struct DeflateChunk
+{
+    size_t source = 0;
+    size_t first = 0;
+    size_t count = 0;
+    bool last = false;
+    std::vector<uint8_t> data; // 生のdeflateストリーム (ヘッダなし)
+    uLong adler = 1;           // この塊の入力のAdler-32
+    size_t input_size = 0;
+};
+
+size_t deflate_chunk_items(const DeflateSource& source);
+bool deflate_chunk(const DeflateSource& source, int level, DeflateChunk& chunk,
+                   StatsRecorder& stats);
+uint8_t zlib_header_flags(int level);
+
+/// @brief 配列をzlib形式で圧縮する
+/// 全ての配列を塊に分けて並列に圧縮し、配列ごとに連結する (塊の直前の入力を
+/// 辞書にするので、圧縮率は1つのストリームで圧縮した場合とほぼ同じになる)
+/// @param sources 圧縮する配列
+/// @param level 圧縮レベル (1-9)
+/// @param out 配列ごとの圧縮結果 (zlibのヘッダとAdler-32を含む)
+/// @param monitor 進捗の報告先 (塊ごとにadvanceする)
+/// @param stats 統計の記録先 (配列の読み出しはread_phaseに、圧縮はSERIALIZEに足す)
+/// @return 圧縮できたかどうか (中断を要求された場合もfalse)
+bool deflate_arrays(const std::vector<DeflateSource>& sources, int level,
+                    std::vector<std::vector<uint8_t>>& out,
+                    ExportMonitor& monitor, StatsRecorder& stats)
+{
+    std::vector<DeflateChunk> chunks;
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        auto per_chunk = deflate_chunk_items(sources[i]);
+        auto item_count = sources[i].item_count;
+        size_t first = 0;
+        do
+        {
+            DeflateChunk chunk;
+            chunk.source = i;
+            chunk.first = first;
+            chunk.count = std::min(per_chunk, item_count - first);
+            first += chunk.count;
+            chunk.last = first >= item_count;
+            chunks.push_back(std::move(chunk));
+        } while (first < item_count);
+    }
+
+    std::atomic<bool> ok = true;
+    {
+        StatsParallelScope scope(stats,
+                                 {STATS_PHASE_SERIALIZE, STATS_PHASE_MESHES,
+                                  STATS_PHASE_LAYERS});
+        parallel_for(
+            chunks.size(),
+            [&](size_t i) {
+                if (!ok || monitor.cancelled()) return;
+                StatsScope task(stats, STATS_PHASE_SERIALIZE,
+                                STATS_PHASE_COUNT, true);
+                auto& chunk = chunks[i];
+                if (!deflate_chunk(sources[chunk.source], level, chunk, stats))
+                    ok = false;
+                monitor.advance();
+            },
+            1);
+    }
+    if (!ok)
+    {
+        std::cerr << "An error occurred while compressing an array..."
+                  << std::endl;
+        return false;
+    }
+    if (monitor.cancelled()) return false;
+
+    int64_t chunk_bytes = 0;
+    for (auto& chunk : chunks) chunk_bytes += chunk.data.capacity();
+    stats.track_allocation(chunk_bytes);
+
+    // 配列ごとにヘッダ、塊、入力全体のAdler-32 (ビッグエンディアン) を並べる
+    StatsScope scope(stats, STATS_PHASE_SERIALIZE);
+    out.assign(sources.size(), {});
+    auto chunk = chunks.begin();
+    int64_t out_bytes = 0;
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        auto end = chunk;
+        size_t size = 2 + 4;
+        while (end != chunks.end() && end->source == i)
+            size += (end++)->data.size();
+
+        auto& stream = out[i];
+        stream.reserve(size);
+        stream.push_back(0x78);
+        stream.push_back(zlib_header_flags(level));
+        auto adler = adler32(0L, Z_NULL, 0);
+        for (; chunk != end; ++chunk)
+        {
+            stream.insert(stream.end(), chunk->data.begin(), chunk->data.end());
+            adler = adler32_combine(adler, chunk->adler,
+                                    (z_off_t)chunk->input_size);
+            std::vector<uint8_t>().swap(chunk->data);
+        }
+        for (int shift = 24; shift >= 0; shift -= 8)
+            stream.push_back((uint8_t)(adler >> shift));
+        out_bytes += stream.size();
+    }
+    stats.track_allocation(out_bytes - chunk_bytes);
+    return true;
+}
+
+/// @brief 配列を分ける塊の数
+/// @param source 配列
+/// @return 塊の数 (空の配列でも1)
+size_t deflate_chunk_count(const DeflateSource& source)
+{
+    auto per_chunk = deflate_chunk_items(source);
+    return std::max<size_t>(1, (source.item_count + per_chunk - 1) / per_chunk);
+}
+
+/// @brief 書き出しに使う圧縮レベル
+/// @param export_data エクスポートするデータ
+/// @return 圧縮レベル (1-9、0を指定した場合は既定値)
+int resolve_compression_level(const IOData* export_data)
+{
+    return export_data->compression_level > 0
+               ? std::min(export_data->compression_level, 9)
+               : DEFAULT_COMPRESSION_LEVEL;
+}
+
+/// @brief 圧縮する配列の最小のバイト数
+/// @param export_data エクスポートするデータ
+/// @return バイト数 (0を指定した場合は既定値)
+size_t resolve_compression_threshold(const IOData* export_data)
+{
+    return export_data->compression_threshold > 0
+               ? export_data->compression_threshold
+               : DEFAULT_COMPRESSION_THRESHOLD;
+}
+
+/// @brief 1つの塊の項目数
+size_t deflate_chunk_items(const DeflateSource& source)
+{
+    auto item_size = std::max<size_t>(1, source.item_size);
+    return std::max<size_t>(1, DEFLATE_CHUNK_SIZE / item_size);
+}
+
+/// @brief 1つの塊を圧縮する (塊ごとに並列に呼び出される)
+/// @param source 配列
+/// @param level 圧縮レベル
+/// @param chunk 圧縮する範囲と出力先
+/// @param stats 統計の記録先
+/// @return 圧縮できたかどうか
+bool deflate_chunk(const DeflateSource& source, int level, DeflateChunk& chunk,
+                   StatsRecorder& stats)
+{
+    // 直前の窓の分も読み出して辞書にする
+    auto item_size = source.item_size;
+    auto dict_items = std::min(
+        chunk.first, (DEFLATE_WINDOW_SIZE + item_size - 1) / item_size);
+    std::vector<uint8_t> input((dict_items + chunk.count) * item_size);
+    if (!input.empty())
+    {
+        StatsScope scope(stats, source.read_phase, STATS_PHASE_SERIALIZE,
+                         true);
+        source.read(chunk.first - dict_items, dict_items + chunk.count,
+                    input.data());
+    }
+    auto body = input.data() + dict_items * item_size;
+    auto dict_size = std::min(DEFLATE_WINDOW_SIZE, dict_items * item_size);
+    chunk.input_size = chunk.count * item_size;
+
+    z_stream stream = {};
+    if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    if (dict_size > 0)
+        deflateSetDictionary(&stream, body - dict_size, (uInt)dict_size);
+
+    // Z_SYNC_FLUSHの空のブロックの分を余分に確保する
+    chunk.data.resize(deflateBound(&stream, (uLong)chunk.input_size) + 16);
+    stream.next_in = body;
+    stream.avail_in = (uInt)chunk.input_size;
+    stream.next_out = chunk.data.data();
+    stream.avail_out = (uInt)chunk.data.size();
+    auto result = deflate(&stream, chunk.last ? Z_FINISH : Z_SYNC_FLUSH);
+    auto ok = chunk.last ? result == Z_STREAM_END
+                         : result == Z_OK && stream.avail_in == 0 &&
+                               stream.avail_out > 0;
+    chunk.data.resize(stream.total_out);
+    chunk.data.shrink_to_fit();
+    deflateEnd(&stream);
+
+    chunk.adler = adler32(adler32(0L, Z_NULL, 0), body, (uInt)chunk.input_size);
+    return ok;
+}
+
+/// @brief zlibヘッダの2バイト目 (圧縮レベルの目安とチェックビット)
+/// @param level 圧縮レベル
+uint8_t zlib_header_flags(int level)
+{
+    if (level <= 1) return 0x01;
+    if (level <= 5) return 0x5e;
+    if (level == 6) return 0x9c;
+    return 0xda;
+}
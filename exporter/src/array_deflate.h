@@ -0,0 +1,39 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// バイナリFBXの配列のzlib圧縮 (配列をまたいで塊ごとに並列に圧縮する)
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+class ExportMonitor;
+class StatsRecorder;
+
+// 1つの塊で圧縮する入力のバイト数 (これより大きい配列は分割して並列に圧縮する)
+constexpr size_t DEFLATE_CHUNK_SIZE = 1 << 18;
+
+// 圧縮レベルと閾値の既定値 (IODataで0を指定した場合)
+constexpr int DEFAULT_COMPRESSION_LEVEL = 6;
+constexpr size_t DEFAULT_COMPRESSION_THRESHOLD = 4096;
+
+/// @brief 圧縮する配列 (項目単位で読み出す)
+struct DeflateSource
+{
+    size_t item_count = 0;
+    size_t item_size = 0; // 1項目のバイト数
+    std::function<void(size_t first, size_t count, void* out)> read;
+    StatsPhase read_phase = STATS_PHASE_MESHES; // readの時間を足す段階
+};
+
+bool deflate_arrays(const std::vector<DeflateSource>& sources, int level,
+                    std::vector<std::vector<uint8_t>>& out,
+                    ExportMonitor& monitor, StatsRecorder& stats);
+size_t deflate_chunk_count(const DeflateSource& source);
+int resolve_compression_level(const IOData* export_data);
+size_t resolve_compression_threshold(const IOData* export_data);
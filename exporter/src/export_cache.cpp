@@ -0,0 +1,646 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "export_cache.h"
+#include "array_deflate.h"
+#include "io_stats.h"
+#include "mesh_instances.h"
+#include "parallel.h"
+#include "scene_tables.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+// キーの2本目のハッシュの初期値 (キーは2本合わせて128bit)
+constexpr uint64_t CACHE_SECOND_SEED = 0x6a09e667f3bcc909ull;
+// Geometryのファイルの先頭 (この後にバージョンとキーが続き、末尾は全体のハッシュ)
+constexpr char CACHE_GEOMETRY_MAGIC[] = "HFBXGEO";
+// シーンの要約のファイルの先頭行
+constexpr char CACHE_MANIFEST_MAGIC[] = "halFBXIO4B-export-cache";
+// 読み込むノードの深さの上限 (壊れたファイルで再帰し続けないように)
+constexpr int CACHE_MAX_DEPTH = 32;
+
+/// @brief キャッシュファイルの読み出し位置
+struct CacheReader
+{
+    const uint8_t* p;
+    const uint8_t* end;
+};
+
+void append_bytes(std::string& out, const void* data, size_t size);
+void append_name(std::string& out, const char* name);
+void summarize_skin(std::string& out, const Skin* skin, size_t vertex_count,
+                    const std::unordered_map<const Object*, size_t>& objects);
+void index_objects(const Object* object,
+                   std::unordered_map<const Object*, size_t>& out);
+void summarize_objects(std::string& out, const Object* object,
+                       const MaterialTable& materials,
+                       const MeshInstances& instances,
+                       const std::unordered_map<const Mesh*, size_t>& indices);
+std::string cache_hex(uint64_t value);
+void serialize_cache_node(const BinNode& node, std::string& out);
+bool parse_cache_node(CacheReader& reader, BinNode& node, int depth);
+bool read_cache_file(const std::filesystem::path& path,
+                     std::vector<uint8_t>& out);
+bool write_cache_file(const std::filesystem::path& path,
+                      const std::string& bytes);
+int64_t cache_file_time(const std::filesystem::path& path);
+
+// 配列はポインタになるので、append_bytesで足すこと
+template <typename T> void append_value(std::string& out, T value)
+{
+    static_assert(!std::is_pointer_v<T>, "append the pointed bytes instead");
+    append_bytes(out, &value, sizeof(T));
+}
+
+template <typename T> bool read_value(CacheReader& reader, T& value)
+{
+    if ((size_t)(reader.end - reader.p) < sizeof(T)) return false;
+    std::memcpy(&value, reader.p, sizeof(T));
+    reader.p += sizeof(T);
+    return true;
+}
+
+const uint8_t* read_span(CacheReader& reader, size_t size)
+{
+    if ((size_t)(reader.end - reader.p) < size) return nullptr;
+    auto p = reader.p;
+    reader.p += size;
+    return p;
+}
+
+ExportCache::ExportCache(const char* export_path, const IOData* export_data,
+                         const MeshInstances& instances)
+{
+    if (export_data->cache_dir == nullptr || *export_data->cache_dir == '\0')
+        return;
+    std::error_code error;
+    std::filesystem::path cache_dir((const char8_t*)export_data->cache_dir);
+    std::filesystem::create_directories(cache_dir, error);
+    if (!std::filesystem::is_directory(cache_dir, error))
+    {
+        std::cerr << "The export cache directory is not available..."
+                  << std::endl;
+        return;
+    }
+    directory = cache_dir;
+    std::filesystem::path path((const char8_t*)export_path);
+    output = std::filesystem::absolute(path, error);
+    if (error) output = path;
+    cache_geometries =
+        export_data->array_compression != ARRAY_COMPRESSION_STORE;
+
+    // Geometryの中身に影響する設定 (メッシュの内容はハッシュで足す)
+    std::string settings;
+    append_value(settings, EXPORT_CACHE_VERSION);
+    append_value(settings, export_data->unit_scale);
+    append_value(settings, (int32_t)export_data->array_compression);
+    append_value(settings, (int32_t)resolve_compression_level(export_data));
+    append_value(settings,
+                 (uint64_t)resolve_compression_threshold(export_data));
+    append_value(settings, export_data->weld_corner_attributes);
+    append_value(settings, export_data->optimize_vertex_cache);
+
+    // メッシュのハッシュは名前を含まないので、UV・法線セットの名前を足す
+    auto& meshes = instances.unique_meshes();
+    auto& hashes = instances.unique_hashes();
+    std::vector<Key> keys(meshes.size());
+    parallel_for(
+        meshes.size(),
+        [&](size_t i) {
+            auto mesh = meshes[i];
+            auto summary = settings;
+            for (size_t j = 0; j < mesh->uv_set_count; j++)
+                append_name(summary, mesh->uv_sets[j].name);
+            for (size_t j = 0; j < mesh->normal_set_count; j++)
+                append_name(summary, mesh->normal_sets[j].name);
+            auto second = hash_mesh(mesh, CACHE_SECOND_SEED);
+            keys[i] = {hash_bytes(summary.data(), summary.size(), hashes[i]),
+                       hash_bytes(summary.data(), summary.size(), second)};
+        },
+        1);
+
+    // シーンの要約は作成日時以外の書き出す内容を全て決める
+    auto scene = settings;
+    append_value(scene, export_data->merge_materials);
+    // LODはGeometryの中身に影響しないが、書き出すノードとGeometryが増える
+    append_value(scene, (uint64_t)export_data->lod_count);
+    for (size_t i = 0; export_data->lod_ratios != nullptr &&
+                       i < export_data->lod_count;
+         i++)
+        append_value(scene, export_data->lod_ratios[i]);
+    append_value(scene, export_data->frame_rate);
+    append_value(scene, export_data->animation_start);
+    append_value(scene, export_data->key_tolerance);
+    append_value(scene, (uint64_t)export_data->max_influences);
+    append_value(scene, (int32_t)export_data->weight_bits);
+    MaterialTable materials(export_data, export_data->merge_materials);
+    append_value(scene, (uint64_t)materials.unique_count());
+    for (size_t i = 0; i < materials.unique_count(); i++)
+    {
+        auto& material = materials.unique_material(i);
+        append_name(scene, material.name);
+        append_value(scene, material.standard_surface);
+    }
+    // スキンはGeometryの中身に影響しないので、キーではなく要約に足す
+    auto root = export_data->root;
+    std::unordered_map<const Object*, size_t> object_indices;
+    index_objects(root, object_indices);
+    std::unordered_map<const Mesh*, size_t> indices;
+    append_value(scene, (uint64_t)meshes.size());
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        entries[meshes[i]].key = keys[i];
+        indices.emplace(meshes[i], i);
+        append_value(scene, keys[i]);
+        summarize_skin(scene, meshes[i]->skin, meshes[i]->vertex_count,
+                       object_indices);
+    }
+    append_value(scene, (uint64_t)root->child_count);
+    for (size_t i = 0; i < root->child_count; i++)
+    {
+        summarize_objects(scene, &root->children[i], materials, instances,
+                          indices);
+    }
+    scene_digest = {hash_bytes(scene.data(), scene.size(), 0),
+                    hash_bytes(scene.data(), scene.size(), CACHE_SECOND_SEED)};
+
+    // 前回の要約と一致し、書き出し先も前回書き出したままなら書き出さない
+    auto output_text = output.u8string();
+    manifest = directory /
+               ("scene-" +
+                cache_hex(hash_bytes(output_text.data(), output_text.size(),
+                                     0)) +
+                ".txt");
+    std::ifstream stream(manifest);
+    std::string magic, digest;
+    uint32_t version = 0;
+    uint64_t size = 0;
+    int64_t time = 0;
+    if (!(stream >> magic >> version >> digest >> size >> time)) return;
+    unchanged = magic == CACHE_MANIFEST_MAGIC &&
+                version == EXPORT_CACHE_VERSION &&
+                digest == cache_hex(scene_digest[0]) +
+                              cache_hex(scene_digest[1]) &&
+                std::filesystem::is_regular_file(output, error) &&
+                std::filesystem::file_size(output, error) == size &&
+                cache_file_time(output) == time;
+}
+
+/// @brief 書き出すメッシュのGeometryをキャッシュから並列に読み込む
+/// 末尾のハッシュやキーが一致しないものは無かったものとして変換し直す
+/// @param stats 統計の記録先 (読み込みの時間はMESHESに足す)
+void ExportCache::load_geometries(StatsRecorder& stats)
+{
+    if (!enabled() || !cache_geometries) return;
+    std::vector<Entry*> list;
+    for (auto& [mesh, entry] : entries) list.push_back(&entry);
+
+    std::atomic<int64_t> loaded_bytes = 0;
+    {
+        StatsParallelScope scope(stats, {STATS_PHASE_MESHES});
+        parallel_for(
+            list.size(),
+            [&](size_t i) {
+                StatsScope task(stats, STATS_PHASE_MESHES, STATS_PHASE_COUNT,
+                                true);
+                auto& entry = *list[i];
+                std::vector<uint8_t> bytes;
+                if (!read_cache_file(geometry_path(entry.key), bytes) ||
+                    bytes.size() < sizeof(uint64_t))
+                    return;
+                auto body_size = bytes.size() - sizeof(uint64_t);
+                uint64_t checksum = 0;
+                std::memcpy(&checksum, bytes.data() + body_size,
+                            sizeof(uint64_t));
+                if (checksum != hash_bytes(bytes.data(), body_size, 0)) return;
+
+                CacheReader reader = {bytes.data(), bytes.data() + body_size};
+                auto magic = read_span(reader, sizeof(CACHE_GEOMETRY_MAGIC));
+                uint32_t version = 0;
+                Key key = {};
+                uint32_t child_count = 0;
+                auto ok = magic != nullptr &&
+                          std::memcmp(magic, CACHE_GEOMETRY_MAGIC,
+                                      sizeof(CACHE_GEOMETRY_MAGIC)) == 0 &&
+                          read_value(reader, version) &&
+                          version == EXPORT_CACHE_VERSION &&
+                          read_value(reader, key) && key == entry.key &&
+                          read_value(reader, child_count);
+                for (uint32_t j = 0; ok && j < child_count; j++)
+                {
+                    entry.children.emplace_back();
+                    ok = parse_cache_node(reader, entry.children.back(), 0);
+                }
+                if (!ok || reader.p != reader.end)
+                {
+                    entry.children.clear();
+                    return;
+                }
+                entry.hit = true;
+                loaded_bytes += bytes.size();
+            },
+            1);
+    }
+    stats.track_allocation(loaded_bytes);
+}
+
+/// @brief キャッシュから読み込んだGeometryの中身を取り出す
+/// @param mesh 書き出すメッシュ
+/// @param geometry 中身の出力先 (Geometryノード)
+/// @return 取り出せたかどうか (falseなら変換して構築する)
+bool ExportCache::take_geometry(const Mesh* mesh, BinNode& geometry)
+{
+    auto found = entries.find(mesh);
+    if (found == entries.end() || !found->second.hit) return false;
+    geometry.children = std::move(found->second.children);
+    found->second.children.clear();
+    return true;
+}
+
+/// @brief キャッシュに無かったGeometryの中身を並列に保存する (圧縮の後に呼ぶ)
+/// 保存できなくても書き出しは続ける
+/// @param document ルートノード
+/// @param geometry_ids 書き出したGeometryのID
+/// @param stats 統計の記録先 (保存の時間はSERIALIZEに足す)
+void ExportCache::store_geometries(
+    const BinNode& document,
+    const std::unordered_map<const Mesh*, int64_t>& geometry_ids,
+    StatsRecorder& stats)
+{
+    if (!enabled() || !cache_geometries) return;
+    std::unordered_map<int64_t, const Mesh*> meshes;
+    for (auto& [mesh, id] : geometry_ids) meshes.emplace(id, mesh);
+
+    std::vector<std::pair<const BinNode*, const Entry*>> pending;
+    for (auto& node : document.children)
+    {
+        if (node.name != "Objects") continue;
+        for (auto& child : node.children)
+        {
+            if (child.name != "Geometry" || child.props.empty()) continue;
+            auto mesh = meshes.find(child.props[0].i);
+            if (mesh == meshes.end()) continue;
+            auto entry = entries.find(mesh->second);
+            if (entry == entries.end() || entry->second.hit) continue;
+            pending.emplace_back(&child, &entry->second);
+        }
+    }
+
+    std::atomic<bool> failed = false;
+    {
+        StatsParallelScope scope(stats, {STATS_PHASE_SERIALIZE});
+        parallel_for(
+            pending.size(),
+            [&](size_t i) {
+                StatsScope task(stats, STATS_PHASE_SERIALIZE,
+                                STATS_PHASE_COUNT, true);
+                auto [geometry, entry] = pending[i];
+                std::string bytes;
+                append_bytes(bytes, CACHE_GEOMETRY_MAGIC,
+                             sizeof(CACHE_GEOMETRY_MAGIC));
+                append_value(bytes, EXPORT_CACHE_VERSION);
+                append_value(bytes, entry->key);
+                append_value(bytes, (uint32_t)geometry->children.size());
+                for (auto& child : geometry->children)
+                    serialize_cache_node(child, bytes);
+                append_value(bytes, hash_bytes(bytes.data(), bytes.size(), 0));
+                if (!write_cache_file(geometry_path(entry->key), bytes))
+                    failed = true;
+            },
+            1);
+    }
+    if (failed)
+    {
+        std::cerr << "Some geometries could not be saved to the export cache..."
+                  << std::endl;
+    }
+}
+
+/// @brief 書き出しに成功したら呼び、シーンの要約と書き出したファイルを記録する
+void ExportCache::commit()
+{
+    if (!enabled()) return;
+    std::error_code error;
+    auto size = std::filesystem::file_size(output, error);
+    if (error) return;
+
+    std::string text = CACHE_MANIFEST_MAGIC;
+    text += " " + std::to_string(EXPORT_CACHE_VERSION) + "\n";
+    text += cache_hex(scene_digest[0]) + cache_hex(scene_digest[1]) + "\n";
+    text += std::to_string(size) + "\n";
+    text += std::to_string(cache_file_time(output)) + "\n";
+    if (!write_cache_file(manifest, text))
+    {
+        std::cerr << "The export cache manifest could not be saved..."
+                  << std::endl;
+    }
+}
+
+/// @brief Geometryを保存するファイルのパス
+/// @param key メッシュのキー
+std::filesystem::path ExportCache::geometry_path(const Key& key) const
+{
+    return directory /
+           ("geometry-" + cache_hex(key[0]) + cache_hex(key[1]) + ".bin");
+}
+
+void append_bytes(std::string& out, const void* data, size_t size)
+{
+    out.append((const char*)data, size);
+}
+
+/// @brief 名前を長さ付きで足す (nullptrは空の名前と同じ)
+void append_name(std::string& out, const char* name)
+{
+    std::string_view view = name != nullptr ? name : "";
+    append_value(out, (uint64_t)view.size());
+    append_bytes(out, view.data(), view.size());
+}
+
+/// @brief スキンを要約に足す (配列は大きいので、ハッシュだけを足す)
+/// @param out 要約の出力先
+/// @param skin スキン (無ければnullptr)
+/// @param vertex_count メッシュの頂点数
+/// @param objects オブジェクトのツリーでの番号 (ボーンを番号で足す)
+void summarize_skin(std::string& out, const Skin* skin, size_t vertex_count,
+                    const std::unordered_map<const Object*, size_t>& objects)
+{
+    append_value(out, skin != nullptr);
+    if (skin == nullptr) return;
+    append_value(out, (uint64_t)skin->bone_count);
+    for (size_t i = 0; skin->bones != nullptr && i < skin->bone_count; i++)
+    {
+        auto found = objects.find(skin->bones[i]);
+        append_value(out, found != objects.end() ? (uint64_t)found->second
+                                                 : UINT64_MAX);
+    }
+    append_bytes(out, skin->mesh_bind_matrix, sizeof(skin->mesh_bind_matrix));
+    auto hash_twice = [&](const void* data, size_t bytes) {
+        append_value(out, hash_bytes(data, bytes, 0));
+        append_value(out, hash_bytes(data, bytes, CACHE_SECOND_SEED));
+    };
+    append_value(out, skin->bind_matrices != nullptr);
+    if (skin->bind_matrices != nullptr)
+        hash_twice(skin->bind_matrices, skin->bone_count * 16 * sizeof(double));
+    if (skin->influence_offsets == nullptr) return;
+    auto count = skin->influence_offsets[vertex_count];
+    hash_twice(skin->influence_offsets,
+               (vertex_count + 1) * sizeof(unsigned int));
+    hash_twice(skin->influence_bones, count * sizeof(unsigned int));
+    hash_twice(skin->influence_weights, count * sizeof(float));
+}
+
+/// @brief オブジェクトにツリーを親から順にたどった番号を付ける
+/// @param object オブジェクト
+/// @param out 番号の出力先
+void index_objects(const Object* object,
+                   std::unordered_map<const Object*, size_t>& out)
+{
+    out.emplace(object, out.size());
+    for (size_t i = 0; i < object->child_count; i++)
+        index_objects(&object->children[i], out);
+}
+
+/// @brief オブジェクトツリーを要約に足す
+/// @param out 要約の出力先
+/// @param object オブジェクト
+/// @param materials 書き出すマテリアルの表
+/// @param instances 内容が同じメッシュの表
+/// @param indices 書き出すメッシュの番号 (キーは番号順に足してある)
+void summarize_objects(std::string& out, const Object* object,
+                       const MaterialTable& materials,
+                       const MeshInstances& instances,
+                       const std::unordered_map<const Mesh*, size_t>& indices)
+{
+    append_name(out, object->name);
+    append_bytes(out, object->matrix_local, sizeof(object->matrix_local));
+    // フレームごとの行列は大きいので、ハッシュだけを足す
+    auto frame_count =
+        object->animation_matrices != nullptr ? object->animation_frame_count
+                                              : 0;
+    append_value(out, (uint64_t)frame_count);
+    if (frame_count > 0)
+    {
+        auto bytes = frame_count * 16 * sizeof(double);
+        append_value(out, hash_bytes(object->animation_matrices, bytes, 0));
+        append_value(out, hash_bytes(object->animation_matrices, bytes,
+                                     CACHE_SECOND_SEED));
+    }
+    auto mesh = object->mesh != nullptr
+                    ? (uint64_t)indices.at(instances.canonical(object->mesh))
+                    : UINT64_MAX;
+    append_value(out, mesh);
+    append_value(out, (uint64_t)object->material_slot_count);
+    for (size_t i = 0; i < object->material_slot_count; i++)
+        append_value(out, (int64_t)materials.find(object->material_slots[i]));
+    append_value(out, (uint64_t)object->child_count);
+    for (size_t i = 0; i < object->child_count; i++)
+    {
+        summarize_objects(out, &object->children[i], materials, instances,
+                          indices);
+    }
+}
+
+std::string cache_hex(uint64_t value)
+{
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", (unsigned long long)value);
+    return text;
+}
+
+/// @brief ノードをキャッシュの形式で足す (配列は圧縮したものか中身をそのまま)
+/// @param node ノード
+/// @param out 出力先
+void serialize_cache_node(const BinNode& node, std::string& out)
+{
+    append_value(out, (uint8_t)node.name.size());
+    append_bytes(out, node.name.data(), node.name.size());
+    append_value(out, (uint32_t)node.props.size());
+    for (auto& prop : node.props)
+    {
+        append_value(out, prop.type);
+        switch (prop.type)
+        {
+        case 'Y':
+        case 'C':
+        case 'I':
+        case 'L': append_value(out, prop.i); break;
+        case 'F':
+        case 'D': append_value(out, prop.d); break;
+        case 'S':
+        case 'R':
+            append_value(out, (uint64_t)prop.s.size());
+            append_bytes(out, prop.s.data(), prop.s.size());
+            break;
+        default: {
+            append_value(out, (uint64_t)prop.count);
+            append_value(out, (uint64_t)prop.stride);
+            if (!prop.compressed.empty())
+            {
+                append_value(out, (uint8_t)1);
+                append_value(out, (uint64_t)prop.compressed.size());
+                append_bytes(out, prop.compressed.data(),
+                             prop.compressed.size());
+                break;
+            }
+            auto size = prop.count * array_element_size(prop.type);
+            append_value(out, (uint8_t)0);
+            append_value(out, (uint64_t)size);
+            if (prop.data != nullptr)
+            {
+                append_bytes(out, prop.data, size);
+                break;
+            }
+            auto offset = out.size();
+            out.resize(offset + size);
+            if (size > 0) prop.fill(0, prop.count / prop.stride, &out[offset]);
+            break;
+        }
+        }
+    }
+    append_value(out, (uint32_t)node.children.size());
+    for (auto& child : node.children) serialize_cache_node(child, out);
+}
+
+/// @brief キャッシュの形式のノードを読み込む
+/// @param reader 読み出し位置
+/// @param node 出力先
+/// @param depth ノードの深さ
+/// @return 読み込めたかどうか
+bool parse_cache_node(CacheReader& reader, BinNode& node, int depth)
+{
+    if (depth > CACHE_MAX_DEPTH) return false;
+    uint8_t name_size = 0;
+    if (!read_value(reader, name_size)) return false;
+    auto name = read_span(reader, name_size);
+    uint32_t prop_count = 0;
+    if (name == nullptr || !read_value(reader, prop_count)) return false;
+    node.name.assign((const char*)name, name_size);
+
+    for (uint32_t i = 0; i < prop_count; i++)
+    {
+        BinProperty prop = {};
+        if (!read_value(reader, prop.type)) return false;
+        switch (prop.type)
+        {
+        case 'Y':
+        case 'C':
+        case 'I':
+        case 'L':
+            if (!read_value(reader, prop.i)) return false;
+            break;
+        case 'F':
+        case 'D':
+            if (!read_value(reader, prop.d)) return false;
+            break;
+        case 'S':
+        case 'R': {
+            uint64_t size = 0;
+            if (!read_value(reader, size)) return false;
+            auto p = read_span(reader, size);
+            if (p == nullptr) return false;
+            prop.s.assign((const char*)p, size);
+            break;
+        }
+        case 'b':
+        case 'i':
+        case 'l':
+        case 'f':
+        case 'd': {
+            uint64_t count = 0, stride = 0, size = 0;
+            uint8_t encoding = 0;
+            if (!read_value(reader, count) || !read_value(reader, stride) ||
+                !read_value(reader, encoding) || !read_value(reader, size))
+                return false;
+            auto p = read_span(reader, size);
+            if (p == nullptr || stride == 0 || count % stride != 0)
+                return false;
+            prop.count = count;
+            prop.stride = stride;
+            if (encoding == 1 && size > 0)
+            {
+                prop.compressed.assign(p, p + size);
+                break;
+            }
+            if (encoding != 0 || size != count * array_element_size(prop.type))
+                return false;
+            auto owned = std::make_shared<std::vector<uint8_t>>(p, p + size);
+            prop.data = owned->data();
+            prop.owned = std::move(owned);
+            break;
+        }
+        default: return false;
+        }
+        node.props.push_back(std::move(prop));
+    }
+
+    uint32_t child_count = 0;
+    if (!read_value(reader, child_count)) return false;
+    for (uint32_t i = 0; i < child_count; i++)
+    {
+        node.children.emplace_back();
+        if (!parse_cache_node(reader, node.children.back(), depth + 1))
+            return false;
+    }
+    return true;
+}
+
+/// @brief ファイル全体を読み込む
+/// @return 読み込めたかどうか (無い場合もfalse)
+bool read_cache_file(const std::filesystem::path& path,
+                     std::vector<uint8_t>& out)
+{
+    std::ifstream stream(path, std::ios::binary | std::ios::ate);
+    if (!stream) return false;
+    auto size = (size_t)stream.tellg();
+    out.resize(size);
+    stream.seekg(0);
+    return (bool)stream.read((char*)out.data(), size);
+}
+
+/// @brief ファイルを置き換える
+/// 一時ファイルに書き出してから名前を変えるので、同時に書き出しても
+/// 書きかけのファイルを読み込むことはない
+/// @return 書き出せたかどうか
+bool write_cache_file(const std::filesystem::path& path,
+                      const std::string& bytes)
+{
+    static std::atomic<uint64_t> counter = 0;
+    auto thread = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    auto temporary = path;
+    temporary += ".tmp-" + cache_hex(thread ^ (uint64_t)now) + "-" +
+                 std::to_string(counter++);
+    std::ofstream stream(temporary, std::ios::binary | std::ios::trunc);
+    stream.write(bytes.data(), bytes.size());
+    stream.close();
+    std::error_code error;
+    if (!stream)
+    {
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (!error) return true;
+    std::filesystem::remove(temporary, error);
+    return false;
+}
+
+/// @brief ファイルの更新日時 (書き出し先が変わっていないかの確認用)
+/// @return 更新日時 (取得できなければ0)
+int64_t cache_file_time(const std::filesystem::path& path)
+{
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(path, error);
+    return error ? 0 : (int64_t)time.time_since_epoch().count();
+}
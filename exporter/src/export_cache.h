@@ -0,0 +1,82 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// ネイティブライタの書き出しキャッシュ
+// (変換・圧縮済みのGeometryと、書き出し先ごとの前回のシーンの要約を保存する)
+
+#pragma once
+
+#include "../include/io.h"
+#include "fbx_binary_nodes.h"
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <unordered_map>
+#include <vector>
+
+class MeshInstances;
+class StatsRecorder;
+
+// キャッシュの形式のバージョン (変えると以前のキャッシュは使わない)
+constexpr uint32_t EXPORT_CACHE_VERSION = 1;
+
+/// @brief 書き出しキャッシュ
+/// IOData::cache_dirを指定した場合だけ有効になる
+/// Geometryの中身はメッシュの内容と書き出しの設定から求めたキーごとに保存し、
+/// 内容が変わっていないメッシュは変換と圧縮を省いて読み込んだものを使う
+/// シーン全体の要約が前回と同じで、書き出し先も前回のままなら書き出し自体を省く
+class ExportCache
+{
+  public:
+    /// @param export_path 書き出し先のパス
+    /// @param export_data エクスポートするデータ
+    /// @param instances 内容が同じメッシュの表 (キーは書き出すメッシュごとに求める)
+    ExportCache(const char* export_path, const IOData* export_data,
+                const MeshInstances& instances);
+    ExportCache(const ExportCache&) = delete;
+    ExportCache& operator=(const ExportCache&) = delete;
+
+    /// @brief キャッシュを使うかどうか
+    bool enabled() const { return !directory.empty(); }
+
+    /// @brief 前回と同じ内容を書き出し済みで、書き出し先も変わっていないかどうか
+    bool output_unchanged() const { return unchanged; }
+
+    /// @brief メッシュのGeometryをキャッシュから読み込めたかどうか
+    bool has_geometry(const Mesh* mesh) const
+    {
+        auto found = entries.find(mesh);
+        return found != entries.end() && found->second.hit;
+    }
+
+    void load_geometries(StatsRecorder& stats);
+    bool take_geometry(const Mesh* mesh, BinNode& geometry);
+    void store_geometries(
+        const BinNode& document,
+        const std::unordered_map<const Mesh*, int64_t>& geometry_ids,
+        StatsRecorder& stats);
+    void commit();
+
+  private:
+    using Key = std::array<uint64_t, 2>;
+
+    /// @brief 書き出すメッシュごとのキャッシュ
+    struct Entry
+    {
+        Key key = {};
+        bool hit = false; // キャッシュから読み込めたかどうか
+        std::vector<BinNode> children; // Geometryの子ノード (使ったら空になる)
+    };
+
+    std::filesystem::path directory; // 空なら使わない
+    std::filesystem::path output;
+    std::filesystem::path manifest; // 書き出し先ごとのシーンの要約
+    Key scene_digest = {};
+    bool unchanged = false;
+    bool cache_geometries = false; // 無圧縮ではGeometryを保存しない
+    std::unordered_map<const Mesh*, Entry> entries;
+
+    std::filesystem::path geometry_path(const Key& key) const;
+};
@@ -0,0 +1,119 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "../include/io.h"
+#include "export_job.h"
+
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/// @brief バックグラウンドのスレッドで実行中の書き出し
+struct ExportJob
+{
+    IOSession* session; // 終わるまで解放しない
+    std::string path;
+    const IOData* data; // 呼び出し元が終わるまで保持する
+    ExportMonitor monitor;
+    std::thread worker;
+    std::mutex join_mutex;
+    bool result = false;
+    IOStats stats = {}; // 書き出すスレッドの統計 (終わってから読む)
+    bool has_stats = false;
+};
+
+/// @brief 書き出しをバックグラウンドのスレッドで開始する
+/// @param export_path エクスポート先のパス (コピーする)
+/// @param export_data エクスポートするデータ
+/// @return 開始した書き出し (delete_export_jobで解放する)
+ExportJob* start_export_fbx(const char* export_path, const IOData* export_data)
+{
+    return session_start_export_fbx(nullptr, export_path, export_data);
+}
+
+/// @brief セッションのマネージャを使って書き出しをバックグラウンドで開始する
+/// @param session セッション (nullptrならマネージャをその場で作る)
+/// @param export_path エクスポート先のパス (コピーする)
+/// @param export_data エクスポートするデータ
+/// @return 開始した書き出し (delete_export_jobで解放する)
+ExportJob* session_start_export_fbx(IOSession* session, const char* export_path,
+                                    const IOData* export_data)
+{
+    if (export_path == nullptr || export_data == nullptr)
+    {
+        std::cerr << "Export path or data is null." << std::endl;
+        return nullptr;
+    }
+
+    auto job = new ExportJob();
+    job->session = session;
+    job->path = export_path;
+    job->data = export_data;
+    job->worker = std::thread([job] {
+        auto& monitor = job->monitor;
+        job->result = run_export(job->session, job->path.c_str(), job->data,
+                                 monitor);
+        // 統計はこのスレッドに残るので、終了を知らせる前にジョブへ移す
+        job->has_stats = get_last_stats(&job->stats);
+        if (job->result)
+            monitor.begin_phase(EXPORT_PHASE_FINISHED);
+        else if (monitor.cancelled())
+            monitor.begin_phase(EXPORT_PHASE_CANCELLED);
+        else
+            monitor.begin_phase(EXPORT_PHASE_FAILED);
+    });
+    return job;
+}
+
+/// @brief 書き出しの進捗を取得する (どのスレッドから呼んでもよい)
+/// @param job 書き出し
+/// @param out_progress 進捗の出力先
+void get_export_progress(const ExportJob* job, ExportProgress* out_progress)
+{
+    if (job == nullptr || out_progress == nullptr) return;
+    *out_progress = job->monitor.progress();
+}
+
+/// @brief 書き出しの統計を取得する (どのスレッドから呼んでもよい)
+/// @param job 書き出し
+/// @param out_stats 出力先
+/// @return 統計があったかどうか (終わっていないか、計測の前に失敗したならfalse)
+bool get_export_job_stats(const ExportJob* job, IOStats* out_stats)
+{
+    if (job == nullptr || out_stats == nullptr) return false;
+    auto phase = job->monitor.progress().phase;
+    if (phase < EXPORT_PHASE_FINISHED || !job->has_stats) return false;
+    *out_stats = job->stats;
+    return true;
+}
+
+/// @brief 書き出しの中断を要求する (実際に止まるのは次の区切り)
+/// 中断した場合は書きかけのファイルを削除する
+/// @param job 書き出し
+void cancel_export(ExportJob* job)
+{
+    if (job != nullptr) job->monitor.cancel();
+}
+
+/// @brief 書き出しが終わるまで待つ
+/// @param job 書き出し
+/// @return 書き出しに成功したかどうか
+bool wait_export(ExportJob* job)
+{
+    if (job == nullptr) return false;
+    std::lock_guard lock(job->join_mutex);
+    if (job->worker.joinable()) job->worker.join();
+    return job->result;
+}
+
+/// @brief 書き出しを解放する (終わっていなければ中断して待つ)
+/// @param job 書き出し
+void delete_export_job(ExportJob* job)
+{
+    if (job == nullptr) return;
+    job->monitor.cancel();
+    wait_export(job);
+    delete job;
+}
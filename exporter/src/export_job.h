@@ -0,0 +1,63 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 書き出しの進捗の報告と中断 (非同期の書き出しとexport_fbxで共有する)
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <atomic>
+#include <cstdint>
+
+/// @brief 書き出しの進捗と中断の要求
+/// 書き出すスレッドが更新し、他のスレッドから読み取る
+class ExportMonitor
+{
+  public:
+    /// @brief 次の段階に進む
+    /// @param phase 段階
+    /// @param item_count この段階で処理する項目数 (分からなければ0)
+    void begin_phase(ExportPhase phase, size_t item_count = 0)
+    {
+        items_done = 0;
+        items = item_count;
+        current_phase = phase;
+    }
+
+    void advance(size_t count = 1) { items_done += count; }
+    void set_items_done(size_t count) { items_done = count; }
+
+    /// @brief ファイルに書き出したバイト数を設定する
+    void set_bytes(uint64_t written, uint64_t total)
+    {
+        bytes_total = total;
+        bytes_written = written;
+    }
+
+    void cancel() { cancel_requested = true; }
+    bool cancelled() const { return cancel_requested; }
+
+    ExportProgress progress() const
+    {
+        ExportProgress out;
+        out.phase = current_phase;
+        out.items_done = items_done;
+        out.item_count = items;
+        out.bytes_written = bytes_written;
+        out.bytes_total = bytes_total;
+        return out;
+    }
+
+  private:
+    std::atomic<ExportPhase> current_phase = EXPORT_PHASE_PENDING;
+    std::atomic<size_t> items_done = 0;
+    std::atomic<size_t> items = 0;
+    std::atomic<uint64_t> bytes_written = 0;
+    std::atomic<uint64_t> bytes_total = 0;
+    std::atomic<bool> cancel_requested = false;
+};
+
+bool run_export(IOSession* session, const char* export_path,
+                const IOData* export_data, ExportMonitor& monitor);
@@ -0,0 +1,34 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// FBX SDKを使用しないバイナリFBX (7.x) の読み書き
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <cstdint>
+#include <optional>
+
+// FBX 7.4 (32bitオフセット) / 7.5 (64bitオフセット)
+constexpr uint32_t FBX_BINARY_VERSION_32 = 7400;
+constexpr uint32_t FBX_BINARY_VERSION_64 = 7500;
+
+// ファイル先頭のマジック (この後にuint32のバージョンが続く)
+constexpr char FBX_HEADER_MAGIC[] = "Kaydara FBX Binary  \x00\x1a\x00";
+constexpr size_t FBX_HEADER_SIZE = sizeof(FBX_HEADER_MAGIC) - 1 + 4;
+
+class ExportMonitor;
+class StatsRecorder;
+
+bool write_fbx_binary(const char* export_path, const IOData* export_data,
+                      ExportMonitor& monitor, StatsRecorder& stats);
+IOData* read_fbx_binary(const char* import_path, const ImportOptions& options,
+                        StatsRecorder& stats);
+std::optional<bool> stream_fbx_binary(const char* import_path,
+                                      const ImportCallbacks* callbacks,
+                                      const ImportOptions& options,
+                                      StatsRecorder& stats);
+
+void decompose_matrix(const double* m, double* t, double* r, double* s);
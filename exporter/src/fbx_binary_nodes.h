@@ -0,0 +1,45 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// バイナリFBXの書き出しで組み立てるノードツリー (ライタと書き出しキャッシュで共有する)
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// @brief バイナリFBXのプロパティ
+struct BinProperty
+{
+    char type;
+    int64_t i = 0;              // Y, C, I, L
+    double d = 0.0;             // F, D
+    std::string s = {};         // S, R
+    size_t count = 0;           // 配列の要素数
+    size_t stride = 1;          // 1項目あたりの要素数 (座標なら3)
+    const void* data = nullptr; // 配列データ (そのまま書き出せる場合)
+    // 項目単位の変換
+    std::function<void(size_t, size_t, void*)> fill = {};
+    StatsPhase phase = STATS_PHASE_MESHES; // fillの時間を足す段階
+    // 空でなければzlibで圧縮したものを書き出す
+    std::vector<uint8_t> compressed = {};
+    // キャッシュから読んだ無圧縮の配列 (dataはこの中を指す)
+    std::shared_ptr<const std::vector<uint8_t>> owned = {};
+};
+
+/// @brief バイナリFBXのノードレコード
+struct BinNode
+{
+    std::string name;
+    std::vector<BinProperty> props;
+    std::vector<BinNode> children;
+    uint64_t size = 0; // ヌルレコードを含むノード全体のバイト数
+};
+
+size_t array_element_size(char type);
@@ -0,0 +1,1378 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "arena.h"
+#include "fbx_binary.h"
+#include "geometry_kernels.h"
+#include "import_stream.h"
+#include "io_stats.h"
+#include "layer_elements.h"
+#include "parallel.h"
+#include "scene_tables.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// ノードレコードの入れ子の深さの上限 (壊れたファイルで再帰し続けないように)
+constexpr int FBX_MAX_RECORD_DEPTH = 256;
+
+/// @brief 読み取り専用でメモリマップしたファイル
+struct MappedFile
+{
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+/// @brief プロパティ (値はマップされたファイルを直接指す)
+struct BinValue
+{
+    char type;
+    const uint8_t* data;
+    uint64_t size;      // ファイル上のバイト数
+    uint32_t count;     // 配列の要素数
+    uint32_t encoding;  // 0: 無圧縮, 1: deflate
+};
+
+/// @brief ノードレコード (名前と値はマップされたファイルを直接指す)
+struct BinRecord
+{
+    std::string_view name;
+    std::vector<BinValue> values;
+    std::vector<BinRecord> children;
+};
+
+/// @brief 展開済みの配列 (無圧縮ならファイルを直接指す)
+struct ArrayView
+{
+    char type = 0;
+    size_t count = 0;
+    const void* data = nullptr;
+    std::vector<uint8_t> inflated;
+};
+
+/// @brief 読み込み中のModel
+struct ReadModel
+{
+    const BinRecord* record = nullptr;
+    const BinRecord* geometry = nullptr;
+    std::vector<size_t> children = {};
+    std::vector<size_t> materials = {};
+    bool has_parent = false;
+    bool visited = false; // ノードツリーを作成済みかどうか (循環の検出用)
+};
+
+/// @brief 後から中身を読み込むメッシュ
+struct BinaryMeshRead
+{
+    const BinRecord* geometry;
+    Mesh* mesh;
+    bool has_geometric = false; // Geometric*の変換があるかどうか
+    std::array<double, 16> geometric; // Geometric*の行列 (FbxAMatrixと同じ並び)
+};
+
+/// @brief メッシュの中身を読み込む前のシーン
+struct BinaryScene
+{
+    MappedFile file;
+    BinRecord document; // 名前と値はfileを指す
+    IOData* data = nullptr;
+    std::vector<BinaryMeshRead> meshes;
+    double file_unit_scale = 0.01;
+};
+
+bool load_binary_scene(const char* import_path, bool reserve_meshes,
+                       bool indexed, BinaryScene& scene, StatsRecorder& stats);
+void collect_arrays(const BinRecord& record,
+                    std::vector<const BinValue*>& values,
+                    std::unordered_map<const BinValue*, ArrayView*>& arrays);
+bool map_file(const char* path, MappedFile& file);
+void unmap_file(MappedFile& file);
+bool parse_records(const MappedFile& file, BinRecord& document);
+bool parse_record(const MappedFile& file, uint64_t& offset, bool is_64,
+                  int depth, BinRecord& record, bool& is_null);
+void read_binary_material(const BinRecord& record, Material& material,
+                          NameTable& names);
+void build_binary_object(
+    std::vector<ReadModel>& models, size_t index, const Material* mats,
+    Object& object, Arena& arena, NameTable& names,
+    std::unordered_map<const BinRecord*, Mesh*>& mesh_map,
+    std::vector<BinaryMeshRead>& meshes);
+void model_local_matrix(const BinRecord& model, double* m);
+bool model_geometric_matrix(const BinRecord& model, double* m);
+void euler_matrix(const double* degrees, int64_t order, double* m);
+void translation_matrix(const double* t, double sign, double* m);
+void multiply_matrices(std::initializer_list<const double*> matrices,
+                       double* m);
+size_t estimate_binary_mesh_size(const BinRecord& geometry, bool indexed);
+bool read_binary_mesh(const BinaryMeshRead& read, double unit_scale,
+                      bool indexed, Arena& arena,
+                      const std::unordered_map<const BinValue*, ArrayView*>&
+                          arrays,
+                      StatsRecorder& stats);
+bool inflate_array(const BinValue& value, ArrayView& view);
+
+const BinRecord* find_child(const BinRecord& record, std::string_view name)
+{
+    for (auto& child : record.children)
+        if (child.name == name) return &child;
+    return nullptr;
+}
+
+template <typename T> T load_value(const uint8_t* data)
+{
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+int64_t value_int(const BinValue& value)
+{
+    switch (value.type)
+    {
+    case 'C': return load_value<uint8_t>(value.data);
+    case 'Y': return load_value<int16_t>(value.data);
+    case 'I': return load_value<int32_t>(value.data);
+    case 'L': return load_value<int64_t>(value.data);
+    case 'F': return (int64_t)load_value<float>(value.data);
+    case 'D': return (int64_t)load_value<double>(value.data);
+    default: return 0;
+    }
+}
+
+double value_double(const BinValue& value)
+{
+    switch (value.type)
+    {
+    case 'F': return load_value<float>(value.data);
+    case 'D': return load_value<double>(value.data);
+    default: return (double)value_int(value);
+    }
+}
+
+std::string_view value_str(const BinValue& value)
+{
+    if (value.type != 'S' && value.type != 'R') return {};
+    return {(const char*)value.data, value.size};
+}
+
+/// @brief 子ノードの最初の値を文字列として取得する
+std::string_view child_str(const BinRecord& record, std::string_view name)
+{
+    auto child = find_child(record, name);
+    if (child == nullptr || child->values.empty()) return {};
+    return value_str(child->values[0]);
+}
+
+/// @brief "名前\x00\x01クラス" 形式の名前から名前だけを取り出す
+std::string_view object_name(const BinRecord& record)
+{
+    if (record.values.size() < 2) return {};
+    auto name = value_str(record.values[1]);
+    auto pos = name.find(std::string_view("\x00\x01", 2));
+    if (pos != std::string_view::npos) return name.substr(0, pos);
+    pos = name.find("::");
+    if (pos != std::string_view::npos) return name.substr(pos + 2);
+    return name;
+}
+
+/// @brief Properties70からPを探す
+/// @param record Properties70を持つノード
+/// @param name プロパティ名
+/// @return 見つかったP (値は5番目から)
+const BinRecord* find_p(const BinRecord& record, std::string_view name)
+{
+    auto props70 = find_child(record, "Properties70");
+    if (props70 == nullptr) return nullptr;
+    for (auto& p : props70->children)
+    {
+        if (p.values.size() >= 5 && value_str(p.values[0]) == name) return &p;
+    }
+    return nullptr;
+}
+
+void read_p(const BinRecord& record, std::string_view name, double* out,
+            size_t count)
+{
+    auto p = find_p(record, name);
+    if (p == nullptr) return;
+    for (size_t i = 0; i < count && 4 + i < p->values.size(); i++)
+        out[i] = value_double(p->values[4 + i]);
+}
+
+/// @brief FBX SDKを使用せずにバイナリFBXファイルを読み込む
+/// @param import_path インポートするファイルのパス
+/// @param options 読み込みの設定
+/// @param stats 統計の記録先
+/// @return インポートされたデータ (バイナリFBXでない場合はnullptr)
+IOData* read_fbx_binary(const char* import_path, const ImportOptions& options,
+                        StatsRecorder& stats)
+{
+    BinaryScene scene;
+    if (!load_binary_scene(import_path, true, options.indexed_attributes,
+                           scene, stats))
+        return nullptr;
+
+    // 圧縮された配列は全コアで並列に展開する
+    std::vector<const BinValue*> values;
+    std::unordered_map<const BinValue*, ArrayView*> arrays;
+    for (auto& read : scene.meshes)
+        collect_arrays(*read.geometry, values, arrays);
+
+    std::vector<ArrayView> views(values.size());
+    for (size_t i = 0; i < values.size(); i++) arrays[values[i]] = &views[i];
+    std::atomic<bool> ok = true;
+    {
+        StatsParallelScope scope(stats, {STATS_PHASE_SERIALIZE});
+        parallel_for(values.size(), [&](size_t i) {
+            StatsScope task(stats, STATS_PHASE_SERIALIZE, STATS_PHASE_COUNT,
+                            true);
+            if (!inflate_array(*values[i], views[i])) ok = false;
+        });
+    }
+    int64_t inflated_bytes = 0;
+    for (auto& view : views) inflated_bytes += view.inflated.capacity();
+    stats.track_allocation(inflated_bytes);
+    if (!ok)
+    {
+        std::cerr << "An error occurred while inflating an array..."
+                  << std::endl;
+        unmap_file(scene.file);
+        delete_iodata(scene.data);
+        return nullptr;
+    }
+
+    // メッシュごとの変換も並列に行う
+    auto& arena = *(Arena*)scene.data->arena;
+    auto& meshes = scene.meshes;
+    auto reserved = arena.capacity();
+    {
+        StatsParallelScope scope(stats,
+                                 {STATS_PHASE_MESHES, STATS_PHASE_LAYERS});
+        parallel_for(meshes.size(), [&](size_t i) {
+            if (!read_binary_mesh(meshes[i], scene.file_unit_scale,
+                                  options.indexed_attributes, arena, arrays,
+                                  stats))
+                ok = false;
+        });
+    }
+    stats.track_allocation(arena.capacity() - reserved);
+    stats.track_allocation(-inflated_bytes);
+
+    unmap_file(scene.file);
+    if (!ok)
+    {
+        delete_iodata(scene.data);
+        return nullptr;
+    }
+    return scene.data;
+}
+
+/// @brief FBX SDKを使用せずにバイナリFBXファイルを読み込み、コールバックに渡す
+/// メッシュの配列はメッシュごとに展開し、コールバックの後に解放する
+/// @param import_path インポートするファイルのパス
+/// @param callbacks コールバック
+/// @param options 読み込みの設定
+/// @param stats 統計の記録先
+/// @return 読み込めたかどうか (バイナリFBXでない場合はnullopt)
+std::optional<bool> stream_fbx_binary(const char* import_path,
+                                      const ImportCallbacks* callbacks,
+                                      const ImportOptions& options,
+                                      StatsRecorder& stats)
+{
+    BinaryScene scene;
+    if (!load_binary_scene(import_path, false, false, scene, stats))
+        return std::nullopt;
+
+    std::vector<Mesh*> meshes;
+    for (auto& read : scene.meshes) meshes.push_back(read.mesh);
+    auto decode = [&](size_t index, Arena& arena) {
+        auto& read = scene.meshes[index];
+        auto geometry = read.geometry;
+        std::vector<const BinValue*> values;
+        std::unordered_map<const BinValue*, ArrayView*> arrays;
+        collect_arrays(*geometry, values, arrays);
+        std::vector<ArrayView> views(values.size());
+        {
+            StatsScope task(stats, STATS_PHASE_SERIALIZE, STATS_PHASE_COUNT,
+                            true);
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                arrays[values[i]] = &views[i];
+                if (!inflate_array(*values[i], views[i])) return false;
+            }
+        }
+        int64_t inflated_bytes = 0;
+        for (auto& view : views) inflated_bytes += view.inflated.capacity();
+        stats.track_allocation(inflated_bytes);
+        auto ok = read_binary_mesh(read, scene.file_unit_scale,
+                                   options.indexed_attributes, arena, arrays,
+                                   stats);
+        stats.track_allocation(-inflated_bytes);
+        return ok;
+    };
+    auto result = stream_imported_scene(scene.data, meshes, decode, callbacks,
+                                        stats);
+
+    unmap_file(scene.file);
+    delete_iodata(scene.data);
+    return result;
+}
+
+/// @brief バイナリFBXファイルを解析し、マテリアルとノードツリーを作成する
+/// メッシュは名前だけを読み込み、中身は後から読み込む
+/// @param import_path インポートするファイルのパス
+/// @param reserve_meshes メッシュの中身の分も領域を確保しておくかどうか
+/// @param indexed UV・法線を値とポリゴン頂点ごとの番号で読み込むかどうか
+/// (確保しておく大きさの見積もりに使う)
+/// @param scene 出力先 (失敗した場合はファイルを閉じる)
+/// @param stats 統計の記録先
+/// @return 読み込めたかどうか (バイナリFBXでない場合もfalse)
+bool load_binary_scene(const char* import_path, bool reserve_meshes,
+                       bool indexed, BinaryScene& scene, StatsRecorder& stats)
+{
+    auto& file = scene.file;
+    auto& document = scene.document;
+    {
+        StatsScope scope(stats, STATS_PHASE_SERIALIZE);
+        if (!map_file(import_path, file)) return false;
+        if (!parse_records(file, document))
+        {
+            unmap_file(file);
+            return false;
+        }
+    }
+
+    // 配列以外のノードツリーの解析はノードツリーの作成に含める
+    StatsScope node_scope(stats, STATS_PHASE_NODES);
+
+    auto objects = find_child(document, "Objects");
+    auto connections = find_child(document, "Connections");
+    if (objects == nullptr || connections == nullptr)
+    {
+        std::cerr << "Objects or Connections is missing." << std::endl;
+        unmap_file(file);
+        return false;
+    }
+
+    // オブジェクトをIDで引けるようにする
+    std::vector<const BinRecord*> mat_records;
+    std::vector<ReadModel> models;
+    std::unordered_map<int64_t, size_t> material_index;
+    std::unordered_map<int64_t, size_t> model_index;
+    std::unordered_map<int64_t, const BinRecord*> geometries;
+    for (auto& record : objects->children)
+    {
+        if (record.values.empty()) continue;
+        auto id = value_int(record.values[0]);
+        if (record.name == "Material")
+        {
+            material_index[id] = mat_records.size();
+            mat_records.push_back(&record);
+        }
+        else if (record.name == "Model")
+        {
+            model_index[id] = models.size();
+            models.push_back({&record});
+        }
+        else if (record.name == "Geometry" && record.values.size() >= 3 &&
+                 value_str(record.values[2]) == "Mesh")
+        {
+            geometries[id] = &record;
+        }
+    }
+
+    // 親子関係とジオメトリ・マテリアルの割り当て
+    for (auto& c : connections->children)
+    {
+        if (c.values.size() < 3 || value_str(c.values[0]) != "OO") continue;
+        auto child_id = value_int(c.values[1]);
+        auto parent = model_index.find(value_int(c.values[2]));
+        if (parent == model_index.end()) continue;
+        auto& model = models[parent->second];
+
+        if (auto child = model_index.find(child_id); child != model_index.end())
+        {
+            model.children.push_back(child->second);
+            models[child->second].has_parent = true;
+        }
+        else if (auto geom = geometries.find(child_id);
+                 geom != geometries.end())
+        {
+            if (model.geometry == nullptr) model.geometry = geom->second;
+        }
+        else if (auto mat = material_index.find(child_id);
+                 mat != material_index.end())
+        {
+            model.materials.push_back(mat->second);
+        }
+    }
+
+    // 結果は1つの領域にまとめて確保するので、先に大きさを見積もる
+    // (複数のModelで共有するGeometryは1回だけ数える)
+    size_t estimate = (models.size() + 1) * (sizeof(Object) + 64) +
+                      mat_records.size() * (sizeof(Material) + 64);
+    std::unordered_set<const BinRecord*> estimated;
+    for (auto& model : models)
+    {
+        estimate += model.materials.size() * sizeof(Material*);
+        if (model.geometry != nullptr && reserve_meshes &&
+            estimated.insert(model.geometry).second)
+            estimate += estimate_binary_mesh_size(*model.geometry, indexed);
+    }
+
+    auto data = create_arena_iodata(estimate);
+    scene.data = data;
+    auto& arena = *(Arena*)data->arena;
+    stats.track_allocation(arena.capacity());
+    data->is_ascii = false;
+    data->backend = IO_BACKEND_NATIVE;
+    double factor = 1.0;
+    if (auto settings = find_child(document, "GlobalSettings"))
+        read_p(*settings, "UnitScaleFactor", &factor, 1);
+
+    // ジオメトリはZ-upとメートルに戻して読み込む
+    scene.file_unit_scale = factor * 0.01;
+    data->unit_scale = 1.0;
+
+    // 名前は同じものを共有する (メッシュの読み込みは並列なので名前は先に登録する)
+    NameTable names(arena);
+    data->material_count = mat_records.size();
+    data->materials = arena.allocate<Material>(data->material_count);
+    {
+        StatsScope scope(stats, STATS_PHASE_MATERIALS, STATS_PHASE_NODES);
+        for (size_t i = 0; i < mat_records.size(); i++)
+            read_binary_material(*mat_records[i], data->materials[i], names);
+    }
+
+    // ノードツリーを作成し、メッシュはまとめて後から読み込む
+    std::vector<size_t> top_level;
+    for (size_t i = 0; i < models.size(); i++)
+        if (!models[i].has_parent) top_level.push_back(i);
+
+    data->root = arena.allocate<Object>();
+    data->root->name = names.intern("RootNode", &data->root->name_length);
+    data->root->matrix_local[0] = data->root->matrix_local[5] =
+        data->root->matrix_local[10] = data->root->matrix_local[15] = 1.0;
+    data->root->child_count = top_level.size();
+    data->root->children = arena.allocate<Object>(top_level.size());
+    std::unordered_map<const BinRecord*, Mesh*> mesh_map;
+    for (size_t i = 0; i < top_level.size(); i++)
+    {
+        build_binary_object(models, top_level[i], data->materials,
+                            data->root->children[i], arena, names, mesh_map,
+                            scene.meshes);
+    }
+    return true;
+}
+
+/// @brief ノード以下の数値配列を集める
+/// @param record ノード
+/// @param values 配列の出力先 (同じものは1回だけ追加する)
+/// @param arrays 集めた配列 (展開先はnullptrで登録する)
+void collect_arrays(const BinRecord& record,
+                    std::vector<const BinValue*>& values,
+                    std::unordered_map<const BinValue*, ArrayView*>& arrays)
+{
+    for (auto& child : record.children)
+    {
+        if (child.values.size() == 1 && child.values[0].count > 0 &&
+            std::strchr("fdlib", child.values[0].type) &&
+            !arrays.contains(&child.values[0]))
+        {
+            arrays[&child.values[0]] = nullptr;
+            values.push_back(&child.values[0]);
+        }
+        collect_arrays(child, values, arrays);
+    }
+}
+
+/// @brief ファイルをメモリマップする
+/// @param path ファイルのパス (UTF-8)
+/// @param file マップしたファイルの出力先
+/// @return マップに成功したかどうか
+bool map_file(const char* path, MappedFile& file)
+{
+    if (path == nullptr || *path == '\0')
+    {
+        std::cerr << "File path is invalid." << std::endl;
+        return false;
+    }
+
+#ifdef _WIN32
+    auto length = MultiByteToWideChar(CP_UTF8, 0, path, -1, nullptr, 0);
+    std::wstring wpath(length, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath.data(), length);
+    file.file = CreateFileW(wpath.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+    if (file.file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    GetFileSizeEx(file.file, &size);
+    file.size = (size_t)size.QuadPart;
+    if (file.size > 0)
+        file.mapping = CreateFileMappingW(file.file, nullptr, PAGE_READONLY, 0,
+                                          0, nullptr);
+    if (file.mapping != nullptr)
+        file.data = (const uint8_t*)MapViewOfFile(file.mapping, FILE_MAP_READ,
+                                                  0, 0, 0);
+#else
+    auto fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        file.size = (size_t)st.st_size;
+        auto p = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            madvise(p, file.size, MADV_WILLNEED);
+            file.data = (const uint8_t*)p;
+        }
+    }
+    close(fd);
+#endif
+
+    if (file.data == nullptr)
+    {
+        std::cerr << "An error occurred while mapping the file..." << std::endl;
+        unmap_file(file);
+        return false;
+    }
+    return true;
+}
+
+/// @brief メモリマップを解除する
+/// @param file マップしたファイル
+void unmap_file(MappedFile& file)
+{
+#ifdef _WIN32
+    if (file.data != nullptr) UnmapViewOfFile(file.data);
+    if (file.mapping != nullptr) CloseHandle(file.mapping);
+    if (file.file != INVALID_HANDLE_VALUE) CloseHandle(file.file);
+    file.mapping = nullptr;
+    file.file = INVALID_HANDLE_VALUE;
+#else
+    if (file.data != nullptr) munmap((void*)file.data, file.size);
+#endif
+    file.data = nullptr;
+    file.size = 0;
+}
+
+/// @brief トップレベルのノードを全て読み込む (配列はコピーしない)
+/// @param file マップしたファイル
+/// @param document トップレベルのノードの出力先
+/// @return バイナリFBX 7.x として読み込めたかどうか
+bool parse_records(const MappedFile& file, BinRecord& document)
+{
+    if (file.size < FBX_HEADER_SIZE ||
+        std::memcmp(file.data, FBX_HEADER_MAGIC,
+                    sizeof(FBX_HEADER_MAGIC) - 1) != 0)
+        return false;
+
+    uint32_t version;
+    std::memcpy(&version, file.data + FBX_HEADER_SIZE - 4, 4);
+    if (version < 7000)
+    {
+        std::cerr << "FBX version " << version << " is not supported."
+                  << std::endl;
+        return false;
+    }
+
+    auto is_64 = version >= FBX_BINARY_VERSION_64;
+    uint64_t offset = FBX_HEADER_SIZE;
+    while (offset < file.size)
+    {
+        BinRecord record;
+        bool is_null;
+        if (!parse_record(file, offset, is_64, 0, record, is_null))
+        {
+            std::cerr << "The file is corrupted." << std::endl;
+            return false;
+        }
+        if (is_null) break;
+        document.children.push_back(std::move(record));
+    }
+    return true;
+}
+
+/// @brief ノードレコードを再帰的に読み込む
+/// @param file マップしたファイル
+/// @param offset 読み込み位置 (読み込んだ分だけ進む)
+/// @param is_64 64bitオフセットかどうか
+/// @param depth 入れ子の深さ (トップレベルは0)
+/// @param record ノードの出力先
+/// @param is_null ヌルレコードだったかどうか
+/// @return 正しく読み込めたかどうか
+bool parse_record(const MappedFile& file, uint64_t& offset, bool is_64,
+                  int depth, BinRecord& record, bool& is_null)
+{
+    if (depth > FBX_MAX_RECORD_DEPTH) return false;
+    auto header_size = is_64 ? 25u : 13u;
+    if (offset + header_size > file.size) return false;
+
+    uint64_t end_offset = 0, value_count = 0, values_size = 0;
+    auto p = file.data + offset;
+    if (is_64)
+    {
+        std::memcpy(&end_offset, p, 8);
+        std::memcpy(&value_count, p + 8, 8);
+        std::memcpy(&values_size, p + 16, 8);
+    }
+    else
+    {
+        uint32_t v[3];
+        std::memcpy(v, p, 12);
+        end_offset = v[0];
+        value_count = v[1];
+        values_size = v[2];
+    }
+    auto name_length = p[header_size - 1];
+    is_null = end_offset == 0;
+    if (is_null)
+    {
+        offset += header_size;
+        return true;
+    }
+    if (end_offset > file.size || offset + header_size + name_length > end_offset)
+        return false;
+
+    record.name = {(const char*)p + header_size, name_length};
+    offset += header_size + name_length;
+
+    // プロパティはファイルを直接指すだけにする
+    auto values_end = offset + values_size;
+    if (values_end > end_offset) return false;
+    record.values.reserve(value_count);
+    for (uint64_t i = 0; i < value_count; i++)
+    {
+        if (offset + 1 > values_end) return false;
+        BinValue value{};
+        value.type = (char)file.data[offset++];
+        switch (value.type)
+        {
+        case 'C': value.size = 1; break;
+        case 'Y': value.size = 2; break;
+        case 'I':
+        case 'F': value.size = 4; break;
+        case 'L':
+        case 'D': value.size = 8; break;
+        case 'S':
+        case 'R': {
+            uint32_t length;
+            if (offset + 4 > values_end) return false;
+            std::memcpy(&length, file.data + offset, 4);
+            offset += 4;
+            value.size = length;
+            break;
+        }
+        case 'f':
+        case 'd':
+        case 'l':
+        case 'i':
+        case 'b': {
+            uint32_t header[3];
+            if (offset + 12 > values_end) return false;
+            std::memcpy(header, file.data + offset, 12);
+            offset += 12;
+            value.count = header[0];
+            value.encoding = header[1];
+            value.size = header[2];
+            break;
+        }
+        default: return false;
+        }
+        if (offset + value.size > values_end) return false;
+        value.data = file.data + offset;
+        offset += value.size;
+        record.values.push_back(value);
+    }
+    offset = values_end;
+
+    while (offset < end_offset)
+    {
+        BinRecord child;
+        bool child_is_null;
+        if (!parse_record(file, offset, is_64, depth + 1, child,
+                          child_is_null))
+            return false;
+        if (child_is_null) break;
+        record.children.push_back(std::move(child));
+    }
+    offset = end_offset;
+    return true;
+}
+
+size_t array_value_size(char type)
+{
+    switch (type)
+    {
+    case 'b': return 1;
+    case 'i':
+    case 'f': return 4;
+    default: return 8;
+    }
+}
+
+/// @brief 配列を展開する (無圧縮の場合はファイルを直接指す)
+/// @param value 配列のプロパティ
+/// @param view 展開した配列の出力先
+/// @return 展開に成功したかどうか
+bool inflate_array(const BinValue& value, ArrayView& view)
+{
+    view.type = value.type;
+    view.count = value.count;
+    auto byte_size = (size_t)value.count * array_value_size(value.type);
+    if (value.encoding == 0)
+    {
+        if (value.size < byte_size) return false;
+        view.data = value.data;
+        return true;
+    }
+    if (value.encoding != 1) return false;
+
+    // zlibの長さは32bitなので、大きな配列は出力を分けて展開する
+    view.inflated.resize(byte_size);
+    z_stream stream{};
+    if (inflateInit(&stream) != Z_OK) return false;
+    stream.next_in = (Bytef*)value.data;
+    stream.avail_in = (uInt)value.size;
+    size_t produced = 0;
+    auto result = Z_OK;
+    while (result == Z_OK && produced < byte_size)
+    {
+        auto chunk = std::min<size_t>(byte_size - produced, UINT32_MAX);
+        stream.next_out = view.inflated.data() + produced;
+        stream.avail_out = (uInt)chunk;
+        result = inflate(&stream, Z_NO_FLUSH);
+        produced += chunk - stream.avail_out;
+    }
+    inflateEnd(&stream);
+    if ((result != Z_OK && result != Z_STREAM_END) || produced != byte_size)
+        return false;
+    view.data = view.inflated.data();
+    return true;
+}
+
+/// @brief 配列を任意の型に変換しながらコピーする
+/// @param view 配列
+/// @param out 出力先 (view.count個)
+template <typename T> void convert_array(const ArrayView& view, T* out)
+{
+    auto copy = [&](auto* src) {
+        for (size_t i = 0; i < view.count; i++) out[i] = (T)src[i];
+    };
+    switch (view.type)
+    {
+    case 'b': copy((const uint8_t*)view.data); break;
+    case 'i': copy((const int32_t*)view.data); break;
+    case 'l': copy((const int64_t*)view.data); break;
+    case 'f': copy((const float*)view.data); break;
+    case 'd': copy((const double*)view.data); break;
+    }
+}
+
+const ArrayView* child_array(
+    const BinRecord& record, std::string_view name,
+    const std::unordered_map<const BinValue*, ArrayView*>& arrays)
+{
+    auto child = find_child(record, name);
+    if (child == nullptr || child->values.size() != 1) return nullptr;
+    auto found = arrays.find(&child->values[0]);
+    return found != arrays.end() ? found->second : nullptr;
+}
+
+/// @brief MappingInformationTypeを割り当て方に変換する
+/// @param element レイヤー要素のノード
+/// @return 割り当て方
+LayerMapping binary_layer_mapping(const BinRecord& element)
+{
+    auto mapping = child_str(element, "MappingInformationType");
+    if (mapping == "ByPolygonVertex") return LayerMapping::ByPolygonVertex;
+    if (mapping == "ByVertice" || mapping == "ByVertex" ||
+        mapping == "ByControlPoint")
+        return LayerMapping::ByControlPoint;
+    if (mapping == "ByPolygon") return LayerMapping::ByPolygon;
+    if (mapping == "AllSame") return LayerMapping::AllSame;
+    return LayerMapping::Unsupported;
+}
+
+/// @brief レイヤー要素の配列を変換して、LayerSourceとして渡す
+/// @param element レイヤー要素のノード
+/// @param values_name 値の配列の名前
+/// @param index_name インデックスの配列の名前
+/// @param components 1要素あたりの成分数
+/// @param arrays 展開済みの配列
+/// @param fn LayerSourceを受け取る関数
+/// @return 配列が揃っていてfnが成功したかどうか
+template <typename Fn>
+bool with_binary_layer_source(
+    const BinRecord& element, std::string_view values_name,
+    std::string_view index_name, size_t components,
+    const std::unordered_map<const BinValue*, ArrayView*>& arrays, Fn fn)
+{
+    auto values_view = child_array(element, values_name, arrays);
+    if (values_view == nullptr) return false;
+    std::vector<double> values(values_view->count);
+    convert_array(*values_view, values.data());
+
+    LayerSource source = {};
+    source.mapping = binary_layer_mapping(element);
+    source.values = values.data();
+    source.value_count = values.size() / components;
+    source.value_stride = components;
+
+    std::vector<int32_t> index;
+    auto reference = child_str(element, "ReferenceInformationType");
+    if (reference == "IndexToDirect" || reference == "Index")
+    {
+        auto index_view = child_array(element, index_name, arrays);
+        if (index_view == nullptr) return false;
+        index.resize(index_view->count);
+        convert_array(*index_view, index.data());
+        source.index = index.data();
+        source.index_count = index.size();
+    }
+    return fn(source);
+}
+
+/// @brief レイヤー要素をポリゴン頂点ごとの値に展開する
+/// @param element レイヤー要素のノード
+/// @param values_name 値の配列の名前
+/// @param index_name インデックスの配列の名前
+/// @param components 1要素あたりの成分数
+/// @param topology ポリゴン頂点の並び
+/// @param arrays 展開済みの配列
+/// @param out 出力先 (ポリゴン頂点数 * out_stride)
+/// @param out_stride 出力の1要素あたりの成分数
+/// @return 展開に成功したかどうか
+bool expand_layer(const BinRecord& element, std::string_view values_name,
+                  std::string_view index_name, size_t components,
+                  const CornerTopology& topology,
+                  const std::unordered_map<const BinValue*, ArrayView*>& arrays,
+                  double* out, size_t out_stride)
+{
+    return with_binary_layer_source(
+        element, values_name, index_name, components, arrays,
+        [&](const LayerSource& source) {
+            return expand_layer_corners(source, topology, components, out,
+                                        out_stride);
+        });
+}
+
+/// @brief レイヤー要素を重複の無い値とポリゴン頂点ごとの番号に分ける
+/// 配列が揃っていなければ、全てのポリゴン頂点が1つの初期値を指すようにする
+/// @param element レイヤー要素のノード
+/// @param values_name 値の配列の名前
+/// @param index_names インデックスの配列の名前の候補 (前から順に試す)
+/// @param components 1要素あたりの成分数
+/// @param topology ポリゴン頂点の並び
+/// @param arrays 展開済みの配列
+/// @param arena 値とインデックスの確保に使用する領域
+/// @param fill 値の初期値 (out_stride個)
+/// @param out_stride 出力の1要素あたりの成分数
+/// @param out_values 値の出力先
+/// @param out_value_count 値の数の出力先
+/// @param out_indices ポリゴン頂点ごとの値の番号の出力先
+/// @return 配列が揃っていたかどうか
+bool index_binary_layer(
+    const BinRecord& element, std::string_view values_name,
+    std::initializer_list<std::string_view> index_names, size_t components,
+    const CornerTopology& topology,
+    const std::unordered_map<const BinValue*, ArrayView*>& arrays,
+    Arena& arena, const double* fill, size_t out_stride, double*& out_values,
+    size_t& out_value_count, unsigned int*& out_indices)
+{
+    auto store = [&](const LayerSource& source) {
+        IndexedLayer layer;
+        index_layer_corners(source, topology, components, layer);
+        out_value_count = layer.values.size();
+        out_values = arena.allocate<double>(out_value_count * out_stride);
+        for (size_t i = 0; i < out_value_count; i++)
+            std::copy(fill, fill + out_stride, out_values + i * out_stride);
+        gather_layer_values(source, layer, components, out_values,
+                            out_stride);
+        out_indices = arena.allocate<unsigned int>(topology.corner_count);
+        std::copy(layer.index.begin(), layer.index.end(), out_indices);
+        return true;
+    };
+    for (auto index_name : index_names)
+    {
+        if (with_binary_layer_source(element, values_name, index_name,
+                                     components, arrays, store))
+            return true;
+    }
+
+    LayerSource missing = {};
+    missing.mapping = LayerMapping::Unsupported;
+    missing.value_stride = components;
+    store(missing);
+    return false;
+}
+
+/// @brief Geometryノードからメッシュを読み込む
+/// @param read 読み込むGeometryノードと読み込み先のメッシュ
+/// @param unit_scale ファイルの1単位あたりのメートル
+/// @param indexed UV・法線を値とポリゴン頂点ごとの番号で読み込むかどうか
+/// @param arena 確保に使用する領域
+/// @param arrays 展開済みの配列
+/// @param stats 統計の記録先 (メッシュごとに並列に呼び出される)
+/// @return 読み込めたかどうか (頂点数を超える頂点番号があればfalse)
+bool read_binary_mesh(const BinaryMeshRead& read, double unit_scale,
+                      bool indexed, Arena& arena,
+                      const std::unordered_map<const BinValue*, ArrayView*>&
+                          arrays,
+                      StatsRecorder& stats)
+{
+    StatsScope mesh_scope(stats, STATS_PHASE_MESHES, STATS_PHASE_COUNT, true);
+    auto& geometry = *read.geometry;
+    auto mesh = read.mesh;
+
+    // Geometric*の変換はファイルの座標系のまま、軸の変換より先にかける
+    double m[16];
+    axis_conversion_matrix(unit_scale, false, m);
+    double nm[16];
+    axis_conversion_matrix(1.0, false, nm);
+    if (read.has_geometric)
+    {
+        double converted[16];
+        multiply_matrices({read.geometric.data(), m}, converted);
+        std::memcpy(m, converted, sizeof(m));
+        double normal[16];
+        normal_matrix(read.geometric.data(), normal);
+        multiply_matrices({normal, nm}, converted);
+        std::memcpy(nm, converted, sizeof(nm));
+    }
+
+    // 頂点の追加、Y-up to Z-up
+    if (auto vertices = child_array(geometry, "Vertices", arrays))
+    {
+        std::vector<double> coords(vertices->count);
+        convert_array(*vertices, coords.data());
+        mesh->vertex_count = coords.size() / 3;
+        mesh->vertices = arena.allocate<Vector4>(mesh->vertex_count);
+        for (size_t i = 0; i < mesh->vertex_count; i++)
+        {
+            mesh->vertices[i] = {coords[i * 3], coords[i * 3 + 1],
+                                 coords[i * 3 + 2], 1.0};
+        }
+        transform_points(m, mesh->vertices, mesh->vertices, mesh->vertex_count);
+    }
+
+    // 頂点インデックスと面の設定 (負の値がポリゴンの終端)
+    std::vector<unsigned int> indices;
+    std::vector<unsigned int> polys;
+    std::vector<unsigned int> corner_polys;
+    if (auto pvi = child_array(geometry, "PolygonVertexIndex", arrays))
+    {
+        std::vector<int32_t> raw(pvi->count);
+        convert_array(*pvi, raw.data());
+        indices.resize(raw.size());
+        corner_polys.resize(raw.size());
+        auto is_start = true;
+        for (size_t i = 0; i < raw.size(); i++)
+        {
+            if (is_start) polys.push_back((unsigned int)i);
+            corner_polys[i] = (unsigned int)polys.size() - 1;
+            indices[i] = raw[i] < 0 ? ~raw[i] : raw[i];
+            is_start = raw[i] < 0;
+            if (indices[i] >= mesh->vertex_count)
+            {
+                std::cerr << "Mesh " << object_name(geometry)
+                          << " refers to vertex " << indices[i] << " of "
+                          << mesh->vertex_count << "." << std::endl;
+                return false;
+            }
+        }
+    }
+    mesh->index_count = indices.size();
+    mesh->indices = arena.allocate<unsigned int>(indices.size());
+    std::memcpy(mesh->indices, indices.data(),
+                indices.size() * sizeof(unsigned int));
+    mesh->poly_count = polys.size();
+    mesh->polys = arena.allocate<unsigned int>(polys.size());
+    std::memcpy(mesh->polys, polys.data(), polys.size() * sizeof(unsigned int));
+
+    CornerTopology topology = {indices.data(), corner_polys.data(),
+                               indices.size()};
+
+    // ここから後はレイヤー要素
+    StatsScope layer_scope(stats, STATS_PHASE_LAYERS, STATS_PHASE_MESHES, true);
+
+    // マテリアルの設定
+    mesh->material_indices = arena.allocate<unsigned int>(mesh->poly_count);
+    if (auto elmat = find_child(geometry, "LayerElementMaterial"))
+    {
+        if (auto mats = child_array(*elmat, "Materials", arrays))
+        {
+            std::vector<int32_t> values(mats->count);
+            convert_array(*mats, values.data());
+            expand_layer_polygons(binary_layer_mapping(*elmat), values.data(),
+                                  values.size(), topology, mesh->polys,
+                                  mesh->poly_count, mesh->material_indices);
+        }
+    }
+
+    std::vector<const BinRecord*> uv_elements, normal_elements;
+    for (auto& child : geometry.children)
+    {
+        if (child.name == "LayerElementUV") uv_elements.push_back(&child);
+        if (child.name == "LayerElementNormal")
+            normal_elements.push_back(&child);
+    }
+
+    // UVの設定
+    mesh->uv_set_count = uv_elements.size();
+    mesh->uv_sets = arena.allocate<UV>(mesh->uv_set_count);
+    for (size_t i = 0; i < uv_elements.size(); i++)
+    {
+        auto& uv = mesh->uv_sets[i];
+        uv.name =
+            arena.copy_name(child_str(*uv_elements[i], "Name"), &uv.name_length);
+        if (indexed)
+        {
+            const double fill[2] = {0.0, 0.0};
+            double* values = nullptr;
+            index_binary_layer(*uv_elements[i], "UV", {"UVIndex"}, 2,
+                               topology, arrays, arena, fill, 2, values,
+                               uv.value_count, uv.indices);
+            uv.uv = (Vector2*)values;
+            continue;
+        }
+        uv.uv = arena.allocate<Vector2>(mesh->index_count);
+        uv.value_count = mesh->index_count;
+        expand_layer(*uv_elements[i], "UV", "UVIndex", 2, topology, arrays,
+                     (double*)uv.uv, 2);
+    }
+
+    // 頂点法線の設定、Y-up to Z-up (Geometric*で拡縮する場合は正規化し直す)
+    mesh->normal_set_count = normal_elements.size();
+    mesh->normal_sets = arena.allocate<Normal>(mesh->normal_set_count);
+    for (size_t i = 0; i < normal_elements.size(); i++)
+    {
+        auto& normal = mesh->normal_sets[i];
+        normal.name = arena.copy_name(child_str(*normal_elements[i], "Name"),
+                                      &normal.name_length);
+        if (indexed)
+        {
+            const double fill[4] = {0.0, 0.0, 0.0, 1.0};
+            double* values = nullptr;
+            index_binary_layer(*normal_elements[i], "Normals",
+                               {"NormalsIndex", "NormalIndex"}, 3, topology,
+                               arrays, arena, fill, 4, values,
+                               normal.value_count, normal.indices);
+            normal.normal = (Vector4*)values;
+            transform_normals(nm, normal.normal, normal.normal,
+                              normal.value_count, read.has_geometric);
+            continue;
+        }
+        normal.normal = arena.allocate<Vector4>(mesh->index_count);
+        normal.value_count = mesh->index_count;
+        for (size_t j = 0; j < mesh->index_count; j++)
+            normal.normal[j] = {0.0, 0.0, 0.0, 1.0};
+        if (!expand_layer(*normal_elements[i], "Normals", "NormalsIndex", 3,
+                          topology, arrays, (double*)normal.normal, 4))
+        {
+            expand_layer(*normal_elements[i], "Normals", "NormalIndex", 3,
+                         topology, arrays, (double*)normal.normal, 4);
+        }
+        transform_normals(nm, normal.normal, normal.normal, mesh->index_count,
+                          read.has_geometric);
+    }
+    return true;
+}
+
+/// @brief Modelからノードを再帰的に作成する (メッシュは確保のみ)
+/// @param models 全てのModel
+/// @param index 作成するModelの番号
+/// @param mats マテリアル
+/// @param object 作成先のオブジェクト
+/// @param arena 確保に使用する領域
+/// @param names 名前の表
+/// @param mesh_map 確保済みのメッシュ (同じGeometryのModelは共有する)
+/// @param meshes 後から読み込むメッシュの一覧
+void build_binary_object(
+    std::vector<ReadModel>& models, size_t index, const Material* mats,
+    Object& object, Arena& arena, NameTable& names,
+    std::unordered_map<const BinRecord*, Mesh*>& mesh_map,
+    std::vector<BinaryMeshRead>& meshes)
+{
+    auto& model = models[index];
+    model.visited = true;
+    object.name = names.intern(object_name(*model.record), &object.name_length);
+
+    model_local_matrix(*model.record, object.matrix_local);
+
+    // Geometric*の変換はこのModelのメッシュの頂点にだけかけるので共有しない
+    if (model.geometry != nullptr)
+    {
+        BinaryMeshRead read = {};
+        read.geometry = model.geometry;
+        read.has_geometric =
+            model_geometric_matrix(*model.record, read.geometric.data());
+        auto& shared = mesh_map[model.geometry];
+        auto mesh = read.has_geometric ? nullptr : shared;
+        if (mesh == nullptr)
+        {
+            mesh = arena.allocate<Mesh>();
+            mesh->name = names.intern(object_name(*model.geometry),
+                                      &mesh->name_length);
+            read.mesh = mesh;
+            meshes.push_back(read);
+            if (!read.has_geometric) shared = mesh;
+        }
+        object.mesh = mesh;
+    }
+
+    if (!model.materials.empty())
+    {
+        object.material_slot_count = model.materials.size();
+        object.material_slots =
+            arena.allocate<Material*>(model.materials.size());
+        for (size_t i = 0; i < model.materials.size(); i++)
+            object.material_slots[i] = (Material*)&mats[model.materials[i]];
+    }
+
+    // 作成済みのModelへの接続 (循環や複数の親) は壊れたファイルなので無視する
+    std::vector<size_t> children;
+    for (auto child : model.children)
+    {
+        if (models[child].visited) continue;
+        models[child].visited = true;
+        children.push_back(child);
+    }
+    object.child_count = children.size();
+    object.children = arena.allocate<Object>(object.child_count);
+    for (size_t i = 0; i < children.size(); i++)
+    {
+        build_binary_object(models, children[i], mats, object.children[i],
+                            arena, names, mesh_map, meshes);
+    }
+}
+
+/// @brief Geometryノードを読み込むのに必要な大きさを見積もる
+/// @param geometry Geometryノード
+/// @param indexed UV・法線を値とポリゴン頂点ごとの番号で読み込むかどうか
+/// @return 必要な大きさ (バイト、多めに見積もる)
+size_t estimate_binary_mesh_size(const BinRecord& geometry, bool indexed)
+{
+    auto array_count = [](const BinRecord* record) -> size_t {
+        if (record == nullptr || record->values.size() != 1) return 0;
+        return record->values[0].count;
+    };
+    auto vertex_count = array_count(find_child(geometry, "Vertices")) / 3;
+    auto index_count = array_count(find_child(geometry, "PolygonVertexIndex"));
+    // 番号で読み込む場合の値はファイルの要素の数 (と範囲外の参照用の1つ) まで
+    size_t layer_size = 0;
+    for (auto& child : geometry.children)
+    {
+        if (child.name == "LayerElementUV")
+        {
+            auto value_count = array_count(find_child(child, "UV")) / 2 + 1;
+            layer_size += sizeof(UV) + 64 +
+                          (indexed ? value_count * sizeof(Vector2) +
+                                         index_count * sizeof(unsigned int)
+                                   : index_count * sizeof(Vector2));
+        }
+        if (child.name == "LayerElementNormal")
+        {
+            auto value_count =
+                array_count(find_child(child, "Normals")) / 3 + 1;
+            layer_size += sizeof(Normal) + 64 +
+                          (indexed ? value_count * sizeof(Vector4) +
+                                         index_count * sizeof(unsigned int)
+                                   : index_count * sizeof(Vector4));
+        }
+    }
+
+    // 面の数は分からないので、面ごとの配列も頂点インデックスと同じ数で見積もる
+    return sizeof(Mesh) + 256 + vertex_count * sizeof(Vector4) +
+           index_count * sizeof(unsigned int) * 3 + layer_size;
+}
+
+/// @brief Materialノードを読み込む
+/// @param record Materialノード
+/// @param material 読み込み先のマテリアル
+/// @param names 名前の表
+void read_binary_material(const BinRecord& record, Material& material,
+                          NameTable& names)
+{
+    material.name = names.intern(object_name(record), &material.name_length);
+
+    auto& surface = material.standard_surface;
+    double diffuse[3] = {0.8, 0.8, 0.8};
+    double emissive[3] = {0.0, 0.0, 0.0};
+    double transparency = 0.0;
+    double opacity = -1.0;
+    read_p(record, "DiffuseColor", diffuse, 3);
+    read_p(record, "EmissiveColor", emissive, 3);
+    read_p(record, "TransparencyFactor", &transparency, 1);
+    read_p(record, "Opacity", &opacity, 1);
+    if (opacity < 0.0) opacity = 1.0 - transparency;
+
+    surface.base = 1.0;
+    surface.base_color = {diffuse[0], diffuse[1], diffuse[2], opacity};
+    surface.emission = 1.0;
+    surface.emission_color = {emissive[0], emissive[1], emissive[2], 1.0};
+    surface.opacity = opacity;
+}
+
+/// @brief Modelのローカル行列を作る (FbxNode::EvaluateLocalTransformと同じ式)
+/// 移動・回転・拡縮に加えて回転順、PreRotation・PostRotation、
+/// 回転と拡縮のピボット・オフセットを反映する
+/// @param model Model
+/// @param m FbxAMatrixと同じ並びの行列の出力先 (16要素)
+void model_local_matrix(const BinRecord& model, double* m)
+{
+    double t[3] = {0, 0, 0}, r[3] = {0, 0, 0}, s[3] = {1, 1, 1};
+    double pre[3] = {0, 0, 0}, post[3] = {0, 0, 0};
+    double r_offset[3] = {0, 0, 0}, r_pivot[3] = {0, 0, 0};
+    double s_offset[3] = {0, 0, 0}, s_pivot[3] = {0, 0, 0};
+    double order = 0;
+    read_p(model, "Lcl Translation", t, 3);
+    read_p(model, "Lcl Rotation", r, 3);
+    read_p(model, "Lcl Scaling", s, 3);
+    read_p(model, "PreRotation", pre, 3);
+    read_p(model, "PostRotation", post, 3);
+    read_p(model, "RotationOffset", r_offset, 3);
+    read_p(model, "RotationPivot", r_pivot, 3);
+    read_p(model, "ScalingOffset", s_offset, 3);
+    read_p(model, "ScalingPivot", s_pivot, 3);
+    read_p(model, "RotationOrder", &order, 1);
+
+    // T * Roff * Rp * Rpre * R * Rpost^-1 * Rp^-1 * Soff * Sp * S * Sp^-1 を
+    // 行ベクトルの並び (右から順にかける) で掛ける
+    double mt[16], mr[16], mpre[16], mpost[16], ms[16];
+    double mr_offset[16], mr_pivot[16], mr_pivot_inv[16];
+    double ms_offset[16], ms_pivot[16], ms_pivot_inv[16];
+    translation_matrix(t, 1.0, mt);
+    euler_matrix(r, (int64_t)order, mr);
+    euler_matrix(pre, 0, mpre);
+    euler_matrix(post, 0, mpost);
+    for (auto i = 0; i < 3; i++) // 回転の逆行列は転置
+        for (auto j = 0; j < i; j++)
+            std::swap(mpost[i * 4 + j], mpost[j * 4 + i]);
+    for (auto i = 0; i < 16; i++) ms[i] = i % 5 == 0 ? 1.0 : 0.0;
+    for (auto i = 0; i < 3; i++) ms[i * 5] = s[i];
+    translation_matrix(r_offset, 1.0, mr_offset);
+    translation_matrix(r_pivot, 1.0, mr_pivot);
+    translation_matrix(r_pivot, -1.0, mr_pivot_inv);
+    translation_matrix(s_offset, 1.0, ms_offset);
+    translation_matrix(s_pivot, 1.0, ms_pivot);
+    translation_matrix(s_pivot, -1.0, ms_pivot_inv);
+    multiply_matrices({ms_pivot_inv, ms, ms_pivot, ms_offset, mr_pivot_inv,
+                       mpost, mr, mpre, mr_pivot, mr_offset, mt},
+                      m);
+}
+
+/// @brief ModelのGeometricTranslation・Rotation・Scalingの行列を作る
+/// (子には伝わらず、このModelのジオメトリだけにかかる)
+/// @param model Model
+/// @param m FbxAMatrixと同じ並びの行列の出力先 (16要素)
+/// @return 単位行列でないかどうか
+bool model_geometric_matrix(const BinRecord& model, double* m)
+{
+    double t[3] = {0, 0, 0}, r[3] = {0, 0, 0}, s[3] = {1, 1, 1};
+    read_p(model, "GeometricTranslation", t, 3);
+    read_p(model, "GeometricRotation", r, 3);
+    read_p(model, "GeometricScaling", s, 3);
+    double mt[16], mr[16], ms[16];
+    translation_matrix(t, 1.0, mt);
+    euler_matrix(r, 0, mr);
+    for (auto i = 0; i < 16; i++) ms[i] = i % 5 == 0 ? 1.0 : 0.0;
+    for (auto i = 0; i < 3; i++) ms[i * 5] = s[i];
+    multiply_matrices({ms, mr, mt}, m);
+    for (auto i = 0; i < 16; i++)
+        if (m[i] != (i % 5 == 0 ? 1.0 : 0.0)) return true;
+    return false;
+}
+
+/// @brief オイラー角の回転行列を作る (行ベクトルにかける並び)
+/// @param degrees X, Y, Z軸の回転 (度)
+/// @param order FBXの回転順 (0: XYZ, 1: XZY, 2: YZX, 3: YXZ, 4: ZXY, 5: ZYX、
+///              それ以外はXYZ)、先に書かれた軸から順に回す
+/// @param m 行列の出力先 (16要素)
+void euler_matrix(const double* degrees, int64_t order, double* m)
+{
+    const auto to_rad = 3.14159265358979323846 / 180.0;
+    double axes[3][16];
+    for (auto a = 0; a < 3; a++)
+    {
+        auto c = std::cos(degrees[a] * to_rad);
+        auto s = std::sin(degrees[a] * to_rad);
+        auto& axis = axes[a];
+        for (auto i = 0; i < 16; i++) axis[i] = i % 5 == 0 ? 1.0 : 0.0;
+        auto u = (a + 1) % 3, v = (a + 2) % 3;
+        axis[u * 4 + u] = c;
+        axis[u * 4 + v] = s;
+        axis[v * 4 + u] = -s;
+        axis[v * 4 + v] = c;
+    }
+
+    static const int orders[6][3] = {{0, 1, 2}, {0, 2, 1}, {1, 2, 0},
+                                     {1, 0, 2}, {2, 0, 1}, {2, 1, 0}};
+    auto& o = orders[order >= 0 && order < 6 ? order : 0];
+    multiply_matrices({axes[o[0]], axes[o[1]], axes[o[2]]}, m);
+}
+
+/// @brief 移動の行列を作る
+/// @param t 移動
+/// @param sign 1なら移動、-1なら逆向きの移動
+/// @param m 行列の出力先 (16要素)
+void translation_matrix(const double* t, double sign, double* m)
+{
+    for (auto i = 0; i < 16; i++) m[i] = i % 5 == 0 ? 1.0 : 0.0;
+    for (auto i = 0; i < 3; i++) m[12 + i] = t[i] * sign;
+}
+
+/// @brief 行列を順に掛ける (行ベクトルの並びなので、先に書いたものから順にかかる)
+/// @param matrices 掛ける行列 (16要素)
+/// @param m 結果の出力先 (16要素)
+void multiply_matrices(std::initializer_list<const double*> matrices,
+                       double* m)
+{
+    double result[16], product[16];
+    for (auto i = 0; i < 16; i++) result[i] = i % 5 == 0 ? 1.0 : 0.0;
+    for (auto b : matrices)
+    {
+        for (auto row = 0; row < 4; row++)
+        {
+            for (auto col = 0; col < 4; col++)
+            {
+                auto sum = 0.0;
+                for (auto k = 0; k < 4; k++)
+                    sum += result[row * 4 + k] * b[k * 4 + col];
+                product[row * 4 + col] = sum;
+            }
+        }
+        std::memcpy(result, product, sizeof(result));
+    }
+    std::memcpy(m, result, sizeof(result));
+}
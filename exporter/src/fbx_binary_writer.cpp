@@ -0,0 +1,1545 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "animation_curves.h"
+#include "array_deflate.h"
+#include "export_cache.h"
+#include "export_job.h"
+#include "fbx_binary.h"
+#include "fbx_binary_nodes.h"
+#include "geometry_kernels.h"
+#include "io_stats.h"
+#include "mesh_geometry.h"
+#include "mesh_instances.h"
+#include "mesh_layout.h"
+#include "mesh_lods.h"
+#include "mesh_normals.h"
+#include "mesh_skin.h"
+#include "parallel.h"
+#include "scene_tables.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+static_assert(std::endian::native == std::endian::little,
+              "Binary FBX writer assumes a little-endian host.");
+
+/// @brief 書き出す前に変換したメッシュ (メッシュごとに並列に求める)
+struct PreparedGeometry
+{
+    std::vector<Vector4> smooth_normals; // 法線を持たないスムーズなメッシュ用
+    bool has_smooth = false;
+    MeshLayout layout; // 並べ替えと法線・UVの共有 (しない場合は空)
+};
+using PreparedGeometries =
+    std::unordered_map<const Mesh*, std::shared_ptr<const PreparedGeometry>>;
+
+/// @brief バッファ付きの書き出し先
+struct BinWriter
+{
+    std::ofstream stream;
+    std::vector<char> buffer;
+    size_t used = 0;
+    uint64_t offset = 0;
+    uint64_t total = 0; // フッタを除いたバイト数
+    ExportMonitor* monitor = nullptr;
+    StatsRecorder* stats = nullptr;
+    bool cancelled = false; // 中断したら以降は何も書き出さない
+};
+
+bool prepare_geometries(const IOData* export_data,
+                        const MeshInstances& instances, const MeshLods& lods,
+                        const ExportCache& cache, PreparedGeometries& out,
+                        ExportMonitor& monitor, StatsRecorder& stats);
+void build_document(BinNode& document, const IOData* export_data,
+                    uint32_t version, const MeshInstances& instances,
+                    const MeshLods& lods, const MeshSkins& skins,
+                    const SceneAnimation& animation, ExportCache& cache,
+                    const PreparedGeometries& prepared,
+                    std::unordered_map<const Mesh*, int64_t>& geometry_ids,
+                    StatsRecorder& stats);
+void build_objects(BinNode& objects, BinNode& connections,
+                   const IOData* export_data, const Object* object,
+                   int64_t parent_id, int64_t& next_id,
+                   const MaterialTable& materials,
+                   const std::vector<int64_t>& material_ids,
+                   const MeshInstances& instances, const MeshLods& lods,
+                   ExportCache& cache, const PreparedGeometries& prepared,
+                   std::unordered_map<const Mesh*, int64_t>& geometry_ids,
+                   std::unordered_map<const Object*, int64_t>& model_ids,
+                   size_t& attribute_count, StatsRecorder& stats);
+void build_animation(BinNode& objects, BinNode& connections,
+                     const SceneAnimation& animation,
+                     const std::unordered_map<const Object*, int64_t>& model_ids,
+                     int64_t& next_id, size_t& curve_node_count,
+                     size_t& curve_count);
+void build_curve(BinNode& curve, const AnimationCurve& input);
+void build_skins(BinNode& objects, BinNode& connections,
+                 const MeshInstances& instances, const MeshLods& lods,
+                 const MeshSkins& skins,
+                 const std::unordered_map<const Mesh*, int64_t>& geometry_ids,
+                 const std::unordered_map<const Object*, int64_t>& model_ids,
+                 int64_t& next_id, size_t& deformer_count, size_t& pose_count);
+void collect_skinned_models(
+    const Object* object, const MeshInstances& instances,
+    const MeshSkins& skins,
+    std::unordered_map<const Mesh*, std::vector<const Object*>>& out);
+void build_geometry(BinNode& geometry, const Mesh* mesh,
+                    const std::shared_ptr<const PreparedGeometry>& prepared,
+                    double unit_scale, StatsRecorder& stats);
+void build_model(BinNode& model, const Object* object, bool has_attribute);
+void build_material(BinNode& material, const Material& input);
+bool compress_document(BinNode& document, const IOData* export_data,
+                       ExportMonitor& monitor, StatsRecorder& stats);
+void collect_compressible(BinNode& node, size_t threshold,
+                          std::vector<BinProperty*>& props);
+bool fits_property_headers(const BinNode& node);
+void set_document_version(BinNode& document, uint32_t version);
+uint64_t compute_size(BinNode& node, uint32_t version);
+void write_node(BinWriter& writer, const BinNode& node, uint32_t version);
+void write_footer(BinWriter& writer, uint32_t version);
+void flush_buffer(BinWriter& writer);
+
+// FBX SDKが出力するファイルと同じ固定値 (FileIdと作成日時とフッタは対応している)
+const uint8_t FBX_FILE_ID[] = {0x28, 0xb3, 0x2a, 0xeb, 0xb6, 0x24, 0xcc, 0xc2,
+                               0xbf, 0xc8, 0xb0, 0x2a, 0xa9, 0x2b, 0xfc, 0xf1};
+const uint8_t FBX_FOOTER_ID[] = {0xfa, 0xbc, 0xab, 0x09, 0xd0, 0xc8,
+                                 0xd4, 0x66, 0xb1, 0x76, 0xfb, 0x83,
+                                 0x1c, 0xf7, 0x26, 0x7e};
+const uint8_t FBX_FOOTER_MAGIC[] = {0xf8, 0x5a, 0x8c, 0x6a, 0xde, 0xf5,
+                                    0xd9, 0x7e, 0xec, 0xe9, 0x0c, 0xe3,
+                                    0x75, 0x8f, 0x29, 0x0b};
+const char FBX_CREATION_TIME[] = "1970-01-01 10:00:00:000";
+const size_t WRITE_BUFFER_SIZE = 1 << 20;
+const size_t FILL_CHUNK_SIZE = 1 << 16;
+// AnimationCurveのキーの属性 (直線補間、自動接線) とその接線の既定値
+// Blenderなどが書き出すファイルと同じ値で、全てのキーが共有する
+const int32_t FBX_KEY_ATTR_FLAGS[] = {0x2104};
+const uint32_t FBX_KEY_ATTR_DATA[] = {0, 0, 0x0d050d05, 0};
+// AnimationCurveNodeの名前と接続先のModelのプロパティ (移動・回転・拡縮の順)
+const char* const FBX_CURVE_NODE_NAMES[] = {"T", "R", "S"};
+const char* const FBX_CURVE_NODE_PROPERTIES[] = {
+    "Lcl Translation", "Lcl Rotation", "Lcl Scaling"};
+const char* const FBX_CURVE_CHANNELS[] = {"d|X", "d|Y", "d|Z"};
+// アニメーションを書き出す場合のテイク (AnimationStack) の名前
+const char FBX_TAKE_NAME[] = "Take 001";
+
+BinProperty prop_i16(int16_t v) { return {.type = 'Y', .i = v}; }
+BinProperty prop_bool(bool v) { return {.type = 'C', .i = v}; }
+BinProperty prop_i32(int32_t v) { return {.type = 'I', .i = v}; }
+BinProperty prop_i64(int64_t v) { return {.type = 'L', .i = v}; }
+BinProperty prop_f64(double v) { return {.type = 'D', .d = v}; }
+BinProperty prop_str(std::string v) { return {.type = 'S', .s = std::move(v)}; }
+BinProperty prop_raw(const void* data, size_t size)
+{
+    return {.type = 'R', .s = std::string((const char*)data, size)};
+}
+BinProperty prop_array(char type, size_t count, const void* data,
+                       StatsPhase phase = STATS_PHASE_MESHES)
+{
+    return {.type = type, .count = count, .data = data, .phase = phase};
+}
+BinProperty prop_array(char type, size_t item_count, size_t stride,
+                       std::function<void(size_t, size_t, void*)> fill,
+                       StatsPhase phase = STATS_PHASE_MESHES)
+{
+    return {.type = type,
+            .count = item_count * stride,
+            .stride = stride,
+            .fill = std::move(fill),
+            .phase = phase};
+}
+
+/// @brief オブジェクト名をFBXの "名前\x00\x01クラス" 形式にする
+/// @param name 名前
+/// @param cls クラス名
+/// @return 変換された名前
+std::string class_name(const char* name, const char* cls)
+{
+    std::string s = name != nullptr ? name : "";
+    s.append("\x00\x01", 2);
+    s.append(cls);
+    return s;
+}
+
+BinNode& add_node(BinNode& parent, const char* name)
+{
+    parent.children.emplace_back();
+    parent.children.back().name = name;
+    return parent.children.back();
+}
+
+template <typename... Props>
+BinNode& add_node(BinNode& parent, const char* name, Props&&... props)
+{
+    auto& node = add_node(parent, name);
+    (node.props.push_back(std::forward<Props>(props)), ...);
+    return node;
+}
+
+void add_p(BinNode& props70, const char* name, const char* type,
+           const char* label, const char* flags, double x, double y, double z)
+{
+    add_node(props70, "P", prop_str(name), prop_str(type), prop_str(label),
+             prop_str(flags), prop_f64(x), prop_f64(y), prop_f64(z));
+}
+
+void add_p(BinNode& props70, const char* name, const char* type,
+           const char* label, const char* flags, double value)
+{
+    add_node(props70, "P", prop_str(name), prop_str(type), prop_str(label),
+             prop_str(flags), prop_f64(value));
+}
+
+void add_p(BinNode& props70, const char* name, const char* type,
+           const char* label, const char* flags, int32_t value)
+{
+    add_node(props70, "P", prop_str(name), prop_str(type), prop_str(label),
+             prop_str(flags), prop_i32(value));
+}
+
+void add_p(BinNode& props70, const char* name, const char* type,
+           const char* label, const char* flags, int64_t value)
+{
+    add_node(props70, "P", prop_str(name), prop_str(type), prop_str(label),
+             prop_str(flags), prop_i64(value));
+}
+
+/// @brief FBX SDKを使用せずにバイナリFBXファイルを書き出す
+/// @param export_path エクスポート先のパス
+/// @param export_data エクスポートするデータ
+/// @param monitor 進捗の報告先 (中断を要求されたら書きかけのファイルを削除する)
+/// @param stats 統計の記録先 (配列の変換は書き出し中に行うので、その時間は
+///              SERIALIZEから差し引いてMESHESとLAYERSに足す)
+/// @return エクスポートに成功したかどうか (キャッシュで書き出しを省いてもtrue)
+bool write_fbx_binary(const char* export_path, const IOData* export_data,
+                      ExportMonitor& monitor, StatsRecorder& stats)
+{
+    if (export_path == nullptr || *export_path == '\0')
+    {
+        std::cerr << "File path is invalid." << std::endl;
+        return false;
+    }
+    if (export_data == nullptr || export_data->root == nullptr)
+    {
+        std::cerr << "Root node is null." << std::endl;
+        return false;
+    }
+
+    // 内容が同じメッシュは1つのGeometryにまとめ、キャッシュもその単位で引く
+    monitor.begin_phase(EXPORT_PHASE_PREPARING);
+    MeshInstances instances(export_data->root);
+    ExportCache cache(export_path, export_data, instances);
+    if (cache.output_unchanged())
+    {
+        auto size = file_size_or_zero(export_path);
+        monitor.begin_phase(EXPORT_PHASE_WRITING);
+        monitor.set_bytes(size, size);
+        return true;
+    }
+    cache.load_geometries(stats);
+    MeshLods lods(export_data, instances);
+    if (!lods.generate(monitor, stats)) return false;
+    PreparedGeometries prepared;
+    if (!prepare_geometries(export_data, instances, lods, cache, prepared,
+                            monitor, stats))
+        return false;
+    MeshSkins skins(export_data, instances, lods);
+    if (!skins.build(monitor, stats)) return false;
+    SceneAnimation animation(export_data, lods.root());
+    if (!animation.bake(monitor, stats)) return false;
+
+    // 32bitオフセットに収まらない場合は7.5形式で書き出す
+    monitor.begin_phase(EXPORT_PHASE_BUILDING);
+    auto version = FBX_BINARY_VERSION_32;
+    BinNode document;
+    std::unordered_map<const Mesh*, int64_t> geometry_ids;
+    build_document(document, export_data, version, instances, lods, skins,
+                   animation, cache, prepared, geometry_ids, stats);
+    if (!compress_document(document, export_data, monitor, stats)) return false;
+    if (!fits_property_headers(document))
+    {
+        std::cerr << "An array or string has 2^32 or more elements or bytes "
+                     "and cannot be written to FBX."
+                  << std::endl;
+        return false;
+    }
+    cache.store_geometries(document, geometry_ids, stats);
+    auto total = FBX_HEADER_SIZE + compute_size(document, version);
+    if (total > UINT32_MAX)
+    {
+        // 圧縮をやり直さないように、ノードツリーはそのままでバージョンだけ変える
+        version = FBX_BINARY_VERSION_64;
+        set_document_version(document, version);
+        total = FBX_HEADER_SIZE + compute_size(document, version);
+    }
+    if (monitor.cancelled()) return false;
+
+    StatsScope write_scope(stats, STATS_PHASE_SERIALIZE);
+    std::filesystem::path path((const char8_t*)export_path);
+    BinWriter writer;
+    writer.stream.open(path, std::ios::binary | std::ios::trunc);
+    if (!writer.stream)
+    {
+        std::cerr << "An error occurred while opening the file..." << std::endl;
+        return false;
+    }
+    writer.buffer.resize(WRITE_BUFFER_SIZE);
+    stats.track_allocation(WRITE_BUFFER_SIZE);
+    writer.monitor = &monitor;
+    writer.stats = &stats;
+    writer.total = total;
+    monitor.begin_phase(EXPORT_PHASE_WRITING);
+    monitor.set_bytes(0, total);
+
+    // ヘッダ、トップレベルのノード、フッタの順に書き出す
+    write_node(writer, document, version);
+    write_footer(writer, version);
+    flush_buffer(writer);
+    writer.stream.close();
+    if (writer.cancelled)
+    {
+        std::error_code error;
+        std::filesystem::remove(path, error);
+        return false;
+    }
+    if (!writer.stream)
+    {
+        std::cerr << "An error occurred while writing the file..." << std::endl;
+        return false;
+    }
+
+    cache.commit();
+    return true;
+}
+
+/// @brief 書き出すメッシュを並列に変換する (キャッシュから読み込めたものは除く)
+/// 自動スムーズの法線と、設定に応じてポリゴンの並べ替えと法線・UVの共有を求める
+/// @param export_data エクスポートするデータ
+/// @param instances 内容が同じメッシュの表
+/// @param lods 作ったLOD (LODのメッシュも変換する)
+/// @param cache 書き出しキャッシュ
+/// @param out 変換結果の出力先
+/// @param monitor 進捗の報告先 (メッシュごとにadvanceする)
+/// @param stats 統計の記録先
+/// @return 変換できたかどうか (中断を要求された場合はfalse)
+bool prepare_geometries(const IOData* export_data,
+                        const MeshInstances& instances, const MeshLods& lods,
+                        const ExportCache& cache, PreparedGeometries& out,
+                        ExportMonitor& monitor, StatsRecorder& stats)
+{
+    std::vector<const Mesh*> meshes;
+    for (auto mesh : instances.unique_meshes())
+    {
+        if (!cache.has_geometry(mesh)) meshes.push_back(mesh);
+    }
+    meshes.insert(meshes.end(), lods.meshes().begin(), lods.meshes().end());
+
+    auto weld = export_data->weld_corner_attributes;
+    auto reorder = export_data->optimize_vertex_cache;
+    std::vector<std::shared_ptr<PreparedGeometry>> results(meshes.size());
+    monitor.begin_phase(EXPORT_PHASE_PREPARING, meshes.size());
+    {
+        StatsParallelScope scope(stats,
+                                 {STATS_PHASE_MESHES, STATS_PHASE_LAYERS});
+        parallel_for(
+            meshes.size(),
+            [&](size_t i) {
+                if (monitor.cancelled()) return;
+                auto mesh = meshes[i];
+                auto result = std::make_shared<PreparedGeometry>();
+                if (mesh->is_smooth && mesh->normal_set_count == 0)
+                {
+                    StatsScope task(stats, STATS_PHASE_LAYERS,
+                                    STATS_PHASE_COUNT, true);
+                    result->has_smooth =
+                        export_smooth_normals(mesh, result->smooth_normals);
+                }
+                if (weld || reorder)
+                {
+                    StatsScope task(stats, STATS_PHASE_MESHES,
+                                    STATS_PHASE_COUNT, true);
+                    auto smooth = result->has_smooth
+                                      ? result->smooth_normals.data()
+                                      : nullptr;
+                    build_mesh_layout(mesh, smooth, weld, reorder,
+                                      result->layout);
+                }
+                results[i] = std::move(result);
+                monitor.advance();
+            },
+            1);
+    }
+    if (monitor.cancelled()) return false;
+
+    int64_t bytes = 0;
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        bytes += results[i]->smooth_normals.capacity() * sizeof(Vector4) +
+                 mesh_layout_bytes(results[i]->layout);
+        out.emplace(meshes[i], std::move(results[i]));
+    }
+    stats.track_allocation(bytes);
+    return true;
+}
+
+/// @brief ファイル全体のノードツリーを構築する (配列の中身はコピーしない)
+/// @param document ルートノード (名前なし)
+/// @param export_data エクスポートするデータ
+/// @param version FBXのバージョン
+/// @param instances 内容が同じメッシュの表
+/// @param lods 作ったLOD (ノードツリーはlods.root()から書き出す)
+/// @param skins 変換したスキン
+/// @param animation ベイクしたアニメーション
+/// @param cache 書き出しキャッシュ (読み込めたGeometryは変換しない)
+/// @param prepared 変換済みのメッシュ
+/// @param geometry_ids 書き出したGeometryのIDの出力先
+/// @param stats 統計の記録先
+void build_document(BinNode& document, const IOData* export_data,
+                    uint32_t version, const MeshInstances& instances,
+                    const MeshLods& lods, const MeshSkins& skins,
+                    const SceneAnimation& animation, ExportCache& cache,
+                    const PreparedGeometries& prepared,
+                    std::unordered_map<const Mesh*, int64_t>& geometry_ids,
+                    StatsRecorder& stats)
+{
+    // 複数の書き出しを同時に行えるよう、共有のバッファを返すlocaltimeは使わない
+    auto now = std::time(nullptr);
+    std::tm tm = {};
+#ifdef _WIN32
+    localtime_s(&tm, &now);
+#else
+    localtime_r(&now, &tm);
+#endif
+
+    {
+        auto& header = add_node(document, "FBXHeaderExtension");
+        add_node(header, "FBXHeaderVersion", prop_i32(1003));
+        add_node(header, "FBXVersion", prop_i32(version));
+        add_node(header, "EncryptionType", prop_i32(0));
+        auto& stamp = add_node(header, "CreationTimeStamp");
+        add_node(stamp, "Version", prop_i32(1000));
+        add_node(stamp, "Year", prop_i32(tm.tm_year + 1900));
+        add_node(stamp, "Month", prop_i32(tm.tm_mon + 1));
+        add_node(stamp, "Day", prop_i32(tm.tm_mday));
+        add_node(stamp, "Hour", prop_i32(tm.tm_hour));
+        add_node(stamp, "Minute", prop_i32(tm.tm_min));
+        add_node(stamp, "Second", prop_i32(tm.tm_sec));
+        add_node(stamp, "Millisecond", prop_i32(0));
+        add_node(header, "Creator", prop_str("halFBXIO4B"));
+    }
+    add_node(document, "FileId", prop_raw(FBX_FILE_ID, sizeof(FBX_FILE_ID)));
+    add_node(document, "CreationTime", prop_str(FBX_CREATION_TIME));
+    add_node(document, "Creator", prop_str("halFBXIO4B"));
+
+    // 座標系はY-up、単位はセンチメートル (ジオメトリは書き出し時に変換する)
+    {
+        auto& settings = add_node(document, "GlobalSettings");
+        add_node(settings, "Version", prop_i32(1000));
+        auto& props70 = add_node(settings, "Properties70");
+        add_p(props70, "UpAxis", "int", "Integer", "", 1);
+        add_p(props70, "UpAxisSign", "int", "Integer", "", 1);
+        add_p(props70, "FrontAxis", "int", "Integer", "", 2);
+        add_p(props70, "FrontAxisSign", "int", "Integer", "", 1);
+        add_p(props70, "CoordAxis", "int", "Integer", "", 0);
+        add_p(props70, "CoordAxisSign", "int", "Integer", "", 1);
+        add_p(props70, "OriginalUpAxis", "int", "Integer", "", 2);
+        add_p(props70, "OriginalUpAxisSign", "int", "Integer", "", 1);
+        add_p(props70, "UnitScaleFactor", "double", "Number", "", 1.0);
+        add_p(props70, "OriginalUnitScaleFactor", "double", "Number", "",
+              export_data->unit_scale * 100.0);
+        // アニメーションのフレームレートは任意の値 (TimeModeの14) として書き出す
+        if (animation.enabled())
+        {
+            add_p(props70, "TimeMode", "enum", "", "", 14);
+            add_p(props70, "CustomFrameRate", "double", "Number", "",
+                  animation.frame_rate());
+            add_p(props70, "TimeSpanStart", "KTime", "Time", "",
+                  animation.start_time());
+            add_p(props70, "TimeSpanStop", "KTime", "Time", "",
+                  animation.stop_time());
+        }
+    }
+
+    {
+        auto& documents = add_node(document, "Documents");
+        add_node(documents, "Count", prop_i32(1));
+        auto& doc = add_node(documents, "Document", prop_i64(1),
+                             prop_str("Scene"), prop_str("Scene"));
+        add_node(doc, "RootNode", prop_i64(0));
+    }
+    add_node(document, "References");
+
+    // オブジェクトと接続はまとめて構築し、定義は数が決まってから追加する
+    auto definitions_index = document.children.size();
+    add_node(document, "Definitions");
+    auto& objects = add_node(document, "Objects");
+    BinNode connections;
+    connections.name = "Connections";
+
+    int64_t next_id = 1000000;
+    MaterialTable materials(export_data, export_data->merge_materials);
+    std::vector<int64_t> material_ids(materials.unique_count());
+    {
+        StatsScope scope(stats, STATS_PHASE_MATERIALS);
+        for (size_t i = 0; i < materials.unique_count(); i++)
+        {
+            auto& input = materials.unique_material(i);
+            material_ids[i] = next_id++;
+            auto& material =
+                add_node(objects, "Material", prop_i64(material_ids[i]),
+                         prop_str(class_name(input.name, "Material")),
+                         prop_str(""));
+            build_material(material, input);
+        }
+    }
+
+    // ルートオブジェクト自体は書き出さず、子をシーンのルートに接続する
+    // 内容が同じメッシュは1つのGeometryを複数のModelに接続する
+    std::unordered_map<const Object*, int64_t> model_ids;
+    size_t attribute_count = 0;
+    size_t curve_node_count = 0;
+    size_t curve_count = 0;
+    size_t deformer_count = 0;
+    size_t pose_count = 0;
+    auto root = lods.root();
+    {
+        StatsScope scope(stats, STATS_PHASE_NODES);
+        for (size_t i = 0; i < root->child_count; i++)
+        {
+            build_objects(objects, connections, export_data,
+                          &root->children[i], 0, next_id, materials,
+                          material_ids, instances, lods, cache, prepared,
+                          geometry_ids, model_ids, attribute_count, stats);
+        }
+        build_skins(objects, connections, instances, lods, skins,
+                    geometry_ids, model_ids, next_id, deformer_count,
+                    pose_count);
+        build_animation(objects, connections, animation, model_ids, next_id,
+                        curve_node_count, curve_count);
+    }
+    auto model_count = model_ids.size();
+    auto geometry_count = geometry_ids.size();
+    auto stack_count = animation.enabled() ? 1 : 0;
+    document.children.push_back(std::move(connections));
+
+    auto& takes = add_node(document, "Takes");
+    add_node(takes, "Current", prop_str(stack_count > 0 ? FBX_TAKE_NAME : ""));
+    if (stack_count > 0)
+    {
+        auto& take = add_node(takes, "Take", prop_str(FBX_TAKE_NAME));
+        add_node(take, "FileName", prop_str(std::string(FBX_TAKE_NAME) + ".tak"));
+        add_node(take, "LocalTime", prop_i64(animation.start_time()),
+                 prop_i64(animation.stop_time()));
+        add_node(take, "ReferenceTime", prop_i64(animation.start_time()),
+                 prop_i64(animation.stop_time()));
+    }
+
+    auto& definitions = document.children[definitions_index];
+    add_node(definitions, "Version", prop_i32(100));
+    add_node(definitions, "Count",
+             prop_i32(1 + (int32_t)(model_count + attribute_count +
+                                    geometry_count + materials.unique_count() +
+                                    deformer_count + pose_count +
+                                    stack_count * 2 + curve_node_count +
+                                    curve_count)));
+    auto add_definition = [&](const char* type, size_t count) {
+        if (count == 0) return;
+        auto& object_type = add_node(definitions, "ObjectType", prop_str(type));
+        add_node(object_type, "Count", prop_i32((int32_t)count));
+    };
+    add_definition("GlobalSettings", 1);
+    add_definition("Model", model_count);
+    add_definition("NodeAttribute", attribute_count);
+    add_definition("Geometry", geometry_count);
+    add_definition("Material", materials.unique_count());
+    add_definition("Deformer", deformer_count);
+    add_definition("Pose", pose_count);
+    add_definition("AnimationStack", stack_count);
+    add_definition("AnimationLayer", stack_count);
+    add_definition("AnimationCurveNode", curve_node_count);
+    add_definition("AnimationCurve", curve_count);
+}
+
+/// @brief ModelとGeometryを再帰的に構築する
+/// @param objects Objectsノード
+/// @param connections Connectionsノード
+/// @param export_data エクスポートデータ
+/// @param object オブジェクトデータ
+/// @param parent_id 親のID (ルートは0)
+/// @param next_id 次に割り当てるID
+/// @param materials 書き出すマテリアルの表
+/// @param material_ids 書き出すマテリアルのID
+/// @param instances 内容が同じメッシュの表
+/// @param lods 作ったLOD (グループはLodGroupのNodeAttributeを持つ)
+/// @param cache 書き出しキャッシュ
+/// @param prepared 変換済みのメッシュ
+/// @param geometry_ids 書き出し済みのGeometryのID
+/// @param model_ids 書き出したModelのIDの出力先
+/// @param attribute_count NodeAttributeの数
+/// @param stats 統計の記録先
+void build_objects(BinNode& objects, BinNode& connections,
+                   const IOData* export_data, const Object* object,
+                   int64_t parent_id, int64_t& next_id,
+                   const MaterialTable& materials,
+                   const std::vector<int64_t>& material_ids,
+                   const MeshInstances& instances, const MeshLods& lods,
+                   ExportCache& cache, const PreparedGeometries& prepared,
+                   std::unordered_map<const Mesh*, int64_t>& geometry_ids,
+                   std::unordered_map<const Object*, int64_t>& model_ids,
+                   size_t& attribute_count, StatsRecorder& stats)
+{
+    auto model_id = next_id++;
+    auto group = lods.is_group(object);
+    auto& model = add_node(objects, "Model", prop_i64(model_id),
+                           prop_str(class_name(object->name, "Model")),
+                           prop_str(group                     ? "LodGroup"
+                                    : object->mesh != nullptr ? "Mesh"
+                                                              : "Null"));
+    build_model(model, object, group || object->mesh != nullptr);
+    add_node(connections, "C", prop_str("OO"), prop_i64(model_id),
+             prop_i64(parent_id));
+    model_ids.emplace(object, model_id);
+
+    // LODグループの切り替えの閾値は書き出さず、読み込む側の既定に任せる
+    if (group)
+    {
+        auto attribute_id = next_id++;
+        auto& attribute =
+            add_node(objects, "NodeAttribute", prop_i64(attribute_id),
+                     prop_str(class_name(object->name, "NodeAttribute")),
+                     prop_str("LodGroup"));
+        add_node(attribute, "TypeFlags", prop_str("LodGroup"));
+        add_node(connections, "C", prop_str("OO"), prop_i64(attribute_id),
+                 prop_i64(model_id));
+        attribute_count++;
+    }
+
+    // メッシュ名はFBX SDKでの書き出しと同じく最初のオブジェクト名を使う
+    if (object->mesh != nullptr)
+    {
+        auto mesh = instances.canonical(object->mesh);
+        auto [found, inserted] = geometry_ids.emplace(mesh, 0);
+        if (inserted)
+        {
+            found->second = next_id++;
+            auto& geometry =
+                add_node(objects, "Geometry", prop_i64(found->second),
+                         prop_str(class_name(object->name, "Geometry")),
+                         prop_str("Mesh"));
+            if (!cache.take_geometry(mesh, geometry))
+            {
+                build_geometry(geometry, mesh, prepared.at(mesh),
+                               export_data->unit_scale, stats);
+            }
+        }
+        add_node(connections, "C", prop_str("OO"), prop_i64(found->second),
+                 prop_i64(model_id));
+    }
+
+    for (size_t i = 0; i < object->material_slot_count; i++)
+    {
+        auto index = materials.find(object->material_slots[i]);
+        if (index < 0) continue;
+        add_node(connections, "C", prop_str("OO"),
+                 prop_i64(material_ids[index]), prop_i64(model_id));
+    }
+
+    for (size_t i = 0; i < object->child_count; i++)
+    {
+        build_objects(objects, connections, export_data, &object->children[i],
+                      model_id, next_id, materials, material_ids, instances,
+                      lods, cache, prepared, geometry_ids, model_ids,
+                      attribute_count, stats);
+    }
+}
+
+/// @brief スキンとクラスタ、バインドポーズを構築する
+/// GeometryごとにSkinを作り、ボーンごとのClusterを接続する (頂点番号と重みの
+/// 配列はスキンの中をそのまま参照する)
+/// バインドポーズはボーンとスキンを持つModelのバインド時の行列を1つにまとめる
+/// @param objects Objectsノード
+/// @param connections Connectionsノード
+/// @param instances 内容が同じメッシュの表
+/// @param lods 作ったLOD (ボーンは書き出すツリーに写したものを引く)
+/// @param skins 変換したスキン (無ければ何も構築しない)
+/// @param geometry_ids 書き出したGeometryのID
+/// @param model_ids 書き出したModelのID
+/// @param next_id 次に割り当てるID
+/// @param deformer_count Deformer (SkinとCluster) の数の出力先
+/// @param pose_count Poseの数の出力先
+void build_skins(BinNode& objects, BinNode& connections,
+                 const MeshInstances& instances, const MeshLods& lods,
+                 const MeshSkins& skins,
+                 const std::unordered_map<const Mesh*, int64_t>& geometry_ids,
+                 const std::unordered_map<const Object*, int64_t>& model_ids,
+                 int64_t& next_id, size_t& deformer_count, size_t& pose_count)
+{
+    if (skins.meshes().empty()) return;
+
+    std::unordered_map<const Mesh*, std::vector<const Object*>> users;
+    auto root = lods.root();
+    for (size_t i = 0; i < root->child_count; i++)
+        collect_skinned_models(&root->children[i], instances, skins, users);
+
+    // ポーズのノードはModelごとに最初に現れた行列を使う
+    std::vector<std::pair<int64_t, const double*>> pose_nodes;
+    std::unordered_map<int64_t, size_t> posed;
+    auto add_pose_node = [&](int64_t model_id, const double* matrix) {
+        if (posed.emplace(model_id, pose_nodes.size()).second)
+            pose_nodes.emplace_back(model_id, matrix);
+    };
+
+    size_t missing_bones = 0;
+    for (auto mesh : skins.meshes())
+    {
+        auto geometry = geometry_ids.find(mesh);
+        auto models = users.find(mesh);
+        if (geometry == geometry_ids.end() || models == users.end()) continue;
+        auto skin = mesh->skin;
+        auto clusters = skins.find(mesh);
+
+        auto skin_id = next_id++;
+        auto& skin_node =
+            add_node(objects, "Deformer", prop_i64(skin_id),
+                     prop_str(class_name(models->second[0]->name, "Deformer")),
+                     prop_str("Skin"));
+        add_node(skin_node, "Version", prop_i32(101));
+        add_node(skin_node, "Link_DeformAcuracy", prop_f64(50.0));
+        add_node(connections, "C", prop_str("OO"), prop_i64(skin_id),
+                 prop_i64(geometry->second));
+        deformer_count++;
+
+        for (size_t b = 0; b < skin->bone_count; b++)
+        {
+            auto bone = skin->bones[b] != nullptr
+                            ? model_ids.find(lods.written(skin->bones[b]))
+                            : model_ids.end();
+            if (bone == model_ids.end())
+            {
+                missing_bones++;
+                continue;
+            }
+            auto begin = clusters->offsets[b];
+            auto count = clusters->offsets[b + 1] - begin;
+            auto cluster_id = next_id++;
+            auto& cluster = add_node(
+                objects, "Deformer", prop_i64(cluster_id),
+                prop_str(class_name(skin->bones[b]->name, "SubDeformer")),
+                prop_str("Cluster"));
+            add_node(cluster, "Version", prop_i32(100));
+            add_node(cluster, "UserData", prop_str(""), prop_str(""));
+            if (count > 0)
+            {
+                add_node(cluster, "Indexes",
+                         prop_array('i', count, &clusters->indices[begin]));
+                add_node(cluster, "Weights",
+                         prop_array('d', count, &clusters->weights[begin]));
+            }
+            add_node(cluster, "Transform",
+                     prop_array('d', 16, &clusters->transforms[b * 16],
+                                STATS_PHASE_NODES));
+            add_node(cluster, "TransformLink",
+                     prop_array('d', 16, &clusters->links[b * 16],
+                                STATS_PHASE_NODES));
+            add_node(connections, "C", prop_str("OO"), prop_i64(cluster_id),
+                     prop_i64(skin_id));
+            add_node(connections, "C", prop_str("OO"), prop_i64(bone->second),
+                     prop_i64(cluster_id));
+            add_pose_node(bone->second, &clusters->links[b * 16]);
+            deformer_count++;
+        }
+        for (auto model : models->second)
+            add_pose_node(model_ids.at(model), skin->mesh_bind_matrix);
+    }
+    if (missing_bones > 0)
+    {
+        std::cerr << missing_bones << " skin bones are not in the exported tree"
+                  << std::endl;
+    }
+    if (pose_nodes.empty()) return;
+
+    auto& pose = add_node(objects, "Pose", prop_i64(next_id++),
+                          prop_str(class_name("BindPose", "Pose")),
+                          prop_str("BindPose"));
+    add_node(pose, "Type", prop_str("BindPose"));
+    add_node(pose, "Version", prop_i32(100));
+    add_node(pose, "NbPoseNodes", prop_i32((int32_t)pose_nodes.size()));
+    for (auto& [model_id, matrix] : pose_nodes)
+    {
+        auto& node = add_node(pose, "PoseNode");
+        add_node(node, "Node", prop_i64(model_id));
+        add_node(node, "Matrix",
+                 prop_array('d', 16, matrix, STATS_PHASE_NODES));
+    }
+    pose_count++;
+}
+
+/// @brief スキンを持つメッシュを使うオブジェクトをツリーの順に集める
+/// @param object オブジェクト
+/// @param instances 内容が同じメッシュの表
+/// @param skins 変換したスキン
+/// @param out 書き出すメッシュごとのオブジェクトの出力先
+void collect_skinned_models(
+    const Object* object, const MeshInstances& instances,
+    const MeshSkins& skins,
+    std::unordered_map<const Mesh*, std::vector<const Object*>>& out)
+{
+    if (object->mesh != nullptr)
+    {
+        auto mesh = instances.canonical(object->mesh);
+        if (skins.find(mesh) != nullptr) out[mesh].push_back(object);
+    }
+    for (size_t i = 0; i < object->child_count; i++)
+        collect_skinned_models(&object->children[i], instances, skins, out);
+}
+
+/// @brief アニメーションのスタック・レイヤーとカーブを構築する
+/// Modelのプロパティごとに3成分のAnimationCurveNodeを作り、成分ごとの
+/// AnimationCurveを接続する (キーの配列はアニメーションの中をそのまま参照する)
+/// @param objects Objectsノード
+/// @param connections Connectionsノード
+/// @param animation ベイクしたアニメーション (無ければ何も構築しない)
+/// @param model_ids 書き出したModelのID
+/// @param next_id 次に割り当てるID
+/// @param curve_node_count AnimationCurveNodeの数の出力先
+/// @param curve_count AnimationCurveの数の出力先
+void build_animation(BinNode& objects, BinNode& connections,
+                     const SceneAnimation& animation,
+                     const std::unordered_map<const Object*, int64_t>& model_ids,
+                     int64_t& next_id, size_t& curve_node_count,
+                     size_t& curve_count)
+{
+    if (!animation.enabled()) return;
+
+    auto stack_id = next_id++;
+    auto& stack =
+        add_node(objects, "AnimationStack", prop_i64(stack_id),
+                 prop_str(class_name(FBX_TAKE_NAME, "AnimStack")), prop_str(""));
+    auto& stack_props = add_node(stack, "Properties70");
+    add_p(stack_props, "LocalStart", "KTime", "Time", "",
+          animation.start_time());
+    add_p(stack_props, "LocalStop", "KTime", "Time", "", animation.stop_time());
+    add_p(stack_props, "ReferenceStart", "KTime", "Time", "",
+          animation.start_time());
+    add_p(stack_props, "ReferenceStop", "KTime", "Time", "",
+          animation.stop_time());
+
+    auto layer_id = next_id++;
+    add_node(objects, "AnimationLayer", prop_i64(layer_id),
+             prop_str(class_name("BaseLayer", "AnimLayer")), prop_str(""));
+    add_node(connections, "C", prop_str("OO"), prop_i64(layer_id),
+             prop_i64(stack_id));
+
+    for (auto& object_animation : animation.objects())
+    {
+        auto model_id = model_ids.at(object_animation.object);
+        for (auto i = 0; i < 3; i++)
+        {
+            auto curves = &object_animation.curves[i * 3];
+            auto node_id = next_id++;
+            auto& curve_node = add_node(
+                objects, "AnimationCurveNode", prop_i64(node_id),
+                prop_str(class_name(FBX_CURVE_NODE_NAMES[i], "AnimCurveNode")),
+                prop_str(""));
+            auto& props70 = add_node(curve_node, "Properties70");
+            for (auto j = 0; j < 3; j++)
+            {
+                add_p(props70, FBX_CURVE_CHANNELS[j], "Number", "", "A",
+                      (double)curves[j].values[0]);
+            }
+            add_node(connections, "C", prop_str("OO"), prop_i64(node_id),
+                     prop_i64(layer_id));
+            add_node(connections, "C", prop_str("OP"), prop_i64(node_id),
+                     prop_i64(model_id),
+                     prop_str(FBX_CURVE_NODE_PROPERTIES[i]));
+            curve_node_count++;
+
+            for (auto j = 0; j < 3; j++)
+            {
+                auto curve_id = next_id++;
+                auto& curve =
+                    add_node(objects, "AnimationCurve", prop_i64(curve_id),
+                             prop_str(class_name("", "AnimCurve")),
+                             prop_str(""));
+                build_curve(curve, curves[j]);
+                add_node(connections, "C", prop_str("OP"), prop_i64(curve_id),
+                         prop_i64(node_id), prop_str(FBX_CURVE_CHANNELS[j]));
+                curve_count++;
+            }
+        }
+    }
+}
+
+/// @brief AnimationCurveノードの中身を構築する (全てのキーを直線補間にする)
+/// @param curve AnimationCurveノード
+/// @param input カーブ (キーは1つ以上)
+void build_curve(BinNode& curve, const AnimationCurve& input)
+{
+    auto key_count = input.times.size();
+    add_node(curve, "Default", prop_f64(input.values[0]));
+    add_node(curve, "KeyVer", prop_i32(4009));
+    add_node(curve, "KeyTime",
+             prop_array('l', key_count, input.times.data(), STATS_PHASE_NODES));
+    add_node(curve, "KeyValueFloat",
+             prop_array('f', key_count, input.values.data(),
+                        STATS_PHASE_NODES));
+    add_node(curve, "KeyAttrFlags",
+             prop_array('i', 1, FBX_KEY_ATTR_FLAGS, STATS_PHASE_NODES));
+    add_node(curve, "KeyAttrDataFloat",
+             prop_array('f', 4, FBX_KEY_ATTR_DATA, STATS_PHASE_NODES));
+    add_node(curve, "KeyAttrRefCount",
+             prop_array(
+                 'i', 1, 1,
+                 [key_count](size_t, size_t, void* out) {
+                     *(int32_t*)out = (int32_t)key_count;
+                 },
+                 STATS_PHASE_NODES));
+}
+
+/// @brief Modelノードの中身を構築する
+/// @param model Modelノード
+/// @param object オブジェクトデータ
+/// @param has_attribute メッシュかLODグループの属性を持つかどうか
+void build_model(BinNode& model, const Object* object, bool has_attribute)
+{
+    double t[3], r[3], s[3];
+    decompose_matrix(object->matrix_local, t, r, s);
+
+    add_node(model, "Version", prop_i32(232));
+    auto& props70 = add_node(model, "Properties70");
+    add_p(props70, "Lcl Translation", "Lcl Translation", "", "A", t[0], t[1],
+          t[2]);
+    add_p(props70, "Lcl Rotation", "Lcl Rotation", "", "A", r[0], r[1], r[2]);
+    add_p(props70, "Lcl Scaling", "Lcl Scaling", "", "A", s[0], s[1], s[2]);
+    add_p(props70, "DefaultAttributeIndex", "int", "Integer", "",
+          has_attribute ? 0 : -1);
+    add_node(model, "MultiLayer", prop_i32(0));
+    add_node(model, "MultiTake", prop_i32(0));
+    add_node(model, "Shading", prop_bool(true));
+    add_node(model, "Culling", prop_str("CullingOff"));
+}
+
+/// @brief Geometryノードの中身を構築する
+/// @param geometry Geometryノード
+/// @param mesh メッシュデータ
+/// @param prepared 変換済みのメッシュ (配列の変換で参照するので書き出しまで保持する)
+/// @param unit_scale 単位
+/// @param stats 統計の記録先 (ノードツリーの構築中に呼び出される)
+void build_geometry(BinNode& geometry, const Mesh* mesh,
+                    const std::shared_ptr<const PreparedGeometry>& prepared,
+                    double unit_scale, StatsRecorder& stats)
+{
+    StatsScope mesh_scope(stats, STATS_PHASE_MESHES, STATS_PHASE_NODES);
+
+    add_node(geometry, "GeometryVersion", prop_i32(124));
+
+    // 頂点座標はZ-up to Y-upとセンチメートルへの変換をしながら書き出す
+    std::array<double, 16> m;
+    axis_conversion_matrix(unit_scale * 100.0, true, m.data());
+    auto vertices = mesh->vertices;
+    auto scalar_type = mesh->scalar_type;
+    add_node(geometry, "Vertices",
+             prop_array('d', mesh->vertex_count, 3,
+                        [=](size_t first, size_t count, void* out) {
+                            if (scalar_type == SCALAR_FLOAT32)
+                                transform_points_packed(
+                                    m.data(), (const float*)vertices + first * 3,
+                                    (double*)out, count);
+                            else
+                                transform_points_packed(m.data(),
+                                                        vertices + first,
+                                                        (double*)out, count);
+                        }));
+
+    // 各ポリゴンの最後の頂点インデックスはビット反転して書き出す
+    // 並べ替えた場合はポリゴン頂点を出力順に読む (ポリゴンの大きさは変わらない)
+    auto& layout = prepared->layout;
+    auto order = layout.reordered() ? layout.corner_order.data() : nullptr;
+    auto indices = mesh->indices;
+    auto polys = layout.reordered() ? layout.polys.data() : mesh->polys;
+    auto poly_count = mesh->poly_count;
+    auto index_count = mesh->index_count;
+    auto uniform_size = uniform_polygon_size(mesh);
+    add_node(geometry, "PolygonVertexIndex",
+             prop_array('i', index_count, 1,
+                        [=](size_t first, size_t count, void* out) {
+                            (void)prepared;
+                            auto dst = (int32_t*)out;
+                            auto corner = [=](size_t j) {
+                                return order != nullptr ? order[j] : j;
+                            };
+                            if (uniform_size != 0)
+                            {
+                                // 三角形か四角形のみなら一定間隔で反転する
+                                for (auto j = first; j < first + count; j++)
+                                {
+                                    auto index = (int32_t)indices[corner(j)];
+                                    *dst++ = (j + 1) % uniform_size == 0
+                                                 ? ~index
+                                                 : index;
+                                }
+                                return;
+                            }
+                            auto next = std::upper_bound(polys,
+                                                         polys + poly_count,
+                                                         first) -
+                                        polys;
+                            auto next_start = next < (ptrdiff_t)poly_count
+                                                  ? polys[next]
+                                                  : index_count;
+                            for (auto j = first; j < first + count; j++)
+                            {
+                                auto index = (int32_t)indices[corner(j)];
+                                if (j + 1 != next_start)
+                                {
+                                    *dst++ = index;
+                                    continue;
+                                }
+                                *dst++ = ~index;
+                                while (next < (ptrdiff_t)poly_count &&
+                                       polys[next] <= j + 1)
+                                    next++;
+                                next_start = next < (ptrdiff_t)poly_count
+                                                 ? polys[next]
+                                                 : index_count;
+                            }
+                        }));
+
+    // 頂点法線の設定 (スムーズで法線が渡されていない場合は計算済みのものを使う)
+    // 共有した場合は値を最初に現れたポリゴン頂点から読み、インデックスを添える
+    std::vector<Normal> normal_sets(mesh->normal_sets,
+                                    mesh->normal_sets + mesh->normal_set_count);
+    if (prepared->has_smooth)
+    {
+        Normal smooth = {};
+        smooth.name = (char*)"Normal";
+        smooth.normal = (Vector4*)prepared->smooth_normals.data();
+        normal_sets.push_back(smooth);
+    }
+    size_t normal_count = normal_sets.size();
+    for (size_t i = 0; i < normal_count; i++)
+    {
+        auto normals = normal_sets[i].normal;
+        // 計算した法線は常にdouble
+        auto normal_type =
+            i < mesh->normal_set_count ? scalar_type : SCALAR_FLOAT64;
+        auto welded = layout.welded() ? &layout.normals[i] : nullptr;
+        auto gather = welded != nullptr ? welded->values.data() : order;
+        auto value_count =
+            welded != nullptr ? welded->values.size() : index_count;
+        auto& elnrm = add_node(geometry, "LayerElementNormal", prop_i32(i));
+        add_node(elnrm, "Version", prop_i32(101));
+        add_node(elnrm, "Name",
+                 prop_str(normal_sets[i].name != nullptr ? normal_sets[i].name
+                                                         : ""));
+        add_node(elnrm, "MappingInformationType", prop_str("ByPolygonVertex"));
+        add_node(elnrm, "ReferenceInformationType",
+                 prop_str(welded != nullptr ? "IndexToDirect" : "Direct"));
+        add_node(elnrm, "Normals",
+                 prop_array('d', value_count, 3,
+                            [=](size_t first, size_t count, void* out) {
+                                (void)prepared;
+                                visit_points(normal_type, normals,
+                                             [&](auto view) {
+                                                 if (gather != nullptr)
+                                                     gather_packed<3>(
+                                                         view, gather + first,
+                                                         count, (double*)out);
+                                                 else
+                                                     widen_packed<3>(
+                                                         view, first, count,
+                                                         (double*)out);
+                                             });
+                            },
+                            STATS_PHASE_LAYERS));
+        if (welded != nullptr)
+        {
+            add_node(elnrm, "NormalsIndex",
+                     prop_array('i', index_count, welded->index.data(),
+                                STATS_PHASE_LAYERS));
+        }
+    }
+
+    // UVはVector2の配列がそのままFBXの形式と一致する (floatなら広げる)
+    for (size_t i = 0; i < mesh->uv_set_count; i++)
+    {
+        auto uvs = mesh->uv_sets[i].uv;
+        auto welded = layout.welded() ? &layout.uvs[i] : nullptr;
+        auto gather = welded != nullptr ? welded->values.data() : order;
+        auto value_count =
+            welded != nullptr ? welded->values.size() : index_count;
+        auto& eluv = add_node(geometry, "LayerElementUV", prop_i32(i));
+        add_node(eluv, "Version", prop_i32(101));
+        add_node(eluv, "Name",
+                 prop_str(mesh->uv_sets[i].name != nullptr
+                              ? mesh->uv_sets[i].name
+                              : ""));
+        add_node(eluv, "MappingInformationType", prop_str("ByPolygonVertex"));
+        add_node(eluv, "ReferenceInformationType",
+                 prop_str(welded != nullptr ? "IndexToDirect" : "Direct"));
+        if (scalar_type != SCALAR_FLOAT32 && gather == nullptr)
+        {
+            add_node(eluv, "UV", prop_array('d', index_count * 2, uvs,
+                                            STATS_PHASE_LAYERS));
+            continue;
+        }
+        add_node(eluv, "UV",
+                 prop_array('d', value_count, 2,
+                            [=](size_t first, size_t count, void* out) {
+                                (void)prepared;
+                                visit_uvs(scalar_type, uvs, [&](auto view) {
+                                    if (gather != nullptr)
+                                        gather_packed<2>(view, gather + first,
+                                                         count, (double*)out);
+                                    else
+                                        widen_packed<2>(view, first, count,
+                                                        (double*)out);
+                                });
+                            },
+                            STATS_PHASE_LAYERS));
+        if (welded != nullptr)
+        {
+            add_node(eluv, "UVIndex",
+                     prop_array('i', index_count, welded->index.data(),
+                                STATS_PHASE_LAYERS));
+        }
+    }
+
+    if (mesh->material_indices != nullptr)
+    {
+        auto& elmat = add_node(geometry, "LayerElementMaterial", prop_i32(0));
+        add_node(elmat, "Version", prop_i32(101));
+        add_node(elmat, "Name", prop_str(""));
+        add_node(elmat, "MappingInformationType", prop_str("ByPolygon"));
+        add_node(elmat, "ReferenceInformationType", prop_str("IndexToDirect"));
+        if (!layout.reordered())
+        {
+            add_node(elmat, "Materials",
+                     prop_array('i', poly_count, mesh->material_indices,
+                                STATS_PHASE_LAYERS));
+        }
+        else
+        {
+            auto material_indices = mesh->material_indices;
+            auto poly_order = layout.poly_order.data();
+            add_node(elmat, "Materials",
+                     prop_array('i', poly_count, 1,
+                                [=](size_t first, size_t count, void* out) {
+                                    (void)prepared;
+                                    auto dst = (int32_t*)out;
+                                    for (auto j = first; j < first + count; j++)
+                                        *dst++ = (int32_t)material_indices
+                                            [poly_order[j]];
+                                },
+                                STATS_PHASE_LAYERS));
+        }
+    }
+
+    // レイヤーn にはn番目の法線とUV (とレイヤー0にはマテリアル) をまとめる
+    auto layer_count = std::max<size_t>(
+        {normal_count, mesh->uv_set_count,
+         mesh->material_indices != nullptr ? (size_t)1 : 0});
+    for (size_t i = 0; i < layer_count; i++)
+    {
+        auto& layer = add_node(geometry, "Layer", prop_i32(i));
+        add_node(layer, "Version", prop_i32(100));
+        auto add_element = [&](const char* type) {
+            auto& element = add_node(layer, "LayerElement");
+            add_node(element, "Type", prop_str(type));
+            add_node(element, "TypedIndex", prop_i32(i));
+        };
+        if (i < normal_count) add_element("LayerElementNormal");
+        if (i == 0 && mesh->material_indices != nullptr)
+            add_element("LayerElementMaterial");
+        if (i < mesh->uv_set_count) add_element("LayerElementUV");
+    }
+}
+
+/// @brief Materialノードの中身を構築する (FBX SDKでの書き出しと同じくLambert)
+/// @param material Materialノード
+/// @param input マテリアルのデータ
+void build_material(BinNode& material, const Material& input)
+{
+    auto& surface = input.standard_surface;
+    add_node(material, "Version", prop_i32(102));
+    add_node(material, "ShadingModel", prop_str("lambert"));
+    add_node(material, "MultiLayer", prop_i32(0));
+    auto& props70 = add_node(material, "Properties70");
+    add_p(props70, "AmbientColor", "Color", "", "A", surface.base_color.x,
+          surface.base_color.y, surface.base_color.z);
+    add_p(props70, "DiffuseColor", "Color", "", "A", surface.base_color.x,
+          surface.base_color.y, surface.base_color.z);
+    add_p(props70, "TransparencyFactor", "Number", "", "A",
+          1.0 - surface.opacity);
+    add_p(props70, "EmissiveColor", "Color", "", "A", surface.emission_color.x,
+          surface.emission_color.y, surface.emission_color.z);
+}
+
+/// @brief 配列の1要素のバイト数
+/// @param type 配列の型 (b, i, l, f, d)
+size_t array_element_size(char type)
+{
+    switch (type)
+    {
+    case 'b': return 1;
+    case 'i':
+    case 'f': return 4;
+    default: return 8;
+    }
+}
+
+size_t property_size(const BinProperty& prop)
+{
+    switch (prop.type)
+    {
+    case 'Y': return 1 + 2;
+    case 'C': return 1 + 1;
+    case 'I':
+    case 'F': return 1 + 4;
+    case 'D':
+    case 'L': return 1 + 8;
+    case 'S':
+    case 'R': return 1 + 4 + prop.s.size();
+    default:
+        if (!prop.compressed.empty()) return 1 + 12 + prop.compressed.size();
+        return 1 + 12 + prop.count * array_element_size(prop.type);
+    }
+}
+
+/// @brief 閾値以上の配列をzlibで圧縮する (結果は各プロパティに持たせる)
+/// 全ての配列を塊に分けて並列に圧縮し、小さくならなかった配列は無圧縮のままにする
+/// @param document ルートノード
+/// @param export_data エクスポートするデータ (圧縮の設定)
+/// @param monitor 進捗の報告先
+/// @param stats 統計の記録先
+/// @return 圧縮できたかどうか (中断を要求された場合もfalse)
+bool compress_document(BinNode& document, const IOData* export_data,
+                       ExportMonitor& monitor, StatsRecorder& stats)
+{
+    if (export_data->array_compression == ARRAY_COMPRESSION_STORE) return true;
+    auto level = resolve_compression_level(export_data);
+    auto threshold = resolve_compression_threshold(export_data);
+
+    std::vector<BinProperty*> props;
+    collect_compressible(document, threshold, props);
+    std::vector<DeflateSource> sources(props.size());
+    size_t chunk_count = 0;
+    for (size_t i = 0; i < props.size(); i++)
+    {
+        auto& prop = *props[i];
+        auto& source = sources[i];
+        source.item_size = array_element_size(prop.type) * prop.stride;
+        source.item_count = prop.count / prop.stride;
+        source.read_phase = prop.phase;
+        if (prop.data != nullptr)
+        {
+            auto data = (const uint8_t*)prop.data;
+            auto item_size = source.item_size;
+            source.read = [=](size_t first, size_t count, void* out) {
+                std::memcpy(out, data + first * item_size, count * item_size);
+            };
+        }
+        else
+        {
+            source.read = prop.fill;
+        }
+        chunk_count += deflate_chunk_count(source);
+    }
+
+    monitor.begin_phase(EXPORT_PHASE_BUILDING, chunk_count);
+    std::vector<std::vector<uint8_t>> compressed;
+    if (!deflate_arrays(sources, level, compressed, monitor, stats))
+        return false;
+    for (size_t i = 0; i < props.size(); i++)
+    {
+        auto raw_size = props[i]->count * array_element_size(props[i]->type);
+        if (compressed[i].size() < raw_size)
+            props[i]->compressed = std::move(compressed[i]);
+    }
+    return true;
+}
+
+/// @brief 圧縮する配列を集める (キャッシュから読み込んだものは除く)
+/// @param node ノード
+/// @param threshold 圧縮する配列の最小のバイト数
+/// @param props 出力先
+void collect_compressible(BinNode& node, size_t threshold,
+                          std::vector<BinProperty*>& props)
+{
+    for (auto& prop : node.props)
+    {
+        if (std::string_view("bilfd").find(prop.type) == std::string_view::npos)
+            continue;
+        if (!prop.compressed.empty() || prop.owned) continue;
+        if (prop.count * array_element_size(prop.type) >= threshold)
+            props.push_back(&prop);
+    }
+    for (auto& child : node.children)
+        collect_compressible(child, threshold, props);
+}
+
+/// @brief プロパティの要素数とバイト数が32bitのヘッダに収まるかどうか
+/// (7.5形式でもプロパティのヘッダは32bitのまま、圧縮後に確かめる)
+/// @param node ノード
+/// @return 全てのプロパティが収まるかどうか
+bool fits_property_headers(const BinNode& node)
+{
+    for (auto& prop : node.props)
+    {
+        if (prop.type == 'S' || prop.type == 'R')
+        {
+            if (prop.s.size() > UINT32_MAX) return false;
+            continue;
+        }
+        if (std::string_view("bilfd").find(prop.type) == std::string_view::npos)
+            continue;
+        auto bytes = prop.compressed.empty()
+                         ? (uint64_t)prop.count * array_element_size(prop.type)
+                         : (uint64_t)prop.compressed.size();
+        if (prop.count > UINT32_MAX || bytes > UINT32_MAX) return false;
+    }
+    for (auto& child : node.children)
+        if (!fits_property_headers(child)) return false;
+    return true;
+}
+
+/// @brief ヘッダのFBXVersionを書き換える
+/// @param document ルートノード
+/// @param version FBXのバージョン
+void set_document_version(BinNode& document, uint32_t version)
+{
+    for (auto& node : document.children)
+    {
+        if (node.name != "FBXHeaderExtension") continue;
+        for (auto& child : node.children)
+        {
+            if (child.name == "FBXVersion") child.props[0].i = version;
+        }
+    }
+}
+
+/// @brief ノードのバイト数を計算する
+/// @param node ノード (名前が空の場合はトップレベルのリスト)
+/// @param version FBXのバージョン
+/// @return ノード全体のバイト数
+uint64_t compute_size(BinNode& node, uint32_t version)
+{
+    auto is_64 = version >= FBX_BINARY_VERSION_64;
+    uint64_t sentinel = is_64 ? 25 : 13;
+    uint64_t size = 0;
+    if (!node.name.empty())
+    {
+        size += (is_64 ? 24 : 12) + 1 + node.name.size();
+        for (auto& prop : node.props) size += property_size(prop);
+    }
+    for (auto& child : node.children) size += compute_size(child, version);
+    if (!node.children.empty() || node.props.empty()) size += sentinel;
+    node.size = size;
+    return size;
+}
+
+/// @brief バッファの中身をファイルに書き出し、進捗を報告する
+/// @param writer 書き出し先
+void flush_buffer(BinWriter& writer)
+{
+    if (writer.cancelled) return;
+    writer.stream.write(writer.buffer.data(), writer.used);
+    writer.used = 0;
+    writer.monitor->set_bytes(writer.offset,
+                              std::max(writer.total, writer.offset));
+    if (writer.monitor->cancelled()) writer.cancelled = true;
+}
+
+void write_bytes(BinWriter& writer, const void* data, size_t size)
+{
+    if (writer.cancelled) return;
+    if (writer.used + size > writer.buffer.size())
+    {
+        flush_buffer(writer);
+        if (writer.cancelled) return;
+        if (size >= writer.buffer.size())
+        {
+            writer.stream.write((const char*)data, size);
+            writer.offset += size;
+            return;
+        }
+    }
+    std::memcpy(writer.buffer.data() + writer.used, data, size);
+    writer.used += size;
+    writer.offset += size;
+}
+
+template <typename T> void write_value(BinWriter& writer, T value)
+{
+    write_bytes(writer, &value, sizeof(T));
+}
+
+void write_property(BinWriter& writer, const BinProperty& prop)
+{
+    write_value(writer, prop.type);
+    switch (prop.type)
+    {
+    case 'Y': write_value(writer, (int16_t)prop.i); break;
+    case 'C': write_value(writer, (uint8_t)(prop.i != 0)); break;
+    case 'I': write_value(writer, (int32_t)prop.i); break;
+    case 'F': write_value(writer, (float)prop.d); break;
+    case 'D': write_value(writer, prop.d); break;
+    case 'L': write_value(writer, prop.i); break;
+    case 'S':
+    case 'R':
+        write_value(writer, (uint32_t)prop.s.size());
+        write_bytes(writer, prop.s.data(), prop.s.size());
+        break;
+    default: {
+        auto element_size = array_element_size(prop.type);
+        write_value(writer, (uint32_t)prop.count);
+        if (!prop.compressed.empty())
+        {
+            write_value(writer, (uint32_t)1); // zlib
+            write_value(writer, (uint32_t)prop.compressed.size());
+            write_bytes(writer, prop.compressed.data(), prop.compressed.size());
+            break;
+        }
+        write_value(writer, (uint32_t)0); // 無圧縮
+        write_value(writer, (uint32_t)(prop.count * element_size));
+        if (prop.data != nullptr)
+        {
+            write_bytes(writer, prop.data, prop.count * element_size);
+            break;
+        }
+
+        // 変換が必要な配列は一定の項目数ずつ変換して書き出す
+        auto item_size = element_size * prop.stride;
+        auto item_count = prop.count / prop.stride;
+        std::vector<uint8_t> chunk(FILL_CHUNK_SIZE * item_size);
+        writer.stats->track_allocation(chunk.size());
+        for (size_t first = 0; first < item_count && !writer.cancelled;
+             first += FILL_CHUNK_SIZE)
+        {
+            auto count = std::min(FILL_CHUNK_SIZE, item_count - first);
+            {
+                StatsScope scope(*writer.stats, prop.phase,
+                                 STATS_PHASE_SERIALIZE);
+                prop.fill(first, count, chunk.data());
+            }
+            write_bytes(writer, chunk.data(), count * item_size);
+        }
+        writer.stats->track_allocation(-(int64_t)chunk.size());
+        break;
+    }
+    }
+}
+
+/// @brief ノードを書き出す
+/// @param writer 書き出し先
+/// @param node ノード
+/// @param version FBXのバージョン
+void write_node(BinWriter& writer, const BinNode& node, uint32_t version)
+{
+    auto is_64 = version >= FBX_BINARY_VERSION_64;
+    if (node.name.empty())
+    {
+        // ファイル先頭のヘッダとトップレベルのノードのリスト
+        write_bytes(writer, FBX_HEADER_MAGIC, sizeof(FBX_HEADER_MAGIC) - 1);
+        write_value(writer, version);
+    }
+    else
+    {
+        auto end_offset = writer.offset + node.size;
+        uint64_t props_size = 0;
+        for (auto& prop : node.props) props_size += property_size(prop);
+        if (is_64)
+        {
+            write_value(writer, end_offset);
+            write_value(writer, (uint64_t)node.props.size());
+            write_value(writer, props_size);
+        }
+        else
+        {
+            write_value(writer, (uint32_t)end_offset);
+            write_value(writer, (uint32_t)node.props.size());
+            write_value(writer, (uint32_t)props_size);
+        }
+        write_value(writer, (uint8_t)node.name.size());
+        write_bytes(writer, node.name.data(), node.name.size());
+        for (auto& prop : node.props) write_property(writer, prop);
+    }
+
+    for (auto& child : node.children) write_node(writer, child, version);
+    if (!node.children.empty() || node.props.empty())
+    {
+        const uint8_t sentinel[25] = {};
+        write_bytes(writer, sentinel, is_64 ? 25 : 13);
+    }
+}
+
+/// @brief フッタを書き出す
+/// @param writer 書き出し先
+/// @param version FBXのバージョン
+void write_footer(BinWriter& writer, uint32_t version)
+{
+    const uint8_t zeros[120] = {};
+    write_bytes(writer, FBX_FOOTER_ID, sizeof(FBX_FOOTER_ID));
+    write_bytes(writer, zeros, 4);
+    auto pad = ((writer.offset + 15) & ~(uint64_t)15) - writer.offset;
+    if (pad == 0) pad = 16;
+    write_bytes(writer, zeros, pad);
+    write_value(writer, version);
+    write_bytes(writer, zeros, 120);
+    write_bytes(writer, FBX_FOOTER_MAGIC, sizeof(FBX_FOOTER_MAGIC));
+}
+
+/// @brief FbxAMatrixと同じ並びの行列を移動・回転 (XYZオイラー角, 度)・拡縮に分解する
+/// @param m 行列 (16要素、移動成分は12-14番目)
+/// @param t 移動の出力先
+/// @param r 回転の出力先
+/// @param s 拡縮の出力先
+void decompose_matrix(const double* m, double* t, double* r, double* s)
+{
+    t[0] = m[12];
+    t[1] = m[13];
+    t[2] = m[14];
+
+    double rows[3][3];
+    auto det = m[0] * (m[5] * m[10] - m[6] * m[9]) -
+               m[1] * (m[4] * m[10] - m[6] * m[8]) +
+               m[2] * (m[4] * m[9] - m[5] * m[8]);
+    auto sign = det < 0 ? -1.0 : 1.0;
+    for (auto i = 0; i < 3; i++)
+    {
+        auto row = &m[i * 4];
+        s[i] = sign * std::sqrt(row[0] * row[0] + row[1] * row[1] +
+                                row[2] * row[2]);
+        for (auto j = 0; j < 3; j++)
+            rows[i][j] = s[i] != 0.0 ? row[j] / s[i] : 0.0;
+    }
+
+    const auto to_deg = 180.0 / 3.14159265358979323846;
+    auto sy = std::clamp(-rows[0][2], -1.0, 1.0);
+    r[1] = std::asin(sy) * to_deg;
+    if (std::sqrt(1.0 - sy * sy) > 1e-6)
+    {
+        r[0] = std::atan2(rows[1][2], rows[2][2]) * to_deg;
+        r[2] = std::atan2(rows[0][1], rows[0][0]) * to_deg;
+    }
+    else
+    {
+        r[0] = std::atan2(-rows[2][1], rows[1][1]) * to_deg;
+        r[2] = 0.0;
+    }
+}
@@ -0,0 +1,468 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "geometry_kernels.h"
+#include "parallel.h"
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#ifdef HALFBX_X86_64
+    #include <emmintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#endif
+
+// この要素数より多い配列は分割して並列に変換する
+const size_t KERNEL_CHUNK_SIZE = 1 << 16;
+
+SimdLevel detect_simd_level();
+
+std::atomic<SimdLevel>& current_simd_level()
+{
+    static std::atomic<SimdLevel> level = detect_simd_level();
+    return level;
+}
+
+/// @brief 実行中のCPUで使える命令セットを調べる
+/// @return 使える中で最も新しい命令セット
+SimdLevel detect_simd_level()
+{
+#ifdef HALFBX_X86_64
+    #ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    auto has_fma = (info[2] & (1 << 12)) != 0;
+    auto has_osxsave = (info[2] & (1 << 27)) != 0;
+    auto has_ymm = has_osxsave && (_xgetbv(0) & 0x6) == 0x6;
+    __cpuidex(info, 7, 0);
+    auto has_avx2 = (info[1] & (1 << 5)) != 0;
+    if (has_avx2 && has_fma && has_ymm) return SimdLevel::AVX2;
+    #else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SimdLevel::AVX2;
+    #endif
+    return SimdLevel::SSE2;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+SimdLevel simd_level() { return current_simd_level(); }
+
+/// @brief 使用する命令セットを変更する (比較用、CPUが対応していない場合は無視)
+/// @param level 命令セット
+void set_simd_level(SimdLevel level)
+{
+    if (level <= detect_simd_level()) current_simd_level() = level;
+}
+
+const char* simd_level_name(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::AVX2: return "avx2";
+    case SimdLevel::SSE2: return "sse2";
+    default: return "scalar";
+    }
+}
+
+const GeometryKernels& kernels()
+{
+    switch (simd_level())
+    {
+#ifdef HALFBX_X86_64
+    case SimdLevel::AVX2: return avx2_kernels;
+    case SimdLevel::SSE2: return sse2_kernels;
+#endif
+    default: return scalar_kernels;
+    }
+}
+
+/// @brief Z-up/Y-up の変換と拡大縮小をする行列を作る
+/// @param scale 変換後の長さの倍率 (法線なら1.0)
+/// @param to_y_up trueならBlender (Z-up) からFBX (Y-up) へ、falseなら逆
+/// @param m 行列の出力先
+void axis_conversion_matrix(double scale, bool to_y_up, double* m)
+{
+    for (auto i = 0; i < 16; i++) m[i] = 0.0;
+    m[15] = 1.0;
+
+    // Z-up to Y-up: (x, y, z) -> (x, z, -y), Y-up to Z-up: (x, y, z) -> (x, -z, y)
+    m[0] = scale;
+    m[6] = to_y_up ? -scale : scale;
+    m[9] = to_y_up ? scale : -scale;
+}
+
+/// @brief 法線用の行列 (3x3部分の逆転置) を作る
+/// @param m 頂点用の行列
+/// @param out 法線用の行列の出力先 (移動成分は0)
+void normal_matrix(const double* m, double* out)
+{
+    auto a = [&](int r, int c) { return m[r * 4 + c]; };
+    double cof[3][3];
+    for (auto r = 0; r < 3; r++)
+    {
+        for (auto c = 0; c < 3; c++)
+        {
+            auto r1 = (r + 1) % 3, r2 = (r + 2) % 3;
+            auto c1 = (c + 1) % 3, c2 = (c + 2) % 3;
+            cof[r][c] = a(r1, c1) * a(r2, c2) - a(r1, c2) * a(r2, c1);
+        }
+    }
+    auto det = a(0, 0) * cof[0][0] + a(0, 1) * cof[0][1] + a(0, 2) * cof[0][2];
+    auto inv_det = det != 0.0 ? 1.0 / det : 0.0;
+
+    // 逆行列の転置は余因子行列を行列式で割ったもの
+    for (auto i = 0; i < 16; i++) out[i] = 0.0;
+    out[15] = 1.0;
+    for (auto r = 0; r < 3; r++)
+        for (auto c = 0; c < 3; c++) out[r * 4 + c] = cof[r][c] * inv_det;
+}
+
+/// @brief 頂点を変換する (inとoutは同じ配列でもよい)
+/// @param m 行列
+/// @param in 変換元
+/// @param out 変換先 (wは変換元のまま)
+/// @param count 頂点数
+void transform_points(const double* m, const Vector4* in, Vector4* out,
+                      size_t count)
+{
+    auto& k = kernels();
+    parallel_for((count + KERNEL_CHUNK_SIZE - 1) / KERNEL_CHUNK_SIZE,
+                 [&](size_t chunk) {
+                     auto first = chunk * KERNEL_CHUNK_SIZE;
+                     auto n = std::min(KERNEL_CHUNK_SIZE, count - first);
+                     k.points(m, in + first, out + first, n);
+                 },
+                 1);
+}
+
+/// @brief 頂点を変換し、xyzを詰めて書き出す
+/// @param m 行列
+/// @param in 変換元
+/// @param out 変換先 (count * 3要素)
+/// @param count 頂点数
+void transform_points_packed(const double* m, const Vector4* in, double* out,
+                             size_t count)
+{
+    auto& k = kernels();
+    parallel_for((count + KERNEL_CHUNK_SIZE - 1) / KERNEL_CHUNK_SIZE,
+                 [&](size_t chunk) {
+                     auto first = chunk * KERNEL_CHUNK_SIZE;
+                     auto n = std::min(KERNEL_CHUNK_SIZE, count - first);
+                     k.points_packed(m, in + first, out + first * 3, n);
+                 },
+                 1);
+}
+
+/// @brief 法線を変換する (inとoutは同じ配列でもよい)
+/// @param m 法線用の行列 (normal_matrixの結果、回転のみなら頂点用と同じ)
+/// @param in 変換元
+/// @param out 変換先 (wは変換元のまま)
+/// @param count 法線の数
+/// @param normalize 変換後に正規化するかどうか
+void transform_normals(const double* m, const Vector4* in, Vector4* out,
+                       size_t count, bool normalize)
+{
+    auto& k = kernels();
+    parallel_for((count + KERNEL_CHUNK_SIZE - 1) / KERNEL_CHUNK_SIZE,
+                 [&](size_t chunk) {
+                     auto first = chunk * KERNEL_CHUNK_SIZE;
+                     auto n = std::min(KERNEL_CHUNK_SIZE, count - first);
+                     k.normals(m, in + first, out + first, n, normalize);
+                 },
+                 1);
+}
+
+/// @brief floatの頂点を変換しながらdoubleに広げる (コンパイラの自動ベクトル化に任せる)
+/// @param m 行列
+/// @param in 変換元 (xyzを詰めた配列)
+/// @param out 変換先 (1要素あたりN個、4ならwは1)
+/// @param count 頂点数
+template <size_t N>
+void widen_points(const double* m, const float* in, double* out, size_t count)
+{
+    parallel_for((count + KERNEL_CHUNK_SIZE - 1) / KERNEL_CHUNK_SIZE,
+                 [&](size_t chunk) {
+                     auto first = chunk * KERNEL_CHUNK_SIZE;
+                     auto last = std::min(first + KERNEL_CHUNK_SIZE, count);
+                     for (auto i = first; i < last; i++)
+                     {
+                         double x = in[i * 3];
+                         double y = in[i * 3 + 1];
+                         double z = in[i * 3 + 2];
+                         auto dst = out + i * N;
+                         dst[0] = x * m[0] + y * m[4] + z * m[8] + m[12];
+                         dst[1] = x * m[1] + y * m[5] + z * m[9] + m[13];
+                         dst[2] = x * m[2] + y * m[6] + z * m[10] + m[14];
+                         if constexpr (N == 4) dst[3] = 1.0;
+                     }
+                 },
+                 1);
+}
+
+/// @brief floatの頂点を変換する
+/// @param m 行列
+/// @param in 変換元 (xyzを詰めた配列)
+/// @param out 変換先 (wは1)
+/// @param count 頂点数
+void transform_points(const double* m, const float* in, Vector4* out,
+                      size_t count)
+{
+    widen_points<4>(m, in, (double*)out, count);
+}
+
+/// @brief floatの頂点を変換し、xyzを詰めて書き出す
+/// @param m 行列
+/// @param in 変換元 (xyzを詰めた配列)
+/// @param out 変換先 (count * 3要素)
+/// @param count 頂点数
+void transform_points_packed(const double* m, const float* in, double* out,
+                             size_t count)
+{
+    widen_points<3>(m, in, out, count);
+}
+
+/// @brief 全ての面の頂点数が同じ (三角形または四角形のみ) かどうか調べる
+/// @param mesh メッシュ
+/// @return 面の頂点数 (3か4、そうでなければ0)
+size_t uniform_polygon_size(const Mesh* mesh)
+{
+    // 面は3頂点以上なので、頂点数が面数の3倍なら全て三角形
+    if (mesh->poly_count == 0) return 0;
+    if (mesh->index_count == mesh->poly_count * 3) return 3;
+    if (mesh->index_count != mesh->poly_count * 4) return 0;
+    for (size_t i = 0; i < mesh->poly_count; i++)
+        if (mesh->polys[i] != i * 4) return 0;
+    return 4;
+}
+
+/// @brief 三角形または四角形のみのメッシュの面法線をまとめて求める
+/// 頂点番号を集めて複数の面を一度に計算する (AVX2ではgatherで4面ずつ)
+/// @param mesh メッシュ (頂点番号は検証済み)
+/// @param out 出力先 (poly_count個、長さは面積の2倍、wは0)
+/// @return 求めたかどうか (多角形を含む場合はfalseで、呼び出し元で求める)
+bool uniform_face_normals(const Mesh* mesh, Vector4* out)
+{
+    // gatherの添字 (頂点番号 * 4) がint32に収まる場合だけ
+    auto corners = uniform_polygon_size(mesh);
+    if (corners == 0 || mesh->vertex_count > (size_t)INT32_MAX / 4)
+        return false;
+    // 頂点数の合計が同じでも、3頂点未満の面が混ざっていることがある
+    for (size_t i = 0; corners == 3 && i < mesh->poly_count; i++)
+        if (mesh->polys[i] != i * 3) return false;
+
+    auto& k = kernels();
+    auto count = mesh->poly_count;
+    parallel_for((count + KERNEL_CHUNK_SIZE - 1) / KERNEL_CHUNK_SIZE,
+                 [&](size_t chunk) {
+                     auto first = chunk * KERNEL_CHUNK_SIZE;
+                     auto n = std::min(KERNEL_CHUNK_SIZE, count - first);
+                     auto idx = mesh->indices + first * corners;
+                     if (mesh->scalar_type == SCALAR_FLOAT32)
+                     {
+                         k.face_normals_packed((const float*)mesh->vertices,
+                                               idx, corners, n, out + first);
+                     }
+                     else
+                     {
+                         k.face_normals(mesh->vertices, idx, corners, n,
+                                        out + first);
+                     }
+                 },
+                 1);
+    return true;
+}
+
+void scalar_points(const double* m, const Vector4* in, Vector4* out,
+                   size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        auto v = in[i];
+        out[i].x = v.x * m[0] + v.y * m[4] + v.z * m[8] + m[12];
+        out[i].y = v.x * m[1] + v.y * m[5] + v.z * m[9] + m[13];
+        out[i].z = v.x * m[2] + v.y * m[6] + v.z * m[10] + m[14];
+        out[i].w = v.w;
+    }
+}
+
+void scalar_points_packed(const double* m, const Vector4* in, double* out,
+                          size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        auto v = in[i];
+        out[i * 3] = v.x * m[0] + v.y * m[4] + v.z * m[8] + m[12];
+        out[i * 3 + 1] = v.x * m[1] + v.y * m[5] + v.z * m[9] + m[13];
+        out[i * 3 + 2] = v.x * m[2] + v.y * m[6] + v.z * m[10] + m[14];
+    }
+}
+
+void scalar_normals(const double* m, const Vector4* in, Vector4* out,
+                    size_t count, bool normalize)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        auto v = in[i];
+        auto x = v.x * m[0] + v.y * m[4] + v.z * m[8];
+        auto y = v.x * m[1] + v.y * m[5] + v.z * m[9];
+        auto z = v.x * m[2] + v.y * m[6] + v.z * m[10];
+        auto length_sq = x * x + y * y + z * z;
+        if (normalize && length_sq > 0.0)
+        {
+            auto inv = 1.0 / std::sqrt(length_sq);
+            x *= inv;
+            y *= inv;
+            z *= inv;
+        }
+        out[i] = {x, y, z, v.w};
+    }
+}
+
+/// @brief 三角形は2辺、四角形は対角線の外積で面法線を求める
+/// (四角形の対角線の外積は、平面でなくてもNewellの方法と同じ値になる)
+/// @param point 頂点番号から座標を読む関数
+/// @param idx 頂点インデックス (面ごとにcorners個)
+/// @param corners 面の頂点数 (3か4)
+/// @param count 面数
+/// @param out 出力先 (長さは面積の2倍、wは0)
+template <typename P>
+void scalar_face_normals_of(P point, const unsigned int* idx, size_t corners,
+                            size_t count, Vector4* out)
+{
+    auto quad = corners == 4;
+    for (size_t i = 0; i < count; i++)
+    {
+        auto face = idx + i * corners;
+        auto a = point(face[quad ? 2 : 1]), b = point(face[0]);
+        auto c = point(face[quad ? 3 : 2]), d = point(face[quad ? 1 : 0]);
+        double e[3] = {a[0] - b[0], a[1] - b[1], a[2] - b[2]};
+        double f[3] = {c[0] - d[0], c[1] - d[1], c[2] - d[2]};
+        out[i] = {e[1] * f[2] - e[2] * f[1], e[2] * f[0] - e[0] * f[2],
+                  e[0] * f[1] - e[1] * f[0], 0.0};
+    }
+}
+
+void scalar_face_normals(const Vector4* v, const unsigned int* idx,
+                         size_t corners, size_t count, Vector4* out)
+{
+    scalar_face_normals_of(
+        [&](unsigned int i) {
+            return std::array<double, 3>{v[i].x, v[i].y, v[i].z};
+        },
+        idx, corners, count, out);
+}
+
+void scalar_face_normals_packed(const float* v, const unsigned int* idx,
+                                size_t corners, size_t count, Vector4* out)
+{
+    scalar_face_normals_of(
+        [&](unsigned int i) {
+            auto p = v + (size_t)i * 3;
+            return std::array<double, 3>{p[0], p[1], p[2]};
+        },
+        idx, corners, count, out);
+}
+
+const GeometryKernels scalar_kernels = {
+    scalar_points, scalar_points_packed, scalar_normals, scalar_face_normals,
+    scalar_face_normals_packed};
+
+#ifdef HALFBX_X86_64
+// SSE2: Vector4を (x, y) と (z, w) の2レジスタで扱う
+
+void sse2_points(const double* m, const Vector4* in, Vector4* out,
+                 size_t count)
+{
+    auto r0l = _mm_loadu_pd(m), r0h = _mm_loadu_pd(m + 2);
+    auto r1l = _mm_loadu_pd(m + 4), r1h = _mm_loadu_pd(m + 6);
+    auto r2l = _mm_loadu_pd(m + 8), r2h = _mm_loadu_pd(m + 10);
+    auto r3l = _mm_loadu_pd(m + 12), r3h = _mm_loadu_pd(m + 14);
+    for (size_t i = 0; i < count; i++)
+    {
+        auto src = (const double*)&in[i];
+        auto x = _mm_set1_pd(src[0]), y = _mm_set1_pd(src[1]);
+        auto z = _mm_set1_pd(src[2]);
+        auto w = _mm_load_sd(src + 3);
+        auto lo = _mm_add_pd(
+            _mm_add_pd(_mm_mul_pd(r0l, x), _mm_mul_pd(r1l, y)),
+            _mm_add_pd(_mm_mul_pd(r2l, z), r3l));
+        auto hi = _mm_add_pd(
+            _mm_add_pd(_mm_mul_pd(r0h, x), _mm_mul_pd(r1h, y)),
+            _mm_add_pd(_mm_mul_pd(r2h, z), r3h));
+        hi = _mm_unpacklo_pd(hi, w);
+        auto dst = (double*)&out[i];
+        _mm_storeu_pd(dst, lo);
+        _mm_storeu_pd(dst + 2, hi);
+    }
+}
+
+void sse2_points_packed(const double* m, const Vector4* in, double* out,
+                        size_t count)
+{
+    auto r0l = _mm_loadu_pd(m), r0h = _mm_load_sd(m + 2);
+    auto r1l = _mm_loadu_pd(m + 4), r1h = _mm_load_sd(m + 6);
+    auto r2l = _mm_loadu_pd(m + 8), r2h = _mm_load_sd(m + 10);
+    auto r3l = _mm_loadu_pd(m + 12), r3h = _mm_load_sd(m + 14);
+    for (size_t i = 0; i < count; i++)
+    {
+        auto src = (const double*)&in[i];
+        auto x = _mm_set1_pd(src[0]), y = _mm_set1_pd(src[1]);
+        auto z = _mm_set1_pd(src[2]);
+        auto lo = _mm_add_pd(
+            _mm_add_pd(_mm_mul_pd(r0l, x), _mm_mul_pd(r1l, y)),
+            _mm_add_pd(_mm_mul_pd(r2l, z), r3l));
+        auto hi = _mm_add_sd(
+            _mm_add_sd(_mm_mul_sd(r0h, x), _mm_mul_sd(r1h, y)),
+            _mm_add_sd(_mm_mul_sd(r2h, z), r3h));
+        _mm_storeu_pd(out + i * 3, lo);
+        _mm_store_sd(out + i * 3 + 2, hi);
+    }
+}
+
+void sse2_normals(const double* m, const Vector4* in, Vector4* out,
+                  size_t count, bool normalize)
+{
+    auto r0l = _mm_loadu_pd(m), r0h = _mm_load_sd(m + 2);
+    auto r1l = _mm_loadu_pd(m + 4), r1h = _mm_load_sd(m + 6);
+    auto r2l = _mm_loadu_pd(m + 8), r2h = _mm_load_sd(m + 10);
+    for (size_t i = 0; i < count; i++)
+    {
+        auto src = (const double*)&in[i];
+        auto x = _mm_set1_pd(src[0]), y = _mm_set1_pd(src[1]);
+        auto z = _mm_set1_pd(src[2]);
+        auto w = _mm_load_sd(src + 3);
+        auto lo = _mm_add_pd(_mm_add_pd(_mm_mul_pd(r0l, x), _mm_mul_pd(r1l, y)),
+                             _mm_mul_pd(r2l, z));
+        auto hi = _mm_add_sd(_mm_add_sd(_mm_mul_sd(r0h, x), _mm_mul_sd(r1h, y)),
+                             _mm_mul_sd(r2h, z));
+        if (normalize)
+        {
+            auto sq = _mm_mul_pd(lo, lo);
+            auto length_sq = _mm_add_sd(
+                _mm_add_sd(sq, _mm_unpackhi_pd(sq, sq)), _mm_mul_sd(hi, hi));
+            if (_mm_cvtsd_f64(length_sq) > 0.0)
+            {
+                auto length = _mm_sqrt_pd(_mm_unpacklo_pd(length_sq, length_sq));
+                lo = _mm_div_pd(lo, length);
+                hi = _mm_div_sd(hi, length);
+            }
+        }
+        auto dst = (double*)&out[i];
+        _mm_storeu_pd(dst, lo);
+        _mm_storeu_pd(dst + 2, _mm_unpacklo_pd(hi, w));
+    }
+}
+
+// 面法線は頂点を集める必要があり、2要素のSSE2では速くならないのでスカラーを使う
+const GeometryKernels sse2_kernels = {
+    sse2_points, sse2_points_packed, sse2_normals, scalar_face_normals,
+    scalar_face_normals_packed};
+#endif
@@ -0,0 +1,66 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 頂点・法線の一括変換と面法線の計算 (SSE2/AVX2を実行時に選択し、それ以外はスカラー)
+// 行列はFbxAMatrixと同じ並び (16要素、各行が変換後の軸、12-14番目が移動)
+
+#pragma once
+
+#include "../include/io.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+    #define HALFBX_X86_64
+#endif
+
+enum class SimdLevel
+{
+    Scalar,
+    SSE2,
+    AVX2,
+};
+
+/// @brief 各命令セット向けのカーネル
+struct GeometryKernels
+{
+    void (*points)(const double* m, const Vector4* in, Vector4* out,
+                   size_t count);
+    void (*points_packed)(const double* m, const Vector4* in, double* out,
+                          size_t count);
+    void (*normals)(const double* m, const Vector4* in, Vector4* out,
+                    size_t count, bool normalize);
+    // 三角形 (corners=3) または四角形 (corners=4) のみの面の法線
+    void (*face_normals)(const Vector4* v, const unsigned int* idx,
+                         size_t corners, size_t count, Vector4* out);
+    void (*face_normals_packed)(const float* v, const unsigned int* idx,
+                                size_t corners, size_t count, Vector4* out);
+};
+
+extern const GeometryKernels scalar_kernels;
+#ifdef HALFBX_X86_64
+extern const GeometryKernels sse2_kernels;
+extern const GeometryKernels avx2_kernels;
+#endif
+
+SimdLevel simd_level();
+void set_simd_level(SimdLevel level);
+const char* simd_level_name(SimdLevel level);
+
+void axis_conversion_matrix(double scale, bool to_y_up, double* m);
+void normal_matrix(const double* m, double* out);
+
+void transform_points(const double* m, const Vector4* in, Vector4* out,
+                      size_t count);
+void transform_points_packed(const double* m, const Vector4* in, double* out,
+                             size_t count);
+void transform_normals(const double* m, const Vector4* in, Vector4* out,
+                       size_t count, bool normalize);
+
+// floatのxyzを詰めた配列を変換しながらdoubleに広げる
+void transform_points(const double* m, const float* in, Vector4* out,
+                      size_t count);
+void transform_points_packed(const double* m, const float* in, double* out,
+                             size_t count);
+
+size_t uniform_polygon_size(const Mesh* mesh);
+bool uniform_face_normals(const Mesh* mesh, Vector4* out);
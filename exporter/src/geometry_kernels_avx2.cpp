@@ -0,0 +1,166 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// AVX2/FMAを有効にしてコンパイルする (呼び出すかどうかは実行時に判定する)
+
+#include "geometry_kernels.h"
+
+#ifdef HALFBX_X86_64
+    #include <immintrin.h>
+
+// AVX2: Vector4を1レジスタで扱い、行をx, y, z倍して足し合わせる
+
+void avx2_points(const double* m, const Vector4* in, Vector4* out,
+                 size_t count)
+{
+    auto r0 = _mm256_loadu_pd(m), r1 = _mm256_loadu_pd(m + 4);
+    auto r2 = _mm256_loadu_pd(m + 8), r3 = _mm256_loadu_pd(m + 12);
+    for (size_t i = 0; i < count; i++)
+    {
+        auto src = (const double*)&in[i];
+        auto v = _mm256_loadu_pd(src);
+        auto r = _mm256_fmadd_pd(r0, _mm256_broadcast_sd(src), r3);
+        r = _mm256_fmadd_pd(r1, _mm256_broadcast_sd(src + 1), r);
+        r = _mm256_fmadd_pd(r2, _mm256_broadcast_sd(src + 2), r);
+        _mm256_storeu_pd((double*)&out[i], _mm256_blend_pd(r, v, 0b1000));
+    }
+}
+
+void avx2_points_packed(const double* m, const Vector4* in, double* out,
+                        size_t count)
+{
+    auto r0 = _mm256_loadu_pd(m), r1 = _mm256_loadu_pd(m + 4);
+    auto r2 = _mm256_loadu_pd(m + 8), r3 = _mm256_loadu_pd(m + 12);
+    auto mask = _mm256_setr_epi64x(-1, -1, -1, 0);
+    for (size_t i = 0; i < count; i++)
+    {
+        auto src = (const double*)&in[i];
+        auto r = _mm256_fmadd_pd(r0, _mm256_broadcast_sd(src), r3);
+        r = _mm256_fmadd_pd(r1, _mm256_broadcast_sd(src + 1), r);
+        r = _mm256_fmadd_pd(r2, _mm256_broadcast_sd(src + 2), r);
+        _mm256_maskstore_pd(out + i * 3, mask, r);
+    }
+}
+
+void avx2_normals(const double* m, const Vector4* in, Vector4* out,
+                  size_t count, bool normalize)
+{
+    // w成分は0にしておき、正規化の長さに含めない
+    auto xyz = _mm256_castsi256_pd(_mm256_setr_epi64x(-1, -1, -1, 0));
+    auto r0 = _mm256_and_pd(_mm256_loadu_pd(m), xyz);
+    auto r1 = _mm256_and_pd(_mm256_loadu_pd(m + 4), xyz);
+    auto r2 = _mm256_and_pd(_mm256_loadu_pd(m + 8), xyz);
+    auto zero = _mm256_setzero_pd();
+    for (size_t i = 0; i < count; i++)
+    {
+        auto src = (const double*)&in[i];
+        auto v = _mm256_loadu_pd(src);
+        auto r = _mm256_mul_pd(r0, _mm256_broadcast_sd(src));
+        r = _mm256_fmadd_pd(r1, _mm256_broadcast_sd(src + 1), r);
+        r = _mm256_fmadd_pd(r2, _mm256_broadcast_sd(src + 2), r);
+        if (normalize)
+        {
+            auto sq = _mm256_mul_pd(r, r);
+            auto pair = _mm256_hadd_pd(sq, sq);
+            auto length_sq =
+                _mm256_add_pd(pair, _mm256_permute2f128_pd(pair, pair, 1));
+            auto valid = _mm256_cmp_pd(length_sq, zero, _CMP_GT_OQ);
+            auto normalized = _mm256_div_pd(r, _mm256_sqrt_pd(length_sq));
+            r = _mm256_blendv_pd(r, normalized, valid);
+        }
+        _mm256_storeu_pd((double*)&out[i], _mm256_blend_pd(r, v, 0b1000));
+    }
+}
+
+// 面法線: 4面分の頂点をgatherでx, y, zごとのレジスタに集めて外積を求め、
+// 4x4を転置してVector4で書き込む (残りの面はスカラーで求める)
+
+/// @brief 4面分の頂点の座標 (x, y, zごとに4面分)
+struct FaceCorners
+{
+    __m256d x, y, z;
+};
+
+/// @brief 4面ずつ面法線を求める (三角形は2辺、四角形は対角線の外積)
+/// @param load 4面分の頂点番号から座標を読む関数
+/// @param idx 頂点インデックス (面ごとにcorners個)
+/// @param corners 面の頂点数 (3か4)
+/// @param count 面数
+/// @param out 出力先
+/// @return 求めた面数 (4の倍数)
+template <typename L>
+size_t avx2_face_normals_of(L load, const unsigned int* idx, size_t corners,
+                            size_t count, Vector4* out)
+{
+    auto quad = corners == 4;
+    auto c = (int)corners;
+    auto offsets = _mm_setr_epi32(0, c, c * 2, c * 3);
+    auto zero = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        auto face = (const int*)(idx + i * corners);
+        auto corner = [&](int k) {
+            return load(_mm_i32gather_epi32(face + k, offsets, 4));
+        };
+        auto a = corner(quad ? 2 : 1), b = corner(0);
+        auto d = quad ? corner(1) : b, e = corner(quad ? 3 : 2);
+        auto ex = _mm256_sub_pd(a.x, b.x), ey = _mm256_sub_pd(a.y, b.y);
+        auto ez = _mm256_sub_pd(a.z, b.z);
+        auto fx = _mm256_sub_pd(e.x, d.x), fy = _mm256_sub_pd(e.y, d.y);
+        auto fz = _mm256_sub_pd(e.z, d.z);
+        auto nx = _mm256_fmsub_pd(ey, fz, _mm256_mul_pd(ez, fy));
+        auto ny = _mm256_fmsub_pd(ez, fx, _mm256_mul_pd(ex, fz));
+        auto nz = _mm256_fmsub_pd(ex, fy, _mm256_mul_pd(ey, fx));
+
+        auto xy02 = _mm256_unpacklo_pd(nx, ny); // x0 y0 x2 y2
+        auto xy13 = _mm256_unpackhi_pd(nx, ny); // x1 y1 x3 y3
+        auto z02 = _mm256_unpacklo_pd(nz, zero);
+        auto z13 = _mm256_unpackhi_pd(nz, zero);
+        auto dst = (double*)&out[i];
+        _mm256_storeu_pd(dst, _mm256_permute2f128_pd(xy02, z02, 0x20));
+        _mm256_storeu_pd(dst + 4, _mm256_permute2f128_pd(xy13, z13, 0x20));
+        _mm256_storeu_pd(dst + 8, _mm256_permute2f128_pd(xy02, z02, 0x31));
+        _mm256_storeu_pd(dst + 12, _mm256_permute2f128_pd(xy13, z13, 0x31));
+    }
+    return i;
+}
+
+void avx2_face_normals(const Vector4* v, const unsigned int* idx,
+                       size_t corners, size_t count, Vector4* out)
+{
+    // 頂点番号 * 4がint32に収まることは呼び出し元で確かめる
+    auto base = (const double*)v;
+    auto done = avx2_face_normals_of(
+        [&](__m128i vertex) {
+            auto offset = _mm_slli_epi32(vertex, 2);
+            return FaceCorners{_mm256_i32gather_pd(base, offset, 8),
+                               _mm256_i32gather_pd(base + 1, offset, 8),
+                               _mm256_i32gather_pd(base + 2, offset, 8)};
+        },
+        idx, corners, count, out);
+    scalar_kernels.face_normals(v, idx + done * corners, corners, count - done,
+                                out + done);
+}
+
+void avx2_face_normals_packed(const float* v, const unsigned int* idx,
+                              size_t corners, size_t count, Vector4* out)
+{
+    auto done = avx2_face_normals_of(
+        [&](__m128i vertex) {
+            auto offset = _mm_add_epi32(_mm_slli_epi32(vertex, 1), vertex);
+            return FaceCorners{
+                _mm256_cvtps_pd(_mm_i32gather_ps(v, offset, 4)),
+                _mm256_cvtps_pd(_mm_i32gather_ps(v + 1, offset, 4)),
+                _mm256_cvtps_pd(_mm_i32gather_ps(v + 2, offset, 4))};
+        },
+        idx, corners, count, out);
+    scalar_kernels.face_normals_packed(v, idx + done * corners, corners,
+                                       count - done, out + done);
+}
+
+const GeometryKernels avx2_kernels = {
+    avx2_points, avx2_points_packed, avx2_normals, avx2_face_normals,
+    avx2_face_normals_packed};
+#endif
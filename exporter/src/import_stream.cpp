@@ -0,0 +1,165 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "import_stream.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+
+// 一度に読み込むメッシュの数 (スレッド数の倍数、メモリの上限の目安になる)
+constexpr size_t STREAM_MESHES_PER_THREAD = 2;
+
+/// @brief まとめて読み込んだメッシュ
+struct StreamBatch
+{
+    size_t begin = 0;
+    size_t end = 0;
+    std::vector<std::unique_ptr<Arena>> arenas; // メッシュごとの確保先
+    std::vector<char> decoded;
+    int64_t allocated = 0; // 確保先の合計 (統計用)
+};
+
+void stream_objects(const Object* object, size_t parent,
+                    const ImportCallbacks* callbacks, size_t& next_index,
+                    std::unordered_map<const Mesh*, std::vector<size_t>>& users);
+
+/// @brief 読み込んだシーンをコールバックに渡す
+/// メッシュは数個ずつ並列に読み込み、次のまとまりを読み込んでいる間に
+/// 読み込み済みのものをコールバックに渡して解放する
+/// @param data マテリアルとノードツリー (メッシュは中身を読み込む前のもの)
+/// @param meshes 中身を読み込むメッシュ
+/// @param decode メッシュの中身を読み込む関数
+/// @param callbacks コールバック
+/// @param stats 統計の記録先 (コールバックの時間はCOPY_OUTに含める)
+/// @return 全てのメッシュを読み込めたかどうか
+bool stream_imported_scene(const IOData* data, const std::vector<Mesh*>& meshes,
+                           const MeshDecoder& decode,
+                           const ImportCallbacks* callbacks,
+                           StatsRecorder& stats)
+{
+    // ポリゴン頂点数はメッシュを読み込むたびに足す
+    count_scene(data, stats.counts());
+
+    auto user_data = callbacks->user_data;
+    std::unordered_map<const Mesh*, std::vector<size_t>> users;
+    {
+        StatsScope scope(stats, STATS_PHASE_COPY_OUT);
+        for (size_t i = 0; i < data->material_count; i++)
+        {
+            if (callbacks->on_material != nullptr)
+                callbacks->on_material(user_data, i, &data->materials[i]);
+        }
+
+        // ルート自体は渡さない
+        size_t next_index = 0;
+        if (auto root = data->root)
+        {
+            for (size_t i = 0; i < root->child_count; i++)
+            {
+                stream_objects(&root->children[i], SIZE_MAX, callbacks,
+                               next_index, users);
+            }
+        }
+    }
+
+    auto batch_size = std::max<size_t>(
+        1, ThreadPool::instance().thread_count() * STREAM_MESHES_PER_THREAD);
+    auto decode_batch = [&](size_t begin) {
+        auto batch = std::make_unique<StreamBatch>();
+        batch->begin = begin;
+        batch->end = std::min(begin + batch_size, meshes.size());
+        auto count = batch->end - begin;
+        batch->arenas.resize(count);
+        batch->decoded.resize(count);
+        {
+            // 読み込みはコールバックと重なるので、経過時間の合計は全体を超える
+            StatsParallelScope scope(stats,
+                                     {STATS_PHASE_MESHES, STATS_PHASE_LAYERS,
+                                      STATS_PHASE_SERIALIZE});
+            parallel_for(
+                count,
+                [&](size_t i) {
+                    batch->arenas[i] = std::make_unique<Arena>(0);
+                    batch->decoded[i] = decode(begin + i, *batch->arenas[i]);
+                },
+                1);
+        }
+        for (auto& arena : batch->arenas)
+            batch->allocated += arena->capacity();
+        stats.track_allocation(batch->allocated);
+        return batch;
+    };
+
+    auto result = true;
+    std::future<std::unique_ptr<StreamBatch>> next;
+    if (!meshes.empty())
+        next = std::async(std::launch::async, decode_batch, 0);
+    while (next.valid())
+    {
+        auto batch = next.get();
+        if (batch->end < meshes.size())
+            next = std::async(std::launch::async, decode_batch, batch->end);
+
+        for (auto i = batch->begin; i < batch->end; i++)
+        {
+            auto mesh = meshes[i];
+            if (!batch->decoded[i - batch->begin])
+            {
+                std::cerr << "An error occurred while reading a mesh..."
+                          << std::endl;
+                result = false;
+            }
+            else if (callbacks->on_mesh != nullptr)
+            {
+                StatsScope scope(stats, STATS_PHASE_COPY_OUT);
+                auto& objects = users[mesh];
+                callbacks->on_mesh(user_data, objects.data(), objects.size(),
+                                   mesh);
+            }
+            stats.counts().corner_count += mesh->index_count;
+
+            // 中身はこのまとまりと一緒に解放されるので、名前以外を消しておく
+            auto name = mesh->name;
+            auto name_length = mesh->name_length;
+            *mesh = Mesh{};
+            mesh->name = name;
+            mesh->name_length = name_length;
+        }
+        stats.track_allocation(-batch->allocated);
+    }
+    return result;
+}
+
+/// @brief ノードを親から順にコールバックに渡す
+/// @param object オブジェクト
+/// @param parent 親の番号
+/// @param callbacks コールバック
+/// @param next_index 次に割り当てる番号
+/// @param users メッシュごとの使っているノードの番号の出力先
+void stream_objects(const Object* object, size_t parent,
+                    const ImportCallbacks* callbacks, size_t& next_index,
+                    std::unordered_map<const Mesh*, std::vector<size_t>>& users)
+{
+    auto index = next_index++;
+    if (object->mesh != nullptr) users[object->mesh].push_back(index);
+
+    if (callbacks->on_object != nullptr)
+    {
+        auto node = *object;
+        node.children = nullptr;
+        node.child_count = 0;
+        callbacks->on_object(callbacks->user_data, index, parent, &node);
+    }
+
+    for (size_t i = 0; i < object->child_count; i++)
+    {
+        stream_objects(&object->children[i], index, callbacks, next_index,
+                       users);
+    }
+}
@@ -0,0 +1,23 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 読み込んだシーンをコールバックに順に渡す (FBX SDKとバイナリFBXで共有する)
+
+#pragma once
+
+#include "../include/io.h"
+#include "arena.h"
+#include "io_stats.h"
+
+#include <functional>
+#include <vector>
+
+/// @brief メッシュの中身を読み込む関数 (メッシュごとに並列に呼び出される)
+/// 引数は読み込むメッシュの番号と、中身の確保先 (コールバックの後に解放される)
+using MeshDecoder = std::function<bool(size_t index, Arena& arena)>;
+
+bool stream_imported_scene(const IOData* data, const std::vector<Mesh*>& meshes,
+                           const MeshDecoder& decode,
+                           const ImportCallbacks* callbacks,
+                           StatsRecorder& stats);
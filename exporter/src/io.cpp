@@ -3,86 +3,350 @@
 // LICENSE for details.
 
 #include "../include/io.h"
-
-#include <fbxsdk.h>
-
+#include "animation_curves.h"
+#include "arena.h"
+#include "export_job.h"
+#include "fbx_binary.h"
+#include "geometry_kernels.h"
+#include "import_stream.h"
+#include "io_session.h"
+#include "io_stats.h"
+#include "layer_elements.h"
+#include "mesh_geometry.h"
+#include "mesh_instances.h"
+#include "mesh_layout.h"
+#include "mesh_lods.h"
+#include "mesh_normals.h"
+#include "mesh_skin.h"
+#include "parallel.h"
+#include "scene_tables.h"
+
+#ifdef HALFBX_WITH_FBXSDK
+    #include <fbxsdk.h>
+#endif
+
+#include <algorithm>
 #include <cstring>
+#include <filesystem>
 #include <iostream>
+#include <memory>
 #define _USE_MATH_DEFINES
 #include <concepts>
 #include <math.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#ifdef HALFBX_WITH_FBXSDK
+/// @brief ノードに取り付ける前の変換済みメッシュ
+struct PreparedMesh
+{
+    std::vector<FbxVector4> control_points; // 座標系を修正済み
+    std::vector<Vector4> smooth_normals; // 法線を持たないスムーズなメッシュ用
+    MeshLayout layout; // 並べ替えと法線・UVの共有 (しない場合は空)
+};
+using PreparedMeshes = std::unordered_map<const Mesh*, PreparedMesh>;
+
+// 書き出す内容ごとに作成済みのFbxMesh (インスタンスのノードで共有する)
+using FbxMeshMap = std::unordered_map<const Mesh*, FbxMesh*>;
+
+// 書き出すツリーのオブジェクトから作成したノードを引く表 (スキンのボーン用)
+using FbxNodeMap = std::unordered_map<const Object*, FbxNode*>;
+
+// インポートするシーンのマテリアルから読み込み先のマテリアルを引く表
+using FbxMaterialMap =
+    std::unordered_map<const FbxSurfaceMaterial*, Material*>;
+
+// ノードツリーの作成後に並列に読み込むメッシュ (インスタンスは1つにまとめる)
+using FbxMeshReads = std::vector<std::pair<FbxMesh*, Mesh*>>;
+
+/// @brief FBX SDKで読み込んだ、メッシュの中身を読み込む前のシーン
+struct SdkImport
+{
+    std::unique_ptr<SdkManagerLease> lease; // 読み込み後にシーンごと返す
+    IOData* data = nullptr; // マテリアルとノードツリー
+    FbxMeshReads meshes;
+    double unit_scale = 0.01; // ファイルの1単位あたりのメートル
+};
+
 FbxString get_path(const char* path);
-FbxNode* create_node_recursive(FbxScene* scene, const IOData* export_data,
-                               Object* object_data);
-FbxMesh* create_mesh(const Mesh* mesh_data, const char* name, FbxScene* scene,
-                     double unit_scale);
+FbxNode* create_node_recursive(FbxScene* scene, const MaterialTable& materials,
+                               const std::vector<FbxSurfaceMaterial*>& fbx_mats,
+                               Object* object_data,
+                               const MeshInstances& instances,
+                               const MeshLods& lods,
+                               const SceneAnimation& animation,
+                               FbxAnimLayer* layer,
+                               const PreparedMeshes& prepared,
+                               FbxMeshMap& meshes, FbxNodeMap& nodes,
+                               StatsRecorder& stats);
+void create_skins(FbxScene* scene, const MeshSkins& skins,
+                  const MeshLods& lods, const FbxMeshMap& meshes,
+                  const FbxNodeMap& nodes);
+FbxAnimLayer* create_animation_stack(FbxScene* scene,
+                                     const SceneAnimation& animation);
+void set_animation_curves(FbxNode* node, const ObjectAnimation& animation,
+                          FbxAnimLayer* layer);
+void prepare_mesh(const Mesh* emesh, const IOData* export_data,
+                  PreparedMesh& out, StatsRecorder& stats);
+bool sdk_export_progress(void* args, float percentage, const char* status);
+FbxMesh* create_mesh(const Mesh* mesh_data, const PreparedMesh& prepared,
+                     const char* name, FbxScene* scene, StatsRecorder& stats);
+void set_polygons(const Mesh* emesh, const MeshLayout& layout, FbxMesh* mesh);
 FbxSurfaceMaterial* create_material(FbxScene* scene, const Material& input);
 template <typename T>
 void define_property(FbxSurfaceMaterial* mat, const char* name,
                      const char* shader_name, FbxDataType data_type, T value);
-void set_normal(const Normal* input, size_t input_count,
+void set_normal(const Normal* input, size_t input_count, ScalarType type,
+                const WeldedLayer* welded, const unsigned int* order,
                 FbxGeometryElementNormal* target);
-void set_uv(const UV* input, size_t input_count, FbxGeometryElementUV* target);
-void fix_coord(double unit_scale, Vector4* vertices, size_t vertex_count);
-FbxAMatrix fix_rot_m(const FbxAMatrix& input);
-FbxAMatrix fix_scale_m(const FbxAMatrix& input, double unit_scale);
-void recursive_delete_object(Object* object);
-void delete_mesh(Mesh* mesh);
-Object* read_node_recursive(FbxNode* node, Material* mats);
-Mesh* read_mesh(FbxMesh* fmesh);
-int read_materials(FbxScene* scene, Material** out_mats);
+void set_uv(const UV* input, size_t input_count, ScalarType type,
+            const WeldedLayer* welded, const unsigned int* order,
+            FbxGeometryElementUV* target);
+template <typename T>
+void set_layer_index(const std::vector<unsigned int>& index,
+                     FbxLayerElementTemplate<T>* target);
+bool load_sdk_scene(IOSession* session, const char* import_path,
+                    bool reserve_meshes, bool indexed, SdkImport& out,
+                    StatsRecorder& stats);
+size_t estimate_import_size(FbxNode* node, bool include_meshes, bool indexed);
+void read_node_recursive(FbxNode* node, const FbxMaterialMap& mats,
+                         Arena& arena, NameTable& names,
+                         std::unordered_map<FbxMesh*, Mesh*>& mesh_map,
+                         FbxMeshReads& meshes, Object& object);
+Mesh* read_mesh_header(FbxMesh* fmesh, Arena& arena, NameTable& names);
+void read_mesh(FbxMesh* fmesh, double unit_scale, bool indexed, Arena& arena,
+               Mesh* imesh, StatsRecorder& stats);
+void read_indexed_uv(FbxGeometryElementUV* element,
+                     const CornerTopology& topology, Arena& arena, UV& uv);
+void read_indexed_normal(FbxGeometryElementNormal* element,
+                         const CornerTopology& topology, Arena& arena,
+                         Normal& normal);
+template <typename T, typename Fn>
+bool with_layer_source(FbxLayerElementTemplate<T>* element, Fn fn);
+template <typename T>
+bool read_layer(FbxLayerElementTemplate<T>* element, size_t components,
+                const CornerTopology& topology, double* out,
+                size_t out_stride);
+LayerMapping sdk_layer_mapping(FbxLayerElement::EMappingMode mode);
+int read_materials(FbxScene* scene, Arena& arena, NameTable& names,
+                   Material** out_mats, FbxMaterialMap& out_map);
+#endif
+
+IOData* import_scene(IOSession* session, const char* import_path,
+                     const ImportOptions& options, StatsRecorder& stats);
+bool export_scene(IOSession* session, const char* export_path,
+                  const IOData* export_data, ExportMonitor& monitor,
+                  StatsRecorder& stats);
+bool has_indexed_attributes(const Object* object);
 
 /// @brief FBXファイルをインポートする
 /// @param import_path インポートするファイルのパス
 /// @return インポートされたデータ
 IOData* import_fbx(const char* import_path)
 {
-    auto path_fbxstr = get_path(import_path);
-    if (path_fbxstr.IsEmpty())
+    return session_import_fbx_with_options(nullptr, import_path, nullptr);
+}
+
+/// @brief 設定を指定してFBXファイルをインポートする
+/// @param import_path インポートするファイルのパス
+/// @param options 読み込みの設定 (nullptrなら既定値)
+/// @return インポートされたデータ
+IOData* import_fbx_with_options(const char* import_path,
+                                const ImportOptions* options)
+{
+    return session_import_fbx_with_options(nullptr, import_path, options);
+}
+
+/// @brief セッションのマネージャを使ってFBXファイルをインポートする
+/// @param session セッション (nullptrならマネージャをその場で作る)
+/// @param import_path インポートするファイルのパス
+/// @return インポートされたデータ
+IOData* session_import_fbx(IOSession* session, const char* import_path)
+{
+    return session_import_fbx_with_options(session, import_path, nullptr);
+}
+
+/// @brief セッションのマネージャを使い、設定を指定してFBXファイルをインポートする
+/// @param session セッション (nullptrならマネージャをその場で作る)
+/// @param import_path インポートするファイルのパス
+/// @param options 読み込みの設定 (nullptrなら既定値)
+/// @return インポートされたデータ
+IOData* session_import_fbx_with_options(IOSession* session,
+                                        const char* import_path,
+                                        const ImportOptions* options)
+{
+    StatsRecorder stats;
+    auto data = import_scene(session, import_path,
+                             options != nullptr ? *options : ImportOptions{},
+                             stats);
+    count_scene(data, stats.counts());
+    stats.counts().bytes_read = file_size_or_zero(import_path);
+    stats.publish(data != nullptr);
+    return data;
+}
+
+/// @brief FBXファイルをインポートする (import_fbxの本体)
+/// @param session セッション (nullptrならマネージャをその場で作る)
+/// @param import_path インポートするファイルのパス
+/// @param options 読み込みの設定
+/// @param stats 統計の記録先
+/// @return インポートされたデータ
+IOData* import_scene([[maybe_unused]] IOSession* session,
+                     const char* import_path, const ImportOptions& options,
+                     StatsRecorder& stats)
+{
+    // バイナリFBX 7.x はFBX SDKを使用せずに読み込む
+    if (options.backend != IMPORT_BACKEND_FBXSDK)
     {
-        std::cerr << "File path is invalid." << std::endl;
-        return nullptr;
+        auto native_data = read_fbx_binary(import_path, options, stats);
+        if (native_data != nullptr) return native_data;
+        if (options.backend == IMPORT_BACKEND_NATIVE)
+        {
+            std::cerr << "The native backend could not read the file "
+                         "(only binary FBX 7.x is supported)."
+                      << std::endl;
+            return nullptr;
+        }
     }
 
-    auto manager = FbxManager::Create();
-    auto importer = FbxImporter::Create(manager, "");
+#ifdef HALFBX_WITH_FBXSDK
+    SdkImport import;
+    if (!load_sdk_scene(session, import_path, true,
+                        options.indexed_attributes, import, stats))
+        return nullptr;
 
-    if (!importer->Initialize(path_fbxstr, -1, manager->GetIOSettings()))
+    // メッシュの中身はメッシュごとに独立していて、読み込み後の時間の大半を
+    // 占めるので並列に読む
+    auto& arena = *(Arena*)import.data->arena;
+    auto& meshes = import.meshes;
     {
-        std::cerr << "An error occurred while initializing the importer..."
-                  << std::endl;
-        manager->Destroy();
-        return nullptr;
+        StatsParallelScope scope(stats,
+                                 {STATS_PHASE_MESHES, STATS_PHASE_LAYERS});
+        parallel_for(
+            meshes.size(),
+            [&](size_t i) {
+                read_mesh(meshes[i].first, import.unit_scale,
+                          options.indexed_attributes, arena, meshes[i].second,
+                          stats);
+            },
+            1);
     }
+    stats.track_allocation(arena.capacity());
+
+    import.lease.reset();
+    return import.data;
+#else
+    std::cerr << "This build does not include the FBX SDK." << std::endl;
+    return nullptr;
+#endif
+}
 
-    auto scene = FbxScene::Create(manager, "Scene");
-    importer->Import(scene);
-    importer->Destroy();
+/// @brief FBXファイルをインポートし、読み込んだ順にコールバックに渡す
+/// 全体を1つのIODataにまとめないので、メッシュは渡した後に解放される
+/// @param import_path インポートするファイルのパス
+/// @param callbacks コールバック
+/// @return インポートに成功したかどうか
+bool import_fbx_stream(const char* import_path,
+                       const ImportCallbacks* callbacks)
+{
+    return session_import_fbx_stream_with_options(nullptr, import_path,
+                                                  callbacks, nullptr);
+}
 
-    auto root_node = scene->GetRootNode();
-    if (root_node == nullptr)
+/// @brief 設定を指定してFBXファイルをストリーミングで読み込む
+/// @param import_path インポートするファイルのパス
+/// @param callbacks コールバック
+/// @param options 読み込みの設定 (nullptrなら既定値)
+/// @return インポートに成功したかどうか
+bool import_fbx_stream_with_options(const char* import_path,
+                                    const ImportCallbacks* callbacks,
+                                    const ImportOptions* options)
+{
+    return session_import_fbx_stream_with_options(nullptr, import_path,
+                                                  callbacks, options);
+}
+
+/// @brief セッションのマネージャを使ってFBXファイルをストリーミングで読み込む
+/// @param session セッション (nullptrならマネージャをその場で作る)
+/// @param import_path インポートするファイルのパス
+/// @param callbacks コールバック
+/// @return インポートに成功したかどうか
+bool session_import_fbx_stream(IOSession* session, const char* import_path,
+                               const ImportCallbacks* callbacks)
+{
+    return session_import_fbx_stream_with_options(session, import_path,
+                                                  callbacks, nullptr);
+}
+
+/// @brief セッションのマネージャを使い、設定を指定してストリーミングで読み込む
+/// @param session セッション (nullptrならマネージャをその場で作る)
+/// @param import_path インポートするファイルのパス
+/// @param callbacks コールバック
+/// @param options 読み込みの設定 (nullptrなら既定値)
+/// @return インポートに成功したかどうか
+bool session_import_fbx_stream_with_options(
+    [[maybe_unused]] IOSession* session, const char* import_path,
+    const ImportCallbacks* callbacks, const ImportOptions* options)
+{
+    if (callbacks == nullptr)
     {
-        std::cerr << "Root node is null." << std::endl;
-        manager->Destroy();
-        return nullptr;
+        std::cerr << "Callbacks is null." << std::endl;
+        return false;
     }
 
-    Material* mats = nullptr;
-    auto mat_count = read_materials(scene, &mats);
-    auto root = read_node_recursive(root_node, mats);
+    StatsRecorder stats;
+    stats.counts().bytes_read = file_size_or_zero(import_path);
 
-    manager->Destroy();
+    // バイナリFBX 7.x はFBX SDKを使用せずに読み込む
+    auto backend = options != nullptr ? options->backend : IMPORT_BACKEND_AUTO;
+    if (backend != IMPORT_BACKEND_FBXSDK)
+    {
+        if (auto result = stream_fbx_binary(
+                import_path, callbacks,
+                options != nullptr ? *options : ImportOptions{}, stats))
+        {
+            stats.publish(*result);
+            return *result;
+        }
+        if (backend == IMPORT_BACKEND_NATIVE)
+        {
+            std::cerr << "The native backend could not read the file "
+                         "(only binary FBX 7.x is supported)."
+                      << std::endl;
+            stats.publish(false);
+            return false;
+        }
+    }
 
-    auto data = new IOData();
-    data->root = root;
-    data->unit_scale = 0.01;
-    data->is_ascii = true;
-    data->materials = mats;
-    data->material_count = mat_count;
+#ifdef HALFBX_WITH_FBXSDK
+    SdkImport import;
+    if (!load_sdk_scene(session, import_path, false, false, import, stats))
+    {
+        stats.publish(false);
+        return false;
+    }
 
-    return data;
+    auto indexed = options != nullptr && options->indexed_attributes;
+    std::vector<Mesh*> meshes;
+    for (auto& [fmesh, mesh] : import.meshes) meshes.push_back(mesh);
+    auto decode = [&](size_t index, Arena& arena) {
+        read_mesh(import.meshes[index].first, import.unit_scale, indexed,
+                  arena, meshes[index], stats);
+        return true;
+    };
+    auto result = stream_imported_scene(import.data, meshes, decode, callbacks,
+                                        stats);
+
+    import.lease.reset();
+    delete_iodata(import.data);
+    stats.publish(result);
+    return result;
+#else
+    std::cerr << "This build does not include the FBX SDK." << std::endl;
+    stats.publish(false);
+    return false;
+#endif
 }
 
 /// @brief FBXファイルをエクスポートする
@@ -91,6 +355,98 @@ IOData* import_fbx(const char* import_path)
 /// @return エクスポートに成功したかどうか
 bool export_fbx(const char* export_path, const IOData* export_data)
 {
+    return session_export_fbx(nullptr, export_path, export_data);
+}
+
+/// @brief セッションのマネージャを使ってFBXファイルをエクスポートする
+/// @param session セッション (nullptrならマネージャをその場で作る)
+/// @param export_path エクスポート先のパス
+/// @param export_data エクスポートするデータ
+/// @return エクスポートに成功したかどうか
+bool session_export_fbx(IOSession* session, const char* export_path,
+                        const IOData* export_data)
+{
+    ExportMonitor monitor;
+    return run_export(session, export_path, export_data, monitor);
+}
+
+/// @brief FBXファイルをエクスポートする (export_fbxと非同期の書き出しで共有)
+/// 段階の区切りごとに中断の要求を確かめ、中断したら書きかけのファイルを削除する
+/// @param session セッション (nullptrならマネージャをその場で作る)
+/// @param export_path エクスポート先のパス
+/// @param export_data エクスポートするデータ
+/// @param monitor 進捗の報告先
+/// @return エクスポートに成功したかどうか
+bool run_export(IOSession* session, const char* export_path,
+                const IOData* export_data, ExportMonitor& monitor)
+{
+    StatsRecorder stats;
+    auto result =
+        export_scene(session, export_path, export_data, monitor, stats);
+    count_scene(export_data, stats.counts());
+    if (result) stats.counts().bytes_written = file_size_or_zero(export_path);
+    stats.publish(result);
+    return result;
+}
+
+/// @brief ツリーにUV・法線セットのindicesを持つメッシュがあるかを調べる
+/// @param object 調べるオブジェクト (nullptrなら無し)
+/// @return indicesを持つメッシュがあるかどうか
+bool has_indexed_attributes(const Object* object)
+{
+    if (object == nullptr) return false;
+    if (auto mesh = object->mesh)
+    {
+        for (size_t i = 0; i < mesh->uv_set_count; i++)
+            if (mesh->uv_sets[i].indices != nullptr) return true;
+        for (size_t i = 0; i < mesh->normal_set_count; i++)
+            if (mesh->normal_sets[i].indices != nullptr) return true;
+    }
+    for (size_t i = 0; i < object->child_count; i++)
+        if (has_indexed_attributes(&object->children[i])) return true;
+    return false;
+}
+
+/// @brief FBXファイルをエクスポートする (run_exportの本体)
+/// @param session セッション (nullptrならマネージャをその場で作る)
+/// @param export_path エクスポート先のパス
+/// @param export_data エクスポートするデータ
+/// @param monitor 進捗の報告先
+/// @param stats 統計の記録先
+/// @return エクスポートに成功したかどうか
+bool export_scene([[maybe_unused]] IOSession* session, const char* export_path,
+                  const IOData* export_data, ExportMonitor& monitor,
+                  StatsRecorder& stats)
+{
+    if (export_data == nullptr)
+    {
+        std::cerr << "Export data is null." << std::endl;
+        return false;
+    }
+
+    // 値と番号で読み込んだUV・法線はポリゴン頂点ごとの配列ではないので書き出せない
+    if (has_indexed_attributes(export_data->root))
+    {
+        std::cerr << "Meshes with indexed UV or normal sets (indices) cannot "
+                     "be exported."
+                  << std::endl;
+        return false;
+    }
+
+    // ネイティブライタはバイナリ形式のみ対応 (FBX SDKでの書き出しに切り替えない)
+    if (export_data->backend == IO_BACKEND_NATIVE)
+    {
+        if (export_data->is_ascii)
+        {
+            std::cerr << "The native backend writes binary FBX only. Use the "
+                         "FBX SDK backend for ASCII FBX."
+                      << std::endl;
+            return false;
+        }
+        return write_fbx_binary(export_path, export_data, monitor, stats);
+    }
+
+#ifdef HALFBX_WITH_FBXSDK
     auto path_fbxstr = get_path(export_path);
     if (path_fbxstr.IsEmpty())
     {
@@ -98,96 +454,324 @@ bool export_fbx(const char* export_path, const IOData* export_data)
         return false;
     }
 
-    auto manager = FbxManager::Create();
-    auto scene = FbxScene::Create(manager, "Scene");
+    // シーンはマネージャを返すときに破棄される
+    SdkManagerLease lease(session);
+    auto manager = lease.manager();
+    auto scene = lease.create_scene("Scene");
 
     // マテリアルの設定 (ノードツリーの作成より先に行う必要がある)
-    for (auto i = 0; i < export_data->material_count; i++)
+    MaterialTable materials(export_data, export_data->merge_materials);
+    std::vector<FbxSurfaceMaterial*> fbx_mats(materials.unique_count());
     {
-        auto emat = export_data->materials[i];
-        auto fmat = create_material(scene, emat);
-        scene->AddMaterial(fmat);
+        StatsScope scope(stats, STATS_PHASE_MATERIALS);
+        for (size_t i = 0; i < materials.unique_count(); i++)
+        {
+            fbx_mats[i] = create_material(scene, materials.unique_material(i));
+            scene->AddMaterial(fbx_mats[i]);
+        }
     }
 
-    // ノードツリーの作成
-    auto root = export_data->root;
-    auto root_node = create_node_recursive(scene, export_data, root);
+    // 内容が同じメッシュは1つのFbxMeshを共有する
+    MeshInstances instances(export_data->root);
+    MeshLods lods(export_data, instances);
+    if (!lods.generate(monitor, stats)) return false;
+
+    // メッシュの変換 (FBX SDKを呼ばない処理なので全コアで並列に行う)
+    auto unique_meshes = instances.unique_meshes();
+    unique_meshes.insert(unique_meshes.end(), lods.meshes().begin(),
+                         lods.meshes().end());
+    PreparedMeshes prepared;
+    for (auto mesh : unique_meshes) prepared[mesh];
+    monitor.begin_phase(EXPORT_PHASE_PREPARING, unique_meshes.size());
+    {
+        StatsParallelScope scope(stats,
+                                 {STATS_PHASE_MESHES, STATS_PHASE_LAYERS});
+        parallel_for(
+            unique_meshes.size(),
+            [&](size_t i) {
+                if (monitor.cancelled()) return;
+                prepare_mesh(unique_meshes[i], export_data,
+                             prepared.at(unique_meshes[i]), stats);
+                monitor.advance();
+            },
+            1);
+    }
+    int64_t prepared_bytes = 0;
+    for (auto& [mesh, prepared_mesh] : prepared)
+    {
+        prepared_bytes +=
+            prepared_mesh.control_points.size() * sizeof(FbxVector4) +
+            prepared_mesh.smooth_normals.size() * sizeof(Vector4) +
+            mesh_layout_bytes(prepared_mesh.layout);
+    }
+    stats.track_allocation(prepared_bytes);
+    if (monitor.cancelled()) return false;
+
+    // スキンのクラスタもFBX SDKを呼ばずにメッシュごとに並列に並べ替えておく
+    MeshSkins skins(export_data, instances, lods);
+    if (!skins.build(monitor, stats)) return false;
+
+    // アニメーションのベイクもFBX SDKを呼ばないので、カーブごとに並列に行う
+    auto root = lods.root();
+    SceneAnimation animation(export_data, root);
+    if (!animation.bake(monitor, stats)) return false;
+
+    // ノードツリーの作成 (FBX SDKはスレッドセーフではないので直列に行う)
+    monitor.begin_phase(EXPORT_PHASE_BUILDING);
+    FbxMeshMap meshes;
+    FbxNodeMap nodes;
+    FbxNode* root_node;
+    {
+        StatsScope scope(stats, STATS_PHASE_NODES);
+        auto layer = create_animation_stack(scene, animation);
+        root_node = create_node_recursive(scene, materials, fbx_mats, root,
+                                          instances, lods, animation, layer,
+                                          prepared, meshes, nodes, stats);
+        if (root_node != nullptr)
+            create_skins(scene, skins, lods, meshes, nodes);
+    }
     if (root_node == nullptr)
     {
         std::cerr << "Root node is null." << std::endl;
-        manager->Destroy();
         return false;
     }
-    for (auto i = 0; i < root->child_count; i++)
+    for (size_t i = 0; i < root->child_count; i++)
     {
-        scene->GetRootNode()->AddChild(root_node->GetChild(i));
+        scene->GetRootNode()->AddChild(root_node->GetChild((int)i));
     }
 
-    // バイナリまたはASCII形式の選択
-    int format;
-    if (export_data->is_ascii)
-        format = manager->GetIOPluginRegistry()->FindWriterIDByDescription(
-            "FBX ascii (*.fbx)");
-    else
-        format = manager->GetIOPluginRegistry()->FindWriterIDByDescription(
-            "FBX binary (*.fbx)");
+    // バイナリまたはASCII形式の選択 (IDはマネージャを作ったときに引いてある)
+    auto format = lease.writer_id(export_data->is_ascii);
 
     auto exporter = FbxExporter::Create(manager, "");
     if (!exporter->Initialize(path_fbxstr, format))
     {
         std::cerr << "An error occurred while initializing the exporter..."
                   << std::endl;
-        manager->Destroy();
+        exporter->Destroy();
         return false;
     }
 
-    exporter->Export(scene);
-    manager->Destroy();
+    // 進捗はFBX SDKの割合 (0-100) で報告し、書き出したバイト数は終わってから測る
+    monitor.begin_phase(EXPORT_PHASE_WRITING, 100);
+    exporter->SetProgressCallback(sdk_export_progress, &monitor);
+    bool exported;
+    {
+        StatsScope scope(stats, STATS_PHASE_SERIALIZE);
+        exported = exporter->Export(scene);
+        exporter->Destroy();
+    }
+
+    std::filesystem::path path((const char8_t*)export_path);
+    std::error_code error;
+    if (monitor.cancelled())
+    {
+        std::filesystem::remove(path, error);
+        return false;
+    }
+    if (!exported)
+    {
+        std::cerr << "An error occurred while exporting the scene..."
+                  << std::endl;
+        return false;
+    }
+    auto size = std::filesystem::file_size(path, error);
+    if (!error) monitor.set_bytes(size, size);
 
     return true;
+#else
+    std::cerr << "This build does not include the FBX SDK." << std::endl;
+    return false;
+#endif
+}
+
+#ifdef HALFBX_WITH_FBXSDK
+/// @brief FBX SDKでファイルを読み込み、マテリアルとノードツリーを作成する
+/// メッシュは名前だけを読み込み、中身は後からread_meshで読み込む
+/// @param session セッション (nullptrならマネージャをその場で作る)
+/// @param import_path インポートするファイルのパス
+/// @param reserve_meshes メッシュの中身の分も領域を確保しておくかどうか
+/// @param indexed UV・法線を値とポリゴン頂点ごとの番号で読み込むかどうか
+/// (確保しておく大きさの見積もりに使う)
+/// @param out 出力先
+/// @param stats 統計の記録先
+/// @return 読み込めたかどうか
+bool load_sdk_scene(IOSession* session, const char* import_path,
+                    bool reserve_meshes, bool indexed, SdkImport& out,
+                    StatsRecorder& stats)
+{
+    auto path_fbxstr = get_path(import_path);
+    if (path_fbxstr.IsEmpty())
+    {
+        std::cerr << "File path is invalid." << std::endl;
+        return false;
+    }
+
+    StatsScope parse_scope(stats, STATS_PHASE_SERIALIZE);
+    // シーンはメッシュを読み終えてマネージャを返すときに破棄される
+    auto lease = std::make_unique<SdkManagerLease>(session);
+    auto manager = lease->manager();
+    auto importer = FbxImporter::Create(manager, "");
+
+    if (!importer->Initialize(path_fbxstr, -1, manager->GetIOSettings()))
+    {
+        std::cerr << "An error occurred while initializing the importer..."
+                  << std::endl;
+        importer->Destroy();
+        return false;
+    }
+
+    auto scene = lease->create_scene("Scene");
+    importer->Import(scene);
+    importer->Destroy();
+
+    auto root_node = scene->GetRootNode();
+    if (root_node == nullptr)
+    {
+        std::cerr << "Root node is null." << std::endl;
+        return false;
+    }
+
+    // ジオメトリはZ-upとメートルに戻して読み込む
+    out.unit_scale =
+        scene->GetGlobalSettings().GetSystemUnit().GetScaleFactor() * 0.01;
+
+    // 結果は1つの領域にまとめて確保するので、先に大きさを見積もる
+    auto estimate = estimate_import_size(root_node, reserve_meshes, indexed) +
+                    scene->GetMaterialCount() * (sizeof(Material) + 64);
+    auto data = create_arena_iodata(estimate);
+    auto& arena = *(Arena*)data->arena;
+
+    // 名前は同じものを共有し、マテリアルはポインタから引く
+    NameTable names(arena);
+    FbxMaterialMap mats;
+    {
+        StatsScope scope(stats, STATS_PHASE_MATERIALS, STATS_PHASE_SERIALIZE);
+        data->material_count =
+            read_materials(scene, arena, names, &data->materials, mats);
+    }
+
+    // ノードツリーと名前は直列に作る (メッシュは確保して一覧に加えるだけ)
+    {
+        StatsScope scope(stats, STATS_PHASE_NODES, STATS_PHASE_SERIALIZE);
+        std::unordered_map<FbxMesh*, Mesh*> mesh_map;
+        data->root = arena.allocate<Object>();
+        read_node_recursive(root_node, mats, arena, names, mesh_map,
+                            out.meshes, *data->root);
+
+        // ネイティブの読み込みと同じく、ルートは単位行列にする
+        std::memset(data->root->matrix_local, 0, 16 * sizeof(double));
+        data->root->matrix_local[0] = data->root->matrix_local[5] =
+            data->root->matrix_local[10] = data->root->matrix_local[15] = 1.0;
+    }
+
+    data->unit_scale = 1.0;
+    data->is_ascii = true;
+    data->backend = IO_BACKEND_FBXSDK;
+    out.lease = std::move(lease);
+    out.data = data;
+    return true;
+}
+
+/// @brief ノードツリーを読み込むのに必要な大きさを見積もる
+/// @param node ノード
+/// @param include_meshes メッシュの中身も含めるかどうか
+/// @param indexed UV・法線を値とポリゴン頂点ごとの番号で読み込むかどうか
+/// @return 必要な大きさ (バイト、多めに見積もる)
+size_t estimate_import_size(FbxNode* node, bool include_meshes, bool indexed)
+{
+    if (node == nullptr) return 0;
+
+    size_t size = sizeof(Object) + strlen(node->GetName()) + 16 +
+                  node->GetMaterialCount() * sizeof(Material*);
+    if (auto mesh = include_meshes ? node->GetMesh() : nullptr)
+    {
+        size_t index_count = mesh->GetPolygonVertexCount();
+        size_t poly_count = mesh->GetPolygonCount();
+        size += sizeof(Mesh) + 256 +
+                mesh->GetControlPointsCount() * sizeof(Vector4) +
+                (index_count + poly_count * 2) * sizeof(unsigned int) +
+                mesh->GetElementUVCount() * (sizeof(UV) + 64) +
+                mesh->GetElementNormalCount() * (sizeof(Normal) + 64);
+        // 番号で読み込む場合の値はファイルの要素の数 (と範囲外の参照用の1つ) まで
+        for (auto i = 0; i < mesh->GetElementUVCount(); i++)
+        {
+            size += indexed ? (mesh->GetElementUV(i)->GetDirectArray()
+                                   .GetCount() +
+                               1) * sizeof(Vector2) +
+                                  index_count * sizeof(unsigned int)
+                            : index_count * sizeof(Vector2);
+        }
+        for (auto i = 0; i < mesh->GetElementNormalCount(); i++)
+        {
+            size += indexed ? (mesh->GetElementNormal(i)->GetDirectArray()
+                                   .GetCount() +
+                               1) * sizeof(Vector4) +
+                                  index_count * sizeof(unsigned int)
+                            : index_count * sizeof(Vector4);
+        }
+    }
+    for (auto i = 0; i < node->GetChildCount(); i++)
+    {
+        size += estimate_import_size(node->GetChild(i), include_meshes,
+                                     indexed);
+    }
+    return size;
 }
 
 /// @brief ノードを再帰的に読み込む
 /// @param node ノード
-/// @param mats マテリアル
-/// @return 読み込まれたノード
-Object* read_node_recursive(FbxNode* node, Material* mats)
+/// @param mats シーンのマテリアルから読み込み先のマテリアルを引く表
+/// @param arena 確保に使用する領域
+/// @param names 名前の表
+/// @param mesh_map 確保済みのメッシュ (同じFbxMeshのノードは共有する)
+/// @param meshes 後から読み込むメッシュの一覧
+/// @param object 読み込み先のオブジェクト
+void read_node_recursive(FbxNode* node, const FbxMaterialMap& mats,
+                         Arena& arena, NameTable& names,
+                         std::unordered_map<FbxMesh*, Mesh*>& mesh_map,
+                         FbxMeshReads& meshes, Object& object)
 {
-    if (node == nullptr) return nullptr;
+    if (node == nullptr) return;
 
-    auto object = new Object();
-    object->name = new char[strlen(node->GetName()) + 1];
-    std::strcpy(object->name, node->GetName());
-    object->child_count = node->GetChildCount();
-    object->children = new Object[object->child_count];
-    for (auto i = 0; i < object->child_count; i++)
+    object.name = names.intern(node->GetName(), &object.name_length);
+
+    // ピボットや回転順も含めたローカル行列 (FbxAMatrixとmatrix_localは同じ並び)
+    FbxAMatrix local = node->EvaluateLocalTransform();
+    std::memcpy(object.matrix_local, (const double*)local,
+                16 * sizeof(double));
+
+    object.child_count = node->GetChildCount();
+    object.children = arena.allocate<Object>(object.child_count);
+    for (size_t i = 0; i < object.child_count; i++)
     {
-        object->children[i] = *read_node_recursive(node->GetChild(i), mats);
+        read_node_recursive(node->GetChild((int)i), mats, arena, names,
+                            mesh_map, meshes, object.children[i]);
     }
 
     auto mesh = node->GetMesh();
-    if (mesh != nullptr) { object->mesh = read_mesh(mesh); }
+    if (mesh != nullptr)
+    {
+        auto& imesh = mesh_map[mesh];
+        if (imesh == nullptr)
+        {
+            imesh = read_mesh_header(mesh, arena, names);
+            meshes.push_back({mesh, imesh});
+        }
+        object.mesh = imesh;
+    }
 
     auto material_count = node->GetMaterialCount();
     if (material_count > 0)
     {
-        object->material_slot_count = material_count;
-        object->material_slots = new Material*[material_count];
+        object.material_slot_count = material_count;
+        object.material_slots = arena.allocate<Material*>(material_count);
         for (auto i = 0; i < material_count; i++)
         {
-            auto fmat = node->GetMaterial(i);
-            for (auto mat_i = 0; mat_i < material_count; mat_i++)
-            {
-                if (std::strcmp(fmat->GetName(), mats[mat_i].name) == 0)
-                {
-                    object->material_slots[i] = &mats[mat_i];
-                    break;
-                }
-            }
+            auto found = mats.find(node->GetMaterial(i));
+            if (found != mats.end()) object.material_slots[i] = found->second;
         }
     }
-
-    return object;
 }
 
 /// @brief パスのバリデーション
@@ -208,11 +792,28 @@ FbxString get_path(const char* path)
 
 /// @brief ノードを再帰的に作成する
 /// @param scene シーン
-/// @param export_data エクスポートデータ
+/// @param materials 書き出すマテリアルの表
+/// @param fbx_mats 書き出し先の番号ごとのマテリアル
 /// @param object_data オブジェクトデータ
+/// @param instances 内容が同じメッシュの表
+/// @param lods 作ったLOD (グループにはFbxLODGroupを設定する)
+/// @param animation ベイクしたアニメーション
+/// @param layer アニメーションのレイヤー (アニメーションが無ければnullptr)
+/// @param prepared 変換済みのメッシュ
+/// @param meshes 作成済みのメッシュ (最初のノードで作成し、以降は共有する)
+/// @param nodes 作成したノードの出力先
+/// @param stats 統計の記録先
 /// @return 作成されたノード
-FbxNode* create_node_recursive(FbxScene* scene, const IOData* export_data,
-                               Object* object_data)
+FbxNode* create_node_recursive(FbxScene* scene, const MaterialTable& materials,
+                               const std::vector<FbxSurfaceMaterial*>& fbx_mats,
+                               Object* object_data,
+                               const MeshInstances& instances,
+                               const MeshLods& lods,
+                               const SceneAnimation& animation,
+                               FbxAnimLayer* layer,
+                               const PreparedMeshes& prepared,
+                               FbxMeshMap& meshes, FbxNodeMap& nodes,
+                               StatsRecorder& stats)
 {
     if (object_data == nullptr)
     {
@@ -221,6 +822,7 @@ FbxNode* create_node_recursive(FbxScene* scene, const IOData* export_data,
     }
 
     auto node = FbxNode::Create(scene, object_data->name);
+    nodes.emplace(object_data, node);
 
     // ローカルトランスフォームの設定
     FbxAMatrix transform;
@@ -228,29 +830,24 @@ FbxNode* create_node_recursive(FbxScene* scene, const IOData* export_data,
     node->LclTranslation.Set(FbxVector4(transform.GetT()));
     node->LclRotation.Set(FbxVector4(transform.GetR()));
     node->LclScaling.Set(FbxVector4(transform.GetS()));
+    if (auto curves = animation.find(object_data))
+        set_animation_curves(node, *curves, layer);
 
     // マテリアルの設定はメッシュの設定より先にやったほうがいい気がする
-    if (object_data->material_slot_count > 0)
+    for (size_t i = 0; i < object_data->material_slot_count; i++)
     {
-        for (auto i = 0; i < object_data->material_slot_count; i++)
-        {
-            auto mat = object_data->material_slots[i];
-            for (auto mat_i = 0; mat_i < export_data->material_count; mat_i++)
-            {
-                if (&export_data->materials[mat_i] != mat) continue;
-
-                auto fbx_mat = scene->GetMaterial(mat_i);
-                node->AddMaterial(fbx_mat);
-                break;
-            }
-        }
+        auto index = materials.find(object_data->material_slots[i]);
+        if (index >= 0) node->AddMaterial(fbx_mats[index]);
     }
 
-    // メッシュデータがある場合はメッシュを作成
+    // メッシュデータがある場合はメッシュを作成 (同じ内容なら作成済みのものを使う)
     if (object_data->mesh != nullptr)
     {
-        auto mesh = create_mesh(object_data->mesh, object_data->name, scene,
-                                export_data->unit_scale);
+        auto emesh = instances.canonical(object_data->mesh);
+        auto& mesh = meshes[emesh];
+        if (mesh == nullptr)
+            mesh = create_mesh(emesh, prepared.at(emesh), object_data->name,
+                               scene, stats);
         if (mesh == nullptr)
         {
             std::cerr << "Mesh is null." << std::endl;
@@ -259,166 +856,573 @@ FbxNode* create_node_recursive(FbxScene* scene, const IOData* export_data,
         node->SetNodeAttribute(mesh);
     }
 
+    // LODグループの切り替えの閾値は設定せず、読み込む側の既定に任せる
+    if (lods.is_group(object_data))
+        node->SetNodeAttribute(FbxLODGroup::Create(scene, object_data->name));
+
     // 子ノードの作成
-    for (auto i = 0; i < object_data->child_count; i++)
+    for (size_t i = 0; i < object_data->child_count; i++)
     {
-        auto child_node = create_node_recursive(scene, export_data,
-                                                &object_data->children[i]);
+        auto child_node = create_node_recursive(
+            scene, materials, fbx_mats, &object_data->children[i], instances,
+            lods, animation, layer, prepared, meshes, nodes, stats);
         node->AddChild(child_node);
     }
 
     return node;
 }
 
-/// @brief メッシュを読み込む
+/// @brief スキンを持つメッシュにFbxSkinとボーンごとのFbxClusterを設定する
+/// クラスタの配列は大きさを1回で決めてから並べ替え済みの配列をそのまま写す
+/// (AddControlPointIndexは1頂点ごとに配列を伸ばすので使わない)
+/// バインドポーズはボーンとスキンを持つノードのバインド時の行列を1つにまとめる
+/// @param scene シーン
+/// @param skins 変換したスキン
+/// @param lods 作ったLOD (ボーンは書き出すツリーに写したものを引く)
+/// @param meshes 作成したメッシュ
+/// @param nodes 作成したノード
+void create_skins(FbxScene* scene, const MeshSkins& skins,
+                  const MeshLods& lods, const FbxMeshMap& meshes,
+                  const FbxNodeMap& nodes)
+{
+    if (skins.meshes().empty()) return;
+
+    auto pose = FbxPose::Create(scene, "BindPose");
+    pose->SetIsBindPose(true);
+    std::unordered_set<FbxNode*> posed;
+    size_t missing_bones = 0;
+    for (auto mesh : skins.meshes())
+    {
+        auto found = meshes.find(mesh);
+        if (found == meshes.end()) continue;
+        auto fmesh = found->second;
+        auto skin = mesh->skin;
+        auto clusters = skins.find(mesh);
+
+        FbxAMatrix mesh_bind;
+        std::memcpy(mesh_bind, skin->mesh_bind_matrix, 16 * sizeof(double));
+        auto fskin = FbxSkin::Create(scene, fmesh->GetName());
+        for (size_t b = 0; b < skin->bone_count; b++)
+        {
+            auto bone = skin->bones[b] != nullptr
+                            ? nodes.find(lods.written(skin->bones[b]))
+                            : nodes.end();
+            if (bone == nodes.end())
+            {
+                missing_bones++;
+                continue;
+            }
+            FbxAMatrix link;
+            std::memcpy(link, &clusters->links[b * 16], 16 * sizeof(double));
+            auto cluster = FbxCluster::Create(scene, bone->second->GetName());
+            cluster->SetLink(bone->second);
+            cluster->SetLinkMode(FbxCluster::eNormalize);
+            cluster->SetTransformMatrix(mesh_bind);
+            cluster->SetTransformLinkMatrix(link);
+            auto begin = clusters->offsets[b];
+            auto count = clusters->offsets[b + 1] - begin;
+            cluster->SetControlPointIWCount((int)count);
+            std::copy_n(&clusters->indices[begin], count,
+                        cluster->GetControlPointIndices());
+            std::copy_n(&clusters->weights[begin], count,
+                        cluster->GetControlPointWeights());
+            fskin->AddCluster(cluster);
+            if (posed.insert(bone->second).second)
+                pose->Add(bone->second, FbxMatrix(link));
+        }
+        fmesh->AddDeformer(fskin);
+        for (auto i = 0; i < fmesh->GetNodeCount(); i++)
+        {
+            if (posed.insert(fmesh->GetNode(i)).second)
+                pose->Add(fmesh->GetNode(i), FbxMatrix(mesh_bind));
+        }
+    }
+    if (missing_bones > 0)
+    {
+        std::cerr << missing_bones << " skin bones are not in the exported tree"
+                  << std::endl;
+    }
+    scene->AddPose(pose);
+}
+
+/// @brief アニメーションのスタックとレイヤーを作り、シーンの時間を設定する
+/// @param scene シーン
+/// @param animation ベイクしたアニメーション
+/// @return カーブを置くレイヤー (アニメーションが無ければnullptr)
+FbxAnimLayer* create_animation_stack(FbxScene* scene,
+                                     const SceneAnimation& animation)
+{
+    if (!animation.enabled()) return nullptr;
+
+    FbxTimeSpan span(FbxTime(animation.start_time()),
+                     FbxTime(animation.stop_time()));
+    auto& settings = scene->GetGlobalSettings();
+    settings.SetTimeMode(FbxTime::eCustom);
+    settings.SetCustomFrameRate(animation.frame_rate());
+    settings.SetTimelineDefaultTimeSpan(span);
+
+    auto stack = FbxAnimStack::Create(scene, "Take 001");
+    stack->SetLocalTimeSpan(span);
+    stack->SetReferenceTimeSpan(span);
+    auto layer = FbxAnimLayer::Create(scene, "BaseLayer");
+    stack->AddMember(layer);
+    return layer;
+}
+
+/// @brief ノードの移動・回転・拡縮にベイクしたカーブのキーを設定する (直線補間)
+/// @param node ノード
+/// @param animation ベイクしたカーブ
+/// @param layer カーブを置くレイヤー
+void set_animation_curves(FbxNode* node, const ObjectAnimation& animation,
+                          FbxAnimLayer* layer)
+{
+    FbxProperty* properties[] = {&node->LclTranslation, &node->LclRotation,
+                                 &node->LclScaling};
+    const char* components[] = {FBXSDK_CURVENODE_COMPONENT_X,
+                                FBXSDK_CURVENODE_COMPONENT_Y,
+                                FBXSDK_CURVENODE_COMPONENT_Z};
+    for (auto i = 0; i < ANIMATION_CURVE_COUNT; i++)
+    {
+        auto& input = animation.curves[i];
+        auto curve = properties[i / 3]->GetCurve(layer, components[i % 3], true);
+        curve->KeyModifyBegin();
+        // キーは時刻順に足すので、直前の位置を渡して探索を省く
+        int last = 0;
+        for (size_t k = 0; k < input.times.size(); k++)
+        {
+            FbxTime time(input.times[k]);
+            auto index = curve->KeyAdd(time, &last);
+            curve->KeySet(index, time, input.values[k],
+                          FbxAnimCurveDef::eInterpolationLinear);
+        }
+        curve->KeyModifyEnd();
+    }
+}
+
+/// @brief メッシュを確保し、名前とUV・法線セットの名前だけを読み込む
+/// 名前の表はスレッドセーフではないので、ノードツリーと一緒に直列に呼び出す
 /// @param fmesh 読み込むメッシュ
-/// @return 読み込まれたメッシュ
-Mesh* read_mesh(FbxMesh* fmesh)
+/// @param arena 確保に使用する領域
+/// @param names 名前の表
+/// @return 確保されたメッシュ
+Mesh* read_mesh_header(FbxMesh* fmesh, Arena& arena, NameTable& names)
 {
-    if (fmesh == nullptr) return nullptr;
+    auto imesh = arena.allocate<Mesh>();
+    imesh->name = names.intern(fmesh->GetName(), &imesh->name_length);
 
-    auto imesh = new Mesh();
-    imesh->name = new char[strlen(fmesh->GetName()) + 1];
-    std::strcpy(imesh->name, fmesh->GetName());
+    imesh->uv_set_count = fmesh->GetElementUVCount();
+    imesh->uv_sets = arena.allocate<UV>(imesh->uv_set_count);
+    for (size_t i = 0; i < imesh->uv_set_count; i++)
+    {
+        auto& uv = imesh->uv_sets[i];
+        uv.name = names.intern(fmesh->GetElementUV((int)i)->GetName(),
+                               &uv.name_length);
+    }
 
-    // 頂点の追加
-    imesh->vertex_count = fmesh->GetControlPointsCount();
-    imesh->vertices = new Vector4[imesh->vertex_count];
-    auto control_points = fmesh->GetControlPoints();
-    for (auto i = 0; i < imesh->vertex_count; i++)
+    imesh->normal_set_count = fmesh->GetElementNormalCount();
+    imesh->normal_sets = arena.allocate<Normal>(imesh->normal_set_count);
+    for (size_t i = 0; i < imesh->normal_set_count; i++)
     {
-        imesh->vertices[i] = *(Vector4*)&control_points[i];
+        auto& normal = imesh->normal_sets[i];
+        normal.name = names.intern(fmesh->GetElementNormal((int)i)->GetName(),
+                                   &normal.name_length);
     }
+    return imesh;
+}
+
+/// @brief メッシュの中身を読み込む (メッシュごとに並列に呼び出される)
+/// @param fmesh 読み込むメッシュ
+/// @param unit_scale ファイルの1単位あたりのメートル
+/// @param indexed UV・法線を値とポリゴン頂点ごとの番号で読み込むかどうか
+/// @param arena 確保に使用する領域 (スレッドセーフ)
+/// @param imesh read_mesh_headerで確保したメッシュ
+/// @param stats 統計の記録先
+void read_mesh(FbxMesh* fmesh, double unit_scale, bool indexed, Arena& arena,
+               Mesh* imesh, StatsRecorder& stats)
+{
+    StatsScope mesh_scope(stats, STATS_PHASE_MESHES, STATS_PHASE_COUNT, true);
+
+    // 頂点の追加、Y-up to Z-up
+    double m[16];
+    axis_conversion_matrix(unit_scale, false, m);
+    imesh->vertex_count = fmesh->GetControlPointsCount();
+    imesh->vertices = arena.allocate<Vector4>(imesh->vertex_count);
+    transform_points(m, (const Vector4*)fmesh->GetControlPoints(),
+                     imesh->vertices, imesh->vertex_count);
 
     // 頂点インデックスの設定
     imesh->index_count = fmesh->GetPolygonVertexCount();
-    imesh->indices = new unsigned int[imesh->index_count];
+    imesh->indices = arena.allocate<unsigned int>(imesh->index_count);
     std::memcpy(imesh->indices, fmesh->GetPolygonVertices(),
                 imesh->index_count * sizeof(unsigned int));
 
-    // 面の設定
+    // 面の設定 (各ポリゴンの開始位置)
     imesh->poly_count = fmesh->GetPolygonCount();
-    imesh->polys = new unsigned int[imesh->poly_count];
-    std::memcpy(imesh->polys, fmesh->GetPolygonVertices(),
-                imesh->poly_count * sizeof(unsigned int));
+    imesh->polys = arena.allocate<unsigned int>(imesh->poly_count);
+    for (size_t i = 0; i < imesh->poly_count; i++)
+        imesh->polys[i] = (unsigned int)fmesh->GetPolygonVertexIndex((int)i);
 
-    // マテリアルの設定
-    imesh->material_indices = new unsigned int[imesh->poly_count];
-    for (auto i = 0; i < imesh->poly_count; i++)
+    auto corner_polys = corner_polygons(imesh->polys, imesh->poly_count,
+                                        imesh->index_count);
+    CornerTopology topology = {imesh->indices, corner_polys.data(),
+                               imesh->index_count};
+
+    // ここから後はレイヤー要素
+    StatsScope layer_scope(stats, STATS_PHASE_LAYERS, STATS_PHASE_MESHES, true);
+
+    // マテリアルの設定 (要素がなければ全て0番)
+    imesh->material_indices = arena.allocate<unsigned int>(imesh->poly_count);
+    if (auto elmat = fmesh->GetElementMaterial())
     {
-        imesh->material_indices[i] =
-            fmesh->GetElementMaterial()->GetIndexArray().GetAt(i);
+        auto& index_array = elmat->GetIndexArray();
+        auto values = index_array.GetLocked(FbxLayerElementArray::eReadLock);
+        expand_layer_polygons(sdk_layer_mapping(elmat->GetMappingMode()),
+                              values, index_array.GetCount(), topology,
+                              imesh->polys, imesh->poly_count,
+                              imesh->material_indices);
+        index_array.Release(&values);
     }
 
     // UVの設定
-    imesh->uv_set_count = fmesh->GetElementUVCount();
-    imesh->uv_sets = new UV[imesh->uv_set_count];
-    for (auto i = 0; i < imesh->uv_set_count; i++)
-    {
-        auto eluv = fmesh->GetElementUV(i);
-        imesh->uv_sets[i].name = new char[strlen(eluv->GetName()) + 1];
-        std::strcpy(imesh->uv_sets[i].name, eluv->GetName());
-        imesh->uv_sets[i].uv = new Vector2[imesh->index_count];
-        for (auto j = 0; j < imesh->index_count; j++)
+    for (size_t i = 0; i < imesh->uv_set_count; i++)
+    {
+        if (indexed)
         {
-            auto uv = eluv->GetDirectArray().GetAt(j);
-            imesh->uv_sets[i].uv[j] = *(Vector2*)&uv;
+            read_indexed_uv(fmesh->GetElementUV((int)i), topology, arena,
+                            imesh->uv_sets[i]);
+            continue;
         }
+        imesh->uv_sets[i].uv = arena.allocate<Vector2>(imesh->index_count);
+        imesh->uv_sets[i].value_count = imesh->index_count;
+        read_layer(fmesh->GetElementUV((int)i), 2, topology,
+                   (double*)imesh->uv_sets[i].uv, 2);
     }
 
-    // 頂点法線の設定
-    imesh->normal_set_count = fmesh->GetElementNormalCount();
-    imesh->normal_sets = new Normal[imesh->normal_set_count];
-    for (auto i = 0; i < imesh->normal_set_count; i++)
-    {
-        auto elnrm = fmesh->GetElementNormal(i);
-        imesh->normal_sets[i].name = new char[strlen(elnrm->GetName()) + 1];
-        std::strcpy(imesh->normal_sets[i].name, elnrm->GetName());
-        imesh->normal_sets[i].normal = new Vector4[imesh->index_count];
-        for (auto j = 0; j < imesh->index_count; j++)
+    // 頂点法線の設定、Y-up to Z-up
+    double nm[16];
+    axis_conversion_matrix(1.0, false, nm);
+    for (size_t i = 0; i < imesh->normal_set_count; i++)
+    {
+        auto& normal = imesh->normal_sets[i];
+        if (indexed)
         {
-            auto normal = elnrm->GetDirectArray().GetAt(j);
-            imesh->normal_sets[i].normal[j] = *(Vector4*)&normal;
+            read_indexed_normal(fmesh->GetElementNormal((int)i), topology,
+                                arena, normal);
+            transform_normals(nm, normal.normal, normal.normal,
+                              normal.value_count, false);
+            continue;
         }
+        auto normals = arena.allocate<Vector4>(imesh->index_count);
+        for (size_t j = 0; j < imesh->index_count; j++)
+            normals[j] = {0.0, 0.0, 0.0, 1.0};
+        read_layer(fmesh->GetElementNormal((int)i), 3, topology,
+                   (double*)normals, 4);
+        normal.normal = normals;
+        normal.value_count = imesh->index_count;
+        transform_normals(nm, normal.normal, normal.normal, imesh->index_count,
+                          false);
     }
+}
 
-    return imesh;
+/// @brief UVセットを重複の無い値とポリゴン頂点ごとの番号で読み込む
+/// @param element UVのレイヤー要素
+/// @param topology ポリゴン頂点の並び
+/// @param arena 確保に使用する領域
+/// @param uv 読み込み先のUVセット
+void read_indexed_uv(FbxGeometryElementUV* element,
+                     const CornerTopology& topology, Arena& arena, UV& uv)
+{
+    with_layer_source(element, [&](const LayerSource& source) {
+        IndexedLayer layer;
+        auto result = index_layer_corners(source, topology, 2, layer);
+        uv.value_count = layer.values.size();
+        uv.uv = arena.allocate<Vector2>(uv.value_count);
+        gather_layer_values(source, layer, 2, (double*)uv.uv, 2);
+        uv.indices = arena.allocate<unsigned int>(topology.corner_count);
+        std::copy(layer.index.begin(), layer.index.end(), uv.indices);
+        return result;
+    });
+}
+
+/// @brief 法線セットを重複の無い値とポリゴン頂点ごとの番号で読み込む
+/// 軸の変換は呼び出し元で値に対して行う
+/// @param element 法線のレイヤー要素
+/// @param topology ポリゴン頂点の並び
+/// @param arena 確保に使用する領域
+/// @param normal 読み込み先の法線セット
+void read_indexed_normal(FbxGeometryElementNormal* element,
+                         const CornerTopology& topology, Arena& arena,
+                         Normal& normal)
+{
+    with_layer_source(element, [&](const LayerSource& source) {
+        IndexedLayer layer;
+        auto result = index_layer_corners(source, topology, 3, layer);
+        normal.value_count = layer.values.size();
+        normal.normal = arena.allocate<Vector4>(normal.value_count);
+        for (size_t j = 0; j < normal.value_count; j++)
+            normal.normal[j] = {0.0, 0.0, 0.0, 1.0};
+        gather_layer_values(source, layer, 3, (double*)normal.normal, 4);
+        normal.indices = arena.allocate<unsigned int>(topology.corner_count);
+        std::copy(layer.index.begin(), layer.index.end(), normal.indices);
+        return result;
+    });
+}
+
+/// @brief FBX SDKのレイヤー要素の配列をロックして、LayerSourceとして渡す
+/// 要素の配列はまとめて読み、GetAtは使わない
+/// @param element レイヤー要素 (FbxVector2またはFbxVector4)
+/// @param fn LayerSourceを受け取る関数 (戻り値をそのまま返す)
+/// @return fnの戻り値
+template <typename T, typename Fn>
+bool with_layer_source(FbxLayerElementTemplate<T>* element, Fn fn)
+{
+    static_assert(sizeof(T) % sizeof(double) == 0);
+    auto& direct = element->GetDirectArray();
+    auto values = direct.GetLocked(FbxLayerElementArray::eReadLock);
+
+    LayerSource source = {};
+    source.mapping = sdk_layer_mapping(element->GetMappingMode());
+    source.values = (const double*)values;
+    source.value_count = direct.GetCount();
+    source.value_stride = sizeof(T) / sizeof(double);
+
+    // eIndexはeIndexToDirectと同じ扱いにする
+    auto& index_array = element->GetIndexArray();
+    int* index = nullptr;
+    if (element->GetReferenceMode() != FbxLayerElement::eDirect)
+    {
+        index = index_array.GetLocked(FbxLayerElementArray::eReadLock);
+        source.index = index;
+        source.index_count = index_array.GetCount();
+    }
+
+    auto result = fn(source);
+    if (index != nullptr) index_array.Release(&index);
+    direct.Release(&values);
+    return result;
+}
+
+/// @brief FBX SDKのレイヤー要素をポリゴン頂点ごとの値に展開する
+/// @param element レイヤー要素 (FbxVector2またはFbxVector4)
+/// @param components 展開する成分数
+/// @param topology ポリゴン頂点の並び
+/// @param out 出力先 (ポリゴン頂点数 * out_stride)
+/// @param out_stride 出力の1要素あたりの成分数
+/// @return 展開できたかどうか
+template <typename T>
+bool read_layer(FbxLayerElementTemplate<T>* element, size_t components,
+                const CornerTopology& topology, double* out,
+                size_t out_stride)
+{
+    return with_layer_source(element, [&](const LayerSource& source) {
+        return expand_layer_corners(source, topology, components, out,
+                                    out_stride);
+    });
+}
+
+/// @brief FBX SDKの割り当て方を変換する
+/// @param mode 割り当て方
+/// @return 割り当て方
+LayerMapping sdk_layer_mapping(FbxLayerElement::EMappingMode mode)
+{
+    switch (mode)
+    {
+    case FbxLayerElement::eByControlPoint:
+        return LayerMapping::ByControlPoint;
+    case FbxLayerElement::eByPolygonVertex:
+        return LayerMapping::ByPolygonVertex;
+    case FbxLayerElement::eByPolygon:
+        return LayerMapping::ByPolygon;
+    case FbxLayerElement::eAllSame:
+        return LayerMapping::AllSame;
+    default:
+        return LayerMapping::Unsupported;
+    }
+}
+
+/// @brief メッシュをFBX SDKに渡せる形に変換する (並列に呼び出される)
+/// @param emesh メッシュのデータ
+/// @param export_data エクスポートするデータ (単位と並べ替え・共有の設定)
+/// @param out 変換結果の出力先
+/// @param stats 統計の記録先
+void prepare_mesh(const Mesh* emesh, const IOData* export_data,
+                  PreparedMesh& out, StatsRecorder& stats)
+{
+    StatsScope mesh_scope(stats, STATS_PHASE_MESHES, STATS_PHASE_COUNT, true);
+
+    // メッシュの頂点座標を設定、Z-up to Y-up (呼び出し元の配列は変更しない)
+    double m[16];
+    axis_conversion_matrix(export_data->unit_scale * 100.0, true, m);
+    out.control_points.resize(emesh->vertex_count);
+    auto control_points = (Vector4*)out.control_points.data();
+    if (emesh->scalar_type == SCALAR_FLOAT32)
+        transform_points(m, (const float*)emesh->vertices, control_points,
+                         emesh->vertex_count);
+    else
+        transform_points(m, emesh->vertices, control_points,
+                         emesh->vertex_count);
+
+    // スムーズで法線が渡されていない場合は自動スムーズの法線を計算する
+    if (emesh->is_smooth && emesh->normal_set_count == 0)
+    {
+        StatsScope scope(stats, STATS_PHASE_LAYERS, STATS_PHASE_MESHES, true);
+        export_smooth_normals(emesh, out.smooth_normals);
+    }
+
+    // 設定に応じてポリゴンを並べ替え、法線・UVの同じ値をまとめる
+    if (export_data->weld_corner_attributes ||
+        export_data->optimize_vertex_cache)
+    {
+        auto smooth = out.smooth_normals.empty() ? nullptr
+                                                 : out.smooth_normals.data();
+        build_mesh_layout(emesh, smooth, export_data->weld_corner_attributes,
+                          export_data->optimize_vertex_cache, out.layout);
+    }
+}
+
+/// @brief FBX SDKの書き出しの進捗を報告する
+/// @param args 報告先のExportMonitor
+/// @param percentage 進捗 (0-100)
+/// @param status 処理中の内容 (使わない)
+/// @return 書き出しを続けるかどうか (falseで中断する)
+bool sdk_export_progress(void* args, float percentage,
+                         [[maybe_unused]] const char* status)
+{
+    auto monitor = (ExportMonitor*)args;
+    monitor->set_items_done((size_t)std::clamp(percentage, 0.0f, 100.0f));
+    return !monitor->cancelled();
 }
 
 /// @brief メッシュを作成する
 /// @param mesh_data メッシュのデータ
+/// @param prepared 変換済みのメッシュ
 /// @param name メッシュの名前
 /// @param scene メッシュを登録するシーン
-/// @param unit_scale 単位
+/// @param stats 統計の記録先 (ノードツリーの作成中に呼び出される)
 /// @return 作成されたメッシュ
-FbxMesh* create_mesh(const Mesh* emesh, const char* name, FbxScene* scene,
-                     double unit_scale)
+FbxMesh* create_mesh(const Mesh* emesh, const PreparedMesh& prepared,
+                     const char* name, FbxScene* scene, StatsRecorder& stats)
 {
+    StatsScope mesh_scope(stats, STATS_PHASE_MESHES, STATS_PHASE_NODES);
+
     auto mesh = FbxMesh::Create(scene, name);
 
     mesh->InitControlPoints(emesh->vertex_count);
-    auto control_points = mesh->GetControlPoints();
-
-    // メッシュの頂点座標を設定、Z-up to Y-up
-    fix_coord(unit_scale, emesh->vertices, emesh->vertex_count);
-    std::memcpy(control_points, emesh->vertices,
-                emesh->vertex_count * sizeof(Vector4));
+    std::memcpy(mesh->GetControlPoints(), prepared.control_points.data(),
+                emesh->vertex_count * sizeof(FbxVector4));
 
     // メッシュのポリゴンを設定
-    for (auto i = 0; i < emesh->poly_count; i++)
-    {
-        auto curr_index = emesh->polys[i];
-        auto next_index = (i == emesh->poly_count - 1)
-                              ? emesh->index_count
-                              : emesh->polys[i + 1];
+    auto& layout = prepared.layout;
+    set_polygons(emesh, layout, mesh);
 
-        mesh->BeginPolygon();
-        for (int j = curr_index; j < next_index; j++)
-            mesh->AddPolygon(emesh->indices[j]);
-        mesh->EndPolygon();
-    }
+    // ここから後はレイヤー要素
+    StatsScope layer_scope(stats, STATS_PHASE_LAYERS, STATS_PHASE_MESHES);
+    auto order = layout.reordered() ? layout.corner_order.data() : nullptr;
 
     // 頂点法線の設定
-    if (!emesh->is_smooth)
-    for (auto i = 0; i < emesh->normal_set_count; i++)
+    for (size_t i = 0; i < emesh->normal_set_count; i++)
     {
         auto elnrm = mesh->CreateElementNormal();
-        set_normal(&emesh->normal_sets[i], emesh->index_count, elnrm);
+        set_normal(&emesh->normal_sets[i], emesh->index_count,
+                   emesh->scalar_type,
+                   layout.welded() ? &layout.normals[i] : nullptr, order,
+                   elnrm);
+    }
+    if (!prepared.smooth_normals.empty())
+    {
+        Normal smooth = {};
+        smooth.name = (char*)"Normal";
+        smooth.normal = (Vector4*)prepared.smooth_normals.data();
+        set_normal(&smooth, emesh->index_count, SCALAR_FLOAT64,
+                   layout.welded() ? &layout.normals.back() : nullptr, order,
+                   mesh->CreateElementNormal());
     }
 
     // UVの設定
-    for (auto i = 0; i < emesh->uv_set_count; i++)
+    for (size_t i = 0; i < emesh->uv_set_count; i++)
     {
         auto eluv = mesh->CreateElementUV(emesh->uv_sets[i].name);
-        set_uv(&emesh->uv_sets[i], emesh->index_count, eluv);
+        set_uv(&emesh->uv_sets[i], emesh->index_count, emesh->scalar_type,
+               layout.welded() ? &layout.uvs[i] : nullptr, order, eluv);
     }
 
     // マテリアルの設定
     auto elmat = mesh->CreateElementMaterial();
     elmat->SetMappingMode(FbxGeometryElement::eByPolygon);
     elmat->SetReferenceMode(FbxGeometryElement::eIndexToDirect);
-    elmat->GetIndexArray().SetCount(emesh->poly_count);
-    for (auto i = 0; i < emesh->poly_count; i++)
+    auto& mat_indices = elmat->GetIndexArray();
+    mat_indices.SetCount(emesh->poly_count);
+    auto mat_data = mat_indices.GetLocked(FbxLayerElementArray::eWriteLock);
+    if (!layout.reordered())
     {
-        elmat->GetIndexArray().SetAt(i, emesh->material_indices[i]);
+        std::memcpy(mat_data, emesh->material_indices,
+                    emesh->poly_count * sizeof(int));
     }
+    else
+    {
+        auto dst = (int*)mat_data;
+        for (size_t i = 0; i < emesh->poly_count; i++)
+            dst[i] = (int)emesh->material_indices[layout.poly_order[i]];
+    }
+    mat_indices.Release(&mat_data);
 
     return mesh;
 }
 
+/// @brief メッシュのポリゴンをFBX SDKの公開APIで設定する
+/// 配列は先に確保しておき、AddPolygonで配列を伸ばし直さないようにする
+/// @param emesh メッシュのデータ
+/// @param layout 書き出す並び (並べ替えた場合は出力順に読む)
+/// @param mesh 設定先のメッシュ
+void set_polygons(const Mesh* emesh, const MeshLayout& layout, FbxMesh* mesh)
+{
+    auto poly_count = emesh->poly_count;
+    auto index_count = emesh->index_count;
+    auto polys = layout.reordered() ? layout.polys.data() : emesh->polys;
+    auto order = layout.reordered() ? layout.corner_order.data() : nullptr;
+
+    mesh->ReservePolygonCount((int)poly_count);
+    mesh->ReservePolygonVertexCount((int)index_count);
+
+    // 全て三角形か四角形なら面ごとの開始位置を見なくてよい
+    auto uniform_size = uniform_polygon_size(emesh);
+    for (size_t i = 0; i < poly_count; i++)
+    {
+        size_t begin = i * uniform_size, end = begin + uniform_size;
+        if (uniform_size == 0)
+        {
+            begin = polys[i];
+            end = i + 1 < poly_count ? polys[i + 1] : index_count;
+        }
+        // マテリアルは後からレイヤー要素でまとめて設定する
+        mesh->BeginPolygon(-1, -1, -1, false);
+        for (auto j = begin; j < end; j++)
+        {
+            auto corner = order != nullptr ? order[j] : j;
+            mesh->AddPolygon((int)emesh->indices[corner]);
+        }
+        mesh->EndPolygon();
+    }
+}
+
 /// @brief マテリアルを読み込む
 /// @param scene マテリアルを読み込むシーン
+/// @param arena 確保に使用する領域
+/// @param names 名前の表
 /// @param out_mats マテリアルの出力先
+/// @param out_map シーンのマテリアルから読み込み先を引く表の出力先
 /// @return マテリアルの個数
-int read_materials(FbxScene* scene, Material** out_mats)
+int read_materials(FbxScene* scene, Arena& arena, NameTable& names,
+                   Material** out_mats, FbxMaterialMap& out_map)
 {
     auto mat_count = scene->GetMaterialCount();
-    auto mats = new Material[mat_count];
+    auto mats = arena.allocate<Material>(mat_count);
+    out_map.reserve(mat_count);
     for (auto i = 0; i < mat_count; i++)
     {
         auto fbx_mat = scene->GetMaterial(i);
-        mats[i].name = new char[strlen(fbx_mat->GetName()) + 1];
-        std::strcpy(mats[i].name, fbx_mat->GetName());
+        mats[i].name = names.intern(fbx_mat->GetName(), &mats[i].name_length);
+        out_map.emplace(fbx_mat, &mats[i]);
     }
     *out_mats = mats;
     return mat_count;
@@ -574,59 +1578,104 @@ void define_property(FbxSurfaceMaterial* mat, const char* name,
 /// @brief メッシュに対して頂点法線を設定する
 /// @param input 頂点法線のデータ (配列)
 /// @param input_count 頂点法線の数
+/// @param type 頂点法線の格納形式
+/// @param welded 同じ値をまとめた結果 (まとめない場合はnullptr)
+/// @param order 出力順のポリゴン頂点 -> 元の位置 (並べ替えない場合はnullptr)
 /// @param target 設定する対象のジオメトリ
-void set_normal(const Normal* input, size_t input_count,
+void set_normal(const Normal* input, size_t input_count, ScalarType type,
+                const WeldedLayer* welded, const unsigned int* order,
                 FbxGeometryElementNormal* target)
 {
     target->SetName(input->name);
     target->SetMappingMode(FbxGeometryElement::eByPolygonVertex);
-    target->SetReferenceMode(FbxGeometryElement::eDirect);
-
-    for (auto i = 0; i < input_count; i++)
-    {
-        auto normal = input->normal[i];
-        target->GetDirectArray().Add(*(FbxVector4*)&normal);
-    }
+    target->SetReferenceMode(welded != nullptr
+                                 ? FbxGeometryElement::eIndexToDirect
+                                 : FbxGeometryElement::eDirect);
+
+    // Vector4とFbxVector4は同じ並びなのでまとめてコピーする (floatなら広げる)
+    auto gather = welded != nullptr ? welded->values.data() : order;
+    auto value_count = welded != nullptr ? welded->values.size() : input_count;
+    auto& direct = target->GetDirectArray();
+    direct.SetCount(value_count);
+    auto data = direct.GetLocked(FbxLayerElementArray::eWriteLock);
+    visit_points(type, input->normal, [&](auto view) {
+        if (gather != nullptr)
+            gather_packed<4>(view, gather, value_count, (double*)data);
+        else
+            widen_packed<4>(view, 0, value_count, (double*)data);
+    });
+    direct.Release(&data);
+    if (welded != nullptr) set_layer_index(welded->index, target);
 }
 
 /// @brief メッシュに対してUVを設定する
 /// @param input UVのデータ (配列)
 /// @param input_count UVの数
+/// @param type UVの格納形式
+/// @param welded 同じ値をまとめた結果 (まとめない場合はnullptr)
+/// @param order 出力順のポリゴン頂点 -> 元の位置 (並べ替えない場合はnullptr)
 /// @param target 設定する対象のジオメトリ
-void set_uv(const UV* input, size_t input_count, FbxGeometryElementUV* target)
+void set_uv(const UV* input, size_t input_count, ScalarType type,
+            const WeldedLayer* welded, const unsigned int* order,
+            FbxGeometryElementUV* target)
 {
     target->SetName(input->name);
     target->SetMappingMode(FbxGeometryElement::eByPolygonVertex);
-    target->SetReferenceMode(FbxGeometryElement::eDirect);
-    for (auto i = 0; i < input_count; i++)
-    {
-        auto uv = input->uv[i];
-        target->GetDirectArray().Add(*(FbxVector2*)&uv);
-    }
+    target->SetReferenceMode(welded != nullptr
+                                 ? FbxGeometryElement::eIndexToDirect
+                                 : FbxGeometryElement::eDirect);
+
+    // Vector2とFbxVector2は同じ並びなのでまとめてコピーする (floatなら広げる)
+    auto gather = welded != nullptr ? welded->values.data() : order;
+    auto value_count = welded != nullptr ? welded->values.size() : input_count;
+    auto& direct = target->GetDirectArray();
+    direct.SetCount(value_count);
+    auto data = direct.GetLocked(FbxLayerElementArray::eWriteLock);
+    visit_uvs(type, input->uv, [&](auto view) {
+        if (gather != nullptr)
+            gather_packed<2>(view, gather, value_count, (double*)data);
+        else
+            widen_packed<2>(view, 0, value_count, (double*)data);
+    });
+    direct.Release(&data);
+    if (welded != nullptr) set_layer_index(welded->index, target);
+}
+
+/// @brief レイヤー要素のインデックス配列を設定する (IndexToDirect用)
+/// @param index ポリゴン頂点ごとの値の番号
+/// @param target 設定する対象のレイヤー要素
+template <typename T>
+void set_layer_index(const std::vector<unsigned int>& index,
+                     FbxLayerElementTemplate<T>* target)
+{
+    auto& indices = target->GetIndexArray();
+    indices.SetCount((int)index.size());
+    auto data = indices.GetLocked(FbxLayerElementArray::eWriteLock);
+    std::memcpy(data, index.data(), index.size() * sizeof(int));
+    indices.Release(&data);
 }
+#endif
 
 /// @brief 面法線から頂点法線を計算する
-/// @param indices 頂点インデックスの配列
+/// @param indices 頂点インデックスの配列 (ポリゴン頂点ごとに出力するので使わない)
 /// @param index_count 頂点インデックスの数
 /// @param polys ポリゴン開始インデックスの配列
 /// @param poly_count ポリゴン数
 /// @param poly_normals ポリゴン法線の配列
 /// @param out_vertex_normals 計算した頂点法線の出力先
-void vnrm_from_pnrm(const unsigned int* indices, size_t index_count,
+void vnrm_from_pnrm([[maybe_unused]] const unsigned int* indices,
+                    size_t index_count,
                     const unsigned int* polys, size_t poly_count,
                     const Vector4* poly_normals, Vector4* out_vertex_normals)
 {
-    std::vector<Vector4> vertex_normals;
-    vertex_normals.resize(index_count);
-    for (auto i = 0; i < poly_count; i++)
-    {
-        auto normal = poly_normals[i];
-        FbxAMatrix m;
-        m.SetIdentity();
-        m = fix_rot_m(m);
-        auto f_nrm = m.MultT(*(FbxVector4*)&normal);
-        normal = *(Vector4*)&f_nrm;
+    // 面法線をまとめてZ-up to Y-upに変換してから各頂点に配る
+    double m[16];
+    axis_conversion_matrix(1.0, true, m);
+    std::vector<Vector4> normals(poly_count);
+    transform_normals(m, poly_normals, normals.data(), poly_count, false);
 
+    for (size_t i = 0; i < poly_count; i++)
+    {
         // polysはポリゴンの開始インデックスの配列
         // 例: polys = {0, 3, 6, 9} ならば、0-2, 3-5, 6-8, 9-11がポリゴン
         auto curr_index = polys[i];
@@ -634,113 +1683,25 @@ void vnrm_from_pnrm(const unsigned int* indices, size_t index_count,
 
         for (auto j = curr_index; j < next_index; j++)
         {
-            vertex_normals[j] = normal;
+            out_vertex_normals[j] = normals[i];
         }
     }
-    for (auto i = 0; i < index_count; i++)
-    {
-        out_vertex_normals[i] = vertex_normals[i];
-    }
-}
-
-/// @brief ジオメトリの座標系を修正する
-/// @param unit_scale 単位
-/// @param vertices 修正する頂点の配列
-/// @param vertex_count 頂点の数
-void fix_coord(double unit_scale, Vector4* vertices, size_t vertex_count)
-{
-    auto cm_scale = unit_scale * 100.0;
-    auto vecs = (FbxVector4*)vertices;
-
-    FbxAMatrix m;
-    m.SetIdentity();
-    m = fix_rot_m(m);
-    m = fix_scale_m(m, unit_scale);
-    for (size_t i = 0; i < vertex_count; i++) { vecs[i] = m.MultT(vecs[i]); }
 }
 
-/// @brief 座標系を修正する行列を作成する
-/// @param input 入力行列
-/// @return 修正された行列
-FbxAMatrix fix_rot_m(const FbxAMatrix& input)
+/// @brief 法線の座標系を修正する (Z-up to Y-up)
+/// @param normals 修正する法線の配列
+/// @param normal_count 法線の数
+void fix_normal_rot(Vector4* normals, size_t normal_count)
 {
-    FbxAMatrix m(input);
-    auto rad = cos(M_PI / 4.0);
-    m.SetQ(FbxQuaternion(rad, 0, 0, -rad)); // Z-up to Y-up
-    return m;
+    double m[16];
+    axis_conversion_matrix(1.0, true, m);
+    transform_normals(m, normals, normals, normal_count, false);
 }
 
-/// @brief 大きさを修正する行列を作成する
-/// @param input 入力行列
-/// @param unit_scale 単位
-/// @return 修正された行列
-FbxAMatrix fix_scale_m(const FbxAMatrix& input, double unit_scale)
-{
-    FbxAMatrix m(input);
-    auto cm_scale = unit_scale * 100.0;
-    m.SetS(FbxVector4(cm_scale, cm_scale, cm_scale));
-    return m;
-}
-
-/// @brief IODataのメモリを解放する
-/// @param data 解放するデータ
+/// @brief インポートしたIODataのメモリを解放する
+/// @param data 解放するデータ (確保領域ごと解放される)
 void delete_iodata(IOData* data)
 {
     if (data == nullptr) return;
-    if (data->root != nullptr) recursive_delete_object(data->root);
-    if (data->materials != nullptr) delete[] data->materials;
-    delete data;
-}
-
-/// @brief Objectのメモリを再帰的に解放する
-/// @param object 解放するオブジェクト
-void recursive_delete_object(Object* object)
-{
-    if (object == nullptr) return;
-    if (object->name != nullptr) delete[] object->name;
-    if (object->children != nullptr)
-    {
-        for (auto i = 0; i < object->child_count; i++)
-        {
-            recursive_delete_object(&object->children[i]);
-        }
-        delete[] object->children;
-    }
-    if (object->mesh != nullptr) delete_mesh(object->mesh);
-    if (object->material_slots != nullptr) delete[] object->material_slots;
-    delete object;
-}
-
-/// @brief Meshのメモリを解放する
-/// @param mesh 解放するメッシュ
-void delete_mesh(Mesh* mesh)
-{
-    if (mesh == nullptr) return;
-    if (mesh->name != nullptr) delete[] mesh->name;
-    if (mesh->vertices != nullptr) delete[] mesh->vertices;
-    if (mesh->indices != nullptr) delete[] mesh->indices;
-    if (mesh->polys != nullptr) delete[] mesh->polys;
-    if (mesh->material_indices != nullptr) delete[] mesh->material_indices;
-    if (mesh->uv_sets != nullptr)
-    {
-        for (auto i = 0; i < mesh->uv_set_count; i++)
-        {
-            if (mesh->uv_sets[i].name != nullptr)
-                delete[] mesh->uv_sets[i].name;
-            if (mesh->uv_sets[i].uv != nullptr) delete[] mesh->uv_sets[i].uv;
-        }
-        delete[] mesh->uv_sets;
-    }
-    if (mesh->normal_sets != nullptr)
-    {
-        for (auto i = 0; i < mesh->normal_set_count; i++)
-        {
-            if (mesh->normal_sets[i].name != nullptr)
-                delete[] mesh->normal_sets[i].name;
-            if (mesh->normal_sets[i].normal != nullptr)
-                delete[] mesh->normal_sets[i].normal;
-        }
-        delete[] mesh->normal_sets;
-    }
-    delete mesh;
+    delete (Arena*)data->arena;
 }
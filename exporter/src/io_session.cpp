@@ -0,0 +1,114 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "io_session.h"
+
+#include <algorithm>
+#include <thread>
+
+#ifdef HALFBX_WITH_FBXSDK
+std::mutex& sdk_manager_mutex();
+SdkManager* create_sdk_manager();
+void destroy_sdk_manager(SdkManager* entry);
+#endif
+
+/// @brief FbxManagerを使い回す入出力のセッションを作る
+/// @param max_managers 同時にFBX SDKで入出力する数の上限 (0ならコア数)
+/// @return セッション (delete_io_sessionで解放する)
+IOSession* create_io_session(size_t max_managers)
+{
+    auto session = new IOSession();
+    session->capacity =
+        max_managers > 0
+            ? max_managers
+            : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    return session;
+}
+
+/// @brief セッションを解放する (実行中の入出力があれば終わるまで待つ)
+/// @param session セッション
+void delete_io_session(IOSession* session)
+{
+    if (session == nullptr) return;
+    {
+        std::unique_lock lock(session->mutex);
+        session->released.wait(lock, [&] { return session->in_use == 0; });
+    }
+#ifdef HALFBX_WITH_FBXSDK
+    for (auto entry : session->idle) destroy_sdk_manager(entry);
+#endif
+    delete session;
+}
+
+#ifdef HALFBX_WITH_FBXSDK
+SdkManagerLease::SdkManagerLease(IOSession* session) : session(session)
+{
+    if (session != nullptr)
+    {
+        std::unique_lock lock(session->mutex);
+        session->released.wait(
+            lock, [&] { return session->in_use < session->capacity; });
+        session->in_use++;
+        if (!session->idle.empty())
+        {
+            entry = session->idle.back();
+            session->idle.pop_back();
+            return;
+        }
+    }
+    entry = create_sdk_manager();
+}
+
+SdkManagerLease::~SdkManagerLease()
+{
+    for (auto it = scenes.rbegin(); it != scenes.rend(); ++it)
+        (*it)->Destroy(true);
+    if (session == nullptr)
+    {
+        destroy_sdk_manager(entry);
+        return;
+    }
+    {
+        std::lock_guard lock(session->mutex);
+        session->idle.push_back(entry);
+        session->in_use--;
+    }
+    session->released.notify_all();
+}
+
+FbxScene* SdkManagerLease::create_scene(const char* name)
+{
+    auto scene = FbxScene::Create(entry->manager, name);
+    scenes.push_back(scene);
+    return scene;
+}
+
+/// @brief FbxManagerの作成・破棄をプロセス全体で直列にするための排他
+std::mutex& sdk_manager_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+/// @brief FbxManagerを作り、書き出し形式のIDを引いておく
+SdkManager* create_sdk_manager()
+{
+    std::lock_guard lock(sdk_manager_mutex());
+    auto entry = new SdkManager();
+    entry->manager = FbxManager::Create();
+    auto registry = entry->manager->GetIOPluginRegistry();
+    entry->binary_writer =
+        registry->FindWriterIDByDescription("FBX binary (*.fbx)");
+    entry->ascii_writer =
+        registry->FindWriterIDByDescription("FBX ascii (*.fbx)");
+    return entry;
+}
+
+void destroy_sdk_manager(SdkManager* entry)
+{
+    std::lock_guard lock(sdk_manager_mutex());
+    entry->manager->Destroy();
+    delete entry;
+}
+#endif
@@ -0,0 +1,73 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// FBX SDKのマネージャを入出力の間で使い回す (IOSessionの実装)
+// FbxManagerの作成・破棄はプロセス全体で1つずつ行い、
+// 作ったマネージャは同時に1つの入出力だけが使う
+
+#pragma once
+
+#include "../include/io.h"
+
+#ifdef HALFBX_WITH_FBXSDK
+    #include <fbxsdk.h>
+#endif
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#ifdef HALFBX_WITH_FBXSDK
+/// @brief 使い回すFbxManager (書き出し形式のIDは作ったときに引いておく)
+struct SdkManager
+{
+    FbxManager* manager = nullptr;
+    int binary_writer = -1;
+    int ascii_writer = -1;
+};
+#endif
+
+/// @brief FbxManagerを使い回す入出力のセッション
+struct IOSession
+{
+    size_t capacity = 1; // 同時に貸し出すマネージャの最大数
+    std::mutex mutex;
+    std::condition_variable released;
+    size_t in_use = 0; // 貸し出し中のマネージャの数
+#ifdef HALFBX_WITH_FBXSDK
+    std::vector<SdkManager*> idle; // 作成済みで空いているマネージャ
+#endif
+};
+
+#ifdef HALFBX_WITH_FBXSDK
+/// @brief 1回の入出力の間だけ借りるFbxManager
+/// 返すときに、登録したシーンを中身ごと破棄する
+/// セッションがnullptrならその場で作り、返すときにマネージャごと破棄する
+class SdkManagerLease
+{
+  public:
+    /// @param session 借りる先 (全て貸し出し中なら空くまで待つ)
+    explicit SdkManagerLease(IOSession* session);
+    ~SdkManagerLease();
+    SdkManagerLease(const SdkManagerLease&) = delete;
+    SdkManagerLease& operator=(const SdkManagerLease&) = delete;
+
+    FbxManager* manager() const { return entry->manager; }
+
+    /// @brief 形式に応じた書き出しのID
+    int writer_id(bool is_ascii) const
+    {
+        return is_ascii ? entry->ascii_writer : entry->binary_writer;
+    }
+
+    /// @brief 返すときに破棄するシーンを作る
+    FbxScene* create_scene(const char* name);
+
+  private:
+    IOSession* session;
+    SdkManager* entry = nullptr;
+    std::vector<FbxScene*> scenes;
+};
+#endif
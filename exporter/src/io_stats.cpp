@@ -0,0 +1,200 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "io_stats.h"
+
+#include <filesystem>
+#include <unordered_set>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
+
+/// @brief 最後に終わった入出力の統計 (スレッドごと)
+struct LastStats
+{
+    IOStats stats = {};
+    bool valid = false;
+};
+
+LastStats& last_stats();
+void count_objects(const Object* object, IOStats& stats,
+                   std::unordered_set<const Mesh*>& meshes);
+
+StatsRecorder::StatsRecorder() : begin(std::chrono::steady_clock::now()) {}
+
+void StatsRecorder::add(StatsPhase phase, double wall, double cpu)
+{
+    wall_ns[phase] += (int64_t)(wall * 1e9);
+    cpu_ns[phase] += (int64_t)(cpu * 1e9);
+}
+
+double StatsRecorder::cpu_seconds(StatsPhase phase) const
+{
+    return (double)cpu_ns[phase] * 1e-9;
+}
+
+void StatsRecorder::track_allocation(int64_t bytes)
+{
+    auto now = allocated += bytes;
+    auto peak = peak_allocated.load();
+    while (now > peak && !peak_allocated.compare_exchange_weak(peak, now))
+    {
+    }
+}
+
+void StatsRecorder::publish(bool succeeded)
+{
+    // 区間の差し引きで負になった分は0にする (時計の分解能による誤差)
+    result.cpu_seconds = 0.0;
+    for (int i = 0; i < STATS_PHASE_COUNT; i++)
+    {
+        auto& phase = result.phases[i];
+        phase.wall_seconds = std::max<double>(0.0, (double)wall_ns[i] * 1e-9);
+        phase.cpu_seconds = std::max<double>(0.0, (double)cpu_ns[i] * 1e-9);
+        result.cpu_seconds += phase.cpu_seconds;
+    }
+    result.wall_seconds = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - begin)
+                              .count();
+    result.peak_allocated_bytes = (uint64_t)std::max<int64_t>(0, peak_allocated);
+    result.succeeded = succeeded;
+
+    auto& last = last_stats();
+    last.stats = result;
+    last.valid = true;
+}
+
+StatsScope::StatsScope(StatsRecorder& recorder, StatsPhase phase,
+                       StatsPhase parent, bool in_task)
+    : recorder(recorder), phase(phase), parent(parent), in_task(in_task),
+      wall_begin(std::chrono::steady_clock::now()),
+      cpu_begin(thread_cpu_seconds())
+{
+}
+
+StatsScope::~StatsScope()
+{
+    auto cpu = thread_cpu_seconds() - cpu_begin;
+    auto wall = in_task ? 0.0
+                        : std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - wall_begin)
+                              .count();
+    recorder.add(phase, wall, cpu);
+    if (parent != STATS_PHASE_COUNT) recorder.add(parent, -wall, -cpu);
+}
+
+StatsParallelScope::StatsParallelScope(
+    StatsRecorder& recorder, std::initializer_list<StatsPhase> phases)
+    : recorder(recorder), phases(phases),
+      wall_begin(std::chrono::steady_clock::now())
+{
+    for (auto phase : phases) cpu_begin.push_back(recorder.cpu_seconds(phase));
+}
+
+StatsParallelScope::~StatsParallelScope()
+{
+    auto wall = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - wall_begin)
+                    .count();
+    std::vector<double> cpu(phases.size());
+    double total = 0.0;
+    for (size_t i = 0; i < phases.size(); i++)
+    {
+        cpu[i] = std::max(0.0, recorder.cpu_seconds(phases[i]) - cpu_begin[i]);
+        total += cpu[i];
+    }
+    for (size_t i = 0; i < phases.size(); i++)
+    {
+        // CPU時間が測れなければ最初の段階にまとめる
+        auto share = total > 0.0 ? cpu[i] / total : (i == 0 ? 1.0 : 0.0);
+        recorder.add(phases[i], wall * share, 0.0);
+    }
+}
+
+/// @brief 呼び出したスレッドのCPU時間 (秒)
+double thread_cpu_seconds()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0.0;
+    auto ticks = [](const FILETIME& t) {
+        return ((uint64_t)t.dwHighDateTime << 32) | t.dwLowDateTime;
+    };
+    return (double)(ticks(kernel) + ticks(user)) * 1e-7;
+#else
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0.0;
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+/// @brief シーンのノード・メッシュ・ポリゴン頂点・マテリアルの数を数える
+/// メッシュは同じポインタを1回だけ数え、ルートノードは数えない
+/// @param data シーン
+/// @param stats 出力先
+void count_scene(const IOData* data, IOStats& stats)
+{
+    if (data == nullptr) return;
+    stats.material_count = data->material_count;
+    if (data->root == nullptr) return;
+    std::unordered_set<const Mesh*> meshes;
+    for (size_t i = 0; i < data->root->child_count; i++)
+        count_objects(&data->root->children[i], stats, meshes);
+}
+
+/// @brief オブジェクトとその子孫を数える
+/// @param object オブジェクト
+/// @param stats 出力先
+/// @param meshes 数えたメッシュ
+void count_objects(const Object* object, IOStats& stats,
+                   std::unordered_set<const Mesh*>& meshes)
+{
+    stats.node_count++;
+    if (object->mesh != nullptr && meshes.insert(object->mesh).second)
+    {
+        stats.mesh_count++;
+        stats.corner_count += object->mesh->index_count;
+    }
+    for (size_t i = 0; i < object->child_count; i++)
+        count_objects(&object->children[i], stats, meshes);
+}
+
+/// @brief ファイルのバイト数 (開けなければ0)
+/// @param path ファイルのパス (UTF-8)
+uint64_t file_size_or_zero(const char* path)
+{
+    if (path == nullptr) return 0;
+    std::error_code error;
+    auto size = std::filesystem::file_size(
+        std::filesystem::path((const char8_t*)path), error);
+    return error ? 0 : size;
+}
+
+/// @brief 呼び出したスレッドの最後の統計
+/// (同時に別のスレッドで入出力しても上書きされないようにスレッドごとに持つ)
+LastStats& last_stats()
+{
+    thread_local LastStats last;
+    return last;
+}
+
+/// @brief このスレッドで最後に終わった入出力 (export_fbx, import_fbx,
+/// import_fbx_stream) の統計を取得する
+/// start_export_fbxの統計は別のスレッドで取るのでget_export_job_statsで取得する
+/// @param out_stats 出力先
+/// @return 統計があったかどうか (このスレッドでまだ一度も入出力していなければfalse)
+bool get_last_stats(IOStats* out_stats)
+{
+    if (out_stats == nullptr) return false;
+    auto& last = last_stats();
+    if (!last.valid) return false;
+    *out_stats = last.stats;
+    return true;
+}
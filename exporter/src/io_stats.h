@@ -0,0 +1,94 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 入出力の段階ごとの時間・件数・確保量の計測 (get_last_statsで取得する)
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+/// @brief 1回の入出力の計測
+/// 段階ごとの時間は複数のスレッドから足してよい
+class StatsRecorder
+{
+  public:
+    StatsRecorder();
+    StatsRecorder(const StatsRecorder&) = delete;
+    StatsRecorder& operator=(const StatsRecorder&) = delete;
+
+    /// @brief 段階に時間を足す (負の値で差し引く)
+    void add(StatsPhase phase, double wall, double cpu);
+    double cpu_seconds(StatsPhase phase) const;
+
+    /// @brief 確保量を足す (解放したら負の値を渡す)
+    void track_allocation(int64_t bytes);
+
+    /// @brief 件数とバイト数の格納先 (呼び出し元のスレッドでのみ書き込む)
+    IOStats& counts() { return result; }
+
+    /// @brief 計測を終えて、同じスレッドのget_last_statsで取得できるようにする
+    /// @param succeeded 入出力に成功したかどうか
+    void publish(bool succeeded);
+
+  private:
+    IOStats result = {};
+    std::atomic<int64_t> wall_ns[STATS_PHASE_COUNT] = {};
+    std::atomic<int64_t> cpu_ns[STATS_PHASE_COUNT] = {};
+    std::atomic<int64_t> allocated = 0;
+    std::atomic<int64_t> peak_allocated = 0;
+    std::chrono::steady_clock::time_point begin;
+};
+
+/// @brief 区間の時間を段階に足す
+/// 外側の区間の段階を指定すると、この区間の分をそちらから差し引く
+class StatsScope
+{
+  public:
+    /// @param recorder 計測先
+    /// @param phase 段階
+    /// @param parent 外側の区間の段階 (無ければSTATS_PHASE_COUNT)
+    /// @param in_task 並列処理の中ならtrue (CPU時間だけを足し、経過時間は
+    ///                StatsParallelScopeでまとめて分ける)
+    StatsScope(StatsRecorder& recorder, StatsPhase phase,
+               StatsPhase parent = STATS_PHASE_COUNT, bool in_task = false);
+    ~StatsScope();
+    StatsScope(const StatsScope&) = delete;
+    StatsScope& operator=(const StatsScope&) = delete;
+
+  private:
+    StatsRecorder& recorder;
+    StatsPhase phase;
+    StatsPhase parent;
+    bool in_task;
+    std::chrono::steady_clock::time_point wall_begin;
+    double cpu_begin;
+};
+
+/// @brief 並列処理全体の区間
+/// 経過時間を、中の段階に足されたCPU時間の比で分ける
+class StatsParallelScope
+{
+  public:
+    StatsParallelScope(StatsRecorder& recorder,
+                       std::initializer_list<StatsPhase> phases);
+    ~StatsParallelScope();
+    StatsParallelScope(const StatsParallelScope&) = delete;
+    StatsParallelScope& operator=(const StatsParallelScope&) = delete;
+
+  private:
+    StatsRecorder& recorder;
+    std::vector<StatsPhase> phases;
+    std::vector<double> cpu_begin;
+    std::chrono::steady_clock::time_point wall_begin;
+};
+
+double thread_cpu_seconds();
+void count_scene(const IOData* data, IOStats& stats);
+uint64_t file_size_or_zero(const char* path);
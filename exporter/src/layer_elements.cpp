@@ -0,0 +1,321 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "layer_elements.h"
+#include "mesh_layout.h"
+
+#include <algorithm>
+#include <cstring>
+
+template <size_t N, typename Item>
+void gather_layer(const LayerSource& source, size_t corner_count, Item item,
+                  double* out, size_t out_stride);
+template <typename Item>
+void index_layer(const LayerSource& source, size_t corner_count, Item item,
+                 IndexedLayer& out);
+template <typename Item>
+bool gather_layer_components(const LayerSource& source, size_t corner_count,
+                             size_t components, Item item, double* out,
+                             size_t out_stride);
+
+/// @brief ポリゴン頂点ごとのポリゴン番号を求める
+/// @param polys ポリゴンの開始位置
+/// @param poly_count ポリゴン数
+/// @param corner_count ポリゴン頂点数
+/// @return ポリゴン頂点ごとのポリゴン番号
+std::vector<unsigned int> corner_polygons(const unsigned int* polys,
+                                          size_t poly_count,
+                                          size_t corner_count)
+{
+    std::vector<unsigned int> out(corner_count, 0);
+    for (size_t i = 0; i < poly_count; i++)
+    {
+        auto begin = std::min<size_t>(polys[i], corner_count);
+        auto end = i + 1 < poly_count
+                       ? std::min<size_t>(polys[i + 1], corner_count)
+                       : corner_count;
+        if (begin < end)
+            std::fill(out.begin() + begin, out.begin() + end, (unsigned int)i);
+    }
+    return out;
+}
+
+/// @brief レイヤー要素をポリゴン頂点ごとの値に展開する
+/// 範囲外を参照するポリゴン頂点は0にする
+/// @param source レイヤー要素
+/// @param topology ポリゴン頂点の並び
+/// @param components 展開する成分数 (1-4)
+/// @param out 出力先 (ポリゴン頂点数 * out_stride)
+/// @param out_stride 出力の1要素あたりの成分数
+/// @return 展開できたかどうか (対応していない割り当て方ならfalse)
+bool expand_layer_corners(const LayerSource& source,
+                          const CornerTopology& topology, size_t components,
+                          double* out, size_t out_stride)
+{
+    auto count = topology.corner_count;
+    if (components == 0 || components > 4 || components > source.value_stride ||
+        components > out_stride)
+        return false;
+
+    switch (source.mapping)
+    {
+    case LayerMapping::ByPolygonVertex:
+        // 最も多い形 (Directで成分数が同じ) は1回のコピーで済ませる
+        if (source.index == nullptr && source.value_count >= count &&
+            source.value_stride == components && out_stride == components)
+        {
+            std::memcpy(out, source.values,
+                        count * components * sizeof(double));
+            return true;
+        }
+        return gather_layer_components(
+            source, count, components, [](size_t i) { return i; }, out,
+            out_stride);
+    case LayerMapping::ByControlPoint:
+        return gather_layer_components(
+            source, count, components,
+            [&](size_t i) { return (size_t)topology.indices[i]; }, out,
+            out_stride);
+    case LayerMapping::ByPolygon:
+        return gather_layer_components(
+            source, count, components,
+            [&](size_t i) { return (size_t)topology.corner_polys[i]; }, out,
+            out_stride);
+    case LayerMapping::AllSame:
+        return gather_layer_components(
+            source, count, components, [](size_t) { return (size_t)0; }, out,
+            out_stride);
+    default:
+        return false;
+    }
+}
+
+/// @brief レイヤー要素を展開せずに、値とポリゴン頂点ごとの値の番号に分ける
+/// IndexToDirectや頂点ごとの要素はファイルの値の並びをそのまま使い、
+/// Directでポリゴン頂点ごとの値はビット列が同じものを1つにまとめる
+/// 範囲外を参照するポリゴン頂点には、最後に追加する0の値を割り当てる
+/// @param source レイヤー要素
+/// @param topology ポリゴン頂点の並び
+/// @param components 比べる成分数 (1-4)
+/// @param out 出力先 (分けられなければ全てのポリゴン頂点が1つの0の値を指す)
+/// @return 分けられたかどうか (対応していない割り当て方ならfalse)
+bool index_layer_corners(const LayerSource& source,
+                         const CornerTopology& topology, size_t components,
+                         IndexedLayer& out)
+{
+    auto count = topology.corner_count;
+    auto unsupported = [&] {
+        out.index.assign(count, 0);
+        out.values.assign(1, (unsigned int)source.value_count);
+        return false;
+    };
+    if (components == 0 || components > 4 || components > source.value_stride)
+        return unsupported();
+
+    switch (source.mapping)
+    {
+    case LayerMapping::ByPolygonVertex:
+        if (source.index == nullptr && source.value_count >= count)
+        {
+            WeldedLayer welded;
+            weld_layer(source.values, source.value_stride * sizeof(double),
+                       components * sizeof(double), count, nullptr, welded);
+            out.values = std::move(welded.values);
+            out.index = std::move(welded.index);
+            return true;
+        }
+        index_layer(source, count, [](size_t i) { return i; }, out);
+        return true;
+    case LayerMapping::ByControlPoint:
+        index_layer(
+            source, count,
+            [&](size_t i) { return (size_t)topology.indices[i]; }, out);
+        return true;
+    case LayerMapping::ByPolygon:
+        index_layer(
+            source, count,
+            [&](size_t i) { return (size_t)topology.corner_polys[i]; }, out);
+        return true;
+    case LayerMapping::AllSame:
+        index_layer(source, count, [](size_t) { return (size_t)0; }, out);
+        return true;
+    default:
+        return unsupported();
+    }
+}
+
+/// @brief index_layer_cornersで分けた値を集める
+/// @param source レイヤー要素
+/// @param layer 分けたレイヤー要素
+/// @param components 集める成分数
+/// @param out 出力先 (layer.valuesの要素数 * out_stride)
+/// @param out_stride 出力の1要素あたりの成分数
+void gather_layer_values(const LayerSource& source, const IndexedLayer& layer,
+                         size_t components, double* out, size_t out_stride)
+{
+    for (size_t i = 0; i < layer.values.size(); i++)
+    {
+        auto v = (size_t)layer.values[i];
+        auto dst = out + i * out_stride;
+        if (v < source.value_count)
+        {
+            std::memcpy(dst, source.values + v * source.value_stride,
+                        components * sizeof(double));
+        }
+        else
+            std::fill(dst, dst + components, 0.0);
+    }
+}
+
+/// @brief ポリゴンごとの番号 (マテリアル番号) を展開する
+/// ポリゴンごとでない割り当て方はポリゴンの最初の頂点の値を使う
+/// @param mapping 割り当て方
+/// @param values 番号の配列
+/// @param value_count 番号の数
+/// @param topology ポリゴン頂点の並び
+/// @param polys ポリゴンの開始位置
+/// @param poly_count ポリゴン数
+/// @param out 出力先 (ポリゴン数、範囲外は0)
+/// @return 展開できたかどうか
+bool expand_layer_polygons(LayerMapping mapping, const int* values,
+                           size_t value_count, const CornerTopology& topology,
+                           const unsigned int* polys, size_t poly_count,
+                           unsigned int* out)
+{
+    auto fetch = [&](size_t item) {
+        return item < value_count && values[item] >= 0
+                   ? (unsigned int)values[item]
+                   : 0u;
+    };
+    auto corner = [&](size_t poly) {
+        return std::min<size_t>(polys[poly], topology.corner_count);
+    };
+
+    switch (mapping)
+    {
+    case LayerMapping::ByPolygon:
+        for (size_t i = 0; i < poly_count; i++) out[i] = fetch(i);
+        return true;
+    case LayerMapping::AllSame:
+        std::fill(out, out + poly_count, fetch(0));
+        return true;
+    case LayerMapping::ByPolygonVertex:
+        for (size_t i = 0; i < poly_count; i++) out[i] = fetch(corner(i));
+        return true;
+    case LayerMapping::ByControlPoint:
+        for (size_t i = 0; i < poly_count; i++)
+        {
+            auto c = corner(i);
+            out[i] = c < topology.corner_count ? fetch(topology.indices[c]) : 0;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// @brief 成分数ごとのgather_layerを選ぶ
+/// @param source レイヤー要素
+/// @param corner_count ポリゴン頂点数
+/// @param components 展開する成分数
+/// @param item ポリゴン頂点から参照する要素 (インデックスを引く前)
+/// @param out 出力先
+/// @param out_stride 出力の1要素あたりの成分数
+/// @return 展開できたかどうか
+template <typename Item>
+bool gather_layer_components(const LayerSource& source, size_t corner_count,
+                             size_t components, Item item, double* out,
+                             size_t out_stride)
+{
+    switch (components)
+    {
+    case 1:
+        gather_layer<1>(source, corner_count, item, out, out_stride);
+        return true;
+    case 2:
+        gather_layer<2>(source, corner_count, item, out, out_stride);
+        return true;
+    case 3:
+        gather_layer<3>(source, corner_count, item, out, out_stride);
+        return true;
+    case 4:
+        gather_layer<4>(source, corner_count, item, out, out_stride);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// @brief ポリゴン頂点ごとに要素の番号を求める (値はファイルの並びのまま使う)
+/// @param source レイヤー要素
+/// @param corner_count ポリゴン頂点数
+/// @param item ポリゴン頂点から参照する要素 (インデックスを引く前)
+/// @param out 出力先
+template <typename Item>
+void index_layer(const LayerSource& source, size_t corner_count, Item item,
+                 IndexedLayer& out)
+{
+    auto value_count = source.value_count;
+    auto index = source.index;
+    auto index_count = source.index_count;
+    auto outside = false;
+    out.index.resize(corner_count);
+    for (size_t i = 0; i < corner_count; i++)
+    {
+        auto k = item(i);
+        auto v = value_count;
+        if (index == nullptr)
+            v = std::min(k, value_count);
+        else if (k < index_count)
+            v = std::min((size_t)(unsigned int)index[k], value_count);
+        outside |= v == value_count;
+        out.index[i] = (unsigned int)v;
+    }
+
+    out.values.resize(value_count + (outside ? 1 : 0));
+    for (size_t v = 0; v < out.values.size(); v++)
+        out.values[v] = (unsigned int)v;
+}
+
+/// @brief ポリゴン頂点ごとに要素を集める
+/// 成分数を定数にして1要素を固定長のコピーにする (仮想呼び出しはしない)
+/// @param source レイヤー要素
+/// @param corner_count ポリゴン頂点数
+/// @param item ポリゴン頂点から参照する要素 (インデックスを引く前)
+/// @param out 出力先
+/// @param out_stride 出力の1要素あたりの成分数
+template <size_t N, typename Item>
+void gather_layer(const LayerSource& source, size_t corner_count, Item item,
+                  double* out, size_t out_stride)
+{
+    auto values = source.values;
+    auto stride = source.value_stride;
+    auto value_count = source.value_count;
+    if (source.index == nullptr)
+    {
+        for (size_t i = 0; i < corner_count; i++)
+        {
+            auto k = item(i);
+            auto dst = out + i * out_stride;
+            if (k < value_count)
+                std::memcpy(dst, values + k * stride, N * sizeof(double));
+            else
+                std::fill(dst, dst + N, 0.0);
+        }
+        return;
+    }
+
+    auto index = source.index;
+    auto index_count = source.index_count;
+    for (size_t i = 0; i < corner_count; i++)
+    {
+        auto k = item(i);
+        auto dst = out + i * out_stride;
+        auto v = k < index_count ? (size_t)(unsigned int)index[k] : value_count;
+        if (v < value_count)
+            std::memcpy(dst, values + v * stride, N * sizeof(double));
+        else
+            std::fill(dst, dst + N, 0.0);
+    }
+}
@@ -0,0 +1,65 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// FBXのレイヤー要素 (UV・法線・マテリアル) をポリゴン頂点ごとの配列に展開する
+// (または展開せずに値とポリゴン頂点ごとの値の番号に分ける)
+// FBX SDKでの読み込みとバイナリFBXの読み込みで共有する
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/// @brief レイヤー要素の割り当て方 (MappingInformationType)
+enum class LayerMapping
+{
+    ByControlPoint,
+    ByPolygonVertex,
+    ByPolygon,
+    AllSame,
+    Unsupported, // ByEdgeなど
+};
+
+/// @brief メッシュのポリゴン頂点の並び
+struct CornerTopology
+{
+    const unsigned int* indices;      // ポリゴン頂点ごとの頂点番号
+    const unsigned int* corner_polys; // ポリゴン頂点ごとのポリゴン番号
+    size_t corner_count;
+};
+
+/// @brief 展開するレイヤー要素
+struct LayerSource
+{
+    LayerMapping mapping;
+    const double* values; // 要素の配列 (value_count * value_stride)
+    size_t value_count;
+    size_t value_stride; // 1要素あたりの成分数 (FbxVector4なら4)
+    const int* index;    // IndexToDirectのインデックス (Directならnullptr)
+    size_t index_count;
+};
+
+/// @brief 値とポリゴン頂点ごとの番号に分けたレイヤー要素
+struct IndexedLayer
+{
+    // 出力する値ごとの要素の番号 (LayerSource::value_countなら範囲外の参照用の0)
+    std::vector<unsigned int> values;
+    std::vector<unsigned int> index; // ポリゴン頂点ごとのvaluesの番号
+};
+
+std::vector<unsigned int> corner_polygons(const unsigned int* polys,
+                                          size_t poly_count,
+                                          size_t corner_count);
+bool expand_layer_corners(const LayerSource& source,
+                          const CornerTopology& topology, size_t components,
+                          double* out, size_t out_stride);
+bool index_layer_corners(const LayerSource& source,
+                         const CornerTopology& topology, size_t components,
+                         IndexedLayer& out);
+void gather_layer_values(const LayerSource& source, const IndexedLayer& layer,
+                         size_t components, double* out, size_t out_stride);
+bool expand_layer_polygons(LayerMapping mapping, const int* values,
+                           size_t value_count, const CornerTopology& topology,
+                           const unsigned int* polys, size_t poly_count,
+                           unsigned int* out);
@@ -0,0 +1,517 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "../include/io.h"
+#include "geometry_kernels.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// この要素数ごとに分割して並列に変換する
+const size_t BUILDER_CHUNK_SIZE = 1 << 16;
+
+/// @brief 変換が必要だった座標・UVの格納先 (ビルダーの格納形式に合わせて使い分ける)
+struct GeometryStorage
+{
+    std::vector<double> f64;
+    std::vector<float> f32;
+};
+
+/// @brief 呼び出し元のバッファからメッシュを組み立てる
+/// 並びがMeshと一致するバッファはコピーせずにそのまま参照する
+struct MeshBuilder
+{
+    Mesh mesh = {};
+    std::string name;
+    GeometryStorage vertices;
+    std::vector<unsigned int> indices;
+    std::vector<unsigned int> polys;
+    std::vector<unsigned int> material_indices;
+    std::deque<std::string> set_names;
+    std::deque<GeometryStorage> uvs;
+    std::deque<GeometryStorage> normals;
+    std::vector<UV> uv_sets;
+    std::vector<Normal> normal_sets;
+};
+
+size_t component_size(ComponentType type);
+bool store_geometry(ScalarType scalar_type, const void* data, size_t count,
+                    size_t stride, ComponentType type, size_t components,
+                    GeometryStorage& storage, const void*& out);
+char* copy_set_name(MeshBuilder* builder, const char* name, size_t* out_length);
+void push_normal_set(MeshBuilder* builder, const char* name,
+                     const void* normals);
+template <typename D>
+bool convert_buffer(const void* data, size_t count, size_t stride,
+                    ComponentType type, size_t components, D* out,
+                    size_t out_components);
+bool set_index_buffer(const void* data, size_t count, size_t stride,
+                      ComponentType type, std::vector<unsigned int>& storage,
+                      unsigned int*& out);
+
+/// @brief メッシュビルダーを作成する
+/// @param name メッシュの名前 (UTF-8)
+/// @param scalar_type 組み立てるメッシュの頂点座標・法線・UVの格納形式
+/// @return 作成したビルダー (delete_mesh_builderで解放する)
+MeshBuilder* create_mesh_builder(const char* name, ScalarType scalar_type)
+{
+    if (scalar_type != SCALAR_FLOAT64 && scalar_type != SCALAR_FLOAT32)
+    {
+        std::cerr << "Unknown scalar type: " << scalar_type << std::endl;
+        return nullptr;
+    }
+    auto builder = new MeshBuilder();
+    builder->name = name != nullptr ? name : "";
+    builder->mesh.name = builder->name.data();
+    builder->mesh.name_length = builder->name.size();
+    builder->mesh.scalar_type = scalar_type;
+    return builder;
+}
+
+/// @brief 頂点座標を設定する
+/// @param builder ビルダー
+/// @param data 先頭の要素のx成分へのポインタ
+/// @param count 頂点数
+/// @param stride 要素の間隔 (バイト、0なら詰めて並んでいるとみなす)
+/// @param type 成分の型
+/// @return 設定に成功したかどうか
+bool mesh_builder_set_positions(MeshBuilder* builder, const void* data,
+                                size_t count, size_t stride,
+                                ComponentType type)
+{
+    if (builder == nullptr) return false;
+    auto& mesh = builder->mesh;
+    const void* vertices = nullptr;
+    if (!store_geometry(mesh.scalar_type, data, count, stride, type, 3,
+                        builder->vertices, vertices))
+        return false;
+    mesh.vertices = (Vector4*)vertices;
+    mesh.vertex_count = count;
+    return true;
+}
+
+/// @brief 頂点インデックス (面の角ごと) を設定する
+/// @param builder ビルダー
+/// @param data 先頭の要素へのポインタ
+/// @param count 頂点インデックスの数
+/// @param stride 要素の間隔 (バイト、0なら詰めて並んでいるとみなす)
+/// @param type 要素の型
+/// @return 設定に成功したかどうか
+bool mesh_builder_set_indices(MeshBuilder* builder, const void* data,
+                              size_t count, size_t stride, ComponentType type)
+{
+    if (builder == nullptr) return false;
+    if (!set_index_buffer(data, count, stride, type, builder->indices,
+                          builder->mesh.indices))
+        return false;
+    builder->mesh.index_count = count;
+    return true;
+}
+
+/// @brief 面の開始インデックスを設定する
+/// @param builder ビルダー
+/// @param data 先頭の要素へのポインタ
+/// @param count 面の数
+/// @param stride 要素の間隔 (バイト、0なら詰めて並んでいるとみなす)
+/// @param type 要素の型
+/// @return 設定に成功したかどうか
+bool mesh_builder_set_polys(MeshBuilder* builder, const void* data,
+                            size_t count, size_t stride, ComponentType type)
+{
+    if (builder == nullptr) return false;
+    if (!set_index_buffer(data, count, stride, type, builder->polys,
+                          builder->mesh.polys))
+        return false;
+    builder->mesh.poly_count = count;
+    return true;
+}
+
+/// @brief 面ごとのマテリアルインデックスを設定する
+/// @param builder ビルダー
+/// @param data 先頭の要素へのポインタ
+/// @param count 面の数
+/// @param stride 要素の間隔 (バイト、0なら詰めて並んでいるとみなす)
+/// @param type 要素の型
+/// @return 設定に成功したかどうか
+bool mesh_builder_set_material_indices(MeshBuilder* builder, const void* data,
+                                       size_t count, size_t stride,
+                                       ComponentType type)
+{
+    if (builder == nullptr) return false;
+    if (count != builder->mesh.poly_count)
+    {
+        std::cerr << "Material index count does not match the polygon count."
+                  << std::endl;
+        return false;
+    }
+    return set_index_buffer(data, count, stride, type,
+                            builder->material_indices,
+                            builder->mesh.material_indices);
+}
+
+/// @brief UVセットを追加する (面の角ごと)
+/// @param builder ビルダー
+/// @param name UVセットの名前 (UTF-8)
+/// @param data 先頭の要素のu成分へのポインタ
+/// @param count UVの数 (頂点インデックスの数と同じ)
+/// @param stride 要素の間隔 (バイト、0なら詰めて並んでいるとみなす)
+/// @param type 成分の型
+/// @return 追加に成功したかどうか
+bool mesh_builder_add_uv_set(MeshBuilder* builder, const char* name,
+                             const void* data, size_t count, size_t stride,
+                             ComponentType type)
+{
+    if (builder == nullptr) return false;
+    if (count != builder->mesh.index_count)
+    {
+        std::cerr << "UV count does not match the index count." << std::endl;
+        return false;
+    }
+
+    const void* uvs = nullptr;
+    if (!store_geometry(builder->mesh.scalar_type, data, count, stride, type, 2,
+                        builder->uvs.emplace_back(), uvs))
+    {
+        builder->uvs.pop_back();
+        return false;
+    }
+
+    UV uv = {};
+    uv.name = copy_set_name(builder, name, &uv.name_length);
+    uv.uv = (Vector2*)uvs;
+    builder->uv_sets.push_back(uv);
+    builder->mesh.uv_sets = builder->uv_sets.data();
+    builder->mesh.uv_set_count = builder->uv_sets.size();
+    return true;
+}
+
+/// @brief 法線セットを追加する (面の角ごと、Y-upに変換済みのもの)
+/// @param builder ビルダー
+/// @param name 法線セットの名前 (UTF-8)
+/// @param data 先頭の要素のx成分へのポインタ
+/// @param count 法線の数 (頂点インデックスの数と同じ)
+/// @param stride 要素の間隔 (バイト、0なら詰めて並んでいるとみなす)
+/// @param type 成分の型
+/// @return 追加に成功したかどうか
+bool mesh_builder_add_normal_set(MeshBuilder* builder, const char* name,
+                                 const void* data, size_t count, size_t stride,
+                                 ComponentType type)
+{
+    if (builder == nullptr) return false;
+    if (count != builder->mesh.index_count)
+    {
+        std::cerr << "Normal count does not match the index count."
+                  << std::endl;
+        return false;
+    }
+
+    const void* normals = nullptr;
+    if (!store_geometry(builder->mesh.scalar_type, data, count, stride, type, 3,
+                        builder->normals.emplace_back(), normals))
+    {
+        builder->normals.pop_back();
+        return false;
+    }
+
+    push_normal_set(builder, name, normals);
+    return true;
+}
+
+/// @brief 頂点法線を計算して法線セットとして追加する (Y-upに変換する)
+/// @param builder ビルダー (頂点座標、頂点インデックス、面を設定済みのもの)
+/// @param name 法線セットの名前 (UTF-8)
+/// @param mode 計算方法
+/// @param crease_angle 自動スムーズで平滑化する面の間の最大の角度 (ラジアン)
+/// @return 追加に成功したかどうか
+bool mesh_builder_compute_normals(MeshBuilder* builder, const char* name,
+                                  NormalMode mode, double crease_angle)
+{
+    if (builder == nullptr) return false;
+    auto count = builder->mesh.index_count;
+
+    // doubleならそのまま格納先に計算し、floatなら計算後に詰め直す
+    auto& storage = builder->normals.emplace_back();
+    std::vector<Vector4> computed;
+    Vector4* out;
+    if (builder->mesh.scalar_type == SCALAR_FLOAT64)
+    {
+        storage.f64.resize(count * 4);
+        out = (Vector4*)storage.f64.data();
+    }
+    else
+    {
+        computed.resize(count);
+        out = computed.data();
+    }
+
+    Normal normal = {};
+    normal.normal = out;
+    if (!compute_normals(&builder->mesh, mode, crease_angle, &normal))
+    {
+        builder->normals.pop_back();
+        return false;
+    }
+    double m[16];
+    axis_conversion_matrix(1.0, true, m);
+    transform_normals(m, out, out, count, false);
+
+    const void* data = out;
+    if (builder->mesh.scalar_type == SCALAR_FLOAT32 &&
+        !store_geometry(SCALAR_FLOAT32, out, count, sizeof(Vector4),
+                        COMPONENT_FLOAT64, 3, storage, data))
+    {
+        builder->normals.pop_back();
+        return false;
+    }
+    push_normal_set(builder, name, data);
+    return true;
+}
+
+/// @brief スムーズの設定をする
+/// @param builder ビルダー
+/// @param is_smooth スムーズかどうか
+/// @param smooth_angle 自動スムーズの角度 (ラジアン)
+void mesh_builder_set_smooth(MeshBuilder* builder, bool is_smooth,
+                             double smooth_angle)
+{
+    if (builder == nullptr) return;
+    builder->mesh.is_smooth = is_smooth;
+    builder->mesh.smooth_angle = smooth_angle;
+}
+
+/// @brief 組み立てたメッシュを取得する
+/// @param builder ビルダー
+/// @return メッシュ (ビルダーが解放されるまで有効、不正な場合はnullptr)
+Mesh* mesh_builder_get_mesh(MeshBuilder* builder)
+{
+    if (builder == nullptr) return nullptr;
+    auto& mesh = builder->mesh;
+
+    // マテリアルが設定されていなければ全て0番にする
+    if (mesh.material_indices == nullptr && mesh.poly_count > 0)
+    {
+        builder->material_indices.assign(mesh.poly_count, 0);
+        mesh.material_indices = builder->material_indices.data();
+    }
+
+    for (size_t i = 0; i < mesh.index_count; i++)
+    {
+        if (mesh.indices[i] >= mesh.vertex_count)
+        {
+            std::cerr << "Vertex index is out of range." << std::endl;
+            return nullptr;
+        }
+    }
+    for (size_t i = 0; i < mesh.poly_count; i++)
+    {
+        auto end = i + 1 < mesh.poly_count ? mesh.polys[i + 1] : mesh.index_count;
+        if (mesh.polys[i] >= end || end > mesh.index_count)
+        {
+            std::cerr << "Polygon " << i << " is invalid." << std::endl;
+            return nullptr;
+        }
+    }
+    return &mesh;
+}
+
+/// @brief メッシュビルダーを解放する (参照していた呼び出し元のバッファは解放しない)
+/// @param builder ビルダー
+void delete_mesh_builder(MeshBuilder* builder) { delete builder; }
+
+size_t component_size(ComponentType type)
+{
+    switch (type)
+    {
+    case COMPONENT_FLOAT32: return sizeof(float);
+    case COMPONENT_FLOAT64: return sizeof(double);
+    case COMPONENT_INT32: return sizeof(int32_t);
+    case COMPONENT_UINT32: return sizeof(uint32_t);
+    default: return 0;
+    }
+}
+
+/// @brief 間隔を空けて並んだ要素を詰めて変換する
+/// @param data 先頭の要素へのポインタ
+/// @param count 要素数
+/// @param stride 要素の間隔 (バイト)
+/// @param components 1要素あたりの成分数
+/// @param out 出力先
+/// @param out_components 出力先の1要素あたりの成分数
+template <typename S, typename D>
+void convert_strided(const void* data, size_t count, size_t stride,
+                     size_t components, D* out, size_t out_components)
+{
+    auto src = (const char*)data;
+    parallel_for((count + BUILDER_CHUNK_SIZE - 1) / BUILDER_CHUNK_SIZE,
+                 [&](size_t chunk) {
+                     auto first = chunk * BUILDER_CHUNK_SIZE;
+                     auto last = std::min(first + BUILDER_CHUNK_SIZE, count);
+                     for (auto i = first; i < last; i++)
+                     {
+                         auto element = src + i * stride;
+                         for (size_t c = 0; c < components; c++)
+                         {
+                             S value;
+                             std::memcpy(&value, element + c * sizeof(S),
+                                         sizeof(S));
+                             out[i * out_components + c] = (D)value;
+                         }
+                     }
+                 },
+                 1);
+}
+
+/// @brief バッファを型に応じて変換する
+/// @param data 先頭の要素へのポインタ
+/// @param count 要素数
+/// @param stride 要素の間隔 (バイト、0なら詰めて並んでいるとみなす)
+/// @param type 成分の型
+/// @param components 1要素あたりの成分数
+/// @param out 出力先
+/// @param out_components 出力先の1要素あたりの成分数
+/// @return 変換に成功したかどうか
+template <typename D>
+bool convert_buffer(const void* data, size_t count, size_t stride,
+                    ComponentType type, size_t components, D* out,
+                    size_t out_components)
+{
+    if (count == 0) return true;
+    auto size = component_size(type);
+    if (data == nullptr || size == 0)
+    {
+        std::cerr << "Buffer is null or its component type is unknown."
+                  << std::endl;
+        return false;
+    }
+    if (stride == 0) stride = size * components;
+
+    switch (type)
+    {
+    case COMPONENT_FLOAT32:
+        convert_strided<float>(data, count, stride, components, out,
+                               out_components);
+        break;
+    case COMPONENT_FLOAT64:
+        convert_strided<double>(data, count, stride, components, out,
+                                out_components);
+        break;
+    case COMPONENT_INT32:
+        convert_strided<int32_t>(data, count, stride, components, out,
+                                 out_components);
+        break;
+    default:
+        convert_strided<uint32_t>(data, count, stride, components, out,
+                                  out_components);
+        break;
+    }
+    return true;
+}
+
+/// @brief UVセット・法線セットの名前をビルダーに保持する
+/// @param builder ビルダー
+/// @param name 名前 (nullptrなら空)
+/// @param out_length 名前の長さの出力先
+/// @return 保持した名前
+char* copy_set_name(MeshBuilder* builder, const char* name, size_t* out_length)
+{
+    auto& copy = builder->set_names.emplace_back(name != nullptr ? name : "");
+    *out_length = copy.size();
+    return copy.data();
+}
+
+/// @brief 法線セットをメッシュに追加する
+/// @param builder ビルダー
+/// @param name 法線セットの名前
+/// @param normals メッシュの格納形式の法線の配列
+void push_normal_set(MeshBuilder* builder, const char* name,
+                     const void* normals)
+{
+    Normal normal = {};
+    normal.name = copy_set_name(builder, name, &normal.name_length);
+    normal.normal = (Vector4*)normals;
+    builder->normal_sets.push_back(normal);
+    builder->mesh.normal_sets = builder->normal_sets.data();
+    builder->mesh.normal_set_count = builder->normal_sets.size();
+}
+
+/// @brief 座標・UVの配列をメッシュの格納形式で設定する (同じ並びならそのまま参照する)
+/// @param scalar_type メッシュの格納形式
+/// @param data 先頭の要素へのポインタ
+/// @param count 要素数
+/// @param stride 要素の間隔 (バイト、0なら詰めて並んでいるとみなす)
+/// @param type 成分の型
+/// @param components 1要素あたりの成分数 (座標なら3、UVなら2)
+/// @param storage 変換が必要な場合の格納先
+/// @param out 設定先
+/// @return 設定に成功したかどうか
+bool store_geometry(ScalarType scalar_type, const void* data, size_t count,
+                    size_t stride, ComponentType type, size_t components,
+                    GeometryStorage& storage, const void*& out)
+{
+    storage.f64.clear();
+    storage.f32.clear();
+
+    // floatはxyz (uv) を詰めた配列、doubleは座標ならVector4の配列
+    if (scalar_type == SCALAR_FLOAT32)
+    {
+        if (type == COMPONENT_FLOAT32 &&
+            (stride == 0 || stride == sizeof(float) * components))
+        {
+            out = data;
+            return true;
+        }
+        storage.f32.resize(count * components);
+        if (!convert_buffer(data, count, stride, type, components,
+                            storage.f32.data(), components))
+            return false;
+        out = storage.f32.data();
+        return true;
+    }
+
+    auto out_components = components == 3 ? 4 : components;
+    if (type == COMPONENT_FLOAT64 && stride == sizeof(double) * out_components)
+    {
+        out = data;
+        return true;
+    }
+    storage.f64.assign(count * out_components, 1.0);
+    if (!convert_buffer(data, count, stride, type, components,
+                        storage.f64.data(), out_components))
+        return false;
+    out = storage.f64.data();
+    return true;
+}
+
+/// @brief インデックスの配列を設定する (32bit整数が詰めて並んでいればそのまま参照する)
+/// @param data 先頭の要素へのポインタ
+/// @param count 要素数
+/// @param stride 要素の間隔 (バイト、0なら詰めて並んでいるとみなす)
+/// @param type 要素の型
+/// @param storage 変換が必要な場合の格納先
+/// @param out 設定先
+/// @return 設定に成功したかどうか
+bool set_index_buffer(const void* data, size_t count, size_t stride,
+                      ComponentType type, std::vector<unsigned int>& storage,
+                      unsigned int*& out)
+{
+    auto is_int = type == COMPONENT_INT32 || type == COMPONENT_UINT32;
+    if (is_int && (stride == 0 || stride == sizeof(unsigned int)))
+    {
+        storage.clear();
+        out = (unsigned int*)data;
+        return true;
+    }
+
+    storage.resize(count);
+    if (!convert_buffer(data, count, stride, type, 1, storage.data(), 1))
+        return false;
+    out = storage.data();
+    return true;
+}
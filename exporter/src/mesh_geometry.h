@@ -0,0 +1,94 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// Meshの頂点座標・法線・UVの配列を格納形式 (scalar_type) に関係なく読む
+// SCALAR_FLOAT64はVector4/Vector2の配列、SCALAR_FLOAT32はfloatを詰めた配列
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <cstring>
+#include <type_traits>
+
+/// @brief 1要素にN個のT型の成分が並んだ配列
+template <typename T, size_t N> struct PackedView
+{
+    static_assert(N == 2 || N == 3 || N == 4);
+
+    const T* data;
+
+    /// @brief i番目の要素をdoubleに広げて読む (足りない成分は0、wは1)
+    Vector4 operator[](size_t i) const
+    {
+        auto p = data + i * N;
+        if constexpr (N == 2) return {(double)p[0], (double)p[1], 0.0, 1.0};
+        else if constexpr (N == 3)
+            return {(double)p[0], (double)p[1], (double)p[2], 1.0};
+        else return {(double)p[0], (double)p[1], (double)p[2], (double)p[3]};
+    }
+};
+
+/// @brief 座標 (頂点・法線) の配列を格納形式に応じた型で処理する
+/// @param type 格納形式
+/// @param data 配列 (SCALAR_FLOAT32ならfloatのxyz、それ以外はVector4)
+/// @param fn PackedViewを受け取る処理
+template <typename F>
+decltype(auto) visit_points(ScalarType type, const void* data, F&& fn)
+{
+    if (type == SCALAR_FLOAT32) return fn(PackedView<float, 3>{(const float*)data});
+    return fn(PackedView<double, 4>{(const double*)data});
+}
+
+/// @brief UVの配列を格納形式に応じた型で処理する
+/// @param type 格納形式
+/// @param data 配列 (SCALAR_FLOAT32ならfloatのuv、それ以外はVector2)
+/// @param fn PackedViewを受け取る処理
+template <typename F>
+decltype(auto) visit_uvs(ScalarType type, const void* data, F&& fn)
+{
+    if (type == SCALAR_FLOAT32) return fn(PackedView<float, 2>{(const float*)data});
+    return fn(PackedView<double, 2>{(const double*)data});
+}
+
+/// @brief 配列の要素をdoubleに広げて書き出す (成分数が同じdoubleならコピーする)
+/// @param view 変換元
+/// @param first 最初の要素の位置
+/// @param count 要素数
+/// @param out 出力先 (count * M要素)
+template <size_t M, typename T, size_t N>
+void widen_packed(PackedView<T, N> view, size_t first, size_t count,
+                  double* out)
+{
+    if constexpr (std::is_same_v<T, double> && M == N)
+    {
+        std::memcpy(out, view.data + first * N, count * N * sizeof(double));
+    }
+    else
+    {
+        for (auto i = first; i < first + count; i++)
+        {
+            auto v = view[i];
+            const double components[4] = {v.x, v.y, v.z, v.w};
+            for (size_t c = 0; c < M; c++) *out++ = components[c];
+        }
+    }
+}
+
+/// @brief 指定した位置の要素をdoubleに広げて書き出す (並べ替え・共有した値用)
+/// @param view 変換元
+/// @param positions 要素の位置の配列
+/// @param count 要素数
+/// @param out 出力先 (count * M要素)
+template <size_t M, typename T, size_t N>
+void gather_packed(PackedView<T, N> view, const unsigned int* positions,
+                   size_t count, double* out)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        auto v = view[positions[i]];
+        const double components[4] = {v.x, v.y, v.z, v.w};
+        for (size_t c = 0; c < M; c++) *out++ = components[c];
+    }
+}
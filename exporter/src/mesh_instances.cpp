@@ -0,0 +1,182 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "mesh_instances.h"
+#include "parallel.h"
+
+#include <cstring>
+#include <string_view>
+#include <unordered_set>
+
+void collect_object_meshes(const Object* object, std::vector<const Mesh*>& out,
+                           std::unordered_set<const Mesh*>& seen);
+
+MeshInstances::MeshInstances(const Object* root)
+{
+    // 同じポインタは1回だけ数え、出現順を保つ
+    std::vector<const Mesh*> meshes;
+    std::unordered_set<const Mesh*> seen;
+    collect_object_meshes(root, meshes, seen);
+
+    std::vector<uint64_t> hashes(meshes.size());
+    parallel_for(
+        meshes.size(), [&](size_t i) { hashes[i] = hash_mesh(meshes[i]); }, 1);
+
+    // ハッシュが同じものは内容を比較して確かめる
+    std::unordered_map<uint64_t, std::vector<const Mesh*>> buckets;
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        auto& bucket = buckets[hashes[i]];
+        const Mesh* match = nullptr;
+        for (auto candidate : bucket)
+        {
+            if (!mesh_content_equal(candidate, meshes[i])) continue;
+            match = candidate;
+            break;
+        }
+        if (match == nullptr)
+        {
+            bucket.push_back(meshes[i]);
+            uniques.push_back(meshes[i]);
+            content_hashes.push_back(hashes[i]);
+            match = meshes[i];
+        }
+        canonicals.emplace(meshes[i], match);
+    }
+}
+
+/// @brief オブジェクトツリー中のメッシュを出現順に集める
+/// @param object オブジェクト
+/// @param out メッシュの出力先
+/// @param seen 集めたメッシュ
+void collect_object_meshes(const Object* object, std::vector<const Mesh*>& out,
+                           std::unordered_set<const Mesh*>& seen)
+{
+    if (object == nullptr) return;
+    if (object->mesh != nullptr && seen.insert(object->mesh).second)
+        out.push_back(object->mesh);
+    for (size_t i = 0; i < object->child_count; i++)
+        collect_object_meshes(&object->children[i], out, seen);
+}
+
+/// @brief バイト列のハッシュ (8バイトずつ掛け算で混ぜる)
+/// @param data データ
+/// @param size バイト数
+/// @param seed 前のハッシュ
+/// @return ハッシュ
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed)
+{
+    const uint64_t prime = 0x9e3779b97f4a7c15ull;
+    auto p = (const unsigned char*)data;
+    auto h = seed ^ (size * prime);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, p + i, 8);
+        word *= prime;
+        word ^= word >> 29;
+        h = (h ^ word) * 0xbf58476d1ce4e5b9ull;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, p + i, size - i);
+    h = (h ^ (tail * prime)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+/// @brief 座標・法線の1要素のバイト数
+/// @param mesh メッシュ
+size_t mesh_point_size(const Mesh* mesh)
+{
+    return mesh->scalar_type == SCALAR_FLOAT32 ? sizeof(float) * 3
+                                               : sizeof(Vector4);
+}
+
+/// @brief UVの1要素のバイト数
+/// @param mesh メッシュ
+size_t mesh_uv_size(const Mesh* mesh)
+{
+    return mesh->scalar_type == SCALAR_FLOAT32 ? sizeof(float) * 2
+                                               : sizeof(Vector2);
+}
+
+/// @brief 書き出しに影響するメッシュの内容のハッシュ (名前は除く)
+/// @param mesh メッシュ
+/// @param seed ハッシュの初期値 (変えると別系統のハッシュになる)
+/// @return ハッシュ
+uint64_t hash_mesh(const Mesh* mesh, uint64_t seed)
+{
+    uint64_t counts[] = {mesh->vertex_count,
+                         mesh->index_count,
+                         mesh->poly_count,
+                         mesh->uv_set_count,
+                         mesh->normal_set_count,
+                         (uint64_t)mesh->scalar_type,
+                         (uint64_t)mesh->is_smooth,
+                         mesh->material_indices != nullptr};
+    auto h = hash_bytes(counts, sizeof(counts), seed);
+    h = hash_bytes(&mesh->smooth_angle, sizeof(double), h);
+    h = hash_bytes(mesh->vertices, mesh->vertex_count * mesh_point_size(mesh),
+                   h);
+    h = hash_bytes(mesh->indices, mesh->index_count * sizeof(unsigned int), h);
+    h = hash_bytes(mesh->polys, mesh->poly_count * sizeof(unsigned int), h);
+    if (mesh->material_indices != nullptr)
+        h = hash_bytes(mesh->material_indices,
+                       mesh->poly_count * sizeof(unsigned int), h);
+    for (size_t i = 0; i < mesh->uv_set_count; i++)
+        h = hash_bytes(mesh->uv_sets[i].uv,
+                       mesh->index_count * mesh_uv_size(mesh), h);
+    for (size_t i = 0; i < mesh->normal_set_count; i++)
+        h = hash_bytes(mesh->normal_sets[i].normal,
+                       mesh->index_count * mesh_point_size(mesh), h);
+    return h;
+}
+
+/// @brief 2つのメッシュの書き出す内容が同じかどうか
+/// 名前はUV・法線セットのものだけを比べる (メッシュ名はノードから付ける)
+/// スキンは同じSkinを指している場合だけ同じとする
+/// @param a メッシュ
+/// @param b メッシュ
+/// @return 同じかどうか
+bool mesh_content_equal(const Mesh* a, const Mesh* b)
+{
+    if (a == b) return true;
+    if (a->vertex_count != b->vertex_count ||
+        a->index_count != b->index_count || a->poly_count != b->poly_count ||
+        a->uv_set_count != b->uv_set_count ||
+        a->normal_set_count != b->normal_set_count ||
+        a->scalar_type != b->scalar_type || a->is_smooth != b->is_smooth ||
+        a->smooth_angle != b->smooth_angle || a->skin != b->skin ||
+        (a->material_indices == nullptr) != (b->material_indices == nullptr))
+        return false;
+
+    auto same = [](const void* x, const void* y, size_t size) {
+        return size == 0 || x == y || std::memcmp(x, y, size) == 0;
+    };
+    auto name = [](const char* s) { return std::string_view(s ? s : ""); };
+    auto index_size = a->index_count * sizeof(unsigned int);
+    auto poly_size = a->poly_count * sizeof(unsigned int);
+    if (!same(a->vertices, b->vertices, a->vertex_count * mesh_point_size(a)) ||
+        !same(a->indices, b->indices, index_size) ||
+        !same(a->polys, b->polys, poly_size))
+        return false;
+    if (a->material_indices != nullptr &&
+        !same(a->material_indices, b->material_indices, poly_size))
+        return false;
+    for (size_t i = 0; i < a->uv_set_count; i++)
+    {
+        if (name(a->uv_sets[i].name) != name(b->uv_sets[i].name) ||
+            !same(a->uv_sets[i].uv, b->uv_sets[i].uv,
+                  a->index_count * mesh_uv_size(a)))
+            return false;
+    }
+    for (size_t i = 0; i < a->normal_set_count; i++)
+    {
+        if (name(a->normal_sets[i].name) != name(b->normal_sets[i].name) ||
+            !same(a->normal_sets[i].normal, b->normal_sets[i].normal,
+                  a->index_count * mesh_point_size(a)))
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 内容が同じメッシュを1つにまとめて書き出すための表
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/// @brief オブジェクトツリー中のメッシュを内容でまとめる
+/// 別々のMeshでも頂点・面・UV・法線などが全て同じなら同じジオメトリを共有する
+class MeshInstances
+{
+  public:
+    /// @param root オブジェクトツリーのルート (ハッシュは並列に計算する)
+    explicit MeshInstances(const Object* root);
+
+    /// @brief 書き出すメッシュ (内容ごとに最初に現れたもの)
+    const std::vector<const Mesh*>& unique_meshes() const { return uniques; }
+
+    /// @brief 書き出すメッシュの内容のハッシュ (unique_meshesと同じ順)
+    const std::vector<uint64_t>& unique_hashes() const
+    {
+        return content_hashes;
+    }
+
+    /// @brief 同じ内容のメッシュのうち書き出すもの
+    /// @param mesh メッシュ
+    const Mesh* canonical(const Mesh* mesh) const
+    {
+        auto found = canonicals.find(mesh);
+        return found != canonicals.end() ? found->second : mesh;
+    }
+
+  private:
+    std::vector<const Mesh*> uniques;
+    std::vector<uint64_t> content_hashes;
+    std::unordered_map<const Mesh*, const Mesh*> canonicals;
+};
+
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed);
+uint64_t hash_mesh(const Mesh* mesh, uint64_t seed = 0);
+bool mesh_content_equal(const Mesh* a, const Mesh* b);
+size_t mesh_point_size(const Mesh* mesh);
+size_t mesh_uv_size(const Mesh* mesh);
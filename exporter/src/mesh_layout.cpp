@@ -0,0 +1,278 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "mesh_layout.h"
+#include "mesh_instances.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+// 値の番号の空き
+constexpr unsigned int WELD_EMPTY_SLOT = UINT_MAX;
+// ハッシュを並列に求めるときに1回に取り出すポリゴン頂点数
+constexpr size_t WELD_HASH_GRAIN = 1 << 14;
+
+size_t next_fanning_vertex(const std::vector<unsigned int>& candidates,
+                           const std::vector<unsigned int>& live,
+                           const std::vector<size_t>& cache_time,
+                           size_t timestamp, size_t cache_size,
+                           std::vector<unsigned int>& dead_end,
+                           size_t& cursor);
+
+/// @brief 書き出すメッシュの並びを求める (メッシュごとに並列に呼び出される)
+/// @param mesh メッシュ
+/// @param smooth_normals 計算した法線 (ポリゴン頂点ごと、無ければnullptr)
+/// @param weld 法線・UVの同じ値をまとめるかどうか (ビット列が同じものだけ)
+/// @param reorder ポリゴンを頂点キャッシュ向けに並べ替えるかどうか
+/// @param out 出力先
+void build_mesh_layout(const Mesh* mesh, const Vector4* smooth_normals,
+                       bool weld, bool reorder, MeshLayout& out)
+{
+    out = {};
+    if (reorder && mesh->poly_count > 1)
+    {
+        out.poly_order = vertex_cache_order(mesh, VERTEX_CACHE_SIZE);
+        out.polys.reserve(mesh->poly_count);
+        out.corner_order.reserve(mesh->index_count);
+        for (auto poly : out.poly_order)
+        {
+            auto begin = mesh->polys[poly];
+            auto end = poly + 1 < mesh->poly_count ? mesh->polys[poly + 1]
+                                                   : mesh->index_count;
+            out.polys.push_back((unsigned int)out.corner_order.size());
+            for (auto corner = begin; corner < end; corner++)
+                out.corner_order.push_back(corner);
+        }
+    }
+    if (!weld) return;
+
+    // 法線はxyzだけを比べる (FBXに書き出すのは3成分)
+    auto order = out.reordered() ? out.corner_order.data() : nullptr;
+    auto point_size = mesh_point_size(mesh);
+    auto point_value = mesh->scalar_type == SCALAR_FLOAT32
+                           ? sizeof(float) * 3
+                           : sizeof(double) * 3;
+    out.normals.resize(mesh->normal_set_count + (smooth_normals ? 1 : 0));
+    for (size_t i = 0; i < mesh->normal_set_count; i++)
+    {
+        weld_layer(mesh->normal_sets[i].normal, point_size, point_value,
+                   mesh->index_count, order, out.normals[i]);
+    }
+    if (smooth_normals != nullptr)
+    {
+        weld_layer(smooth_normals, sizeof(Vector4), sizeof(double) * 3,
+                   mesh->index_count, order, out.normals.back());
+    }
+    out.uvs.resize(mesh->uv_set_count);
+    for (size_t i = 0; i < mesh->uv_set_count; i++)
+    {
+        weld_layer(mesh->uv_sets[i].uv, mesh_uv_size(mesh), mesh_uv_size(mesh),
+                   mesh->index_count, order, out.uvs[i]);
+    }
+}
+
+/// @brief 並びが確保しているバイト数 (統計用)
+/// @param layout 並び
+size_t mesh_layout_bytes(const MeshLayout& layout)
+{
+    auto bytes = (layout.poly_order.capacity() + layout.corner_order.capacity() +
+                  layout.polys.capacity()) *
+                 sizeof(unsigned int);
+    for (auto layers : {&layout.normals, &layout.uvs})
+    {
+        for (auto& layer : *layers)
+        {
+            bytes += (layer.index.capacity() + layer.values.capacity()) *
+                     sizeof(unsigned int);
+        }
+    }
+    return bytes;
+}
+
+/// @brief ポリゴンを頂点キャッシュに載りやすい順に並べる (Tipsify)
+/// 直前に出力した頂点を中心に、その頂点を使うポリゴンを扇状に出力していき、
+/// 次の中心はまだキャッシュに残っていそうな頂点から選ぶ
+/// (多角形はそのまま1つとして扱い、三角形に分割しない)
+/// @param mesh メッシュ
+/// @param cache_size 想定する頂点キャッシュの大きさ
+/// @return 出力順のポリゴン -> 元のポリゴン
+std::vector<unsigned int> vertex_cache_order(const Mesh* mesh,
+                                             size_t cache_size)
+{
+    auto vertex_count = mesh->vertex_count;
+    auto poly_count = mesh->poly_count;
+    auto indices = mesh->indices;
+    auto poly_end = [&](size_t poly) {
+        return poly + 1 < poly_count ? mesh->polys[poly + 1]
+                                     : (unsigned int)mesh->index_count;
+    };
+
+    // 頂点ごとに使っているポリゴンを並べる (範囲外の頂点番号は無視する)
+    std::vector<unsigned int> offsets(vertex_count + 1);
+    for (size_t i = 0; i < mesh->index_count; i++)
+    {
+        if (indices[i] < vertex_count) offsets[indices[i] + 1]++;
+    }
+    for (size_t v = 0; v < vertex_count; v++) offsets[v + 1] += offsets[v];
+    std::vector<unsigned int> live(vertex_count);
+    for (size_t v = 0; v < vertex_count; v++)
+        live[v] = offsets[v + 1] - offsets[v];
+    std::vector<unsigned int> adjacency(offsets.back());
+    {
+        auto fill = offsets;
+        for (size_t poly = 0; poly < poly_count; poly++)
+        {
+            for (auto corner = mesh->polys[poly]; corner < poly_end(poly);
+                 corner++)
+            {
+                auto v = indices[corner];
+                if (v < vertex_count) adjacency[fill[v]++] = (unsigned int)poly;
+            }
+        }
+    }
+
+    std::vector<unsigned int> order;
+    order.reserve(poly_count);
+    std::vector<char> emitted(poly_count);
+    std::vector<size_t> cache_time(vertex_count);
+    std::vector<unsigned int> dead_end;
+    std::vector<unsigned int> candidates;
+    auto timestamp = cache_size + 1;
+    size_t cursor = 0;
+    auto fanning = vertex_count > 0 ? (size_t)0 : SIZE_MAX;
+    while (fanning != SIZE_MAX)
+    {
+        candidates.clear();
+        for (auto a = offsets[fanning]; a < offsets[fanning + 1]; a++)
+        {
+            auto poly = adjacency[a];
+            if (emitted[poly]) continue;
+            emitted[poly] = true;
+            order.push_back(poly);
+            for (auto corner = mesh->polys[poly]; corner < poly_end(poly);
+                 corner++)
+            {
+                auto v = indices[corner];
+                if (v >= vertex_count) continue;
+                dead_end.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (timestamp - cache_time[v] > cache_size)
+                    cache_time[v] = timestamp++;
+            }
+        }
+        fanning = next_fanning_vertex(candidates, live, cache_time, timestamp,
+                                      cache_size, dead_end, cursor);
+    }
+
+    // 有効な頂点を持たないポリゴンは元の順で最後に出力する
+    for (size_t poly = 0; poly < poly_count && order.size() < poly_count;
+         poly++)
+    {
+        if (!emitted[poly]) order.push_back((unsigned int)poly);
+    }
+    return order;
+}
+
+/// @brief 次に中心にする頂点を選ぶ
+/// 候補のうち、残りのポリゴンを出力してもキャッシュから追い出されないものの中で
+/// 最も古いものを選ぶ (無ければ最近使った頂点、それも無ければ番号順)
+/// @return 頂点番号 (全て出力済みならSIZE_MAX)
+size_t next_fanning_vertex(const std::vector<unsigned int>& candidates,
+                           const std::vector<unsigned int>& live,
+                           const std::vector<size_t>& cache_time,
+                           size_t timestamp, size_t cache_size,
+                           std::vector<unsigned int>& dead_end,
+                           size_t& cursor)
+{
+    auto best = SIZE_MAX;
+    int64_t best_priority = -1;
+    for (auto v : candidates)
+    {
+        if (live[v] == 0) continue;
+        int64_t priority = 0;
+        auto age = timestamp - cache_time[v];
+        if (age + 2 * (size_t)live[v] <= cache_size) priority = (int64_t)age;
+        if (priority > best_priority)
+        {
+            best_priority = priority;
+            best = v;
+        }
+    }
+    if (best != SIZE_MAX) return best;
+
+    while (!dead_end.empty())
+    {
+        auto v = dead_end.back();
+        dead_end.pop_back();
+        if (live[v] > 0) return v;
+    }
+    for (; cursor < live.size(); cursor++)
+    {
+        if (live[cursor] > 0) return cursor;
+    }
+    return SIZE_MAX;
+}
+
+/// @brief ポリゴン頂点ごとの値のうち、ビット列が同じものを1つにまとめる
+/// ハッシュは並列に求め、表への登録は出力順に行う (値の番号は最初に現れた順)
+/// @param data 値の配列 (元のポリゴン頂点の順)
+/// @param stride 1要素のバイト数
+/// @param value_size 比べるバイト数 (要素の先頭から)
+/// @param corner_count ポリゴン頂点数
+/// @param corner_order 出力順のポリゴン頂点 -> 元の位置 (nullptrなら元の順)
+/// @param out 出力先
+void weld_layer(const void* data, size_t stride, size_t value_size,
+                size_t corner_count, const unsigned int* corner_order,
+                WeldedLayer& out)
+{
+    auto bytes = (const uint8_t*)data;
+    auto source = [&](size_t j) {
+        return corner_order != nullptr ? (size_t)corner_order[j] : j;
+    };
+    std::vector<uint64_t> hashes(corner_count);
+    parallel_for(
+        corner_count,
+        [&](size_t j) {
+            hashes[j] = hash_bytes(bytes + source(j) * stride, value_size, 0);
+        },
+        WELD_HASH_GRAIN);
+
+    size_t table_size = 16;
+    while (table_size < corner_count * 2) table_size *= 2;
+    auto mask = table_size - 1;
+    std::vector<unsigned int> slots(table_size, WELD_EMPTY_SLOT);
+    std::vector<uint64_t> value_hashes;
+    out.index.resize(corner_count);
+    out.values.clear();
+    for (size_t j = 0; j < corner_count; j++)
+    {
+        auto corner = source(j);
+        auto value = bytes + corner * stride;
+        auto hash = hashes[j];
+        for (auto pos = hash & mask;; pos = (pos + 1) & mask)
+        {
+            auto slot = slots[pos];
+            if (slot == WELD_EMPTY_SLOT)
+            {
+                slot = (unsigned int)out.values.size();
+                slots[pos] = slot;
+                out.values.push_back((unsigned int)corner);
+                value_hashes.push_back(hash);
+                out.index[j] = slot;
+                break;
+            }
+            if (value_hashes[slot] == hash &&
+                std::memcmp(bytes + (size_t)out.values[slot] * stride, value,
+                            value_size) == 0)
+            {
+                out.index[j] = slot;
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,47 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 書き出すポリゴンの順序 (頂点キャッシュ向けの並べ替え) と、
+// ポリゴン頂点ごとの法線・UVの同じ値の共有 (IndexToDirectでの書き出し用)
+// FBX SDKでの書き出しとネイティブライタで共有する
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <cstddef>
+#include <vector>
+
+// 並べ替えで想定する頂点キャッシュの大きさ (頂点数)
+constexpr size_t VERTEX_CACHE_SIZE = 16;
+
+/// @brief 同じ値をまとめたレイヤー要素
+struct WeldedLayer
+{
+    std::vector<unsigned int> index;  // 出力順のポリゴン頂点ごとの値の番号
+    std::vector<unsigned int> values; // 値ごとの元のポリゴン頂点 (最初に現れた位置)
+};
+
+/// @brief 書き出すメッシュの並び
+/// 並べ替えも共有もしない場合は全て空で、元の並びのまま書き出す
+struct MeshLayout
+{
+    std::vector<unsigned int> poly_order;   // 出力順のポリゴン -> 元のポリゴン
+    std::vector<unsigned int> corner_order; // 出力順のポリゴン頂点 -> 元の位置
+    std::vector<unsigned int> polys;        // 出力順のポリゴン開始インデックス
+    std::vector<WeldedLayer> normals; // 法線セットごと (計算した法線は最後)
+    std::vector<WeldedLayer> uvs;     // UVセットごと
+
+    bool reordered() const { return !poly_order.empty(); }
+    bool welded() const { return !normals.empty() || !uvs.empty(); }
+};
+
+size_t mesh_layout_bytes(const MeshLayout& layout);
+void build_mesh_layout(const Mesh* mesh, const Vector4* smooth_normals,
+                       bool weld, bool reorder, MeshLayout& out);
+std::vector<unsigned int> vertex_cache_order(const Mesh* mesh,
+                                             size_t cache_size);
+void weld_layer(const void* data, size_t stride, size_t value_size,
+                size_t corner_count, const unsigned int* corner_order,
+                WeldedLayer& out);
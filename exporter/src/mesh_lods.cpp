@@ -0,0 +1,868 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "mesh_lods.h"
+#include "export_job.h"
+#include "io_stats.h"
+#include "mesh_geometry.h"
+#include "mesh_instances.h"
+#include "mesh_layout.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+
+// 境界と継ぎ目に沿った平面の重み (面の二次誤差に対する比)
+constexpr double LOD_BORDER_WEIGHT = 10.0;
+// 縮約の前後で周りの三角形の法線がこれ以上傾くなら裏返るとみなす (cos)
+constexpr double LOD_FLIP_COSINE = 0.25;
+// 境界・継ぎ目の線がこれ以上曲がる頂点は角とみなして動かさない (cos)
+constexpr double LOD_CORNER_COSINE = 0.9;
+// 縮約を諦めるまでの走査の回数
+constexpr size_t LOD_MAX_PASSES = 256;
+// 番号の空き
+constexpr unsigned int LOD_NONE = UINT_MAX;
+
+/// @brief 頂点の種類 (縮約できる方向を決める)
+enum class LodVertexKind : uint8_t
+{
+    Manifold, // 内部の頂点 (どの辺に沿っても縮約できる)
+    Border,   // 開いた境界上の頂点 (境界の辺に沿ってのみ縮約できる)
+    Seam,     // UV・法線・マテリアルの継ぎ目上の頂点 (継ぎ目に沿ってのみ)
+    Locked,   // 角や非多様体の頂点 (動かさない)
+};
+
+/// @brief 平面からの距離の二乗和を表す対称行列 (上三角の10要素)
+struct ErrorQuadric
+{
+    double a2 = 0, ab = 0, ac = 0, ad = 0;
+    double b2 = 0, bc = 0, bd = 0;
+    double c2 = 0, cd = 0;
+    double d2 = 0;
+};
+
+/// @brief 縮約の候補 (fromをtoに移す)
+struct EdgeCollapse
+{
+    double cost;
+    unsigned int from;
+    unsigned int to;
+    unsigned int tris[2]; // 辺を共有する三角形 (境界なら2つ目はLOD_NONE)
+    bool seam;            // 両側でウェッジが分かれている辺かどうか
+};
+
+void add_plane_quadric(ErrorQuadric& q, const double* n, double d,
+                       double weight);
+void add_quadric(ErrorQuadric& q, const ErrorQuadric& other);
+double quadric_error(const ErrorQuadric& q, const ErrorQuadric& other,
+                     const double* p);
+unsigned int resolve_wedge(std::vector<unsigned int>& remap, unsigned int w);
+unsigned int corner_wedge(const unsigned int* tri,
+                          const std::vector<unsigned int>& wedge_vertex,
+                          unsigned int vertex);
+bool collapse_allowed(const std::vector<unsigned int>& tris,
+                      const std::vector<unsigned int>& wedge_vertex,
+                      const std::vector<unsigned int>& offsets,
+                      const std::vector<unsigned int>& adjacency,
+                      const std::vector<double>& positions,
+                      const EdgeCollapse& collapse,
+                      std::vector<unsigned int>& marks, unsigned int& stamp);
+bool is_corner(const double* prev, const double* p, const double* next);
+void triangle_normal(const double* p0, const double* p1, const double* p2,
+                     double* out);
+
+MeshLods::MeshLods(const IOData* export_data, const MeshInstances& instances)
+    : export_data(export_data), instances(instances),
+      tree_root(export_data->root)
+{
+    if (export_data->lod_ratios == nullptr) return;
+    for (size_t i = 0; i < export_data->lod_count; i++)
+    {
+        auto ratio = export_data->lod_ratios[i];
+        if (!(ratio > 0.0 && ratio <= 1.0))
+        {
+            std::cerr << "LOD ratio is out of range: " << ratio << std::endl;
+            continue;
+        }
+        ratios.push_back(ratio);
+    }
+}
+
+/// @brief 書き出すメッシュごとにLODを並列に作り、書き出すオブジェクトツリーを作る
+/// @param monitor 進捗の報告先 (メッシュとLODの組ごとにadvanceする)
+/// @param stats 統計の記録先 (時間はMESHESに足す)
+/// @return 作れたかどうか (中断を要求された場合はfalse)
+bool MeshLods::generate(ExportMonitor& monitor, StatsRecorder& stats)
+{
+    if (!enabled()) return true;
+    auto& meshes = instances.unique_meshes();
+    auto level_count = ratios.size();
+    levels.resize(meshes.size() * level_count);
+    for (size_t i = 0; i < meshes.size(); i++)
+        first_level.emplace(meshes[i], i * level_count);
+
+    monitor.begin_phase(EXPORT_PHASE_PREPARING, levels.size());
+    {
+        StatsParallelScope scope(stats, {STATS_PHASE_MESHES});
+        parallel_for(
+            levels.size(),
+            [&](size_t i) {
+                if (monitor.cancelled()) return;
+                StatsScope task(stats, STATS_PHASE_MESHES, STATS_PHASE_COUNT,
+                                true);
+                auto lod = std::make_unique<LodMesh>();
+                simplify_mesh(meshes[i / level_count], ratios[i % level_count],
+                              *lod);
+                levels[i] = std::move(lod);
+                monitor.advance();
+            },
+            1);
+    }
+    if (monitor.cancelled()) return false;
+
+    int64_t bytes = 0;
+    for (auto& lod : levels)
+    {
+        generated.push_back(&lod->mesh);
+        bytes += lod_mesh_bytes(*lod);
+    }
+    stats.track_allocation(bytes);
+
+    // ルート自体は書き出さないのでグループにはしない
+    auto root = export_data->root;
+    objects.push_back(std::make_unique<Object[]>(1));
+    tree_root = &objects.back()[0];
+    *tree_root = *root;
+    tree_root->children = nullptr;
+    if (root->child_count > 0)
+    {
+        objects.push_back(std::make_unique<Object[]>(root->child_count));
+        tree_root->children = objects.back().get();
+        for (size_t i = 0; i < root->child_count; i++)
+            expand(&root->children[i], tree_root->children[i]);
+    }
+    return true;
+}
+
+/// @brief オブジェクトを書き出すツリーに写す (メッシュを持つならLODグループにする)
+/// グループは元の名前とトランスフォームを持ち、子にLOD0から順のノードと
+/// 元の子ノードを持つ (LODのノードはグループと同じ位置に置く)
+/// @param source 元のオブジェクト
+/// @param out 出力先
+void MeshLods::expand(const Object* source, Object& out)
+{
+    out = *source;
+    copies.emplace(source, &out);
+    auto group = source->mesh != nullptr;
+    auto level_count = group ? ratios.size() + 1 : 0;
+    out.child_count = level_count + source->child_count;
+    out.children = nullptr;
+    if (out.child_count == 0) return;
+    objects.push_back(std::make_unique<Object[]>(out.child_count));
+    out.children = objects.back().get();
+    if (group)
+    {
+        out.mesh = nullptr;
+        out.material_slots = nullptr;
+        out.material_slot_count = 0;
+        groups.insert(&out);
+
+        auto mesh = instances.canonical(source->mesh);
+        for (size_t i = 0; i < level_count; i++)
+        {
+            auto& level = out.children[i];
+            level = {};
+            names.push_back(std::string(source->name) + LOD_NAME_SUFFIX +
+                            std::to_string(i));
+            level.name = names.back().data();
+            level.name_length = names.back().size();
+            for (size_t j = 0; j < 4; j++) level.matrix_local[j * 5] = 1.0;
+            level.mesh = i == 0 ? source->mesh
+                                : &levels[first_level.at(mesh) + i - 1]->mesh;
+            level.material_slots = source->material_slots;
+            level.material_slot_count = source->material_slot_count;
+        }
+    }
+    for (size_t i = 0; i < source->child_count; i++)
+        expand(&source->children[i], out.children[level_count + i]);
+}
+
+/// @brief 二次誤差による辺の縮約でメッシュの三角形を減らす
+/// 多角形は扇形に三角形に分割し、縮約は頂点を隣の頂点に移す (位置は動かさない)
+/// 頂点と法線・UVとマテリアルの組 (ウェッジ) が同じポリゴン頂点を1つとして扱い、
+/// 継ぎ目上の頂点は継ぎ目に沿ってだけ動かすことで継ぎ目の形と値を保つ
+/// 1回の走査では誤差の小さい順に、影響が重ならない縮約だけを行う
+/// @param mesh 元のメッシュ
+/// @param ratio 残す三角形の割合 (0-1)
+/// @param out 出力先
+/// @return 目標の三角形数まで減らせたかどうか (減らせなくても出力はする)
+bool simplify_mesh(const Mesh* mesh, double ratio, LodMesh& out)
+{
+    out = LodMesh();
+    auto vertex_count = mesh->vertex_count;
+    auto index_count = mesh->index_count;
+    std::vector<double> positions(vertex_count * 3);
+    visit_points(mesh->scalar_type, mesh->vertices, [&](auto view) {
+        widen_packed<3>(view, 0, vertex_count, positions.data());
+    });
+
+    // 扇形に三角形に分割する (範囲外の頂点番号を含むポリゴンは捨てる)
+    std::vector<unsigned int> corners;
+    std::vector<unsigned int> tri_materials;
+    std::vector<unsigned int> corner_materials(index_count);
+    for (size_t poly = 0; poly < mesh->poly_count; poly++)
+    {
+        size_t begin = mesh->polys[poly];
+        size_t end = poly + 1 < mesh->poly_count ? mesh->polys[poly + 1]
+                                                 : index_count;
+        auto material =
+            mesh->material_indices != nullptr ? mesh->material_indices[poly] : 0;
+        auto valid = end >= begin + 3 && end <= index_count;
+        for (auto c = begin; valid && c < end; c++)
+        {
+            corner_materials[c] = material;
+            valid = mesh->indices[c] < vertex_count;
+        }
+        if (!valid) continue;
+        for (auto c = begin + 1; c + 1 < end; c++)
+        {
+            corners.insert(corners.end(), {(unsigned int)begin,
+                                           (unsigned int)c,
+                                           (unsigned int)c + 1});
+            tri_materials.push_back(material);
+        }
+    }
+    auto source_tris = tri_materials.size();
+    auto target = std::max<size_t>(1, (size_t)std::llround(ratio * source_tris));
+
+    // ウェッジ: 頂点・マテリアル・法線・UVの値の番号の組が同じポリゴン頂点
+    // 自動スムーズの法線は書き出すときに計算し直すので比べない
+    auto point_size = mesh_point_size(mesh);
+    auto normal_value = mesh->scalar_type == SCALAR_FLOAT32
+                            ? sizeof(float) * 3
+                            : sizeof(double) * 3;
+    auto key_size = 2 + mesh->normal_set_count + mesh->uv_set_count;
+    std::vector<unsigned int> keys(index_count * key_size);
+    for (size_t c = 0; c < index_count; c++)
+    {
+        keys[c * key_size] = mesh->indices[c];
+        keys[c * key_size + 1] = corner_materials[c];
+    }
+    WeldedLayer layer;
+    for (size_t i = 0; i < mesh->normal_set_count + mesh->uv_set_count; i++)
+    {
+        if (i < mesh->normal_set_count)
+            weld_layer(mesh->normal_sets[i].normal, point_size, normal_value,
+                       index_count, nullptr, layer);
+        else
+            weld_layer(mesh->uv_sets[i - mesh->normal_set_count].uv,
+                       mesh_uv_size(mesh), mesh_uv_size(mesh), index_count,
+                       nullptr, layer);
+        for (size_t c = 0; c < index_count; c++)
+            keys[c * key_size + 2 + i] = layer.index[c];
+    }
+    WeldedLayer wedges;
+    weld_layer(keys.data(), key_size * sizeof(unsigned int),
+               key_size * sizeof(unsigned int), index_count, nullptr, wedges);
+    keys = {};
+    std::vector<unsigned int> wedge_vertex(wedges.values.size());
+    for (size_t w = 0; w < wedges.values.size(); w++)
+        wedge_vertex[w] = mesh->indices[wedges.values[w]];
+    std::vector<unsigned int> tris(corners.size());
+    for (size_t i = 0; i < corners.size(); i++)
+        tris[i] = wedges.index[corners[i]];
+    corners = {};
+
+    // 面の二次誤差は面積で重みを付ける (境界と継ぎ目の分は最初の走査で足す)
+    std::vector<ErrorQuadric> quadrics(vertex_count);
+    for (size_t t = 0; t < tris.size(); t += 3)
+    {
+        const double* p[3];
+        for (size_t k = 0; k < 3; k++)
+            p[k] = &positions[wedge_vertex[tris[t + k]] * 3];
+        double n[3];
+        triangle_normal(p[0], p[1], p[2], n);
+        auto length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (length == 0.0) continue;
+        for (auto& c : n) c /= length;
+        auto d = -(n[0] * p[0][0] + n[1] * p[0][1] + n[2] * p[0][2]);
+        for (size_t k = 0; k < 3; k++)
+        {
+            add_plane_quadric(quadrics[wedge_vertex[tris[t + k]]], n, d,
+                              length * 0.5);
+        }
+    }
+
+    std::vector<unsigned int> remap(wedge_vertex.size());
+    std::iota(remap.begin(), remap.end(), 0u);
+    std::vector<std::pair<uint64_t, unsigned int>> half_edges;
+    std::vector<LodVertexKind> kinds(vertex_count);
+    std::vector<uint8_t> border_edges(vertex_count);
+    std::vector<uint8_t> seam_edges(vertex_count);
+    std::vector<unsigned int> line_ends(vertex_count * 2); // 境界・継ぎ目の隣
+    std::vector<uint8_t> wedge_counts(vertex_count);
+    std::vector<unsigned int> first_wedge(vertex_count);
+    std::vector<unsigned int> second_wedge(vertex_count);
+    std::vector<unsigned int> offsets(vertex_count + 1);
+    std::vector<unsigned int> adjacency;
+    std::vector<EdgeCollapse> collapses;
+    std::vector<char> touched(vertex_count);
+    std::vector<unsigned int> marks(vertex_count, 0);
+    unsigned int stamp = 0;
+    auto reached = false;
+    for (size_t pass = 0; pass < LOD_MAX_PASSES; pass++)
+    {
+        // 縮約したウェッジを付け替え、潰れた三角形を取り除く
+        size_t live = 0;
+        for (size_t t = 0; t < tris.size() / 3; t++)
+        {
+            unsigned int w[3], v[3];
+            for (size_t k = 0; k < 3; k++)
+            {
+                w[k] = resolve_wedge(remap, tris[t * 3 + k]);
+                v[k] = wedge_vertex[w[k]];
+            }
+            if (v[0] == v[1] || v[1] == v[2] || v[0] == v[2]) continue;
+            std::copy(w, w + 3, &tris[live * 3]);
+            tri_materials[live++] = tri_materials[t];
+        }
+        tris.resize(live * 3);
+        tri_materials.resize(live);
+        if (live <= target)
+        {
+            reached = true;
+            break;
+        }
+
+        // 頂点ごとの三角形の一覧
+        std::fill(offsets.begin(), offsets.end(), 0u);
+        for (auto w : tris) offsets[wedge_vertex[w] + 1]++;
+        for (size_t v = 0; v < vertex_count; v++) offsets[v + 1] += offsets[v];
+        adjacency.resize(tris.size());
+        {
+            auto fill = offsets;
+            for (size_t i = 0; i < tris.size(); i++)
+                adjacency[fill[wedge_vertex[tris[i]]]++] = (unsigned int)(i / 3);
+        }
+
+        // 辺は両端の頂点の組ごとに並べて、共有する三角形を数える
+        half_edges.clear();
+        for (size_t t = 0; t < live; t++)
+        {
+            for (size_t k = 0; k < 3; k++)
+            {
+                uint64_t a = wedge_vertex[tris[t * 3 + k]];
+                uint64_t b = wedge_vertex[tris[t * 3 + (k + 1) % 3]];
+                half_edges.emplace_back(std::min(a, b) * vertex_count +
+                                            std::max(a, b),
+                                        (unsigned int)t);
+            }
+        }
+        std::sort(half_edges.begin(), half_edges.end());
+
+        // 頂点ごとのウェッジを数える (3つ以上なら継ぎ目が交わるので動かさない)
+        std::fill(border_edges.begin(), border_edges.end(), 0);
+        std::fill(seam_edges.begin(), seam_edges.end(), 0);
+        std::fill(wedge_counts.begin(), wedge_counts.end(), 0);
+        std::fill(kinds.begin(), kinds.end(), LodVertexKind::Manifold);
+        for (auto w : tris)
+        {
+            auto v = wedge_vertex[w];
+            auto& count = wedge_counts[v];
+            if (count == 0)
+            {
+                first_wedge[v] = w;
+                count = 1;
+            }
+            else if (count == 1 && w != first_wedge[v])
+            {
+                second_wedge[v] = w;
+                count = 2;
+            }
+            else if (count == 2 && w != first_wedge[v] && w != second_wedge[v])
+                count = 3;
+        }
+
+        collapses.clear();
+        for (size_t i = 0; i < half_edges.size();)
+        {
+            auto j = i + 1;
+            auto key = half_edges[i].first;
+            while (j < half_edges.size() && half_edges[j].first == key) j++;
+            auto a = (unsigned int)(key / vertex_count);
+            auto b = (unsigned int)(key % vertex_count);
+            EdgeCollapse collapse = {
+                0.0, a, b, {half_edges[i].second, LOD_NONE}, false};
+            auto count = j - i;
+            i = j;
+            // 境界・継ぎ目の辺の先を2つまで覚えておく (角かどうかを見る)
+            auto add_line = [&](std::vector<uint8_t>& edges) {
+                if (edges[a] < 2) line_ends[a * 2 + edges[a]] = b;
+                if (edges[b] < 2) line_ends[b * 2 + edges[b]] = a;
+                if (edges[a] < UINT8_MAX) edges[a]++;
+                if (edges[b] < UINT8_MAX) edges[b]++;
+            };
+            if (count == 1)
+            {
+                add_line(border_edges);
+            }
+            else if (count == 2)
+            {
+                collapse.tris[1] = half_edges[j - 1].second;
+                auto t0 = &tris[collapse.tris[0] * 3];
+                auto t1 = &tris[collapse.tris[1] * 3];
+                collapse.seam = corner_wedge(t0, wedge_vertex, a) !=
+                                    corner_wedge(t1, wedge_vertex, a) ||
+                                corner_wedge(t0, wedge_vertex, b) !=
+                                    corner_wedge(t1, wedge_vertex, b);
+                if (collapse.seam) add_line(seam_edges);
+            }
+            else
+            {
+                kinds[a] = kinds[b] = LodVertexKind::Locked;
+                continue;
+            }
+            collapses.push_back(collapse);
+        }
+        for (size_t v = 0; v < vertex_count; v++)
+        {
+            if (kinds[v] == LodVertexKind::Locked) continue;
+            if (border_edges[v] == 0 && seam_edges[v] == 0 &&
+                wedge_counts[v] == 1)
+                kinds[v] = LodVertexKind::Manifold;
+            else if (border_edges[v] == 2 && seam_edges[v] == 0 &&
+                     wedge_counts[v] == 1)
+                kinds[v] = LodVertexKind::Border;
+            else if (border_edges[v] == 0 && seam_edges[v] == 2 &&
+                     wedge_counts[v] == 2)
+                kinds[v] = LodVertexKind::Seam;
+            else
+                kinds[v] = LodVertexKind::Locked;
+            if ((kinds[v] == LodVertexKind::Border ||
+                 kinds[v] == LodVertexKind::Seam) &&
+                is_corner(&positions[line_ends[v * 2] * 3], &positions[v * 3],
+                          &positions[line_ends[v * 2 + 1] * 3]))
+                kinds[v] = LodVertexKind::Locked;
+        }
+
+        // 最初の走査で境界と継ぎ目に垂直な平面を足し、形が縮まないようにする
+        if (pass == 0)
+        {
+            for (auto& collapse : collapses)
+            {
+                if (collapse.tris[1] != LOD_NONE && !collapse.seam) continue;
+                auto t = &tris[collapse.tris[0] * 3];
+                double n[3];
+                triangle_normal(&positions[wedge_vertex[t[0]] * 3],
+                                &positions[wedge_vertex[t[1]] * 3],
+                                &positions[wedge_vertex[t[2]] * 3], n);
+                auto pa = &positions[collapse.from * 3];
+                auto pb = &positions[collapse.to * 3];
+                double e[3] = {pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2]};
+                double plane[3] = {e[1] * n[2] - e[2] * n[1],
+                                   e[2] * n[0] - e[0] * n[2],
+                                   e[0] * n[1] - e[1] * n[0]};
+                auto length = std::sqrt(plane[0] * plane[0] +
+                                        plane[1] * plane[1] +
+                                        plane[2] * plane[2]);
+                if (length == 0.0) continue;
+                for (auto& c : plane) c /= length;
+                auto d = -(plane[0] * pa[0] + plane[1] * pa[1] +
+                           plane[2] * pa[2]);
+                auto weight =
+                    (e[0] * e[0] + e[1] * e[1] + e[2] * e[2]) * LOD_BORDER_WEIGHT;
+                add_plane_quadric(quadrics[collapse.from], plane, d, weight);
+                add_plane_quadric(quadrics[collapse.to], plane, d, weight);
+            }
+        }
+
+        // 辺ごとに縮約できる向きのうち誤差の小さい方を候補にする
+        size_t candidate_count = 0;
+        for (auto collapse : collapses)
+        {
+            auto best = -1.0;
+            EdgeCollapse chosen = collapse;
+            for (size_t dir = 0; dir < 2; dir++)
+            {
+                auto from = dir == 0 ? collapse.from : collapse.to;
+                auto to = dir == 0 ? collapse.to : collapse.from;
+                auto border = collapse.tris[1] == LOD_NONE;
+                auto allowed = false;
+                switch (kinds[from])
+                {
+                case LodVertexKind::Manifold:
+                    allowed = true;
+                    break;
+                case LodVertexKind::Border:
+                    allowed = border;
+                    break;
+                case LodVertexKind::Seam:
+                    // 継ぎ目の両側でウェッジが分かれている辺に沿ってだけ動かす
+                    if (!border)
+                    {
+                        auto t0 = &tris[collapse.tris[0] * 3];
+                        auto t1 = &tris[collapse.tris[1] * 3];
+                        allowed = corner_wedge(t0, wedge_vertex, from) !=
+                                      corner_wedge(t1, wedge_vertex, from) &&
+                                  corner_wedge(t0, wedge_vertex, to) !=
+                                      corner_wedge(t1, wedge_vertex, to);
+                    }
+                    break;
+                default:
+                    break;
+                }
+                if (!allowed) continue;
+                auto cost = quadric_error(quadrics[from], quadrics[to],
+                                          &positions[to * 3]);
+                if (best < 0.0 || cost < best)
+                {
+                    best = cost;
+                    chosen.from = from;
+                    chosen.to = to;
+                    chosen.cost = cost;
+                }
+            }
+            if (best >= 0.0) collapses[candidate_count++] = chosen;
+        }
+        collapses.resize(candidate_count);
+        std::sort(collapses.begin(), collapses.end(),
+                  [](const EdgeCollapse& a, const EdgeCollapse& b) {
+                      if (a.cost != b.cost) return a.cost < b.cost;
+                      if (a.from != b.from) return a.from < b.from;
+                      return a.to < b.to;
+                  });
+
+        // 誤差の小さい順に、周りの三角形が既に変わっていないものだけ縮約する
+        std::fill(touched.begin(), touched.end(), 0);
+        size_t removed = 0;
+        size_t applied = 0;
+        for (auto& collapse : collapses)
+        {
+            if (live - removed <= target) break;
+            auto from = collapse.from;
+            auto to = collapse.to;
+            if (touched[from] || touched[to]) continue;
+            if (!collapse_allowed(tris, wedge_vertex, offsets, adjacency,
+                                  positions, collapse, marks, stamp))
+                continue;
+
+            // 継ぎ目ではそれぞれの側のウェッジを、移した先の同じ側のものにする
+            for (auto t : collapse.tris)
+            {
+                if (t == LOD_NONE) continue;
+                auto tri = &tris[t * 3];
+                auto w_from = corner_wedge(tri, wedge_vertex, from);
+                remap[w_from] = corner_wedge(tri, wedge_vertex, to);
+            }
+            add_quadric(quadrics[to], quadrics[from]);
+            for (auto a = offsets[from]; a < offsets[from + 1]; a++)
+            {
+                for (size_t k = 0; k < 3; k++)
+                    touched[wedge_vertex[tris[adjacency[a] * 3 + k]]] = 1;
+            }
+            removed += collapse.tris[1] == LOD_NONE ? 1 : 2;
+            applied++;
+        }
+        if (applied == 0) break;
+    }
+
+    // 使われている頂点を最初に現れた順に詰め、ポリゴン頂点の値は元の位置から写す
+    auto tri_count = tris.size() / 3;
+    std::vector<unsigned int> vertex_map(vertex_count, LOD_NONE);
+    size_t used = 0;
+    out.indices.resize(tris.size());
+    for (size_t i = 0; i < tris.size(); i++)
+    {
+        auto v = wedge_vertex[tris[i]];
+        if (vertex_map[v] == LOD_NONE) vertex_map[v] = (unsigned int)used++;
+        out.indices[i] = vertex_map[v];
+    }
+    out.vertices.resize(used * point_size);
+    auto src_vertices = (const uint8_t*)mesh->vertices;
+    for (size_t v = 0; v < vertex_count; v++)
+    {
+        if (vertex_map[v] == LOD_NONE) continue;
+        std::memcpy(&out.vertices[vertex_map[v] * point_size],
+                    src_vertices + v * point_size, point_size);
+    }
+    // スキンの影響は残った頂点のものを詰めた順に写す (ボーンは元のものを指す)
+    auto skin = mesh->skin;
+    if (skin != nullptr)
+    {
+        out.skin = *skin;
+        out.influence_offsets.resize(used + 1);
+        for (size_t v = 0; v < vertex_count; v++)
+        {
+            if (vertex_map[v] == LOD_NONE) continue;
+            out.influence_offsets[vertex_map[v] + 1] =
+                skin->influence_offsets[v + 1] - skin->influence_offsets[v];
+        }
+        for (size_t v = 0; v < used; v++)
+            out.influence_offsets[v + 1] += out.influence_offsets[v];
+        out.influence_bones.resize(out.influence_offsets[used]);
+        out.influence_weights.resize(out.influence_offsets[used]);
+        for (size_t v = 0; v < vertex_count; v++)
+        {
+            if (vertex_map[v] == LOD_NONE) continue;
+            auto begin = skin->influence_offsets[v];
+            auto count = skin->influence_offsets[v + 1] - begin;
+            auto dst = out.influence_offsets[vertex_map[v]];
+            std::copy_n(skin->influence_bones + begin, count,
+                        &out.influence_bones[dst]);
+            std::copy_n(skin->influence_weights + begin, count,
+                        &out.influence_weights[dst]);
+        }
+        out.skin.influence_offsets = out.influence_offsets.data();
+        out.skin.influence_bones = out.influence_bones.data();
+        out.skin.influence_weights = out.influence_weights.data();
+    }
+
+    out.polys.resize(tri_count);
+    for (size_t t = 0; t < tri_count; t++) out.polys[t] = (unsigned int)t * 3;
+    if (mesh->material_indices != nullptr)
+        out.material_indices = std::move(tri_materials);
+
+    auto layer_count = mesh->normal_set_count + mesh->uv_set_count;
+    out.layers.resize(layer_count);
+    for (size_t i = 0; i < layer_count; i++)
+    {
+        auto is_normal = i < mesh->normal_set_count;
+        auto size = is_normal ? point_size : mesh_uv_size(mesh);
+        auto src = is_normal
+                       ? (const uint8_t*)mesh->normal_sets[i].normal
+                       : (const uint8_t*)mesh->uv_sets[i -
+                                                       mesh->normal_set_count]
+                             .uv;
+        auto& dst = out.layers[i];
+        dst.resize(tris.size() * size);
+        for (size_t c = 0; c < tris.size(); c++)
+        {
+            std::memcpy(&dst[c * size],
+                        src + (size_t)wedges.values[tris[c]] * size, size);
+        }
+    }
+    for (size_t i = 0; i < mesh->normal_set_count; i++)
+    {
+        auto normal = mesh->normal_sets[i];
+        normal.normal = (Vector4*)out.layers[i].data();
+        out.normal_sets.push_back(normal);
+    }
+    for (size_t i = 0; i < mesh->uv_set_count; i++)
+    {
+        auto uv = mesh->uv_sets[i];
+        uv.uv = (Vector2*)out.layers[mesh->normal_set_count + i].data();
+        out.uv_sets.push_back(uv);
+    }
+
+    auto& lod = out.mesh;
+    lod = *mesh;
+    lod.vertices = (Vector4*)out.vertices.data();
+    lod.vertex_count = used;
+    lod.indices = out.indices.data();
+    lod.index_count = out.indices.size();
+    lod.polys = out.polys.data();
+    lod.poly_count = tri_count;
+    lod.material_indices = mesh->material_indices != nullptr
+                               ? out.material_indices.data()
+                               : nullptr;
+    lod.normal_sets = out.normal_sets.data();
+    lod.uv_sets = out.uv_sets.data();
+    lod.skin = skin != nullptr ? &out.skin : nullptr;
+    return reached;
+}
+
+/// @brief LODが確保しているバイト数 (統計用)
+/// @param lod LOD
+size_t lod_mesh_bytes(const LodMesh& lod)
+{
+    auto bytes = lod.vertices.capacity() +
+                 (lod.indices.capacity() + lod.polys.capacity() +
+                  lod.material_indices.capacity() +
+                  lod.influence_offsets.capacity() +
+                  lod.influence_bones.capacity()) *
+                     sizeof(unsigned int) +
+                 lod.influence_weights.capacity() * sizeof(float);
+    for (auto& layer : lod.layers) bytes += layer.capacity();
+    return bytes;
+}
+
+/// @brief 縮約しても周りの三角形が裏返ったり潰れたりせず、多様体のままかどうか
+/// 移す頂点と移した先の頂点に共通して隣り合う頂点は、辺を共有する三角形の
+/// 残りの頂点だけでなければならない
+/// @param tris 三角形ごとのウェッジ
+/// @param wedge_vertex ウェッジの頂点
+/// @param offsets 頂点ごとの三角形の一覧の開始位置
+/// @param adjacency 頂点ごとの三角形の一覧
+/// @param positions 頂点座標
+/// @param collapse 縮約
+/// @param marks 頂点ごとの印 (頂点数の要素、呼び出しの間で使い回す)
+/// @param stamp 最後に付けた印 (呼び出すごとに進める)
+bool collapse_allowed(const std::vector<unsigned int>& tris,
+                      const std::vector<unsigned int>& wedge_vertex,
+                      const std::vector<unsigned int>& offsets,
+                      const std::vector<unsigned int>& adjacency,
+                      const std::vector<double>& positions,
+                      const EdgeCollapse& collapse,
+                      std::vector<unsigned int>& marks, unsigned int& stamp)
+{
+    auto from = collapse.from;
+    auto to = collapse.to;
+    // 印の番号が一周したら付け直す
+    if (++stamp == 0)
+    {
+        std::fill(marks.begin(), marks.end(), 0u);
+        stamp = 1;
+    }
+    for (auto a = offsets[to]; a < offsets[to + 1]; a++)
+    {
+        for (size_t k = 0; k < 3; k++)
+            marks[wedge_vertex[tris[adjacency[a] * 3 + k]]] = stamp;
+    }
+    marks[to] = 0;
+    marks[from] = 0;
+    size_t shared = 0;
+    for (auto a = offsets[from]; a < offsets[from + 1]; a++)
+    {
+        for (size_t k = 0; k < 3; k++)
+        {
+            auto& mark = marks[wedge_vertex[tris[adjacency[a] * 3 + k]]];
+            if (mark != stamp) continue;
+            mark = 0; // 同じ頂点を2回数えない
+            shared++;
+        }
+    }
+    if (shared != (collapse.tris[1] == LOD_NONE ? 1u : 2u)) return false;
+
+    auto to_position = &positions[to * 3];
+    for (auto a = offsets[from]; a < offsets[from + 1]; a++)
+    {
+        auto tri = &tris[adjacency[a] * 3];
+        const double* before[3];
+        const double* after[3];
+        auto shared_edge = false;
+        for (size_t k = 0; k < 3; k++)
+        {
+            auto v = wedge_vertex[tri[k]];
+            shared_edge |= v == to;
+            before[k] = &positions[v * 3];
+            after[k] = v == from ? to_position : before[k];
+        }
+        if (shared_edge) continue;
+        double n0[3], n1[3];
+        triangle_normal(before[0], before[1], before[2], n0);
+        triangle_normal(after[0], after[1], after[2], n1);
+        auto dot = n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2];
+        auto lengths =
+            std::sqrt((n0[0] * n0[0] + n0[1] * n0[1] + n0[2] * n0[2]) *
+                      (n1[0] * n1[0] + n1[1] * n1[1] + n1[2] * n1[2]));
+        if (lengths == 0.0 || dot < LOD_FLIP_COSINE * lengths) return false;
+    }
+    return true;
+}
+
+/// @brief 境界・継ぎ目の線が頂点で曲がっているか
+/// @param prev 線上の片側の隣の頂点
+/// @param p 頂点
+/// @param next 線上のもう片側の隣の頂点
+/// @return 曲がりがLOD_CORNER_COSINEより大きいかどうか
+bool is_corner(const double* prev, const double* p, const double* next)
+{
+    double a[3], b[3];
+    for (size_t k = 0; k < 3; k++)
+    {
+        a[k] = p[k] - prev[k];
+        b[k] = next[k] - p[k];
+    }
+    auto dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    auto lengths = std::sqrt((a[0] * a[0] + a[1] * a[1] + a[2] * a[2]) *
+                             (b[0] * b[0] + b[1] * b[1] + b[2] * b[2]));
+    return lengths == 0.0 || dot < LOD_CORNER_COSINE * lengths;
+}
+
+/// @brief 三角形の法線 (正規化しない、長さは面積の2倍)
+void triangle_normal(const double* p0, const double* p1, const double* p2,
+                     double* out)
+{
+    double e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+    double e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+    out[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    out[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    out[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+/// @brief 縮約で付け替えたウェッジを辿る (途中の付け替えも縮める)
+unsigned int resolve_wedge(std::vector<unsigned int>& remap, unsigned int w)
+{
+    auto root = w;
+    while (remap[root] != root) root = remap[root];
+    while (remap[w] != root)
+    {
+        auto next = remap[w];
+        remap[w] = root;
+        w = next;
+    }
+    return root;
+}
+
+/// @brief 三角形のうち指定した頂点のウェッジ
+unsigned int corner_wedge(const unsigned int* tri,
+                          const std::vector<unsigned int>& wedge_vertex,
+                          unsigned int vertex)
+{
+    for (size_t k = 0; k < 3; k++)
+    {
+        if (wedge_vertex[tri[k]] == vertex) return tri[k];
+    }
+    return LOD_NONE;
+}
+
+/// @brief 平面 n・p + d = 0 からの距離の二乗を足す
+void add_plane_quadric(ErrorQuadric& q, const double* n, double d,
+                       double weight)
+{
+    q.a2 += weight * n[0] * n[0];
+    q.ab += weight * n[0] * n[1];
+    q.ac += weight * n[0] * n[2];
+    q.ad += weight * n[0] * d;
+    q.b2 += weight * n[1] * n[1];
+    q.bc += weight * n[1] * n[2];
+    q.bd += weight * n[1] * d;
+    q.c2 += weight * n[2] * n[2];
+    q.cd += weight * n[2] * d;
+    q.d2 += weight * d * d;
+}
+
+void add_quadric(ErrorQuadric& q, const ErrorQuadric& other)
+{
+    q.a2 += other.a2;
+    q.ab += other.ab;
+    q.ac += other.ac;
+    q.ad += other.ad;
+    q.b2 += other.b2;
+    q.bc += other.bc;
+    q.bd += other.bd;
+    q.c2 += other.c2;
+    q.cd += other.cd;
+    q.d2 += other.d2;
+}
+
+/// @brief 2つの二次誤差の和を点で評価する
+double quadric_error(const ErrorQuadric& q, const ErrorQuadric& other,
+                     const double* p)
+{
+    auto x = p[0], y = p[1], z = p[2];
+    auto a2 = q.a2 + other.a2, ab = q.ab + other.ab, ac = q.ac + other.ac,
+         ad = q.ad + other.ad, b2 = q.b2 + other.b2, bc = q.bc + other.bc,
+         bd = q.bd + other.bd, c2 = q.c2 + other.c2, cd = q.cd + other.cd,
+         d2 = q.d2 + other.d2;
+    auto error = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x +
+                 b2 * y * y + 2 * bc * y * z + 2 * bd * y + c2 * z * z +
+                 2 * cd * z + d2;
+    return std::max(error, 0.0);
+}
@@ -0,0 +1,103 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 書き出し時のLODの生成 (二次誤差による辺の縮約で三角形を減らす)
+// メッシュを持つオブジェクトをLODグループにし、LOD0 (元のメッシュ) から
+// 順にLODごとの子ノードを持たせたオブジェクトツリーを作る
+// FBX SDKでの書き出しとネイティブライタで共有する
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class ExportMonitor;
+class MeshInstances;
+class StatsRecorder;
+
+// LODごとの子ノードの名前に付ける接尾辞 (後ろに番号を付ける)
+constexpr const char* LOD_NAME_SUFFIX = "_LOD";
+
+/// @brief 削減したメッシュ (配列を所有し、meshはその中を指す)
+/// 三角形だけからなり、頂点・法線・UVは元のメッシュの値をそのまま使う
+struct LodMesh
+{
+    Mesh mesh = {};
+    std::vector<uint8_t> vertices; // 元のメッシュと同じ格納形式
+    std::vector<unsigned int> indices;
+    std::vector<unsigned int> polys;
+    std::vector<unsigned int> material_indices;
+    std::vector<std::vector<uint8_t>> layers; // 法線セット、UVセットの順
+    std::vector<Normal> normal_sets;
+    std::vector<UV> uv_sets;
+    Skin skin = {}; // 元のメッシュにスキンがある場合だけmesh.skinが指す
+    std::vector<unsigned int> influence_offsets;
+    std::vector<unsigned int> influence_bones;
+    std::vector<float> influence_weights;
+};
+
+/// @brief 書き出すメッシュごとのLOD
+/// IOData::lod_countが0でない場合だけ作り、内容が同じメッシュは1つのLODを共有する
+/// LODは元のメッシュから割合ごとに独立に作るので、メッシュとLODの組ごとに並列に作る
+class MeshLods
+{
+  public:
+    /// @param export_data エクスポートするデータ
+    /// @param instances 内容が同じメッシュの表
+    MeshLods(const IOData* export_data, const MeshInstances& instances);
+    MeshLods(const MeshLods&) = delete;
+    MeshLods& operator=(const MeshLods&) = delete;
+
+    /// @brief LODを作るかどうか
+    bool enabled() const { return !ratios.empty(); }
+
+    /// @brief 書き出すオブジェクトツリーのルート (LODを作らない場合は元のルート)
+    Object* root() const { return tree_root; }
+
+    /// @brief LODグループにしたオブジェクトかどうか (root()のツリー中のもの)
+    bool is_group(const Object* object) const
+    {
+        return groups.contains(object);
+    }
+
+    /// @brief 作ったLODのメッシュ (LOD0は含まない)
+    const std::vector<const Mesh*>& meshes() const { return generated; }
+
+    /// @brief 元のツリーのオブジェクトを写した書き出すツリーのオブジェクト
+    /// (LODを作らない場合は元のオブジェクト、スキンのボーンを引くのに使う)
+    /// @param source 元のツリーのオブジェクト
+    const Object* written(const Object* source) const
+    {
+        auto found = copies.find(source);
+        return found != copies.end() ? found->second : source;
+    }
+
+    bool generate(ExportMonitor& monitor, StatsRecorder& stats);
+
+  private:
+    const IOData* export_data;
+    const MeshInstances& instances;
+    std::vector<double> ratios; // LOD1から順の三角形数の割合
+    std::vector<std::unique_ptr<LodMesh>> levels; // メッシュごとにratiosの順
+    std::unordered_map<const Mesh*, size_t> first_level; // levelsでの位置
+    std::vector<const Mesh*> generated;
+    std::vector<std::unique_ptr<Object[]>> objects; // 作ったオブジェクトの配列
+    std::deque<std::string> names; // 作ったオブジェクトの名前
+    std::unordered_set<const Object*> groups;
+    std::unordered_map<const Object*, const Object*> copies;
+    Object* tree_root = nullptr;
+
+    void expand(const Object* source, Object& out);
+};
+
+bool simplify_mesh(const Mesh* mesh, double ratio, LodMesh& out);
+size_t lod_mesh_bytes(const LodMesh& lod);
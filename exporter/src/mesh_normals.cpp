@@ -0,0 +1,260 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "mesh_normals.h"
+#include "geometry_kernels.h"
+#include "mesh_geometry.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <numbers>
+
+Vector4 vec3_sub(const Vector4& a, const Vector4& b)
+{
+    return {a.x - b.x, a.y - b.y, a.z - b.z, 0.0};
+}
+
+Vector4 vec3_cross(const Vector4& a, const Vector4& b)
+{
+    return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x, 0.0};
+}
+
+double vec3_dot(const Vector4& a, const Vector4& b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+Vector4 vec3_normalize(const Vector4& v)
+{
+    auto length = std::sqrt(vec3_dot(v, v));
+    if (length <= 0.0) return {0.0, 0.0, 0.0, 0.0};
+    return {v.x / length, v.y / length, v.z / length, 0.0};
+}
+
+/// @brief 面の法線を求める
+/// @param v 頂点座標
+/// @param idx 頂点インデックス
+/// @param begin 面の最初の頂点インデックスの位置
+/// @param end 面の最後の頂点インデックスの次の位置
+/// @return 面の法線 (長さは面積の2倍)
+template <typename V>
+Vector4 face_normal(V v, const unsigned int* idx, size_t begin, size_t end)
+{
+    if (end - begin == 3)
+    {
+        auto a = v[idx[begin]];
+        return vec3_cross(vec3_sub(v[idx[begin + 1]], a),
+                          vec3_sub(v[idx[begin + 2]], a));
+    }
+
+    // 多角形はNewellの方法で求める (平面でなくても安定する)
+    Vector4 n = {0.0, 0.0, 0.0, 0.0};
+    for (auto j = begin; j < end; j++)
+    {
+        auto a = v[idx[j]];
+        auto b = v[idx[j + 1 == end ? begin : j + 1]];
+        n.x += (a.y - b.y) * (a.z + b.z);
+        n.y += (a.z - b.z) * (a.x + b.x);
+        n.z += (a.x - b.x) * (a.y + b.y);
+    }
+    return n;
+}
+
+/// @brief 面の角の角度を求める
+/// @param v 頂点座標
+/// @param idx 頂点インデックス
+/// @param begin 面の最初の頂点インデックスの位置
+/// @param end 面の最後の頂点インデックスの次の位置
+/// @param corner 角の頂点インデックスの位置
+/// @return 角度 (ラジアン)
+template <typename V>
+double corner_angle(V v, const unsigned int* idx, size_t begin, size_t end,
+                    size_t corner)
+{
+    auto prev = corner == begin ? end - 1 : corner - 1;
+    auto next = corner + 1 == end ? begin : corner + 1;
+    auto e1 = vec3_normalize(vec3_sub(v[idx[prev]], v[idx[corner]]));
+    auto e2 = vec3_normalize(vec3_sub(v[idx[next]], v[idx[corner]]));
+    return std::acos(std::clamp(vec3_dot(e1, e2), -1.0, 1.0));
+}
+
+/// @brief 頂点法線 (面の角ごと) を計算する (入力は検証済み)
+/// @param mesh メッシュ
+/// @param vertices 頂点座標
+/// @param mode 計算方法
+/// @param crease_angle 自動スムーズで平滑化する面の間の最大の角度 (ラジアン)
+/// @param out 出力先 (index_count個)
+template <typename V>
+void compute_corner_normals(const Mesh* mesh, V vertices, NormalMode mode,
+                            double crease_angle, Vector4* out)
+{
+    auto vertex_count = mesh->vertex_count;
+    auto index_count = mesh->index_count;
+    auto poly_count = mesh->poly_count;
+    auto idx = mesh->indices;
+    auto polys = mesh->polys;
+    auto poly_end = [&](size_t i) {
+        return i + 1 < poly_count ? polys[i + 1] : index_count;
+    };
+
+    // 面法線 (長さは面積の2倍)
+    // 三角形・四角形のみならSIMDのカーネルで複数の面をまとめて求める
+    std::vector<Vector4> face_normals(poly_count);
+    if (!uniform_face_normals(mesh, face_normals.data()))
+    {
+        parallel_for(poly_count, [&](size_t i) {
+            face_normals[i] = face_normal(vertices, idx, polys[i], poly_end(i));
+        });
+    }
+
+    if (mode == NORMAL_MODE_FLAT)
+    {
+        parallel_for(poly_count, [&](size_t i) {
+            auto n = vec3_normalize(face_normals[i]);
+            n.w = 1.0;
+            for (auto j = polys[i]; j < poly_end(i); j++) out[j] = n;
+        });
+        return;
+    }
+
+    // 角ごとに頂点法線へ加える量を求め、面法線は単位ベクトルにしておく
+    std::vector<Vector4> contributions(index_count);
+    std::vector<size_t> corner_polys(index_count);
+    parallel_for(poly_count, [&](size_t i) {
+        auto begin = polys[i];
+        auto end = poly_end(i);
+        auto unit = vec3_normalize(face_normals[i]);
+        for (auto j = begin; j < end; j++)
+        {
+            corner_polys[j] = i;
+            if (mode == NORMAL_MODE_SMOOTH_AREA)
+            {
+                contributions[j] = face_normals[i];
+                continue;
+            }
+            auto angle = corner_angle(vertices, idx, begin, end, j);
+            contributions[j] = {unit.x * angle, unit.y * angle, unit.z * angle,
+                                0.0};
+        }
+        face_normals[i] = unit;
+    });
+
+    // 頂点ごとに、その頂点を使う角の一覧を作る
+    std::vector<size_t> offsets(vertex_count + 1, 0);
+    for (size_t j = 0; j < index_count; j++) offsets[idx[j] + 1]++;
+    for (size_t v = 0; v < vertex_count; v++) offsets[v + 1] += offsets[v];
+    std::vector<size_t> corners(index_count);
+    std::vector<size_t> cursor(offsets.begin(), offsets.end() - 1);
+    for (size_t j = 0; j < index_count; j++) corners[cursor[idx[j]]++] = j;
+
+    if (mode != NORMAL_MODE_AUTO_SMOOTH)
+    {
+        std::vector<Vector4> vertex_normals(vertex_count);
+        parallel_for(vertex_count, [&](size_t v) {
+            Vector4 sum = {0.0, 0.0, 0.0, 0.0};
+            for (auto k = offsets[v]; k < offsets[v + 1]; k++)
+            {
+                auto& c = contributions[corners[k]];
+                sum = {sum.x + c.x, sum.y + c.y, sum.z + c.z, 0.0};
+            }
+            vertex_normals[v] = vec3_normalize(sum);
+            vertex_normals[v].w = 1.0;
+        });
+        parallel_for(index_count,
+                     [&](size_t j) { out[j] = vertex_normals[idx[j]]; });
+        return;
+    }
+
+    // 自動スムーズ: 同じ頂点の角のうち、面同士の角度がcrease_angle以下のものだけを平均する
+    auto cos_crease = std::cos(crease_angle);
+    parallel_for(index_count, [&](size_t j) {
+        auto& face = face_normals[corner_polys[j]];
+        auto v = idx[j];
+        Vector4 sum = {0.0, 0.0, 0.0, 0.0};
+        for (auto k = offsets[v]; k < offsets[v + 1]; k++)
+        {
+            auto corner = corners[k];
+            if (vec3_dot(face, face_normals[corner_polys[corner]]) < cos_crease)
+                continue;
+            auto& c = contributions[corner];
+            sum = {sum.x + c.x, sum.y + c.y, sum.z + c.z, 0.0};
+        }
+        auto n = vec3_normalize(sum);
+        if (vec3_dot(n, n) == 0.0) n = face;
+        n.w = 1.0;
+        out[j] = n;
+    });
+}
+
+/// @brief メッシュの頂点法線 (面の角ごと) を計算する
+/// @param mesh メッシュ (vertices, indices, polysを使用する)
+/// @param mode 計算方法
+/// @param crease_angle 自動スムーズでこの角度 (ラジアン) より大きい面の間は平滑化しない
+/// @param out_normal 出力先の法線 (normalにindex_count個の領域が必要、
+///                   メッシュの格納形式に関係なくVector4で出力する)
+/// @return 計算に成功したかどうか
+bool compute_normals(const Mesh* mesh, NormalMode mode, double crease_angle,
+                     Normal* out_normal)
+{
+    if (mesh == nullptr || out_normal == nullptr ||
+        out_normal->normal == nullptr)
+    {
+        std::cerr << "Mesh or output normal is null." << std::endl;
+        return false;
+    }
+    if (mode < NORMAL_MODE_FLAT || mode > NORMAL_MODE_AUTO_SMOOTH)
+    {
+        std::cerr << "Unknown normal mode: " << mode << std::endl;
+        return false;
+    }
+
+    auto vertex_count = mesh->vertex_count;
+    auto index_count = mesh->index_count;
+    auto poly_count = mesh->poly_count;
+    auto idx = mesh->indices;
+    auto polys = mesh->polys;
+
+    if (std::any_of(idx, idx + index_count,
+                    [&](unsigned int i) { return i >= vertex_count; }))
+    {
+        std::cerr << "Vertex index is out of range." << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < poly_count; i++)
+    {
+        auto end = i + 1 < poly_count ? polys[i + 1] : index_count;
+        if (polys[i] >= end || end > index_count)
+        {
+            std::cerr << "Polygon " << i << " is invalid." << std::endl;
+            return false;
+        }
+    }
+    visit_points(mesh->scalar_type, mesh->vertices, [&](auto vertices) {
+        compute_corner_normals(mesh, vertices, mode, crease_angle,
+                               out_normal->normal);
+    });
+    return true;
+}
+
+/// @brief 法線を持たないスムーズなメッシュの書き出し用の法線を計算する
+/// @param mesh メッシュ (smooth_angleが0以下なら全て平滑化する)
+/// @param out 法線の出力先 (Y-upに変換済み)
+/// @return 計算に成功したかどうか
+bool export_smooth_normals(const Mesh* mesh, std::vector<Vector4>& out)
+{
+    out.resize(mesh->index_count);
+    Normal normal = {};
+    normal.normal = out.data();
+    auto angle = mesh->smooth_angle > 0.0 ? mesh->smooth_angle : std::numbers::pi;
+    if (!compute_normals(mesh, NORMAL_MODE_AUTO_SMOOTH, angle, &normal))
+        return false;
+
+    double m[16];
+    axis_conversion_matrix(1.0, true, m);
+    transform_normals(m, out.data(), out.data(), out.size(), false);
+    return true;
+}
@@ -0,0 +1,11 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <vector>
+
+bool export_smooth_normals(const Mesh* mesh, std::vector<Vector4>& out);
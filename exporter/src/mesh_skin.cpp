@@ -0,0 +1,312 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "mesh_skin.h"
+#include "export_job.h"
+#include "io_stats.h"
+#include "mesh_instances.h"
+#include "mesh_lods.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+// 量子化できる最大のビット数
+constexpr int SKIN_MAX_WEIGHT_BITS = 16;
+
+/// @brief 頂点の1つの影響 (並べ替え用)
+struct SkinInfluence
+{
+    double weight;
+    unsigned int bone;
+};
+
+void quantize_skin_weights(std::vector<SkinInfluence>& influences, int bits,
+                           std::vector<double>& remainders);
+void multiply_skin_matrix(const double* a, const double* b, double* out);
+void invert_skin_matrix(const double* m, double* out);
+
+MeshSkins::MeshSkins(const IOData* export_data, const MeshInstances& instances,
+                     const MeshLods& lods)
+    : max_influences(export_data->max_influences),
+      weight_bits(export_data->weight_bits)
+{
+    if (weight_bits < 0 || weight_bits > SKIN_MAX_WEIGHT_BITS)
+    {
+        std::cerr << "Skin weight bits is out of range: " << weight_bits
+                  << std::endl;
+        weight_bits = std::clamp(weight_bits, 0, SKIN_MAX_WEIGHT_BITS);
+    }
+    auto add = [&](const Mesh* mesh) {
+        auto skin = mesh->skin;
+        if (skin == nullptr) return;
+        if (skin->bone_count > 0 && (skin->bones == nullptr ||
+                                     skin->influence_offsets == nullptr))
+        {
+            std::cerr << "Skin has no bones or influences" << std::endl;
+            return;
+        }
+        skinned.push_back(mesh);
+    };
+    for (auto mesh : instances.unique_meshes()) add(mesh);
+    for (auto mesh : lods.meshes()) add(mesh);
+}
+
+/// @brief スキンを持つメッシュのクラスタをメッシュごとに並列に作る
+/// @param monitor 進捗の報告先 (メッシュごとにadvanceする)
+/// @param stats 統計の記録先 (時間はMESHESに足す)
+/// @return 作れたかどうか (中断を要求された場合はfalse)
+bool MeshSkins::build(ExportMonitor& monitor, StatsRecorder& stats)
+{
+    if (skinned.empty()) return true;
+
+    std::vector<std::unique_ptr<SkinClusters>> built(skinned.size());
+    monitor.begin_phase(EXPORT_PHASE_PREPARING, skinned.size());
+    {
+        StatsParallelScope scope(stats, {STATS_PHASE_MESHES});
+        parallel_for(
+            skinned.size(),
+            [&](size_t i) {
+                if (monitor.cancelled()) return;
+                StatsScope task(stats, STATS_PHASE_MESHES, STATS_PHASE_COUNT,
+                                true);
+                auto out = std::make_unique<SkinClusters>();
+                build_skin_clusters(skinned[i], max_influences, weight_bits,
+                                    *out);
+                built[i] = std::move(out);
+                monitor.advance();
+            },
+            1);
+    }
+    if (monitor.cancelled()) return false;
+
+    int64_t bytes = 0;
+    for (size_t i = 0; i < skinned.size(); i++)
+    {
+        bytes += built[i]->offsets.capacity() * sizeof(unsigned int) +
+                 built[i]->indices.capacity() * sizeof(int) +
+                 (built[i]->weights.capacity() +
+                  built[i]->transforms.capacity() +
+                  built[i]->links.capacity()) *
+                     sizeof(double);
+        clusters.emplace(skinned[i], std::move(built[i]));
+    }
+    stats.track_allocation(bytes);
+    return true;
+}
+
+/// @brief 頂点ごとの影響をボーンごとのクラスタに並べ替える
+/// 頂点ごとに重みが0以下のものと範囲外のボーンを除いて同じボーンのものをまとめ、
+/// 重みの大きい順にmax_influences個まで残して合計1に正規化し、量子化する
+/// (どちらも指定が無ければ重みはそのまま使う)
+/// ボーンごとの数を数えてから頂点の順に詰めるので、頂点番号はボーンごとに昇順になる
+/// 影響が無いボーンも空のクラスタとして残す (ボーンの番号とクラスタを対応させる)
+/// ボーンごとのTransformとTransformLinkも求める
+/// @param mesh メッシュ (skinを持つもの)
+/// @param max_influences 頂点ごとに残す影響の数 (0なら減らさない)
+/// @param weight_bits 量子化するビット数 (0ならしない)
+/// @param out 出力先
+void build_skin_clusters(const Mesh* mesh, size_t max_influences,
+                         int weight_bits, SkinClusters& out)
+{
+    auto skin = mesh->skin;
+    auto bone_count = skin->bone_count;
+    auto vertex_count = mesh->vertex_count;
+    auto normalize = max_influences > 0 || weight_bits > 0;
+
+    // 頂点の順に残す影響を並べ、ボーンごとの数を数える
+    std::vector<unsigned int> kept_offsets(vertex_count + 1, 0);
+    std::vector<SkinInfluence> kept;
+    kept.reserve(bone_count > 0 ? skin->influence_offsets[vertex_count] : 0);
+    std::vector<unsigned int> counts(bone_count, 0);
+    std::vector<SkinInfluence> influences;
+    std::vector<double> remainders;
+    for (size_t v = 0; v < vertex_count && bone_count > 0; v++)
+    {
+        influences.clear();
+        for (auto i = skin->influence_offsets[v];
+             i < skin->influence_offsets[v + 1]; i++)
+        {
+            auto weight = (double)skin->influence_weights[i];
+            auto bone = skin->influence_bones[i];
+            if (weight > 0.0 && std::isfinite(weight) && bone < bone_count)
+                influences.push_back({weight, bone});
+        }
+        // 同じボーンの影響は重みを足して1つにする
+        std::sort(influences.begin(), influences.end(),
+                  [](const SkinInfluence& a, const SkinInfluence& b) {
+                      return a.bone < b.bone;
+                  });
+        size_t merged = 0;
+        for (size_t i = 0; i < influences.size(); i++)
+        {
+            if (merged > 0 && influences[merged - 1].bone == influences[i].bone)
+                influences[merged - 1].weight += influences[i].weight;
+            else
+                influences[merged++] = influences[i];
+        }
+        influences.resize(merged);
+        if (normalize && !influences.empty())
+        {
+            std::sort(influences.begin(), influences.end(),
+                      [](const SkinInfluence& a, const SkinInfluence& b) {
+                          return a.weight != b.weight ? a.weight > b.weight
+                                                      : a.bone < b.bone;
+                      });
+            if (max_influences > 0 && influences.size() > max_influences)
+                influences.resize(max_influences);
+            double sum = 0.0;
+            for (auto& influence : influences) sum += influence.weight;
+            for (auto& influence : influences) influence.weight /= sum;
+            if (weight_bits > 0)
+                quantize_skin_weights(influences, weight_bits, remainders);
+        }
+        for (auto& influence : influences)
+        {
+            kept.push_back(influence);
+            counts[influence.bone]++;
+        }
+        kept_offsets[v + 1] = (unsigned int)kept.size();
+    }
+
+    out.offsets.assign(bone_count + 1, 0);
+    for (size_t b = 0; b < bone_count; b++)
+        out.offsets[b + 1] = out.offsets[b] + counts[b];
+    out.indices.resize(kept.size());
+    out.weights.resize(kept.size());
+    std::copy(out.offsets.begin(), out.offsets.end() - 1, counts.begin());
+    for (size_t v = 0; v < vertex_count && bone_count > 0; v++)
+    {
+        for (auto i = kept_offsets[v]; i < kept_offsets[v + 1]; i++)
+        {
+            auto dst = counts[kept[i].bone]++;
+            out.indices[dst] = (int)v;
+            out.weights[dst] = kept[i].weight;
+        }
+    }
+
+    out.transforms.resize(bone_count * 16);
+    out.links.resize(bone_count * 16);
+    for (size_t b = 0; b < bone_count; b++)
+    {
+        skin_cluster_transform(skin, b, &out.transforms[b * 16]);
+        skin_bind_matrix(skin, b, &out.links[b * 16]);
+    }
+}
+
+/// @brief 合計1の重みを1/(2^bits-1)の倍数にする (合計はちょうど1のまま)
+/// 切り捨てた残りを端数の大きい順に配り (同じなら前のものに)、0になったものは除く
+/// 配る数は影響の数より少ないので、並べ替えずに最大のものを選び直す
+/// @param influences 重みの大きい順の影響 (書き換える)
+/// @param bits ビット数
+/// @param remainders 端数の作業領域 (頂点の間で使い回す)
+void quantize_skin_weights(std::vector<SkinInfluence>& influences, int bits,
+                           std::vector<double>& remainders)
+{
+    auto scale = (double)((1u << bits) - 1);
+    auto count = influences.size();
+    remainders.resize(count);
+    auto remaining = (long long)scale;
+    for (size_t i = 0; i < count; i++)
+    {
+        auto value = influences[i].weight * scale;
+        influences[i].weight = std::floor(value);
+        remainders[i] = value - influences[i].weight;
+        remaining -= (long long)influences[i].weight;
+    }
+    for (; remaining > 0; remaining--)
+    {
+        auto largest = std::max_element(remainders.begin(), remainders.end());
+        influences[largest - remainders.begin()].weight += 1.0;
+        *largest = -1.0;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (influences[i].weight == 0.0) continue;
+        influences[kept] = {influences[i].weight / scale, influences[i].bone};
+        kept++;
+    }
+    influences.resize(kept);
+}
+
+/// @brief ボーンのバインド時のワールド行列
+/// @param skin スキン
+/// @param bone ボーンの番号
+/// @param out 出力先 (matrix_localと同じ並びの16要素)
+void skin_bind_matrix(const Skin* skin, size_t bone, double* out)
+{
+    if (skin->bind_matrices != nullptr)
+    {
+        std::copy_n(skin->bind_matrices + bone * 16, 16, out);
+        return;
+    }
+    std::fill_n(out, 16, 0.0);
+    for (auto i = 0; i < 4; i++) out[i * 5] = 1.0;
+}
+
+/// @brief クラスタのTransform (ボーンから見たバインド時のメッシュの行列)
+/// ボーンのバインド時の逆行列とメッシュのバインド時の行列の積
+/// @param skin スキン
+/// @param bone ボーンの番号
+/// @param out 出力先 (matrix_localと同じ並びの16要素)
+void skin_cluster_transform(const Skin* skin, size_t bone, double* out)
+{
+    double link[16], inverse[16];
+    skin_bind_matrix(skin, bone, link);
+    invert_skin_matrix(link, inverse);
+    multiply_skin_matrix(inverse, skin->mesh_bind_matrix, out);
+}
+
+/// @brief 行列の積 a * b (FbxAMatrixと同じ並びで、列ベクトルに掛ける向き)
+void multiply_skin_matrix(const double* a, const double* b, double* out)
+{
+    for (auto c = 0; c < 4; c++)
+    {
+        for (auto r = 0; r < 4; r++)
+        {
+            double sum = 0.0;
+            for (auto k = 0; k < 4; k++) sum += a[k * 4 + r] * b[c * 4 + k];
+            out[c * 4 + r] = sum;
+        }
+    }
+}
+
+/// @brief アフィン行列の逆行列 (特異な場合は単位行列)
+/// @param m 行列 (FbxAMatrixと同じ並び、平行移動はm[12..14])
+/// @param out 出力先
+void invert_skin_matrix(const double* m, double* out)
+{
+    // 3x3部分の要素 a(r, c) = m[c * 4 + r]
+    auto a = [&](int r, int c) { return m[c * 4 + r]; };
+    double cof[3][3];
+    for (auto r = 0; r < 3; r++)
+    {
+        for (auto c = 0; c < 3; c++)
+        {
+            auto r1 = (r + 1) % 3, r2 = (r + 2) % 3;
+            auto c1 = (c + 1) % 3, c2 = (c + 2) % 3;
+            cof[r][c] = a(r1, c1) * a(r2, c2) - a(r1, c2) * a(r2, c1);
+        }
+    }
+    auto det = a(0, 0) * cof[0][0] + a(0, 1) * cof[0][1] + a(0, 2) * cof[0][2];
+    std::fill_n(out, 16, 0.0);
+    out[15] = 1.0;
+    if (det == 0.0 || !std::isfinite(det))
+    {
+        for (auto i = 0; i < 3; i++) out[i * 5] = 1.0;
+        return;
+    }
+    // 逆行列の(r, c)は余因子の(c, r)を行列式で割ったもの
+    for (auto r = 0; r < 3; r++)
+        for (auto c = 0; c < 3; c++) out[c * 4 + r] = cof[c][r] / det;
+    for (auto r = 0; r < 3; r++)
+    {
+        double t = 0.0;
+        for (auto k = 0; k < 3; k++) t += out[k * 4 + r] * m[12 + k];
+        out[12 + r] = -t;
+    }
+}
@@ -0,0 +1,71 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 書き出し時のスキンの変換
+// 頂点ごとのボーンの影響 (CSR形式) を、影響の数の制限・正規化・量子化をしてから
+// ボーンごとの頂点番号と重みの配列 (FBXのクラスタの形式) に1回で並べ替える
+// FBX SDKでの書き出しとネイティブライタで共有する
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class ExportMonitor;
+class MeshInstances;
+class MeshLods;
+class StatsRecorder;
+
+/// @brief ボーンごとの影響 (クラスタのIndexesとWeights) と行列
+struct SkinClusters
+{
+    std::vector<unsigned int> offsets; // ボーンごとの開始位置 (bone_count+1)
+    std::vector<int> indices;          // 頂点番号 (ボーンごとに昇順)
+    std::vector<double> weights;
+    std::vector<double> transforms; // ボーンごとのTransform (16要素ずつ)
+    std::vector<double> links;      // ボーンごとのTransformLink (16要素ずつ)
+};
+
+/// @brief 書き出すメッシュごとのクラスタ
+/// Mesh::skinを持つメッシュ (LODのメッシュを含む) だけを変換する
+/// メッシュごとに並列に変換し、1つのメッシュは頂点を1回ずつたどって作る
+class MeshSkins
+{
+  public:
+    /// @param export_data エクスポートするデータ (影響の数と量子化の設定)
+    /// @param instances 内容が同じメッシュの表
+    /// @param lods 作ったLOD
+    MeshSkins(const IOData* export_data, const MeshInstances& instances,
+              const MeshLods& lods);
+    MeshSkins(const MeshSkins&) = delete;
+    MeshSkins& operator=(const MeshSkins&) = delete;
+
+    /// @brief スキンを持つメッシュ (書き出す順)
+    const std::vector<const Mesh*>& meshes() const { return skinned; }
+
+    /// @brief メッシュのクラスタ (スキンが無ければnullptr)
+    const SkinClusters* find(const Mesh* mesh) const
+    {
+        auto found = clusters.find(mesh);
+        return found != clusters.end() ? found->second.get() : nullptr;
+    }
+
+    bool build(ExportMonitor& monitor, StatsRecorder& stats);
+
+  private:
+    size_t max_influences;
+    int weight_bits;
+    std::vector<const Mesh*> skinned;
+    std::unordered_map<const Mesh*, std::unique_ptr<SkinClusters>> clusters;
+};
+
+void build_skin_clusters(const Mesh* mesh, size_t max_influences,
+                         int weight_bits, SkinClusters& out);
+void skin_bind_matrix(const Skin* skin, size_t bone, double* out);
+void skin_cluster_transform(const Skin* skin, size_t bone, double* out);
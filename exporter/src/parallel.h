@@ -0,0 +1,187 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// @brief parallel_forの1回分の呼び出し
+struct PoolBatch
+{
+    const std::function<void(size_t)>* fn;
+    std::atomic<size_t> remaining;
+    std::mutex mutex;
+    std::condition_variable done;
+};
+
+/// @brief スレッドプールに積まれる処理 (番号の範囲)
+struct PoolTask
+{
+    PoolBatch* batch;
+    size_t begin;
+    size_t end;
+};
+
+/// @brief ワーカーごとのキュー
+struct PoolQueue
+{
+    std::mutex mutex;
+    std::deque<PoolTask> tasks;
+};
+
+/// @brief ワークスティーリング型のスレッドプール
+/// 各ワーカーは自分のキューの末尾から取り出し、空なら他のキューの先頭から盗む
+class ThreadPool
+{
+  public:
+    /// @brief プロセス全体で共有するプール
+    /// DLLのアンロード中にスレッドをjoinするとデッドロックするので解放しない
+    static ThreadPool& instance()
+    {
+        static auto pool = new ThreadPool();
+        return *pool;
+    }
+
+    size_t thread_count() const { return queues.size(); }
+
+    /// @brief 0からcount-1までの処理を実行し、全て終わるまで待つ
+    /// 呼び出し元のスレッドも処理を手伝うので、処理の中から呼び出してもよい
+    void run(size_t count, size_t grain, const std::function<void(size_t)>& fn)
+    {
+        PoolBatch batch;
+        batch.fn = &fn;
+        batch.remaining = (count + grain - 1) / grain;
+        pending += batch.remaining;
+
+        auto first = next_queue++;
+        for (size_t begin = 0, i = 0; begin < count; begin += grain, i++)
+        {
+            auto& queue = *queues[(first + i) % queues.size()];
+            std::lock_guard lock(queue.mutex);
+            queue.tasks.push_back({&batch, begin, std::min(begin + grain, count)});
+        }
+        {
+            std::lock_guard lock(wake_mutex);
+        }
+        wake.notify_all();
+
+        while (batch.remaining > 0)
+        {
+            if (run_one(local_index())) continue;
+            std::unique_lock lock(batch.mutex);
+            batch.done.wait(lock, [&] { return batch.remaining == 0; });
+        }
+
+        // 最後の処理を終えたスレッドがbatchに触らなくなるまで待つ
+        std::lock_guard lock(batch.mutex);
+    }
+
+  private:
+    std::vector<std::unique_ptr<PoolQueue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> pending = 0;
+    std::atomic<size_t> next_queue = 0;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+
+    static size_t& worker_index()
+    {
+        thread_local size_t index = SIZE_MAX;
+        return index;
+    }
+
+    size_t local_index()
+    {
+        auto index = worker_index();
+        return index != SIZE_MAX ? index : next_queue % queues.size();
+    }
+
+    ThreadPool()
+    {
+        auto count = std::max(std::thread::hardware_concurrency(), 1u);
+        for (size_t i = 0; i < count; i++)
+            queues.push_back(std::make_unique<PoolQueue>());
+
+        // 呼び出し元も処理をするので、ワーカーはコア数-1個
+        for (size_t i = 1; i < count; i++)
+        {
+            threads.emplace_back([this, i] {
+                worker_index() = i;
+                for (;;)
+                {
+                    if (run_one(i)) continue;
+                    std::unique_lock lock(wake_mutex);
+                    wake.wait(lock, [&] { return pending > 0; });
+                }
+            });
+        }
+    }
+
+    bool pop(size_t index, PoolTask& task)
+    {
+        auto& own = *queues[index];
+        {
+            std::lock_guard lock(own.mutex);
+            if (!own.tasks.empty())
+            {
+                task = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++)
+        {
+            auto& victim = *queues[(index + i) % queues.size()];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool run_one(size_t index)
+    {
+        PoolTask task;
+        if (!pop(index, task)) return false;
+        pending--;
+
+        auto batch = task.batch;
+        for (auto i = task.begin; i < task.end; i++) (*batch->fn)(i);
+        std::lock_guard lock(batch->mutex);
+        if (--batch->remaining == 0) batch->done.notify_all();
+        return true;
+    }
+};
+
+/// @brief 0からcount-1までの処理を全コアで分担して実行する
+/// @param count 処理の数
+/// @param fn 処理 (引数は番号)
+/// @param grain 1回に取り出す処理の数 (0なら自動)
+template <typename F> void parallel_for(size_t count, F&& fn, size_t grain = 0)
+{
+    if (count == 0) return;
+    auto& pool = ThreadPool::instance();
+    if (grain == 0) grain = std::max<size_t>(1, count / (pool.thread_count() * 8));
+    if (pool.thread_count() <= 1 || count <= grain)
+    {
+        for (size_t i = 0; i < count; i++) fn(i);
+        return;
+    }
+
+    std::function<void(size_t)> task = [&](size_t i) { fn(i); };
+    pool.run(count, grain, task);
+}
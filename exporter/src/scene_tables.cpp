@@ -0,0 +1,115 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "scene_tables.h"
+
+#include <unordered_set>
+
+char* NameTable::intern(std::string_view name, size_t* out_length)
+{
+    if (out_length != nullptr) *out_length = name.size();
+    if (auto found = names.find(name); found != names.end())
+        return found->second;
+
+    auto copy = arena.copy_name(name);
+    names.emplace(std::string_view(copy, name.size()), copy);
+    return copy;
+}
+
+MaterialTable::MaterialTable(const IOData* export_data, bool merge)
+    : materials(export_data->materials),
+      material_count(export_data->material_count), remap(material_count)
+{
+    for (size_t i = 0; i < material_count; i++)
+    {
+        if (materials[i].name != nullptr)
+            by_name.emplace(materials[i].name, i);
+    }
+
+    if (!merge)
+    {
+        for (size_t i = 0; i < material_count; i++)
+        {
+            remap[i] = i;
+            unique_materials.push_back(i);
+        }
+        return;
+    }
+
+    // 同じオブジェクトのスロット同士をまとめるとメッシュのマテリアル番号がずれるので、
+    // 使われているオブジェクトが重ならないものだけをまとめる
+    std::vector<std::vector<const Object*>> slot_objects(material_count);
+    collect_slot_objects(export_data->root, slot_objects);
+
+    std::vector<std::unordered_set<const Object*>> group_objects;
+    std::unordered_map<std::string_view, std::vector<size_t>> groups;
+    for (size_t i = 0; i < material_count; i++)
+    {
+        std::string_view surface((const char*)&materials[i].standard_surface,
+                                 sizeof(StandardSurface));
+        auto& candidates = groups[surface];
+        auto merged = false;
+        for (auto group : candidates)
+        {
+            auto& objects = group_objects[group];
+            auto overlaps = false;
+            for (auto object : slot_objects[i])
+            {
+                if (objects.count(object) == 0) continue;
+                overlaps = true;
+                break;
+            }
+            if (overlaps) continue;
+
+            remap[i] = group;
+            objects.insert(slot_objects[i].begin(), slot_objects[i].end());
+            merged = true;
+            break;
+        }
+        if (merged) continue;
+
+        remap[i] = unique_materials.size();
+        candidates.push_back(unique_materials.size());
+        unique_materials.push_back(i);
+        group_objects.emplace_back(slot_objects[i].begin(),
+                                   slot_objects[i].end());
+    }
+}
+
+ptrdiff_t MaterialTable::find(const Material* slot) const
+{
+    auto index = original_index(slot);
+    return index < 0 ? -1 : (ptrdiff_t)remap[index];
+}
+
+/// @brief スロットのマテリアルの元の番号を引く
+/// @param slot スロットのマテリアル
+/// @return 元の番号 (見つからなければ-1)
+ptrdiff_t MaterialTable::original_index(const Material* slot) const
+{
+    if (slot == nullptr) return -1;
+
+    // スロットは通常マテリアル配列へのポインタなので添字はアドレスから求める
+    if (slot >= materials && slot < materials + material_count)
+        return slot - materials;
+    if (slot->name == nullptr) return -1;
+    auto found = by_name.find(slot->name);
+    return found != by_name.end() ? (ptrdiff_t)found->second : -1;
+}
+
+/// @brief マテリアルごとに、スロットに持つオブジェクトを集める
+/// @param object オブジェクト
+/// @param out マテリアル (元の番号) ごとのオブジェクトの出力先
+void MaterialTable::collect_slot_objects(
+    const Object* object, std::vector<std::vector<const Object*>>& out) const
+{
+    if (object == nullptr) return;
+    for (size_t i = 0; i < object->material_slot_count; i++)
+    {
+        auto index = original_index(object->material_slots[i]);
+        if (index >= 0) out[index].push_back(object);
+    }
+    for (size_t i = 0; i < object->child_count; i++)
+        collect_slot_objects(&object->children[i], out);
+}
@@ -0,0 +1,70 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// シーン全体で共有する名前とマテリアルの表 (ハッシュで引く)
+
+#pragma once
+
+#include "../include/io.h"
+#include "arena.h"
+
+#include <cstddef>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/// @brief 同じ名前を1つにまとめて領域に確保する
+/// ノード名やメッシュ名は重複しやすいので、インポート結果では同じ文字列を共有する
+class NameTable
+{
+  public:
+    explicit NameTable(Arena& arena) : arena(arena) {}
+
+    /// @brief 名前を登録する (登録済みなら同じ文字列を返す)
+    /// @param name 名前
+    /// @param out_length 名前の長さの出力先 (nullptrなら出力しない)
+    /// @return 領域に確保された名前 (NULL終端)
+    char* intern(std::string_view name, size_t* out_length = nullptr);
+
+  private:
+    Arena& arena;
+    std::unordered_map<std::string_view, char*> names;
+};
+
+/// @brief 書き出すマテリアルの表
+/// マテリアルスロットから書き出し先の番号をO(1)で引き、
+/// 必要ならStandardSurfaceが同一のマテリアルを1つにまとめる
+class MaterialTable
+{
+  public:
+    /// @param export_data エクスポートデータ (マテリアルとオブジェクトツリー)
+    /// @param merge StandardSurfaceのビット列が同一のマテリアルをまとめるかどうか
+    MaterialTable(const IOData* export_data, bool merge);
+
+    /// @brief 書き出すマテリアルの数
+    size_t unique_count() const { return unique_materials.size(); }
+
+    /// @brief 書き出すマテリアル
+    /// @param index 書き出し先の番号
+    const Material& unique_material(size_t index) const
+    {
+        return materials[unique_materials[index]];
+    }
+
+    /// @brief マテリアルスロットの書き出し先の番号を引く
+    /// @param slot スロットのマテリアル (配列外なら名前で引く)
+    /// @return 書き出し先の番号 (見つからなければ-1)
+    ptrdiff_t find(const Material* slot) const;
+
+  private:
+    const Material* materials;
+    size_t material_count;
+    std::vector<size_t> remap;            // 元の番号 -> 書き出し先の番号
+    std::vector<size_t> unique_materials; // 書き出し先の番号 -> 元の番号
+    std::unordered_map<std::string_view, size_t> by_name;
+
+    ptrdiff_t original_index(const Material* slot) const;
+    void collect_slot_objects(const Object* object,
+                              std::vector<std::vector<const Object*>>& out) const;
+};
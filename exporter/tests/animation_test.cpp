@@ -0,0 +1,355 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// アニメーションのベイクとキーの削減 (SceneAnimation, reduce_curve_keys) のテスト
+// (FBX SDKを使用しない、失敗があれば終了コード1)
+
+#include "../include/io.h"
+#include "../src/animation_curves.h"
+#include "../src/export_job.h"
+#include "../src/fbx_binary.h"
+#include "../src/io_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// テストのフレーム数とフレームレート、最初のフレームの時刻
+constexpr size_t ANIMATION_TEST_FRAMES = 240;
+constexpr double ANIMATION_TEST_RATE = 24.0;
+constexpr double ANIMATION_TEST_START = 0.5;
+// animation_curves.cppの既定の許容誤差 (移動・回転 (度)・拡縮)
+constexpr double ANIMATION_TEST_TOLERANCES[3] = {1e-4, 1e-2, 1e-4};
+// カーブの値はfloatで持つので、その丸めの分だけ許容誤差を広げる
+constexpr double ANIMATION_TEST_FLOAT_SLACK = 1e-4;
+
+/// @brief アニメーションを持つ2段のオブジェクトツリー
+/// (Objectは配列を参照するので一緒に保持する)
+struct AnimatedScene
+{
+    std::vector<double> parent_matrices;
+    std::vector<double> child_matrices;
+    Object child = {};
+    Object parent = {};
+    Object root = {};
+};
+
+bool run_bake_case(const AnimatedScene& scene, double key_tolerance);
+bool run_reduce_case();
+void build_animated_scene(AnimatedScene& scene);
+void compose_matrix(const double* t, const double* r, const double* s,
+                    double* m);
+double evaluate_curve(const AnimationCurve& curve, int64_t time);
+double rotation_error(const double* matrix, const double* r);
+
+int main()
+{
+    AnimatedScene scene;
+    build_animated_scene(scene);
+    auto failures = 0;
+    for (auto key_tolerance : {1.0, 10.0, -1.0})
+    {
+        auto ok = run_bake_case(scene, key_tolerance);
+        std::cout << (ok ? "ok     " : "FAILED ") << "bake_tolerance_"
+                  << key_tolerance << std::endl;
+        if (!ok) failures++;
+    }
+    auto ok = run_reduce_case();
+    std::cout << (ok ? "ok     " : "FAILED ") << "reduce_curve_keys"
+              << std::endl;
+    if (!ok) failures++;
+    return failures == 0 ? 0 : 1;
+}
+
+/// @brief ツリーをベイクし、オブジェクトごとに次を確かめる
+/// - キーの間を直線補間した移動・回転・拡縮が全てのフレームで許容誤差に収まる
+/// - 回転は±180度をまたいでも隣のフレームとの差が小さい (オイラー角のフィルタ)
+/// - 既定の許容誤差では、等速の回転や一定の成分のキーが最小限になる
+/// @param scene ツリー
+/// @param key_tolerance IOData::key_tolerance (負ならキーを減らさない)
+/// @return 確かめた内容が全て正しかったかどうか
+bool run_bake_case(const AnimatedScene& scene, double key_tolerance)
+{
+    auto label = "bake_tolerance_" + std::to_string(key_tolerance);
+    IOData data = {};
+    data.root = const_cast<Object*>(&scene.root);
+    data.frame_rate = ANIMATION_TEST_RATE;
+    data.animation_start = ANIMATION_TEST_START;
+    data.key_tolerance = key_tolerance;
+
+    SceneAnimation animation(&data, &scene.root);
+    ExportMonitor monitor;
+    StatsRecorder stats;
+    if (!animation.enabled() || !animation.bake(monitor, stats) ||
+        animation.objects().size() != 2 ||
+        animation.find(&scene.parent) == nullptr ||
+        animation.find(&scene.child) == nullptr)
+    {
+        std::cerr << label << ": animated objects were not baked" << std::endl;
+        return false;
+    }
+
+    auto scale = key_tolerance < 0.0 ? 0.0 : key_tolerance;
+    for (auto& object : animation.objects())
+    {
+        auto name = std::string(object.object->name);
+        auto& curves = object.curves;
+        double previous[3] = {};
+        for (size_t f = 0; f < ANIMATION_TEST_FRAMES; f++)
+        {
+            auto time = std::llround(
+                (ANIMATION_TEST_START + (double)f / ANIMATION_TEST_RATE) *
+                (double)FBX_TICKS_PER_SECOND);
+            double t[3], r[3], s[3];
+            for (auto j = 0; j < 3; j++)
+            {
+                t[j] = evaluate_curve(curves[ANIMATION_TRANSLATION + j], time);
+                r[j] = evaluate_curve(curves[ANIMATION_ROTATION + j], time);
+                s[j] = evaluate_curve(curves[ANIMATION_SCALING + j], time);
+            }
+
+            auto matrix = object.object->animation_matrices + f * 16;
+            double source_t[3], source_r[3], source_s[3];
+            decompose_matrix(matrix, source_t, source_r, source_s);
+            double errors[3] = {0.0, rotation_error(matrix, r), 0.0};
+            for (auto j = 0; j < 3; j++)
+            {
+                errors[0] = std::max(errors[0], std::abs(t[j] - source_t[j]));
+                errors[2] = std::max(errors[2], std::abs(s[j] - source_s[j]));
+            }
+            for (auto k = 0; k < 3; k++)
+            {
+                auto limit = ANIMATION_TEST_TOLERANCES[k] * scale +
+                             ANIMATION_TEST_FLOAT_SLACK *
+                                 (k == 1 ? 1.0 : 0.01);
+                if (errors[k] > limit)
+                {
+                    std::cerr << label << ": " << name << " channel " << k
+                              << " at frame " << f << " is off by "
+                              << errors[k] << std::endl;
+                    return false;
+                }
+            }
+
+            // 1フレームの回転は数度なので、360度の飛びがあればすぐに分かる
+            for (auto j = 0; j < 3; j++)
+            {
+                if (f > 0 && std::abs(r[j] - previous[j]) > 10.0)
+                {
+                    std::cerr << label << ": " << name << " rotation " << j
+                              << " jumps from " << previous[j] << " to "
+                              << r[j] << " at frame " << f << std::endl;
+                    return false;
+                }
+                previous[j] = r[j];
+            }
+        }
+
+        for (auto& curve : curves)
+        {
+            auto expected = key_tolerance < 0.0 ? ANIMATION_TEST_FRAMES : 0;
+            if (curve.times.empty() ||
+                curve.times.size() != curve.values.size() ||
+                (expected > 0 && curve.times.size() != expected))
+            {
+                std::cerr << label << ": " << name << " has "
+                          << curve.times.size() << " keys" << std::endl;
+                return false;
+            }
+        }
+    }
+
+    // 等速の回転は直線1本、一定の成分はキー1つになる
+    if (key_tolerance == 1.0)
+    {
+        auto parent = animation.find(&scene.parent);
+        auto child = animation.find(&scene.child);
+        std::pair<const AnimationCurve*, size_t> limits[] = {
+            {&parent->curves[ANIMATION_ROTATION + 2], 2},
+            {&parent->curves[ANIMATION_TRANSLATION + 2], 1},
+            {&child->curves[ANIMATION_ROTATION + 0], 2},
+            {&child->curves[ANIMATION_ROTATION + 1], 1},
+            {&child->curves[ANIMATION_ROTATION + 2], 1},
+        };
+        for (auto [curve, limit] : limits)
+        {
+            if (curve->times.size() > limit)
+            {
+                std::cerr << label << ": a linear curve has "
+                          << curve->times.size() << " keys" << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/// @brief reduce_curve_keysを直接呼び、キーの間の直線補間が全てのサンプルで
+/// 許容誤差に収まること、最初と最後がキーになること、負の許容誤差で全て残ることを確かめる
+/// @return 確かめた内容が全て正しかったかどうか
+bool run_reduce_case()
+{
+    uint32_t state = 2023;
+    std::vector<double> samples(1000);
+    auto value = 0.0;
+    for (auto& sample : samples)
+    {
+        state = state * 1664525u + 1013904223u;
+        value += (double)(state >> 8) / (double)(1u << 24) - 0.5;
+        sample = value;
+    }
+
+    std::vector<uint32_t> keys;
+    for (auto tolerance : {0.0, 0.05, 0.5, 4.0})
+    {
+        reduce_curve_keys(samples.data(), samples.size(), tolerance, keys);
+        if (keys.size() < 2 || keys.front() != 0 ||
+            keys.back() != samples.size() - 1)
+        {
+            std::cerr << "reduce_curve_keys: tolerance " << tolerance
+                      << " does not keep both ends" << std::endl;
+            return false;
+        }
+        for (size_t k = 0; k + 1 < keys.size(); k++)
+        {
+            auto a = keys[k];
+            auto b = keys[k + 1];
+            if (a >= b) return false;
+            for (auto i = a; i <= b; i++)
+            {
+                auto alpha = (double)(i - a) / (double)(b - a);
+                auto line = samples[a] + (samples[b] - samples[a]) * alpha;
+                if (std::abs(line - samples[i]) > tolerance + 1e-12)
+                {
+                    std::cerr << "reduce_curve_keys: tolerance " << tolerance
+                              << " misses frame " << i << std::endl;
+                    return false;
+                }
+            }
+        }
+        if (tolerance == 4.0 && keys.size() * 4 > samples.size())
+        {
+            std::cerr << "reduce_curve_keys: " << keys.size()
+                      << " keys remain" << std::endl;
+            return false;
+        }
+    }
+
+    reduce_curve_keys(samples.data(), samples.size(), -1.0, keys);
+    if (keys.size() != samples.size()) return false;
+    std::vector<double> constant(100, 3.0);
+    reduce_curve_keys(constant.data(), constant.size(), 0.0, keys);
+    if (keys.size() != 1 || keys[0] != 0) return false;
+    reduce_curve_keys(samples.data(), 0, 1.0, keys);
+    return keys.empty();
+}
+
+/// @brief 親と子のフレームごとの行列を作る
+/// 親は移動と拡縮が波打ち、Zの回転が120度から等速で±180度をまたぐ
+/// 子はXの回転だけで、-300度から2回転する
+/// @param scene 作成先
+void build_animated_scene(AnimatedScene& scene)
+{
+    scene.parent_matrices.resize(ANIMATION_TEST_FRAMES * 16);
+    scene.child_matrices.resize(ANIMATION_TEST_FRAMES * 16);
+    for (size_t f = 0; f < ANIMATION_TEST_FRAMES; f++)
+    {
+        auto x = (double)f;
+        double t[3] = {3.0 * std::sin(x * 0.1), x * 0.01, 1.0};
+        double r[3] = {20.0 * std::sin(x * 0.05), 30.0, 120.0 + x};
+        double s[3] = {1.0 + 0.5 * std::sin(x * 0.07), 1.0, 2.0 - x * 0.005};
+        compose_matrix(t, r, s, &scene.parent_matrices[f * 16]);
+
+        double child_t[3] = {0.0, 2.0, 0.0};
+        double child_r[3] = {-300.0 + x * 3.0, 0.0, 0.0};
+        double child_s[3] = {1.0, 1.0, 1.0};
+        compose_matrix(child_t, child_r, child_s,
+                       &scene.child_matrices[f * 16]);
+    }
+
+    static char parent_name[] = "Parent";
+    static char child_name[] = "Child";
+    scene.child.name = child_name;
+    scene.child.name_length = sizeof(child_name) - 1;
+    scene.child.animation_matrices = scene.child_matrices.data();
+    scene.child.animation_frame_count = ANIMATION_TEST_FRAMES;
+    scene.parent.name = parent_name;
+    scene.parent.name_length = sizeof(parent_name) - 1;
+    scene.parent.children = &scene.child;
+    scene.parent.child_count = 1;
+    scene.parent.animation_matrices = scene.parent_matrices.data();
+    scene.parent.animation_frame_count = ANIMATION_TEST_FRAMES;
+    scene.root.children = &scene.parent;
+    scene.root.child_count = 1;
+    for (auto object : {&scene.child, &scene.parent, &scene.root})
+    {
+        for (auto i = 0; i < 4; i++) object->matrix_local[i * 5] = 1.0;
+    }
+}
+
+/// @brief 移動・XYZオイラー角 (度)・拡縮から、FbxAMatrixと同じ並びの行列を作る
+/// (decompose_matrixの逆で、行が拡縮した各軸になる)
+void compose_matrix(const double* t, const double* r, const double* s,
+                    double* m)
+{
+    const auto to_rad = 3.14159265358979323846 / 180.0;
+    auto cx = std::cos(r[0] * to_rad), sx = std::sin(r[0] * to_rad);
+    auto cy = std::cos(r[1] * to_rad), sy = std::sin(r[1] * to_rad);
+    auto cz = std::cos(r[2] * to_rad), sz = std::sin(r[2] * to_rad);
+    double rows[3][3] = {
+        {cy * cz, cy * sz, -sy},
+        {sx * sy * cz - cx * sz, sx * sy * sz + cx * cz, sx * cy},
+        {cx * sy * cz + sx * sz, cx * sy * sz - sx * cz, cx * cy},
+    };
+    for (auto i = 0; i < 3; i++)
+    {
+        for (auto j = 0; j < 3; j++) m[i * 4 + j] = rows[i][j] * s[i];
+        m[i * 4 + 3] = 0.0;
+        m[12 + i] = t[i];
+    }
+    m[15] = 1.0;
+}
+
+/// @brief キーの間を直線補間したカーブの値 (範囲外は端のキーの値)
+double evaluate_curve(const AnimationCurve& curve, int64_t time)
+{
+    auto& times = curve.times;
+    if (times.size() == 1 || time <= times.front()) return curve.values.front();
+    if (time >= times.back()) return curve.values.back();
+    auto next = std::upper_bound(times.begin(), times.end(), time);
+    auto k = (size_t)(next - times.begin());
+    auto alpha = (double)(time - times[k - 1]) /
+                 (double)(times[k] - times[k - 1]);
+    return (double)curve.values[k - 1] +
+           ((double)curve.values[k] - (double)curve.values[k - 1]) * alpha;
+}
+
+/// @brief 行列の回転とオイラー角の差 (度)
+/// 行列を分解した角度と、同じ回転を表す (x+180, 180-y, z+180) のそれぞれを
+/// 成分ごとに360度ずつずらして近づけ、小さい方の最大の差を返す
+/// @param matrix 元の行列
+/// @param r 比べるオイラー角 (度)
+double rotation_error(const double* matrix, const double* r)
+{
+    double t[3], base[3], s[3];
+    decompose_matrix(matrix, t, base, s);
+    double candidates[2][3] = {
+        {base[0], base[1], base[2]},
+        {base[0] + 180.0, 180.0 - base[1], base[2] + 180.0}};
+    auto best = 360.0;
+    for (auto& candidate : candidates)
+    {
+        auto error = 0.0;
+        for (auto j = 0; j < 3; j++)
+        {
+            auto diff = std::remainder(candidate[j] - r[j], 360.0);
+            error = std::max(error, std::abs(diff));
+        }
+        best = std::min(best, error);
+    }
+    return best;
+}
@@ -0,0 +1,232 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// ネイティブライタの書き出しキャッシュ (ExportCache) のテスト
+// 同じシーンの書き出しを省くこと、変わったメッシュだけを変換し直すことを確かめる
+// (FBX SDKを使用しない、失敗があれば終了コード1)
+
+#include "../src/export_cache.h"
+#include "../src/io_stats.h"
+#include "../src/mesh_instances.h"
+#include "test_scene.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+
+/// @brief 書き出す前のキャッシュの状態
+struct CacheProbe
+{
+    bool unchanged = false;       // 書き出しを省くかどうか
+    std::set<std::string> hits;   // Geometryを読み込めたメッシュの名前
+    std::set<std::string> misses; // 変換し直すメッシュの名前
+};
+
+bool run_cache_test();
+void build_cache_scene(TestScene& scene, size_t quads_size,
+                       const std::string& cache_dir);
+CacheProbe probe_cache(const TestScene& scene, const std::string& path);
+bool export_and_compare(const TestScene& scene, const std::string& path,
+                        const std::string& label);
+bool expect_probe(const CacheProbe& probe, bool unchanged,
+                  const std::set<std::string>& misses,
+                  const std::string& label);
+size_t count_cache_files(const std::filesystem::path& directory,
+                         const std::string& prefix);
+
+int main()
+{
+    auto ok = run_cache_test();
+    std::cout << (ok ? "ok     " : "FAILED ") << "export_cache" << std::endl;
+    return ok ? 0 : 1;
+}
+
+/// @brief 同じ書き出し先とキャッシュで次の順に書き出し、その都度確かめる
+/// - 初回はGeometryを全て保存する
+/// - 同じシーンは書き出しを省き、書き出し先は書き換えない
+/// - メッシュを1つ変えると、そのメッシュだけを変換し直す
+/// - ノードの行列を変えると書き出すが、Geometryは全てキャッシュから読み込む
+/// - 書き出しの設定を変えると、Geometryを全て変換し直す
+/// - 書き出し先を外から書き換えると、同じシーンでも書き出す
+/// @return 全て正しかったかどうか
+bool run_cache_test()
+{
+    const std::string label = "export_cache";
+    auto directory =
+        std::filesystem::temp_directory_path() / "halfbx_test_export_cache";
+    std::error_code error;
+    std::filesystem::remove_all(directory, error);
+    auto cache_dir = std::string((const char*)directory.u8string().c_str());
+    auto path = temp_fbx_path("export_cache");
+    std::filesystem::remove(std::filesystem::u8path(path), error);
+    const std::set<std::string> all = {"Quads", "Triangles", "Mixed"};
+
+    TestScene first;
+    build_cache_scene(first, 12, cache_dir);
+    auto ok = expect_probe(probe_cache(first, path), false, all,
+                           label + " first") &&
+              export_and_compare(first, path, label + " first");
+    if (ok && (count_cache_files(directory, "geometry-") != 3 ||
+               count_cache_files(directory, "scene-") != 1))
+    {
+        std::cerr << label << ": the cache has "
+                  << count_cache_files(directory, "geometry-")
+                  << " geometries" << std::endl;
+        ok = false;
+    }
+
+    // 同じシーン (別に組み立てたもの) は書き出し自体を省く
+    TestScene same;
+    build_cache_scene(same, 12, cache_dir);
+    auto written = std::filesystem::last_write_time(path, error);
+    ok = ok &&
+         expect_probe(probe_cache(same, path), true, {}, label + " same") &&
+         export_and_compare(same, path, label + " same");
+    if (ok && std::filesystem::last_write_time(path, error) != written)
+    {
+        std::cerr << label << ": an unchanged scene was written again"
+                  << std::endl;
+        ok = false;
+    }
+
+    TestScene changed;
+    build_cache_scene(changed, 13, cache_dir);
+    ok = ok &&
+         expect_probe(probe_cache(changed, path), false, {"Quads"},
+                      label + " changed mesh") &&
+         export_and_compare(changed, path, label + " changed mesh") &&
+         count_cache_files(directory, "geometry-") == 4;
+
+    TestScene moved;
+    build_cache_scene(moved, 13, cache_dir);
+    moved.objects[1].matrix_local[12] = 2.0;
+    ok = ok &&
+         expect_probe(probe_cache(moved, path), false, {},
+                      label + " moved node") &&
+         export_and_compare(moved, path, label + " moved node");
+
+    TestScene welded;
+    build_cache_scene(welded, 13, cache_dir);
+    welded.objects[1].matrix_local[12] = 2.0;
+    welded.data.weld_corner_attributes = true;
+    ok = ok &&
+         expect_probe(probe_cache(welded, path), false, all,
+                      label + " settings") &&
+         export_and_compare(welded, path, label + " settings");
+
+    // 書き出し先の大きさが変わったら、要約が同じでも書き出し直す
+    if (ok)
+    {
+        std::ofstream stream(std::filesystem::u8path(path),
+                             std::ios::binary | std::ios::app);
+        stream << "touched";
+    }
+    ok = ok && expect_probe(probe_cache(welded, path), false, {},
+                            label + " touched output") &&
+         export_and_compare(welded, path, label + " touched output");
+
+    std::filesystem::remove(std::filesystem::u8path(path), error);
+    std::filesystem::remove_all(directory, error);
+    return ok;
+}
+
+/// @brief 四角形・三角形・混在のメッシュを並べ、キャッシュを使うシーンを作る
+/// @param scene 作成先
+/// @param quads_size 四角形のメッシュの一辺のマス数 (変えるとそのメッシュだけ変わる)
+/// @param cache_dir キャッシュの置き場所 (sceneより長く保持する)
+void build_cache_scene(TestScene& scene, size_t quads_size,
+                       const std::string& cache_dir)
+{
+    scene.meshes.push_back(
+        make_grid_mesh("Quads", TEST_SHAPE_QUADS, quads_size));
+    scene.meshes.push_back(
+        make_grid_mesh("Triangles", TEST_SHAPE_TRIANGLES, 12));
+    scene.meshes.push_back(make_grid_mesh("Mixed", TEST_SHAPE_MIXED, 12));
+    build_test_scene(scene, SCALAR_FLOAT32);
+    scene.data.cache_dir = cache_dir.c_str();
+}
+
+/// @brief 書き出しと同じ手順でキャッシュを引き、書き出しを省くかどうかと
+/// メッシュごとにGeometryを読み込めるかどうかを調べる
+/// @param scene シーン
+/// @param path 書き出し先
+CacheProbe probe_cache(const TestScene& scene, const std::string& path)
+{
+    MeshInstances instances(scene.data.root);
+    ExportCache cache(path.c_str(), &scene.data, instances);
+    StatsRecorder stats;
+    cache.load_geometries(stats);
+    CacheProbe probe;
+    probe.unchanged = cache.output_unchanged();
+    for (auto mesh : instances.unique_meshes())
+    {
+        auto& names = cache.has_geometry(mesh) ? probe.hits : probe.misses;
+        names.insert(std::string(mesh->name, mesh->name_length));
+    }
+    return probe;
+}
+
+/// @brief 書き出して読み込み、書き出したシーンと同じかどうか確かめる
+bool export_and_compare(const TestScene& scene, const std::string& path,
+                        const std::string& label)
+{
+    if (!export_fbx(path.c_str(), &scene.data))
+    {
+        std::cerr << label << ": export failed" << std::endl;
+        return false;
+    }
+    auto imported = import_fbx(path.c_str());
+    if (imported == nullptr)
+    {
+        std::cerr << label << ": import failed" << std::endl;
+        return false;
+    }
+    auto ok = compare_imported_scene(scene, *imported, label);
+    delete_iodata(imported);
+    return ok;
+}
+
+/// @brief キャッシュの状態が期待どおりか
+/// @param probe 調べた状態
+/// @param unchanged 書き出しを省くべきかどうか
+/// @param misses 変換し直すべきメッシュの名前 (他は読み込めるはず)
+/// @param label 表示用の名前
+bool expect_probe(const CacheProbe& probe, bool unchanged,
+                  const std::set<std::string>& misses,
+                  const std::string& label)
+{
+    if (probe.unchanged != unchanged)
+    {
+        std::cerr << label << ": the export would "
+                  << (probe.unchanged ? "be skipped" : "not be skipped")
+                  << std::endl;
+        return false;
+    }
+    if (probe.misses != misses)
+    {
+        std::cerr << label << ": " << probe.misses.size()
+                  << " meshes miss the cache instead of " << misses.size()
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// @brief キャッシュの置き場所にある、名前が指定した文字列で始まるファイルの数
+size_t count_cache_files(const std::filesystem::path& directory,
+                         const std::string& prefix)
+{
+    size_t count = 0;
+    std::error_code error;
+    for (auto& entry : std::filesystem::directory_iterator(directory, error))
+    {
+        auto name = entry.path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) == 0 &&
+            name.find(".tmp-") == std::string::npos)
+            count++;
+    }
+    return count;
+}
@@ -0,0 +1,640 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// ネイティブの読み込み (import_fbx、import_fbx_stream) のテスト
+// (FBX SDKを使用しない、失敗があれば終了コード1)
+
+#include "test_scene.h"
+
+#include "../src/array_deflate.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// @brief import_fbx_streamのコールバックで受け取った内容
+struct StreamResult
+{
+    std::vector<std::string> object_names; // 渡された順
+    std::map<std::string, std::vector<PolygonKey>> polygons; // ノード名ごと
+    std::map<std::string, size_t> mesh_users; // ノード名ごとのメッシュの共有数
+    size_t mesh_calls = 0;
+};
+
+/// @brief テスト用に直接組み立てるバイナリFBXのノード
+struct RawRecord
+{
+    std::string name;
+    std::string values = {}; // 型の文字と値を並べたもの
+    uint32_t value_count = 0;
+    std::vector<RawRecord> children = {};
+
+    RawRecord& str(const std::string& value);
+    RawRecord& i32(int32_t value);
+    RawRecord& i64(int64_t value);
+    RawRecord& f64(double value);
+    template <typename T> RawRecord& array(char type, const std::vector<T>& v);
+    RawRecord& child(const std::string& child_name);
+};
+
+bool test_large_deflated_scene();
+bool test_shared_geometry();
+bool test_cyclic_connections();
+bool test_transform_chain();
+bool test_malformed_files();
+bool stream_scene(const std::string& path, StreamResult& out);
+bool compare_streamed_scene(const TestScene& scene, const StreamResult& result,
+                            const std::string& label);
+int64_t find_model_id(const std::string& bytes, const std::string& name);
+void add_vector_p(RawRecord& props70, const std::string& name, double x,
+                  double y, double z);
+void write_raw_record(const RawRecord& record, std::string& out);
+bool write_raw_fbx(const std::string& path,
+                   const std::vector<RawRecord>& records);
+bool nearly_equal(const double* a, const double* b, size_t count);
+
+int main()
+{
+    auto failures = 0;
+    auto run = [&](const char* name, bool (*test)()) {
+        auto ok = test();
+        std::cout << (ok ? "ok     " : "FAILED ") << name << std::endl;
+        if (!ok) failures++;
+    };
+    run("large_deflated_scene", test_large_deflated_scene);
+    run("shared_geometry", test_shared_geometry);
+    run("cyclic_connections", test_cyclic_connections);
+    run("transform_chain", test_transform_chain);
+    run("malformed_files", test_malformed_files);
+    return failures == 0 ? 0 : 1;
+}
+
+/// @brief 塊に分けて圧縮した大きな配列と、閾値を下げて圧縮した小さな配列を
+/// import_fbx、indexed_attributes付きのimport_fbx、import_fbx_streamで読み込む
+/// (全体を並列に展開する経路と、メッシュごとに展開する経路の両方を通す)
+bool test_large_deflated_scene()
+{
+    const std::string label = "large_deflated_scene";
+    TestScene scene;
+    scene.meshes.push_back(make_grid_mesh("Large", TEST_SHAPE_QUADS, 160));
+    scene.meshes.push_back(make_grid_mesh("Small", TEST_SHAPE_MIXED, 6));
+    build_test_scene(scene, SCALAR_FLOAT32);
+    scene.data.array_compression = ARRAY_COMPRESSION_DEFLATE;
+    scene.data.compression_threshold = 64;
+
+    // ポリゴン頂点ごとのuvが1つの塊より大きくなければ分割の経路を通らない
+    if (scene.meshes[0].uvs.size() * sizeof(double) <= 2 * DEFLATE_CHUNK_SIZE)
+    {
+        std::cerr << label << ": mesh is too small for several chunks"
+                  << std::endl;
+        return false;
+    }
+
+    auto path = temp_fbx_path("import_large");
+    if (!export_fbx(path.c_str(), &scene.data))
+    {
+        std::cerr << label << ": export failed" << std::endl;
+        return false;
+    }
+
+    auto ok = true;
+    auto imported = import_fbx(path.c_str());
+    if (imported == nullptr)
+    {
+        std::cerr << label << ": import failed" << std::endl;
+        ok = false;
+    }
+    else
+    {
+        ok = compare_imported_scene(scene, *imported, label) && ok;
+        delete_iodata(imported);
+    }
+
+    ImportOptions options = {};
+    options.indexed_attributes = true;
+    imported = import_fbx_with_options(path.c_str(), &options);
+    if (imported == nullptr)
+    {
+        std::cerr << label << ": indexed import failed" << std::endl;
+        ok = false;
+    }
+    else
+    {
+        ok = compare_imported_scene(scene, *imported, label + " (indexed)") &&
+             ok;
+        delete_iodata(imported);
+    }
+
+    StreamResult streamed;
+    if (!stream_scene(path, streamed))
+    {
+        std::cerr << label << ": streaming import failed" << std::endl;
+        ok = false;
+    }
+    else
+    {
+        ok = compare_streamed_scene(scene, streamed, label + " (stream)") && ok;
+    }
+    std::remove(path.c_str());
+    return ok;
+}
+
+/// @brief 同じメッシュを使う2つのノードが読み込み後も1つのメッシュを共有するか
+bool test_shared_geometry()
+{
+    const std::string label = "shared_geometry";
+    TestScene scene;
+    scene.meshes.push_back(make_grid_mesh("Shared", TEST_SHAPE_MIXED, 8));
+    build_test_scene(scene, SCALAR_FLOAT64);
+    auto instance = scene.objects[0];
+    instance.name = (char*)"Instance";
+    instance.name_length = 8;
+    instance.matrix_local[12] = 10.0;
+    scene.objects.push_back(instance);
+    scene.root.children = scene.objects.data();
+    scene.root.child_count = scene.objects.size();
+
+    auto path = temp_fbx_path("import_shared");
+    if (!export_fbx(path.c_str(), &scene.data))
+    {
+        std::cerr << label << ": export failed" << std::endl;
+        return false;
+    }
+
+    auto ok = true;
+    auto imported = import_fbx(path.c_str());
+    if (imported == nullptr)
+    {
+        std::cerr << label << ": import failed" << std::endl;
+        ok = false;
+    }
+    else
+    {
+        ok = compare_imported_scene(scene, *imported, label) && ok;
+        auto shared = find_object(*imported->root, "Shared");
+        auto copy = find_object(*imported->root, "Instance");
+        if (shared == nullptr || copy == nullptr || shared->mesh == nullptr ||
+            shared->mesh != copy->mesh)
+        {
+            std::cerr << label << ": nodes do not share the mesh" << std::endl;
+            ok = false;
+        }
+        delete_iodata(imported);
+    }
+
+    StreamResult streamed;
+    if (!stream_scene(path, streamed) || streamed.mesh_calls != 1 ||
+        streamed.mesh_users["Shared"] != 2 ||
+        streamed.mesh_users["Instance"] != 2)
+    {
+        std::cerr << label << ": streamed mesh is not shared" << std::endl;
+        ok = false;
+    }
+    std::remove(path.c_str());
+    return ok;
+}
+
+/// @brief 親子関係が循環するファイルを読み込んでも止まらずに読み込めるか
+/// T->A->B と C->D を書き出し、D->Cの接続をA->Bに書き換えて T->A->B->A にする
+bool test_cyclic_connections()
+{
+    const std::string label = "cyclic_connections";
+    std::vector<std::string> names = {"T", "A", "B", "C", "D"};
+    std::vector<Object> objects(names.size());
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        objects[i].name = names[i].data();
+        objects[i].name_length = names[i].size();
+        objects[i].matrix_local[0] = objects[i].matrix_local[5] =
+            objects[i].matrix_local[10] = objects[i].matrix_local[15] = 1.0;
+    }
+    objects[1].children = &objects[2];
+    objects[1].child_count = 1;
+    objects[0].children = &objects[1];
+    objects[0].child_count = 1;
+    objects[3].children = &objects[4];
+    objects[3].child_count = 1;
+    Object top[2] = {objects[0], objects[3]};
+    Object root = {};
+    root.name = (char*)"RootNode";
+    root.name_length = 8;
+    root.children = top;
+    root.child_count = 2;
+    IOData data = {};
+    data.root = &root;
+    data.unit_scale = 1.0;
+    data.backend = IO_BACKEND_NATIVE;
+
+    auto path = temp_fbx_path("import_cycle");
+    if (!export_fbx(path.c_str(), &data))
+    {
+        std::cerr << label << ": export failed" << std::endl;
+        return false;
+    }
+    std::string bytes;
+    {
+        std::ifstream file(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), {});
+    }
+
+    // 接続は "OO"、子のID、親のIDの順のプロパティ (同じ長さで書き換える)
+    auto a = find_model_id(bytes, "A"), b = find_model_id(bytes, "B");
+    auto c = find_model_id(bytes, "C"), d = find_model_id(bytes, "D");
+    std::string pattern("S\x02\0\0\0OOL", 8);
+    pattern.append((const char*)&d, 8).append("L").append((const char*)&c, 8);
+    auto offset = bytes.find(pattern);
+    if (a == 0 || b == 0 || offset == std::string::npos)
+    {
+        std::cerr << label << ": connection to rewrite is missing" << std::endl;
+        std::remove(path.c_str());
+        return false;
+    }
+    std::memcpy(&bytes[offset + 8], &a, 8);
+    std::memcpy(&bytes[offset + 17], &b, 8);
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(bytes.data(), bytes.size());
+    }
+
+    auto ok = true;
+    auto imported = import_fbx(path.c_str());
+    if (imported == nullptr)
+    {
+        std::cerr << label << ": import failed" << std::endl;
+        ok = false;
+    }
+    else
+    {
+        // Aは最初の親のTの下に1回だけ作り、BからAへの接続は無視する
+        auto t = find_object(*imported->root, "T");
+        auto a_node = t != nullptr ? find_object(*t, "A") : nullptr;
+        auto b_node = a_node != nullptr ? find_object(*a_node, "B") : nullptr;
+        if (b_node == nullptr || b_node->child_count != 0)
+        {
+            std::cerr << label << ": unexpected hierarchy" << std::endl;
+            ok = false;
+        }
+        delete_iodata(imported);
+    }
+
+    StreamResult streamed;
+    if (!stream_scene(path, streamed) || streamed.object_names.size() != 5)
+    {
+        std::cerr << label << ": streaming import failed" << std::endl;
+        ok = false;
+    }
+    std::remove(path.c_str());
+    return ok;
+}
+
+/// @brief 回転順、Pre/PostRotation、回転と拡縮のピボット・オフセット、
+/// Geometric*を持つModelを読み込み、FbxNode::EvaluateLocalTransformと同じ
+/// 行列と、Geometric*をかけた頂点になるか確かめる
+bool test_transform_chain()
+{
+    const std::string label = "transform_chain";
+    RawRecord settings{"GlobalSettings"};
+    settings.child("Properties70")
+        .child("P")
+        .str("UnitScaleFactor")
+        .str("double")
+        .str("Number")
+        .str("")
+        .f64(100.0); // cmなのでメートルでは0.01倍
+
+    RawRecord objects{"Objects"};
+    auto& model = objects.child("Model").i64(100).str(
+        std::string("Node\0\x01Model", 11)).str("Mesh");
+    auto& props = model.child("Properties70");
+    add_vector_p(props, "Lcl Translation", 1, 2, 3);
+    add_vector_p(props, "Lcl Rotation", 90, 0, 90);
+    add_vector_p(props, "Lcl Scaling", 2, 1, 1);
+    add_vector_p(props, "PreRotation", 0, 90, 0);
+    add_vector_p(props, "PostRotation", 0, 0, 90);
+    add_vector_p(props, "RotationPivot", 1, 0, 0);
+    add_vector_p(props, "RotationOffset", 0, 1, 0);
+    add_vector_p(props, "ScalingPivot", 0, 0, 1);
+    add_vector_p(props, "ScalingOffset", 1, 0, 0);
+    add_vector_p(props, "GeometricTranslation", 0, 0, 1);
+    add_vector_p(props, "GeometricRotation", 0, 90, 0);
+    props.child("P")
+        .str("RotationOrder")
+        .str("enum")
+        .str("")
+        .str("A")
+        .i32(4); // ZXY
+    auto& geometry = objects.child("Geometry").i64(200).str(
+        std::string("Tri\0\x01Geometry", 13)).str("Mesh");
+    geometry.child("Vertices").array<double>('d', {1, 0, 0, 0, 1, 0, 0, 0, 0});
+    geometry.child("PolygonVertexIndex").array<int32_t>('i', {0, 1, ~2});
+
+    RawRecord connections{"Connections"};
+    connections.child("C").str("OO").i64(100).i64(0);
+    connections.child("C").str("OO").i64(200).i64(100);
+
+    auto path = temp_fbx_path("import_transform");
+    if (!write_raw_fbx(path, {settings, objects, connections}))
+    {
+        std::cerr << label << ": could not write the file" << std::endl;
+        return false;
+    }
+
+    ImportOptions options = {};
+    options.backend = IMPORT_BACKEND_NATIVE;
+    auto imported = import_fbx_with_options(path.c_str(), &options);
+    std::remove(path.c_str());
+    if (imported == nullptr)
+    {
+        std::cerr << label << ": import failed" << std::endl;
+        return false;
+    }
+
+    // T * Roff * Rp * Rpre * R * Rpost^-1 * Rp^-1 * Soff * Sp * S * Sp^-1
+    // (行ベクトルの並び)
+    const double expected_matrix[16] = {0, 0, -2, 0, 1, 0, 0, 0,
+                                        0, -1, 0, 0, 2, 3, 3, 1};
+    // Geometric*をかけてからY-upをZ-upにした頂点
+    const double expected_vertices[9] = {0, 0, 0, 0, -1, 1, 0, -1, 0};
+    auto ok = true;
+    auto node = find_object(*imported->root, "Node");
+    if (node == nullptr || !nearly_equal(node->matrix_local, expected_matrix, 16))
+    {
+        std::cerr << label << ": local matrix differs" << std::endl;
+        ok = false;
+    }
+    if (node == nullptr || node->mesh == nullptr ||
+        node->mesh->vertex_count != 3)
+    {
+        std::cerr << label << ": mesh is missing" << std::endl;
+        ok = false;
+    }
+    else
+    {
+        for (size_t i = 0; i < 3; i++)
+        {
+            auto& v = node->mesh->vertices[i];
+            double position[3] = {v.x, v.y, v.z};
+            if (!nearly_equal(position, &expected_vertices[i * 3], 3))
+            {
+                std::cerr << label << ": vertex " << i
+                          << " does not have the geometric transform"
+                          << std::endl;
+                ok = false;
+            }
+        }
+    }
+    delete_iodata(imported);
+    return ok;
+}
+
+/// @brief 頂点数を超える頂点番号と、深く入れ子になったノードを持つファイルが
+/// 範囲外の読み込みやスタックの溢れを起こさずに失敗するか
+bool test_malformed_files()
+{
+    const std::string label = "malformed_files";
+    // 三角形1つのシーン (最後の頂点番号だけを変える)
+    auto triangle = [](int32_t last) {
+        RawRecord objects{"Objects"};
+        objects.child("Model").i64(100).str(
+            std::string("Node\0\x01Model", 11));
+        auto& geometry = objects.child("Geometry").i64(200).str(
+            std::string("Tri\0\x01Geometry", 13)).str("Mesh");
+        geometry.child("Vertices").array<double>('d',
+                                                 {1, 0, 0, 0, 1, 0, 0, 0, 0});
+        geometry.child("PolygonVertexIndex")
+            .array<int32_t>('i', {0, 1, ~last});
+        RawRecord connections{"Connections"};
+        connections.child("C").str("OO").i64(100).i64(0);
+        connections.child("C").str("OO").i64(200).i64(100);
+        return std::vector<RawRecord>{objects, connections};
+    };
+
+    // 正しいシーンの後に、上限より深く入れ子になったノードを置く
+    auto nested = triangle(2);
+    nested.push_back({"Nested"});
+    auto* inner = &nested.back();
+    for (auto i = 0; i < 1000; i++) inner = &inner->child("Nested");
+
+    ImportOptions options = {};
+    options.backend = IMPORT_BACKEND_NATIVE;
+    ImportCallbacks callbacks = {};
+    callbacks.on_material = [](void*, size_t, const Material*) {};
+    callbacks.on_object = [](void*, size_t, size_t, const Object*) {};
+    callbacks.on_mesh = [](void*, const size_t*, size_t, const Mesh*) {};
+    auto ok = true;
+    auto path = temp_fbx_path("import_malformed");
+    const std::pair<const char*, std::vector<RawRecord>> cases[] = {
+        {"out of range index", triangle(3)}, {"nested records", nested}};
+    for (auto& [name, records] : cases)
+    {
+        if (!write_raw_fbx(path, records))
+        {
+            std::cerr << label << ": could not write the file" << std::endl;
+            return false;
+        }
+        auto imported = import_fbx_with_options(path.c_str(), &options);
+        if (imported != nullptr)
+        {
+            std::cerr << label << ": " << name << " was imported"
+                      << std::endl;
+            delete_iodata(imported);
+            ok = false;
+        }
+        if (import_fbx_stream_with_options(path.c_str(), &callbacks,
+                                           &options))
+        {
+            std::cerr << label << ": " << name << " was streamed"
+                      << std::endl;
+            ok = false;
+        }
+    }
+    std::remove(path.c_str());
+    return ok;
+}
+
+/// @brief import_fbx_streamで読み込み、ノード名とメッシュのポリゴンを集める
+/// @param path ファイルのパス
+/// @param out 出力先
+/// @return 読み込めたかどうか
+bool stream_scene(const std::string& path, StreamResult& out)
+{
+    ImportCallbacks callbacks = {};
+    callbacks.user_data = &out;
+    callbacks.on_material = [](void*, size_t, const Material*) {};
+    callbacks.on_object = [](void* user_data, size_t index, size_t,
+                             const Object* object) {
+        auto& result = *(StreamResult*)user_data;
+        if (result.object_names.size() <= index)
+            result.object_names.resize(index + 1);
+        result.object_names[index] =
+            std::string(object->name, object->name_length);
+    };
+    callbacks.on_mesh = [](void* user_data, const size_t* object_indices,
+                           size_t object_count, const Mesh* mesh) {
+        // meshはコールバックから戻ると解放されるので、ここで比較用にする
+        auto& result = *(StreamResult*)user_data;
+        result.mesh_calls++;
+        for (size_t i = 0; i < object_count; i++)
+        {
+            auto& name = result.object_names[object_indices[i]];
+            result.mesh_users[name] = object_count;
+            if (mesh->uv_set_count > 0)
+                result.polygons[name] = polygon_keys(*mesh, 0);
+        }
+    };
+    return import_fbx_stream(path.c_str(), &callbacks);
+}
+
+/// @brief ストリーミングで読み込んだメッシュが書き出したものと同じか確かめる
+/// @param scene 書き出したシーン
+/// @param result 読み込んだ内容
+/// @param label 失敗したときに表示する名前
+/// @return 同じかどうか
+bool compare_streamed_scene(const TestScene& scene, const StreamResult& result,
+                            const std::string& label)
+{
+    auto ok = true;
+    for (auto& source : scene.meshes)
+    {
+        auto found = result.polygons.find(source.name);
+        if (found == result.polygons.end() ||
+            found->second != polygon_keys(source))
+        {
+            std::cerr << label << ": " << source.name << ": polygons differ"
+                      << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/// @brief 書き出したファイルからModelのIDを探す
+/// Modelは 'L' ID、'S' "名前\0\x01Model" のプロパティで始まる
+/// @param bytes ファイルの中身
+/// @param name Modelの名前
+/// @return ID (見つからなければ0)
+int64_t find_model_id(const std::string& bytes, const std::string& name)
+{
+    auto class_name = name + std::string("\0\x01Model", 7);
+    std::string pattern = "S";
+    auto length = (uint32_t)class_name.size();
+    pattern.append((const char*)&length, 4).append(class_name);
+    auto offset = bytes.find(pattern);
+    if (offset == std::string::npos || offset < 9 || bytes[offset - 9] != 'L')
+        return 0;
+    int64_t id = 0;
+    std::memcpy(&id, &bytes[offset - 8], 8);
+    return id;
+}
+
+RawRecord& RawRecord::str(const std::string& value)
+{
+    auto length = (uint32_t)value.size();
+    values.append("S").append((const char*)&length, 4).append(value);
+    value_count++;
+    return *this;
+}
+
+RawRecord& RawRecord::i32(int32_t value)
+{
+    values.append("I").append((const char*)&value, 4);
+    value_count++;
+    return *this;
+}
+
+RawRecord& RawRecord::i64(int64_t value)
+{
+    values.append("L").append((const char*)&value, 8);
+    value_count++;
+    return *this;
+}
+
+RawRecord& RawRecord::f64(double value)
+{
+    values.append("D").append((const char*)&value, 8);
+    value_count++;
+    return *this;
+}
+
+/// @brief 圧縮しない配列のプロパティを追加する
+template <typename T>
+RawRecord& RawRecord::array(char type, const std::vector<T>& v)
+{
+    uint32_t header[3] = {(uint32_t)v.size(), 0,
+                          (uint32_t)(v.size() * sizeof(T))};
+    values.append(1, type).append((const char*)header, 12);
+    values.append((const char*)v.data(), v.size() * sizeof(T));
+    value_count++;
+    return *this;
+}
+
+/// @brief 子ノードを追加する
+/// @return 追加した子ノード (次に子を追加するまで有効)
+RawRecord& RawRecord::child(const std::string& child_name)
+{
+    children.push_back({child_name});
+    return children.back();
+}
+
+/// @brief Properties70に3要素のPを追加する
+void add_vector_p(RawRecord& props70, const std::string& name, double x,
+                  double y, double z)
+{
+    props70.child("P")
+        .str(name)
+        .str("Vector3D")
+        .str("Vector")
+        .str("A")
+        .f64(x)
+        .f64(y)
+        .f64(z);
+}
+
+/// @brief ノードをFBX 7.4 (32bitオフセット) の形式で追加する
+/// @param record ノード
+/// @param out 出力先 (ファイルの先頭からの内容)
+void write_raw_record(const RawRecord& record, std::string& out)
+{
+    auto start = out.size();
+    uint32_t header[3] = {0, record.value_count, (uint32_t)record.values.size()};
+    out.append((const char*)header, 12);
+    out.append(1, (char)record.name.size()).append(record.name);
+    out.append(record.values);
+    for (auto& child : record.children) write_raw_record(child, out);
+    if (!record.children.empty()) out.append(13, '\0');
+    auto end = (uint32_t)out.size();
+    std::memcpy(&out[start], &end, 4);
+}
+
+/// @brief ノードを並べたバイナリFBXを書き出す (フッターは省く)
+/// @param path ファイルのパス
+/// @param records トップレベルのノード
+/// @return 書き出せたかどうか
+bool write_raw_fbx(const std::string& path,
+                   const std::vector<RawRecord>& records)
+{
+    std::string bytes("Kaydara FBX Binary  \0\x1a\0", 23);
+    uint32_t version = 7400;
+    bytes.append((const char*)&version, 4);
+    for (auto& record : records) write_raw_record(record, bytes);
+    bytes.append(13, '\0');
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(bytes.data(), bytes.size());
+    return file.good();
+}
+
+/// @brief 計算の誤差を許して同じ値か比べる
+bool nearly_equal(const double* a, const double* b, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        if (std::abs(a[i] - b[i]) > 1e-9) return false;
+    return true;
+}
@@ -0,0 +1,210 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 面法線のカーネル (uniform_face_normals) のテスト
+// 使えるSIMDの段階ごとに、別に求めた外積・Newellの方法の法線と比べる
+// (FBX SDKを使用しない、失敗があれば終了コード1)
+
+#include "../include/io.h"
+#include "../src/geometry_kernels.h"
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// テスト用のメッシュの頂点数と面数 (4の倍数でない面数で端数も通す)
+constexpr size_t KERNEL_TEST_VERTICES = 800;
+constexpr size_t KERNEL_TEST_FACES = 1003;
+
+/// @brief 決まった乱数で頂点を選んだ面を並べたメッシュ
+/// 同じ座標をfloat32とVector4の両方で持つ
+struct KernelMesh
+{
+    std::vector<float> packed; // xyz
+    std::vector<Vector4> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<unsigned int> polys;
+    Mesh mesh = {};
+};
+
+void build_kernel_mesh(KernelMesh& test, size_t corners);
+void bind_kernel_mesh(KernelMesh& test, ScalarType scalar_type);
+std::vector<Vector4> reference_face_normals(const KernelMesh& test);
+bool run_kernel_case(KernelMesh& test, ScalarType scalar_type,
+                     const std::string& label);
+bool run_fallback_case();
+
+int main()
+{
+    auto failures = 0;
+    KernelMesh triangles, quads;
+    build_kernel_mesh(triangles, 3);
+    build_kernel_mesh(quads, 4);
+    for (auto level : {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2})
+    {
+        std::string name = simd_level_name(level);
+        set_simd_level(level);
+        if (simd_level() != level)
+        {
+            std::cout << "skip   " << name << std::endl;
+            continue;
+        }
+        for (auto scalar_type : {SCALAR_FLOAT32, SCALAR_FLOAT64})
+        {
+            auto suffix = scalar_type == SCALAR_FLOAT32 ? "_float32"
+                                                        : "_float64";
+            for (auto [test, shape] : {std::pair{&triangles, "_triangles"},
+                                       std::pair{&quads, "_quads"}})
+            {
+                auto label = name + shape + suffix;
+                auto ok = run_kernel_case(*test, scalar_type, label);
+                std::cout << (ok ? "ok     " : "FAILED ") << label
+                          << std::endl;
+                if (!ok) failures++;
+            }
+        }
+    }
+
+    auto ok = run_fallback_case();
+    std::cout << (ok ? "ok     " : "FAILED ") << "fallback" << std::endl;
+    if (!ok) failures++;
+    return failures == 0 ? 0 : 1;
+}
+
+/// @brief 現在のSIMDの段階で面法線を求め、全ての面で参照の値と比べる
+/// @param test メッシュ
+/// @param scalar_type 頂点の格納形式
+/// @param label 表示用の名前
+/// @return 全ての面で誤差が十分小さかったかどうか
+bool run_kernel_case(KernelMesh& test, ScalarType scalar_type,
+                     const std::string& label)
+{
+    bind_kernel_mesh(test, scalar_type);
+    std::vector<Vector4> result(KERNEL_TEST_FACES, {1.0, 1.0, 1.0, 1.0});
+    if (!uniform_face_normals(&test.mesh, result.data()))
+    {
+        std::cerr << label << ": the kernel was not used" << std::endl;
+        return false;
+    }
+    auto reference = reference_face_normals(test);
+    for (size_t i = 0; i < KERNEL_TEST_FACES; i++)
+    {
+        auto& r = result[i];
+        auto& e = reference[i];
+        // FMAの有無で丸めが変わるので、座標の大きさ (1程度) に対する誤差で比べる
+        auto error = std::abs(r.x - e.x) + std::abs(r.y - e.y) +
+                     std::abs(r.z - e.z) + std::abs(r.w);
+        if (!(error < 1e-12))
+        {
+            std::cerr << label << ": face " << i << " normal (" << r.x << ", "
+                      << r.y << ", " << r.z << ", " << r.w << ") differs from ("
+                      << e.x << ", " << e.y << ", " << e.z << ")" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @brief 三角形・四角形のみでないメッシュはカーネルを使わないことを確かめる
+/// (頂点数の合計が面数の3倍でも、2頂点の面と4頂点の面が混ざる場合を含む)
+bool run_fallback_case()
+{
+    KernelMesh test;
+    build_kernel_mesh(test, 3);
+    test.polys[1] = 2;
+    test.polys[2] = 7;
+    bind_kernel_mesh(test, SCALAR_FLOAT64);
+    std::vector<Vector4> result(KERNEL_TEST_FACES);
+    if (uniform_face_normals(&test.mesh, result.data()))
+    {
+        std::cerr << "fallback: a 2-corner face used the kernel" << std::endl;
+        return false;
+    }
+    test.polys.pop_back();
+    test.mesh.poly_count--;
+    if (uniform_face_normals(&test.mesh, result.data()))
+    {
+        std::cerr << "fallback: a mixed mesh used the kernel" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// @brief 決まった乱数で、頂点の座標と面ごとの頂点番号を作る
+/// 座標は平面に乗らないように散らし、頂点番号は飛び飛びにしてgatherを通す
+/// @param test 作成先
+/// @param corners 面の頂点数 (3か4)
+void build_kernel_mesh(KernelMesh& test, size_t corners)
+{
+    uint32_t state = 2023;
+    auto next = [&] {
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    };
+    for (size_t v = 0; v < KERNEL_TEST_VERTICES; v++)
+    {
+        float p[3];
+        for (auto& c : p) c = (float)(next() % 2001) / 1000.0f - 1.0f;
+        test.packed.insert(test.packed.end(), p, p + 3);
+        test.vertices.push_back({p[0], p[1], p[2], 1.0});
+    }
+    for (size_t i = 0; i < KERNEL_TEST_FACES; i++)
+    {
+        test.polys.push_back((unsigned int)test.indices.size());
+        for (size_t c = 0; c < corners; c++)
+            test.indices.push_back(next() % KERNEL_TEST_VERTICES);
+    }
+}
+
+/// @brief 指定した格納形式の頂点でmeshを組み立てる
+void bind_kernel_mesh(KernelMesh& test, ScalarType scalar_type)
+{
+    auto& mesh = test.mesh;
+    mesh.vertices = scalar_type == SCALAR_FLOAT32
+                        ? (Vector4*)test.packed.data()
+                        : test.vertices.data();
+    mesh.scalar_type = scalar_type;
+    mesh.vertex_count = KERNEL_TEST_VERTICES;
+    mesh.indices = test.indices.data();
+    mesh.index_count = test.indices.size();
+    mesh.polys = test.polys.data();
+    mesh.poly_count = test.polys.size();
+}
+
+/// @brief 三角形は2辺の外積、それ以外はNewellの方法で面法線を求める
+std::vector<Vector4> reference_face_normals(const KernelMesh& test)
+{
+    std::vector<Vector4> out;
+    auto corners = test.indices.size() / test.polys.size();
+    for (size_t i = 0; i < test.polys.size(); i++)
+    {
+        auto face = test.indices.data() + test.polys[i];
+        auto& a = test.vertices[face[0]];
+        auto& b = test.vertices[face[1]];
+        auto& c = test.vertices[face[2]];
+        Vector4 n = {0.0, 0.0, 0.0, 0.0};
+        if (corners == 3)
+        {
+            double e[3] = {b.x - a.x, b.y - a.y, b.z - a.z};
+            double f[3] = {c.x - a.x, c.y - a.y, c.z - a.z};
+            n = {e[1] * f[2] - e[2] * f[1], e[2] * f[0] - e[0] * f[2],
+                 e[0] * f[1] - e[1] * f[0], 0.0};
+        }
+        else
+        {
+            for (size_t j = 0; j < corners; j++)
+            {
+                auto& p = test.vertices[face[j]];
+                auto& q = test.vertices[face[(j + 1) % corners]];
+                n.x += (p.y - q.y) * (p.z + q.z);
+                n.y += (p.z - q.z) * (p.x + q.x);
+                n.z += (p.x - q.x) * (p.y + q.y);
+            }
+        }
+        out.push_back(n);
+    }
+    return out;
+}
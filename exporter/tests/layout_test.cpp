@@ -0,0 +1,359 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 法線・UVの共有と頂点キャッシュ向けの並べ替え (build_mesh_layout) のテスト
+// (FBX SDKを使用しない、失敗があれば終了コード1)
+
+#include "../src/mesh_layout.h"
+#include "test_scene.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// 格子の一辺のマス数
+constexpr size_t LAYOUT_TEST_SIZE = 24;
+// 法線の値の種類 (少なくして共有できる値を増やす)
+constexpr size_t LAYOUT_TEST_NORMALS = 5;
+
+/// @brief ポリゴンの順を混ぜ、法線を足した格子のメッシュ
+/// (ビルダーは配列を参照するので一緒に保持する)
+struct LayoutMesh
+{
+    TestMesh source;
+    std::vector<float> normals;          // ポリゴン頂点ごとのxyz
+    std::vector<Vector4> smooth_normals; // 計算した法線の代わり
+    MeshBuilder* builder = nullptr;
+
+    LayoutMesh() = default;
+    LayoutMesh(const LayoutMesh&) = delete;
+    LayoutMesh& operator=(const LayoutMesh&) = delete;
+    ~LayoutMesh() { delete_mesh_builder(builder); }
+};
+
+// ポリゴンを頂点座標の並びにしたもの
+using PolygonPoints = std::vector<std::array<double, 3>>;
+
+bool run_layout_case(const LayoutMesh& test, ScalarType scalar_type,
+                     bool weld, bool reorder);
+void build_layout_mesh(LayoutMesh& test, ScalarType scalar_type);
+bool check_welded_layer(const WeldedLayer& layer, size_t corner_count,
+                        const MeshLayout& layout,
+                        std::array<double, 3> (*value)(const Mesh*,
+                                                       const void*, size_t),
+                        const Mesh* mesh, const void* data,
+                        const std::string& label);
+std::array<double, 3> normal_value(const Mesh* mesh, const void* data,
+                                   size_t corner);
+std::array<double, 3> uv_value(const Mesh* mesh, const void* data,
+                               size_t corner);
+std::array<double, 3> smooth_value(const Mesh* mesh, const void* data,
+                                   size_t corner);
+std::vector<PolygonPoints> polygon_points(const Mesh* mesh,
+                                          const MeshLayout& layout);
+double cache_miss_ratio(const Mesh* mesh, const MeshLayout& layout);
+
+int main()
+{
+    auto failures = 0;
+    for (auto scalar_type : {SCALAR_FLOAT32, SCALAR_FLOAT64})
+    {
+        LayoutMesh test;
+        build_layout_mesh(test, scalar_type);
+        for (auto [weld, reorder] : {std::pair{true, false},
+                                     std::pair{false, true},
+                                     std::pair{true, true}})
+        {
+            auto ok = run_layout_case(test, scalar_type, weld, reorder);
+            std::cout << (ok ? "ok     " : "FAILED ")
+                      << (scalar_type == SCALAR_FLOAT32 ? "float32"
+                                                        : "float64")
+                      << (weld ? "_weld" : "") << (reorder ? "_reorder" : "")
+                      << std::endl;
+            if (!ok) failures++;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+/// @brief 並びを求め、次を確かめる
+/// - 並べ替えても、ポリゴンの集まりと各ポリゴンの頂点の並びは元のまま
+/// - 並べ替えると、順を混ぜた元のメッシュより頂点キャッシュのミスが減る
+/// - 共有した法線・UVの番号が指す値は元のポリゴン頂点の値と同じで、
+///   同じ値は1つにまとまっている
+/// @param test メッシュ
+/// @param scalar_type メッシュの格納形式
+/// @param weld 法線・UVを共有するかどうか
+/// @param reorder ポリゴンを並べ替えるかどうか
+/// @return 確かめた内容が全て正しかったかどうか
+bool run_layout_case(const LayoutMesh& test, ScalarType scalar_type,
+                     bool weld, bool reorder)
+{
+    auto label = std::string(scalar_type == SCALAR_FLOAT32 ? "float32"
+                                                           : "float64") +
+                 (weld ? "_weld" : "") + (reorder ? "_reorder" : "");
+    auto mesh = mesh_builder_get_mesh(test.builder);
+    if (mesh == nullptr) return false;
+    MeshLayout layout;
+    build_mesh_layout(mesh, test.smooth_normals.data(), weld, reorder, layout);
+    if (layout.reordered() != reorder || layout.welded() != weld)
+    {
+        std::cerr << label << ": the layout does not match the options"
+                  << std::endl;
+        return false;
+    }
+
+    if (reorder)
+    {
+        auto order = layout.poly_order;
+        std::sort(order.begin(), order.end());
+        auto permutation = order.size() == mesh->poly_count;
+        for (size_t i = 0; permutation && i < order.size(); i++)
+            permutation = order[i] == i;
+        if (!permutation || layout.polys.size() != mesh->poly_count ||
+            layout.corner_order.size() != mesh->index_count)
+        {
+            std::cerr << label << ": the polygon order is not a permutation"
+                      << std::endl;
+            return false;
+        }
+
+        auto source = polygon_points(mesh, MeshLayout());
+        auto output = polygon_points(mesh, layout);
+        std::sort(source.begin(), source.end());
+        std::sort(output.begin(), output.end());
+        if (source != output)
+        {
+            std::cerr << label << ": the polygons changed" << std::endl;
+            return false;
+        }
+
+        auto before = cache_miss_ratio(mesh, MeshLayout());
+        auto after = cache_miss_ratio(mesh, layout);
+        if (after >= before * 0.75)
+        {
+            std::cerr << label << ": cache misses per corner went from "
+                      << before << " to " << after << std::endl;
+            return false;
+        }
+    }
+
+    if (weld)
+    {
+        auto corners = mesh->index_count;
+        if (layout.normals.size() != mesh->normal_set_count + 1 ||
+            layout.uvs.size() != mesh->uv_set_count ||
+            !check_welded_layer(layout.normals[0], corners, layout,
+                                normal_value, mesh,
+                                mesh->normal_sets[0].normal, label) ||
+            !check_welded_layer(layout.normals[1], corners, layout,
+                                smooth_value, mesh,
+                                test.smooth_normals.data(), label) ||
+            !check_welded_layer(layout.uvs[0], corners, layout, uv_value, mesh,
+                                mesh->uv_sets[0].uv, label))
+            return false;
+        // 計算した法線はwが全て違うが、書き出すxyzだけで共有する
+        for (auto& normals : layout.normals)
+        {
+            if (normals.values.size() != LAYOUT_TEST_NORMALS)
+            {
+                std::cerr << label << ": " << normals.values.size()
+                          << " normals remain" << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/// @brief 共有したレイヤー要素の番号が元と同じ値を指し、値が重複しないか確かめる
+/// @param layer 共有したレイヤー要素
+/// @param corner_count ポリゴン頂点数
+/// @param layout 並び (出力順のポリゴン頂点から元の位置を引く)
+/// @param value ポリゴン頂点の値を取り出す関数
+/// @param mesh メッシュ
+/// @param data レイヤー要素の値
+/// @param label 表示用の名前
+bool check_welded_layer(const WeldedLayer& layer, size_t corner_count,
+                        const MeshLayout& layout,
+                        std::array<double, 3> (*value)(const Mesh*,
+                                                       const void*, size_t),
+                        const Mesh* mesh, const void* data,
+                        const std::string& label)
+{
+    if (layer.index.size() != corner_count)
+    {
+        std::cerr << label << ": welded index count differs" << std::endl;
+        return false;
+    }
+    for (size_t j = 0; j < corner_count; j++)
+    {
+        auto corner = layout.reordered() ? layout.corner_order[j] : j;
+        if (layer.index[j] >= layer.values.size() ||
+            value(mesh, data, layer.values[layer.index[j]]) !=
+                value(mesh, data, corner))
+        {
+            std::cerr << label << ": corner " << j
+                      << " refers to a different value" << std::endl;
+            return false;
+        }
+    }
+    std::vector<std::array<double, 3>> values;
+    for (auto corner : layer.values)
+        values.push_back(value(mesh, data, corner));
+    std::sort(values.begin(), values.end());
+    if (std::adjacent_find(values.begin(), values.end()) != values.end())
+    {
+        std::cerr << label << ": equal values were not welded" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// @brief 混在の格子のポリゴンを決まった乱数で並べ替え、頂点ごとに決まる法線
+/// (LAYOUT_TEST_NORMALS種類) を付けたメッシュを作る
+/// @param test 作成先
+/// @param scalar_type メッシュの格納形式
+void build_layout_mesh(LayoutMesh& test, ScalarType scalar_type)
+{
+    auto grid = make_grid_mesh("Layout", TEST_SHAPE_MIXED, LAYOUT_TEST_SIZE);
+    auto poly_count = grid.polys.size();
+    std::vector<unsigned int> order(poly_count);
+    for (size_t i = 0; i < poly_count; i++) order[i] = (unsigned int)i;
+    uint32_t state = 7;
+    for (size_t i = poly_count; i > 1; i--)
+    {
+        state = state * 1664525u + 1013904223u;
+        std::swap(order[i - 1], order[(state >> 8) % i]);
+    }
+
+    auto& source = test.source;
+    source.name = grid.name;
+    source.positions = grid.positions;
+    for (auto poly : order)
+    {
+        auto begin = grid.polys[poly];
+        auto end = poly + 1 < poly_count ? grid.polys[poly + 1]
+                                         : (unsigned int)grid.indices.size();
+        source.polys.push_back((unsigned int)source.indices.size());
+        source.material_indices.push_back(grid.material_indices[poly]);
+        for (auto corner = begin; corner < end; corner++)
+        {
+            auto vertex = grid.indices[corner];
+            source.indices.push_back(vertex);
+            source.uvs.push_back(grid.uvs[corner * 2]);
+            source.uvs.push_back(grid.uvs[corner * 2 + 1]);
+            auto kind = (float)(vertex % LAYOUT_TEST_NORMALS);
+            test.normals.insert(test.normals.end(),
+                                {kind * 0.125f, 0.0f, 1.0f});
+            test.smooth_normals.push_back({0.0, kind, 1.0, (double)corner});
+        }
+    }
+
+    auto builder = create_mesh_builder(source.name.c_str(), scalar_type);
+    test.builder = builder;
+    auto corners = source.indices.size();
+    mesh_builder_set_positions(builder, source.positions.data(),
+                               source.positions.size() / 3, sizeof(float) * 3,
+                               COMPONENT_FLOAT32);
+    mesh_builder_set_indices(builder, source.indices.data(), corners,
+                             sizeof(unsigned int), COMPONENT_UINT32);
+    mesh_builder_set_polys(builder, source.polys.data(), source.polys.size(),
+                           sizeof(unsigned int), COMPONENT_UINT32);
+    mesh_builder_set_material_indices(builder, source.material_indices.data(),
+                                      source.material_indices.size(),
+                                      sizeof(unsigned int), COMPONENT_UINT32);
+    mesh_builder_add_normal_set(builder, "Normal", test.normals.data(),
+                                corners, sizeof(float) * 3, COMPONENT_FLOAT32);
+    mesh_builder_add_uv_set(builder, "UVMap", source.uvs.data(), corners,
+                            sizeof(float) * 2, COMPONENT_FLOAT32);
+}
+
+/// @brief 法線セットのポリゴン頂点の値
+std::array<double, 3> normal_value(const Mesh* mesh, const void* data,
+                                   size_t corner)
+{
+    if (mesh->scalar_type == SCALAR_FLOAT32)
+    {
+        auto p = (const float*)data + corner * 3;
+        return {p[0], p[1], p[2]};
+    }
+    auto& n = ((const Vector4*)data)[corner];
+    return {n.x, n.y, n.z};
+}
+
+/// @brief UVセットのポリゴン頂点の値 (3番目の成分は0)
+std::array<double, 3> uv_value(const Mesh* mesh, const void* data,
+                               size_t corner)
+{
+    if (mesh->scalar_type == SCALAR_FLOAT32)
+    {
+        auto p = (const float*)data + corner * 2;
+        return {p[0], p[1], 0.0};
+    }
+    auto& uv = ((const Vector2*)data)[corner];
+    return {uv.x, uv.y, 0.0};
+}
+
+/// @brief 計算した法線のポリゴン頂点の値 (wは比べない)
+std::array<double, 3> smooth_value(const Mesh*, const void* data,
+                                   size_t corner)
+{
+    auto& n = ((const Vector4*)data)[corner];
+    return {n.x, n.y, n.z};
+}
+
+/// @brief 出力順のポリゴンを頂点座標の並びにする
+/// @param mesh メッシュ
+/// @param layout 並び (並べ替えていなければ元の順)
+std::vector<PolygonPoints> polygon_points(const Mesh* mesh,
+                                          const MeshLayout& layout)
+{
+    std::vector<PolygonPoints> out(mesh->poly_count);
+    for (size_t k = 0; k < mesh->poly_count; k++)
+    {
+        auto polys = layout.reordered() ? layout.polys.data() : mesh->polys;
+        auto begin = polys[k];
+        auto end = k + 1 < mesh->poly_count ? polys[k + 1] : mesh->index_count;
+        for (auto j = begin; j < end; j++)
+        {
+            auto corner = layout.reordered() ? layout.corner_order[j] : j;
+            auto vertex = mesh->indices[corner];
+            if (mesh->scalar_type == SCALAR_FLOAT32)
+            {
+                auto p = (const float*)mesh->vertices + vertex * 3;
+                out[k].push_back({p[0], p[1], p[2]});
+            }
+            else
+            {
+                auto& p = mesh->vertices[vertex];
+                out[k].push_back({p.x, p.y, p.z});
+            }
+        }
+    }
+    return out;
+}
+
+/// @brief 出力順に描いたときの、FIFOの頂点キャッシュでのポリゴン頂点あたりのミスの割合
+/// @param mesh メッシュ
+/// @param layout 並び (並べ替えていなければ元の順)
+double cache_miss_ratio(const Mesh* mesh, const MeshLayout& layout)
+{
+    std::vector<unsigned int> cache;
+    size_t misses = 0;
+    for (size_t j = 0; j < mesh->index_count; j++)
+    {
+        auto corner = layout.reordered() ? layout.corner_order[j] : j;
+        auto vertex = mesh->indices[corner];
+        if (std::find(cache.begin(), cache.end(), vertex) != cache.end())
+            continue;
+        misses++;
+        cache.push_back(vertex);
+        if (cache.size() > VERTEX_CACHE_SIZE) cache.erase(cache.begin());
+    }
+    return (double)misses / (double)mesh->index_count;
+}
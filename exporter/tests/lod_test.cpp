@@ -0,0 +1,231 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// LODの生成 (simplify_mesh) のテスト
+// (FBX SDKを使用しない、失敗があれば終了コード1)
+
+#include "../include/io.h"
+#include "../src/mesh_lods.h"
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// 平らな格子の一辺のマス数と、1マスの大きさ
+constexpr size_t LOD_TEST_CELLS = 16;
+constexpr double LOD_TEST_STEP = 0.25;
+// UVの継ぎ目 (xがこれ以上の面はUVをずらす) と法線の継ぎ目 (yがこれ以上の面は
+// 法線を傾ける) の位置
+constexpr double LOD_TEST_UV_SEAM = 2.0;
+constexpr double LOD_TEST_NORMAL_SEAM = 1.0;
+
+/// @brief 継ぎ目のある格子 (ビルダーは配列を参照するので一緒に保持する)
+struct SeamGrid
+{
+    std::vector<double> positions;
+    std::vector<unsigned int> indices;
+    std::vector<unsigned int> polys;
+    std::vector<double> uvs;
+    std::vector<double> normals;
+    MeshBuilder* builder = nullptr;
+
+    SeamGrid() = default;
+    SeamGrid(const SeamGrid&) = delete;
+    SeamGrid& operator=(const SeamGrid&) = delete;
+    ~SeamGrid() { delete_mesh_builder(builder); }
+};
+
+/// @brief 面ごとに継ぎ目のどちら側かを決めた値
+struct SeamSide
+{
+    bool uv_shifted;
+    bool normal_tilted;
+};
+
+bool run_lod_case(const SeamGrid& grid, double ratio);
+void build_seam_grid(SeamGrid& grid);
+SeamSide triangle_side(const Vector4* p0, const Vector4* p1,
+                       const Vector4* p2);
+bool on_side(double value, double seam, bool upper);
+double triangle_area(const Vector4& a, const Vector4& b, const Vector4& c);
+
+int main()
+{
+    SeamGrid grid;
+    build_seam_grid(grid);
+    auto failures = 0;
+    for (auto ratio : {0.5, 0.25, 0.1, 0.05, 0.03, 0.02})
+    {
+        auto ok = run_lod_case(grid, ratio);
+        std::cout << (ok ? "ok     " : "FAILED ") << "ratio_" << ratio
+                  << std::endl;
+        if (!ok) failures++;
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+/// @brief 割合を指定してLODを作り、三角形数と境界・継ぎ目が保たれているか確かめる
+/// 平らな格子なので、境界と継ぎ目が動かなければ継ぎ目で分けた領域ごとの面積は
+/// 変わらず、どの三角形も継ぎ目をまたがない
+/// @param grid 元のメッシュ
+/// @param ratio 残す三角形の割合
+/// @return 確かめた内容が全て正しかったかどうか
+bool run_lod_case(const SeamGrid& grid, double ratio)
+{
+    auto label = "ratio_" + std::to_string(ratio);
+    auto mesh = mesh_builder_get_mesh(grid.builder);
+    if (mesh == nullptr) return false;
+    LodMesh lod;
+    auto reached = simplify_mesh(mesh, ratio, lod);
+
+    // 1回の縮約で三角形は最大2つ減るので、目標より1つ少ないところで止まることがある
+    auto source_tris = LOD_TEST_CELLS * LOD_TEST_CELLS * 2;
+    auto target = (size_t)std::llround(ratio * (double)source_tris);
+    auto tri_count = lod.mesh.poly_count;
+    auto ok = true;
+    if (!reached || tri_count > target || tri_count + 1 < target)
+    {
+        std::cerr << label << ": " << tri_count << " triangles for target "
+                  << target << std::endl;
+        ok = false;
+    }
+
+    auto vertices = lod.mesh.vertices;
+    auto uvs = lod.mesh.uv_sets[0].uv;
+    auto normals = lod.mesh.normal_sets[0].normal;
+    double areas[2][2] = {};
+    for (size_t t = 0; t < tri_count; t++)
+    {
+        auto corner = lod.mesh.polys[t];
+        auto& a = vertices[lod.mesh.indices[corner]];
+        auto& b = vertices[lod.mesh.indices[corner + 1]];
+        auto& c = vertices[lod.mesh.indices[corner + 2]];
+        auto side = triangle_side(&a, &b, &c);
+        areas[side.uv_shifted][side.normal_tilted] += triangle_area(a, b, c);
+
+        for (size_t k = 0; k < 3; k++)
+        {
+            auto& p = vertices[lod.mesh.indices[corner + k]];
+            auto& uv = uvs[corner + k];
+            auto& n = normals[corner + k];
+            auto expected_u = p.x / 4.0 + (side.uv_shifted ? 0.5 : 0.0);
+            auto expected_ny = side.normal_tilted ? 0.6 : 0.0;
+            if (!on_side(p.x, LOD_TEST_UV_SEAM, side.uv_shifted) ||
+                !on_side(p.y, LOD_TEST_NORMAL_SEAM, side.normal_tilted))
+            {
+                std::cerr << label << ": triangle " << t
+                          << " crosses a seam" << std::endl;
+                return false;
+            }
+            if (std::abs(uv.x - expected_u) > 1e-12 ||
+                std::abs(uv.y - p.y / 4.0) > 1e-12 ||
+                std::abs(n.y - expected_ny) > 1e-12)
+            {
+                std::cerr << label << ": corner values of triangle " << t
+                          << " differ" << std::endl;
+                return false;
+            }
+        }
+    }
+
+    // 継ぎ目と境界が動いていなければ、領域ごとの面積は元の格子と同じになる
+    auto size = LOD_TEST_CELLS * LOD_TEST_STEP;
+    for (auto shifted : {false, true})
+    {
+        for (auto tilted : {false, true})
+        {
+            auto width = shifted ? size - LOD_TEST_UV_SEAM : LOD_TEST_UV_SEAM;
+            auto height =
+                tilted ? size - LOD_TEST_NORMAL_SEAM : LOD_TEST_NORMAL_SEAM;
+            if (std::abs(areas[shifted][tilted] - width * height) > 1e-9)
+            {
+                std::cerr << label << ": area of region (" << shifted << ", "
+                          << tilted << ") is " << areas[shifted][tilted]
+                          << " instead of " << width * height << std::endl;
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+/// @brief z=0の平らな四角形の格子を作る
+/// x >= LOD_TEST_UV_SEAMの面はUVを0.5ずらし、y >= LOD_TEST_NORMAL_SEAMの面は
+/// 法線を傾けるので、それぞれの線上の頂点はウェッジが分かれる継ぎ目になる
+/// @param grid 作成先
+void build_seam_grid(SeamGrid& grid)
+{
+    auto row = LOD_TEST_CELLS + 1;
+    auto& positions = grid.positions;
+    for (size_t y = 0; y < row; y++)
+    {
+        for (size_t x = 0; x < row; x++)
+        {
+            positions.insert(positions.end(), {(double)x * LOD_TEST_STEP,
+                                               (double)y * LOD_TEST_STEP, 0.0});
+        }
+    }
+
+    auto& indices = grid.indices;
+    auto& polys = grid.polys;
+    auto& uvs = grid.uvs;
+    auto& normals = grid.normals;
+    for (size_t y = 0; y < LOD_TEST_CELLS; y++)
+    {
+        for (size_t x = 0; x < LOD_TEST_CELLS; x++)
+        {
+            auto shifted = (double)x * LOD_TEST_STEP >= LOD_TEST_UV_SEAM;
+            auto tilted = (double)y * LOD_TEST_STEP >= LOD_TEST_NORMAL_SEAM;
+            polys.push_back((unsigned int)indices.size());
+            for (auto [cx, cy] : {std::pair{x, y}, std::pair{x + 1, y},
+                                  std::pair{x + 1, y + 1}, std::pair{x, y + 1}})
+            {
+                indices.push_back((unsigned int)(cy * row + cx));
+                uvs.push_back((double)cx * LOD_TEST_STEP / 4.0 +
+                              (shifted ? 0.5 : 0.0));
+                uvs.push_back((double)cy * LOD_TEST_STEP / 4.0);
+                normals.insert(normals.end(),
+                               {0.0, tilted ? 0.6 : 0.0, tilted ? 0.8 : 1.0});
+            }
+        }
+    }
+
+    auto builder = create_mesh_builder("SeamGrid", SCALAR_FLOAT64);
+    grid.builder = builder;
+    mesh_builder_set_positions(builder, positions.data(), positions.size() / 3,
+                               sizeof(double) * 3, COMPONENT_FLOAT64);
+    mesh_builder_set_indices(builder, indices.data(), indices.size(),
+                             sizeof(unsigned int), COMPONENT_UINT32);
+    mesh_builder_set_polys(builder, polys.data(), polys.size(),
+                           sizeof(unsigned int), COMPONENT_UINT32);
+    mesh_builder_add_normal_set(builder, "Normal", normals.data(),
+                                indices.size(), sizeof(double) * 3,
+                                COMPONENT_FLOAT64);
+    mesh_builder_add_uv_set(builder, "UVMap", uvs.data(), indices.size(),
+                            sizeof(double) * 2, COMPONENT_FLOAT64);
+}
+
+/// @brief 三角形の重心から、継ぎ目のどちら側の面かを求める
+SeamSide triangle_side(const Vector4* p0, const Vector4* p1,
+                       const Vector4* p2)
+{
+    auto x = (p0->x + p1->x + p2->x) / 3.0;
+    auto y = (p0->y + p1->y + p2->y) / 3.0;
+    return {x > LOD_TEST_UV_SEAM, y > LOD_TEST_NORMAL_SEAM};
+}
+
+/// @brief 値が継ぎ目の指定した側 (継ぎ目の上を含む) にあるか
+bool on_side(double value, double seam, bool upper)
+{
+    return upper ? value >= seam - 1e-12 : value <= seam + 1e-12;
+}
+
+/// @brief xy平面上の三角形の面積
+double triangle_area(const Vector4& a, const Vector4& b, const Vector4& c)
+{
+    return std::abs((b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y)) *
+           0.5;
+}
@@ -0,0 +1,172 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// ネイティブライタで書き出したファイルを読み込み、書き出したシーンと比べる
+// (FBX SDKを使用しない、失敗があれば終了コード1)
+
+#include "test_scene.h"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+
+/// @brief 書き出しの設定の組み合わせ
+struct RoundTripCase
+{
+    ScalarType scalar_type;
+    ArrayCompression compression;
+    bool weld;
+    bool reorder;
+};
+
+std::string case_label(const RoundTripCase& test);
+bool run_round_trip(const RoundTripCase& test);
+bool run_stats_per_thread();
+bool run_native_ascii();
+
+int main()
+{
+    auto failures = 0;
+    for (auto scalar_type : {SCALAR_FLOAT32, SCALAR_FLOAT64})
+    {
+        for (auto compression :
+             {ARRAY_COMPRESSION_DEFLATE, ARRAY_COMPRESSION_STORE})
+        {
+            for (auto weld : {false, true})
+            {
+                for (auto reorder : {false, true})
+                {
+                    RoundTripCase test = {scalar_type, compression, weld,
+                                          reorder};
+                    auto ok = run_round_trip(test);
+                    std::cout << (ok ? "ok     " : "FAILED ")
+                              << case_label(test) << std::endl;
+                    if (!ok) failures++;
+                }
+            }
+        }
+    }
+    auto ok = run_stats_per_thread();
+    std::cout << (ok ? "ok     " : "FAILED ") << "stats_per_thread" << std::endl;
+    if (!ok) failures++;
+    ok = run_native_ascii();
+    std::cout << (ok ? "ok     " : "FAILED ") << "native_ascii" << std::endl;
+    if (!ok) failures++;
+    return failures == 0 ? 0 : 1;
+}
+
+/// @brief 設定の組み合わせを表示用の名前にする
+std::string case_label(const RoundTripCase& test)
+{
+    std::string label =
+        test.scalar_type == SCALAR_FLOAT32 ? "float32" : "float64";
+    label += test.compression == ARRAY_COMPRESSION_DEFLATE ? "_deflate"
+                                                           : "_store";
+    if (test.weld) label += "_weld";
+    if (test.reorder) label += "_reorder";
+    return label;
+}
+
+/// @brief 四角形・三角形・混在のメッシュを書き出して読み込み、同じかどうか確かめる
+/// @param test 書き出しの設定
+/// @return 同じだったかどうか
+bool run_round_trip(const RoundTripCase& test)
+{
+    auto label = case_label(test);
+    TestScene scene;
+    scene.meshes.push_back(make_grid_mesh("Quads", TEST_SHAPE_QUADS, 12));
+    scene.meshes.push_back(
+        make_grid_mesh("Triangles", TEST_SHAPE_TRIANGLES, 12));
+    scene.meshes.push_back(make_grid_mesh("Mixed", TEST_SHAPE_MIXED, 12));
+    build_test_scene(scene, test.scalar_type);
+    scene.data.array_compression = test.compression;
+    scene.data.weld_corner_attributes = test.weld;
+    scene.data.optimize_vertex_cache = test.reorder;
+
+    auto path = temp_fbx_path("roundtrip_" + label);
+    if (!export_fbx(path.c_str(), &scene.data))
+    {
+        std::cerr << label << ": export failed" << std::endl;
+        return false;
+    }
+    auto imported = import_fbx(path.c_str());
+    std::remove(path.c_str());
+    if (imported == nullptr)
+    {
+        std::cerr << label << ": import failed" << std::endl;
+        return false;
+    }
+    auto ok = compare_imported_scene(scene, *imported, label);
+    delete_iodata(imported);
+    return ok;
+}
+
+/// @brief バックグラウンドの書き出しと同時にexport_fbxを呼んでも、
+/// get_last_statsとget_export_job_statsがそれぞれの統計を返すか
+bool run_stats_per_thread()
+{
+    const std::string label = "stats_per_thread";
+    TestScene job_scene, scene;
+    job_scene.meshes.push_back(make_grid_mesh("Job", TEST_SHAPE_QUADS, 64));
+    build_test_scene(job_scene, SCALAR_FLOAT32);
+    scene.meshes.push_back(make_grid_mesh("A", TEST_SHAPE_TRIANGLES, 4));
+    scene.meshes.push_back(make_grid_mesh("B", TEST_SHAPE_MIXED, 4));
+    build_test_scene(scene, SCALAR_FLOAT32);
+
+    auto job_path = temp_fbx_path("stats_job");
+    auto path = temp_fbx_path("stats_main");
+    auto job = start_export_fbx(job_path.c_str(), &job_scene.data);
+    auto ok = export_fbx(path.c_str(), &scene.data);
+    ok = job != nullptr && wait_export(job) && ok;
+
+    IOStats job_stats = {}, last = {};
+    if (!ok || !get_export_job_stats(job, &job_stats) ||
+        !get_last_stats(&last) || job_stats.mesh_count != 1 ||
+        last.mesh_count != 2)
+    {
+        std::cerr << label << ": stats were mixed up" << std::endl;
+        ok = false;
+    }
+
+    // 入出力していないスレッドには統計が無い
+    auto other_has_stats = true;
+    std::thread([&] {
+        IOStats stats;
+        other_has_stats = get_last_stats(&stats);
+    }).join();
+    if (other_has_stats)
+    {
+        std::cerr << label << ": another thread sees the stats" << std::endl;
+        ok = false;
+    }
+    delete_export_job(job);
+    std::remove(job_path.c_str());
+    std::remove(path.c_str());
+    return ok;
+}
+
+/// @brief ネイティブライタでASCII形式を指定すると、FBX SDKに切り替えずに失敗するか
+bool run_native_ascii()
+{
+    TestScene scene;
+    scene.meshes.push_back(make_grid_mesh("Ascii", TEST_SHAPE_QUADS, 2));
+    build_test_scene(scene, SCALAR_FLOAT32);
+    scene.data.is_ascii = true;
+
+    auto path = temp_fbx_path("native_ascii");
+    std::remove(path.c_str());
+    auto exported = export_fbx(path.c_str(), &scene.data);
+    auto file = std::fopen(path.c_str(), "rb");
+    if (file != nullptr) std::fclose(file);
+    std::remove(path.c_str());
+    if (exported || file != nullptr)
+    {
+        std::cerr << "native_ascii: ASCII export with the native backend "
+                     "did not fail"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
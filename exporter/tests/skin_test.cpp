@@ -0,0 +1,211 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// スキンの影響の削減と量子化 (build_skin_clusters) のテスト
+// (FBX SDKを使用しない、失敗があれば終了コード1)
+
+#include "../include/io.h"
+#include "../src/mesh_skin.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// テスト用のスキンの頂点数とボーン数
+constexpr size_t SKIN_TEST_VERTICES = 2000;
+constexpr unsigned int SKIN_TEST_BONES = 24;
+
+/// @brief 頂点ごとの影響 (CSR形式) を持つスキン
+/// 重複したボーン、0以下の重み、範囲外のボーンも混ぜる
+struct TestSkin
+{
+    std::vector<unsigned int> offsets;
+    std::vector<unsigned int> bones;
+    std::vector<float> weights;
+    Skin skin = {};
+    Mesh mesh = {};
+};
+
+/// @brief 頂点ごとに、ボーンの番号から重みを引く表
+using VertexWeights = std::vector<std::map<unsigned int, double>>;
+
+void build_test_skin(TestSkin& test);
+VertexWeights source_weights(const TestSkin& test);
+VertexWeights cluster_weights(const SkinClusters& clusters);
+bool run_skin_case(const TestSkin& test, size_t max_influences, int bits);
+
+int main()
+{
+    TestSkin test;
+    build_test_skin(test);
+    auto failures = 0;
+    for (auto [max_influences, bits] : {std::pair<size_t, int>{4, 8},
+                                        {4, 16},
+                                        {2, 4},
+                                        {1, 8},
+                                        {4, 0},
+                                        {0, 8}})
+    {
+        auto ok = run_skin_case(test, max_influences, bits);
+        std::cout << (ok ? "ok     " : "FAILED ") << "influences_"
+                  << max_influences << "_bits_" << bits << std::endl;
+        if (!ok) failures++;
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+/// @brief 影響を減らして量子化し、頂点ごとに次を確かめる
+/// - 影響の数がmax_influences以下で、残ったのは重みの大きいもの
+/// - 量子化した重みは1/(2^bits-1)の倍数で、合計がちょうど1
+/// - 量子化しない場合も合計が1
+/// @param test スキン
+/// @param max_influences 頂点ごとに残す影響の数 (0なら減らさない)
+/// @param bits 量子化するビット数 (0ならしない)
+/// @return 全ての頂点で正しかったかどうか
+bool run_skin_case(const TestSkin& test, size_t max_influences, int bits)
+{
+    auto label = "influences_" + std::to_string(max_influences) + "_bits_" +
+                 std::to_string(bits);
+    SkinClusters clusters;
+    build_skin_clusters(&test.mesh, max_influences, bits, clusters);
+    if (clusters.offsets.size() != SKIN_TEST_BONES + 1)
+    {
+        std::cerr << label << ": cluster count differs" << std::endl;
+        return false;
+    }
+
+    auto source = source_weights(test);
+    auto result = cluster_weights(clusters);
+    auto scale = bits > 0 ? (double)((1u << bits) - 1) : 1.0;
+    for (size_t v = 0; v < SKIN_TEST_VERTICES; v++)
+    {
+        auto& kept = result[v];
+        if (source[v].empty())
+        {
+            if (!kept.empty())
+            {
+                std::cerr << label << ": vertex " << v
+                          << " has influences from invalid weights"
+                          << std::endl;
+                return false;
+            }
+            continue;
+        }
+        if (max_influences > 0 && kept.size() > max_influences)
+        {
+            std::cerr << label << ": vertex " << v << " keeps " << kept.size()
+                      << " influences" << std::endl;
+            return false;
+        }
+
+        // 残ったボーンは元の重みの大きい順 (同じなら番号の小さい順) の先頭
+        std::vector<std::pair<double, unsigned int>> order;
+        for (auto [bone, weight] : source[v]) order.push_back({-weight, bone});
+        std::sort(order.begin(), order.end());
+        auto limit = max_influences > 0 ? std::min(max_influences, order.size())
+                                        : order.size();
+        for (auto [bone, weight] : kept)
+        {
+            auto rank = std::find_if(order.begin(), order.end(),
+                                     [&](auto& o) { return o.second == bone; });
+            if (rank == order.end() || (size_t)(rank - order.begin()) >= limit)
+            {
+                std::cerr << label << ": vertex " << v << " keeps bone "
+                          << bone << " over a larger influence" << std::endl;
+                return false;
+            }
+        }
+
+        // 量子化した重みは整数の段階で足して、ちょうど全体になる
+        int64_t steps = 0;
+        auto sum = 0.0;
+        for (auto [bone, weight] : kept)
+        {
+            auto step = weight * scale;
+            if (bits > 0 && std::abs(step - std::round(step)) > 1e-9)
+            {
+                std::cerr << label << ": vertex " << v << " weight " << weight
+                          << " is not quantized" << std::endl;
+                return false;
+            }
+            steps += (int64_t)std::llround(step);
+            sum += weight;
+        }
+        auto exact = bits > 0 ? steps == (int64_t)scale
+                              : std::abs(sum - 1.0) < 1e-12;
+        if (!exact)
+        {
+            std::cerr << label << ": vertex " << v << " weights sum to "
+                      << sum << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @brief 決まった乱数で頂点ごとに1-8個の影響を作る
+/// @param test 作成先
+void build_test_skin(TestSkin& test)
+{
+    uint32_t state = 12345;
+    auto next = [&] {
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    };
+    test.offsets.push_back(0);
+    for (size_t v = 0; v < SKIN_TEST_VERTICES; v++)
+    {
+        auto count = 1 + next() % 8;
+        for (size_t i = 0; i < count; i++)
+        {
+            auto bone = next() % (SKIN_TEST_BONES + 2); // 範囲外も混ぜる
+            auto weight = (float)(next() % 1000) / 999.0f;
+            if (next() % 16 == 0) weight = -weight;
+            // 同じボーンを続けて入れ、まとめる処理も通す
+            if (i > 0 && next() % 8 == 0) bone = test.bones.back();
+            test.bones.push_back(bone);
+            test.weights.push_back(weight);
+        }
+        test.offsets.push_back((unsigned int)test.bones.size());
+    }
+
+    test.skin.bone_count = SKIN_TEST_BONES;
+    for (auto i = 0; i < 4; i++) test.skin.mesh_bind_matrix[i * 5] = 1.0;
+    test.skin.influence_offsets = test.offsets.data();
+    test.skin.influence_bones = test.bones.data();
+    test.skin.influence_weights = test.weights.data();
+    test.mesh.vertex_count = SKIN_TEST_VERTICES;
+    test.mesh.skin = &test.skin;
+}
+
+/// @brief 元の影響を、有効なものだけ同じボーンごとに足した重みにする
+VertexWeights source_weights(const TestSkin& test)
+{
+    VertexWeights out(SKIN_TEST_VERTICES);
+    for (size_t v = 0; v < SKIN_TEST_VERTICES; v++)
+    {
+        for (auto i = test.offsets[v]; i < test.offsets[v + 1]; i++)
+        {
+            if (test.weights[i] > 0.0f && test.bones[i] < SKIN_TEST_BONES)
+                out[v][test.bones[i]] += (double)test.weights[i];
+        }
+    }
+    return out;
+}
+
+/// @brief ボーンごとのクラスタを頂点ごとの重みに戻す
+VertexWeights cluster_weights(const SkinClusters& clusters)
+{
+    VertexWeights out(SKIN_TEST_VERTICES);
+    for (unsigned int b = 0; b + 1 < clusters.offsets.size(); b++)
+    {
+        for (auto i = clusters.offsets[b]; i < clusters.offsets[b + 1]; i++)
+            out[clusters.indices[i]][b] = clusters.weights[i];
+    }
+    return out;
+}
@@ -0,0 +1,348 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+#include "test_scene.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <initializer_list>
+#include <iostream>
+
+// 座標とuvを比較する格子の細かさ (生成する値は全てこの逆数の倍数)
+constexpr double TEST_GRID_STEPS = 16.0;
+
+using CornerKey = std::array<int64_t, 5>;
+
+int64_t grid_step(double value);
+void add_test_polygon(TestMesh& mesh, size_t size,
+                      std::initializer_list<std::array<size_t, 2>> corners,
+                      unsigned int material);
+PolygonKey make_polygon_key(unsigned int material,
+                            std::vector<CornerKey>& corners);
+
+TestScene::~TestScene()
+{
+    for (auto builder : builders) delete_mesh_builder(builder);
+}
+
+/// @brief 格子状のメッシュを作る
+/// マテリアル番号は列ごとに0と1を交互にし、1のポリゴンのuvはずらして継ぎ目にする
+/// @param name 名前
+/// @param shape ポリゴンの形
+/// @param size 一辺のマス数
+/// @return 作成したメッシュ
+TestMesh make_grid_mesh(const std::string& name, TestShape shape, size_t size)
+{
+    TestMesh mesh;
+    mesh.name = name;
+    for (size_t y = 0; y <= size; y++)
+    {
+        for (size_t x = 0; x <= size; x++)
+        {
+            mesh.positions.push_back((float)x * 0.25f);
+            mesh.positions.push_back((float)y * 0.5f);
+            mesh.positions.push_back((float)((x * y) % 4) * 0.125f);
+        }
+    }
+
+    for (size_t y = 0; y < size; y++)
+    {
+        // MIXEDは行ごとに四角形、三角形、2マスをまとめた六角形にする
+        auto row = shape == TEST_SHAPE_MIXED ? y % 3
+                   : shape == TEST_SHAPE_TRIANGLES ? 1
+                                                   : 0;
+        for (size_t x = 0; x < size; x++)
+        {
+            auto material = (unsigned int)(x % 2);
+            if (row == 1)
+            {
+                add_test_polygon(mesh, size,
+                                 {{x, y}, {x + 1, y}, {x + 1, y + 1}}, material);
+                add_test_polygon(mesh, size,
+                                 {{x, y}, {x + 1, y + 1}, {x, y + 1}}, material);
+            }
+            else if (row == 2 && x + 1 < size)
+            {
+                add_test_polygon(mesh, size,
+                                 {{x, y}, {x + 1, y}, {x + 2, y},
+                                  {x + 2, y + 1}, {x + 1, y + 1}, {x, y + 1}},
+                                 material);
+                x++;
+            }
+            else
+            {
+                add_test_polygon(
+                    mesh, size,
+                    {{x, y}, {x + 1, y}, {x + 1, y + 1}, {x, y + 1}}, material);
+            }
+        }
+    }
+    return mesh;
+}
+
+/// @brief 格子の頂点を並べたポリゴンを追加する
+/// @param mesh 追加先
+/// @param size 一辺のマス数
+/// @param corners 頂点の格子上の位置
+/// @param material マテリアル番号
+void add_test_polygon(TestMesh& mesh, size_t size,
+                      std::initializer_list<std::array<size_t, 2>> corners,
+                      unsigned int material)
+{
+    mesh.polys.push_back((unsigned int)mesh.indices.size());
+    mesh.material_indices.push_back(material);
+    for (auto [x, y] : corners)
+    {
+        mesh.indices.push_back((unsigned int)(y * (size + 1) + x));
+        mesh.uvs.push_back((float)x / 16.0f + (material == 1 ? 0.5f : 0.0f));
+        mesh.uvs.push_back((float)y / 16.0f);
+    }
+}
+
+/// @brief Blenderからの書き出しと同じくビルダーでメッシュを組み立て、
+/// メッシュごとに1つのノードを持つシーンを作る
+/// @param scene 作成先 (meshesは作成済み)
+/// @param scalar_type 組み立てるメッシュの格納形式
+void build_test_scene(TestScene& scene, ScalarType scalar_type)
+{
+    scene.material_names = {"TestMaterial0", "TestMaterial1"};
+    scene.materials.resize(scene.material_names.size());
+    for (size_t i = 0; i < scene.materials.size(); i++)
+    {
+        auto& material = scene.materials[i];
+        material = {};
+        material.name = scene.material_names[i].data();
+        material.name_length = scene.material_names[i].size();
+        material.standard_surface.base = 1.0;
+        material.standard_surface.base_color = {(double)i, 0.5, 0.25, 1.0};
+        material.standard_surface.opacity = 1.0;
+    }
+
+    scene.objects.resize(scene.meshes.size());
+    scene.slots.resize(scene.meshes.size() * scene.materials.size());
+    for (size_t m = 0; m < scene.meshes.size(); m++)
+    {
+        auto& source = scene.meshes[m];
+        auto builder = create_mesh_builder(source.name.c_str(), scalar_type);
+        scene.builders.push_back(builder);
+        auto corners = source.indices.size();
+        mesh_builder_set_positions(builder, source.positions.data(),
+                                   source.positions.size() / 3,
+                                   sizeof(float) * 3, COMPONENT_FLOAT32);
+        mesh_builder_set_indices(builder, source.indices.data(), corners,
+                                 sizeof(unsigned int), COMPONENT_UINT32);
+        mesh_builder_set_polys(builder, source.polys.data(),
+                               source.polys.size(), sizeof(unsigned int),
+                               COMPONENT_UINT32);
+        mesh_builder_set_material_indices(
+            builder, source.material_indices.data(),
+            source.material_indices.size(), sizeof(unsigned int),
+            COMPONENT_UINT32);
+        mesh_builder_add_uv_set(builder, "UVMap", source.uvs.data(), corners,
+                                sizeof(float) * 2, COMPONENT_FLOAT32);
+        mesh_builder_compute_normals(builder, "Normal", NORMAL_MODE_FLAT, 0.0);
+
+        auto& object = scene.objects[m];
+        object = {};
+        object.name = source.name.data();
+        object.name_length = source.name.size();
+        object.matrix_local[0] = object.matrix_local[5] =
+            object.matrix_local[10] = object.matrix_local[15] = 1.0;
+        object.mesh = mesh_builder_get_mesh(builder);
+        object.material_slots = &scene.slots[m * scene.materials.size()];
+        object.material_slot_count = scene.materials.size();
+        for (size_t i = 0; i < scene.materials.size(); i++)
+            object.material_slots[i] = &scene.materials[i];
+    }
+
+    scene.root.name = (char*)"RootNode";
+    scene.root.name_length = 8;
+    scene.root.matrix_local[0] = scene.root.matrix_local[5] =
+        scene.root.matrix_local[10] = scene.root.matrix_local[15] = 1.0;
+    scene.root.children = scene.objects.data();
+    scene.root.child_count = scene.objects.size();
+
+    scene.data.root = &scene.root;
+    scene.data.materials = scene.materials.data();
+    scene.data.material_count = scene.materials.size();
+    scene.data.unit_scale = 1.0;
+    scene.data.backend = IO_BACKEND_NATIVE;
+}
+
+/// @brief 格子の番号にする (1/16の倍数から僅かにずれた値も同じ番号になる)
+int64_t grid_step(double value)
+{
+    return (int64_t)std::llround(value * TEST_GRID_STEPS);
+}
+
+/// @brief ポリゴンの頂点を、最も小さい頂点から始まるように回して1つにまとめる
+/// (書き出しでポリゴンの順が変わっても、頂点の巡回順は変わらない)
+/// @param material マテリアル番号
+/// @param corners 頂点ごとの座標とuv
+/// @return 比較用のポリゴン
+PolygonKey make_polygon_key(unsigned int material,
+                            std::vector<CornerKey>& corners)
+{
+    auto first = std::min_element(corners.begin(), corners.end());
+    std::rotate(corners.begin(), first, corners.end());
+    PolygonKey key = {(int64_t)material, (int64_t)corners.size()};
+    for (auto& corner : corners)
+        key.insert(key.end(), corner.begin(), corner.end());
+    return key;
+}
+
+/// @brief 書き出したメッシュのポリゴンを並べ替えて比較できる形にする
+/// @param mesh メッシュ
+/// @return 比較用のポリゴン (昇順)
+std::vector<PolygonKey> polygon_keys(const TestMesh& mesh)
+{
+    std::vector<PolygonKey> keys;
+    std::vector<CornerKey> corners;
+    for (size_t p = 0; p < mesh.polys.size(); p++)
+    {
+        auto end = p + 1 < mesh.polys.size() ? mesh.polys[p + 1]
+                                             : mesh.indices.size();
+        corners.clear();
+        for (size_t c = mesh.polys[p]; c < end; c++)
+        {
+            auto v = mesh.indices[c];
+            corners.push_back({grid_step(mesh.positions[v * 3]),
+                               grid_step(mesh.positions[v * 3 + 1]),
+                               grid_step(mesh.positions[v * 3 + 2]),
+                               grid_step(mesh.uvs[c * 2]),
+                               grid_step(mesh.uvs[c * 2 + 1])});
+        }
+        keys.push_back(make_polygon_key(mesh.material_indices[p], corners));
+    }
+    std::sort(keys.begin(), keys.end());
+    return keys;
+}
+
+/// @brief 読み込んだメッシュのポリゴンを並べ替えて比較できる形にする
+/// @param mesh メッシュ (indicesを持つUVセットも扱う)
+/// @param uv_set 比較するUVセットの番号
+/// @return 比較用のポリゴン (昇順)
+std::vector<PolygonKey> polygon_keys(const Mesh& mesh, size_t uv_set)
+{
+    auto is_float = mesh.scalar_type == SCALAR_FLOAT32;
+    auto& uv = mesh.uv_sets[uv_set];
+    auto position = [&](size_t v, size_t axis) {
+        if (is_float)
+            return (double)((const float*)mesh.vertices)[v * 3 + axis];
+        auto& p = mesh.vertices[v];
+        return axis == 0 ? p.x : axis == 1 ? p.y : p.z;
+    };
+    auto uv_value = [&](size_t c, size_t axis) {
+        auto i = uv.indices != nullptr ? uv.indices[c] : c;
+        if (is_float) return (double)((const float*)uv.uv)[i * 2 + axis];
+        return axis == 0 ? uv.uv[i].x : uv.uv[i].y;
+    };
+
+    std::vector<PolygonKey> keys;
+    std::vector<CornerKey> corners;
+    for (size_t p = 0; p < mesh.poly_count; p++)
+    {
+        auto end =
+            p + 1 < mesh.poly_count ? mesh.polys[p + 1] : mesh.index_count;
+        corners.clear();
+        for (size_t c = mesh.polys[p]; c < end; c++)
+        {
+            auto v = mesh.indices[c];
+            corners.push_back({grid_step(position(v, 0)),
+                               grid_step(position(v, 1)),
+                               grid_step(position(v, 2)),
+                               grid_step(uv_value(c, 0)),
+                               grid_step(uv_value(c, 1))});
+        }
+        auto material =
+            mesh.material_indices != nullptr ? mesh.material_indices[p] : 0;
+        keys.push_back(make_polygon_key(material, corners));
+    }
+    std::sort(keys.begin(), keys.end());
+    return keys;
+}
+
+/// @brief 名前で子のノードを探す
+/// @param parent 親のノード
+/// @param name 名前
+/// @return 見つかったノード (無ければnullptr)
+const Object* find_object(const Object& parent, const std::string& name)
+{
+    for (size_t i = 0; i < parent.child_count; i++)
+    {
+        auto& child = parent.children[i];
+        if (std::string(child.name, child.name_length) == name) return &child;
+    }
+    return nullptr;
+}
+
+/// @brief 読み込んだシーンが書き出したシーンと同じかどうかを確かめる
+/// ポリゴンの集合 (頂点の座標、uv、マテリアル番号) とマテリアルの割り当てを比べる
+/// @param scene 書き出したシーン
+/// @param imported 読み込んだシーン
+/// @param label 失敗したときに表示する名前
+/// @return 同じかどうか
+bool compare_imported_scene(const TestScene& scene, const IOData& imported,
+                            const std::string& label)
+{
+    auto ok = true;
+    auto fail = [&](const std::string& name, const std::string& message) {
+        std::cerr << label << ": " << name << ": " << message << std::endl;
+        ok = false;
+    };
+    for (auto& source : scene.meshes)
+    {
+        auto object = find_object(*imported.root, source.name);
+        if (object == nullptr || object->mesh == nullptr)
+        {
+            fail(source.name, "mesh node is missing");
+            continue;
+        }
+        if (object->material_slot_count != scene.material_names.size())
+        {
+            fail(source.name, "material slot count differs");
+        }
+        else
+        {
+            for (size_t i = 0; i < object->material_slot_count; i++)
+            {
+                auto slot = object->material_slots[i];
+                if (slot == nullptr ||
+                    std::string(slot->name, slot->name_length) !=
+                        scene.material_names[i])
+                    fail(source.name, "material slot differs");
+            }
+        }
+
+        auto& mesh = *object->mesh;
+        if (mesh.uv_set_count != 1 ||
+            std::string(mesh.uv_sets[0].name, mesh.uv_sets[0].name_length) !=
+                "UVMap")
+        {
+            fail(source.name, "UV set is missing");
+            continue;
+        }
+        if (mesh.index_count != source.indices.size() ||
+            mesh.poly_count != source.polys.size())
+        {
+            fail(source.name, "polygon or corner count differs");
+            continue;
+        }
+        if (polygon_keys(mesh, 0) != polygon_keys(source))
+            fail(source.name, "polygons differ");
+    }
+    return ok;
+}
+
+/// @brief テストで書き出すファイルのパス (一時ディレクトリ)
+/// @param name ファイル名 (拡張子を除く)
+std::string temp_fbx_path(const std::string& name)
+{
+    auto path = std::filesystem::temp_directory_path() /
+                ("halfbx_test_" + name + ".fbx");
+    return (const char*)path.u8string().c_str();
+}
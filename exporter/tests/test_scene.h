@@ -0,0 +1,64 @@
+// Copyright 2023 HALBY
+// This program is distributed under the terms of the MIT License. See the file
+// LICENSE for details.
+
+// 書き出し・読み込みのテスト用の小さなシーン (FBX SDKを使用しない)
+
+#pragma once
+
+#include "../include/io.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// @brief 格子状のメッシュのポリゴンの形
+enum TestShape
+{
+    TEST_SHAPE_QUADS,     // 四角形のみ
+    TEST_SHAPE_TRIANGLES, // 四角形を2つに分けた三角形のみ
+    TEST_SHAPE_MIXED,     // 四角形・三角形・六角形を行ごとに混ぜる
+};
+
+/// @brief テスト用のメッシュ (Blenderから渡されるのと同じfloat32のバッファ)
+/// 座標とuvは1/16の倍数なので、float32でも丸め誤差なく往復できる
+struct TestMesh
+{
+    std::string name;
+    std::vector<float> positions; // xyz
+    std::vector<unsigned int> indices;
+    std::vector<unsigned int> polys;
+    std::vector<unsigned int> material_indices;
+    std::vector<float> uvs; // ポリゴン頂点ごとのuv
+};
+
+/// @brief メッシュとマテリアルを1つずつ持つノードを並べたシーン
+/// 書き出しが終わるまでバッファとビルダーを保持する
+struct TestScene
+{
+    std::vector<TestMesh> meshes;
+    std::vector<MeshBuilder*> builders;
+    std::vector<std::string> material_names;
+    std::vector<Material> materials;
+    std::vector<Material*> slots; // ノードごとに2つずつ
+    std::vector<Object> objects;
+    Object root = {};
+    IOData data = {};
+
+    TestScene() = default;
+    TestScene(const TestScene&) = delete;
+    TestScene& operator=(const TestScene&) = delete;
+    ~TestScene();
+};
+
+// 比較用のポリゴン (マテリアル番号、頂点数、頂点ごとの座標とuvを格子の番号にしたもの)
+using PolygonKey = std::vector<int64_t>;
+
+TestMesh make_grid_mesh(const std::string& name, TestShape shape, size_t size);
+void build_test_scene(TestScene& scene, ScalarType scalar_type);
+std::vector<PolygonKey> polygon_keys(const TestMesh& mesh);
+std::vector<PolygonKey> polygon_keys(const Mesh& mesh, size_t uv_set);
+const Object* find_object(const Object& parent, const std::string& name);
+bool compare_imported_scene(const TestScene& scene, const IOData& imported,
+                            const std::string& label);
+std::string temp_fbx_path(const std::string& name);
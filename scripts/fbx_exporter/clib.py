@@ -102,6 +102,10 @@ class UV(ctypes.Structure):
         ("name", ctypes.c_char_p),
         ("name_length", ctypes.c_size_t),
         ("uv", ctypes.POINTER(Vector2)),
+        # ImportOptions.indexed_attributesで読み込んだ場合だけ使う
+        # (Noneならuvはポリゴン頂点ごと)
+        ("indices", ctypes.POINTER(ctypes.c_uint)),
+        ("value_count", ctypes.c_size_t),
     ]
 
     def __repr__(self):
@@ -116,6 +120,8 @@ class Normal(ctypes.Structure):
         ("name", ctypes.c_char_p),
         ("name_length", ctypes.c_size_t),
         ("normal", ctypes.POINTER(Vector4)),
+        ("indices", ctypes.POINTER(ctypes.c_uint)),
+        ("value_count", ctypes.c_size_t),
     ]
 
     def __repr__(self):
@@ -125,6 +131,14 @@ class Normal(ctypes.Structure):
         return f"{self.__class__.__name__}({fields})"
 
 
+class Skin(ctypes.Structure):
+    def __repr__(self):
+        fields = ",\n".join(
+            f"{field}: {getattr(self, field)}" for field, _ in self._fields_
+        )
+        return f"{self.__class__.__name__}({fields})"
+
+
 class Mesh(ctypes.Structure):
     _fields_ = [
         ("name", ctypes.c_char_p),
@@ -140,7 +154,10 @@ class Mesh(ctypes.Structure):
         ("uv_set_count", ctypes.c_size_t),
         ("normal_sets", ctypes.POINTER(Normal)),
         ("normal_set_count", ctypes.c_size_t),
-        ("is_smooth", ctypes.c_bool)
+        ("is_smooth", ctypes.c_bool),
+        ("smooth_angle", ctypes.c_double),
+        ("scalar_type", ctypes.c_int),
+        ("skin", ctypes.POINTER(Skin)),
     ]
 
     def __repr__(self):
@@ -167,6 +184,18 @@ Object._fields_ = [
     ("mesh", ctypes.POINTER(Mesh)),
     ("material_slots", ctypes.POINTER(ctypes.POINTER(Material))),
     ("material_slot_count", ctypes.c_size_t),
+    ("animation_matrices", ctypes.POINTER(ctypes.c_double)),
+    ("animation_frame_count", ctypes.c_size_t),
+]
+
+Skin._fields_ = [
+    ("bones", ctypes.POINTER(ctypes.POINTER(Object))),
+    ("bone_count", ctypes.c_size_t),
+    ("bind_matrices", ctypes.POINTER(ctypes.c_double)),
+    ("mesh_bind_matrix", ctypes.c_double * 16),
+    ("influence_offsets", ctypes.POINTER(ctypes.c_uint)),
+    ("influence_bones", ctypes.POINTER(ctypes.c_uint)),
+    ("influence_weights", ctypes.POINTER(ctypes.c_float)),
 ]
 
 
@@ -177,6 +206,22 @@ class IOData(ctypes.Structure):
         ("root", ctypes.POINTER(Object)),
         ("materials", ctypes.POINTER(Material)),
         ("material_count", ctypes.c_size_t),
+        ("backend", ctypes.c_int),
+        ("arena", ctypes.c_void_p),
+        ("merge_materials", ctypes.c_bool),
+        ("array_compression", ctypes.c_int),
+        ("compression_level", ctypes.c_int),
+        ("compression_threshold", ctypes.c_size_t),
+        ("cache_dir", ctypes.c_char_p),
+        ("weld_corner_attributes", ctypes.c_bool),
+        ("optimize_vertex_cache", ctypes.c_bool),
+        ("lod_ratios", ctypes.POINTER(ctypes.c_double)),
+        ("lod_count", ctypes.c_size_t),
+        ("frame_rate", ctypes.c_double),
+        ("animation_start", ctypes.c_double),
+        ("key_tolerance", ctypes.c_double),
+        ("max_influences", ctypes.c_size_t),
+        ("weight_bits", ctypes.c_int),
     ]
 
     def __repr__(self):
@@ -186,16 +231,404 @@ class IOData(ctypes.Structure):
         return f"{self.__class__.__name__}({fields})"
 
 
+# import_fbx_streamのコールバック
+ImportMaterialCallback = ctypes.CFUNCTYPE(
+    None, ctypes.c_void_p, ctypes.c_size_t, ctypes.POINTER(Material)
+)
+ImportObjectCallback = ctypes.CFUNCTYPE(
+    None, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_size_t, ctypes.POINTER(Object)
+)
+ImportMeshCallback = ctypes.CFUNCTYPE(
+    None,
+    ctypes.c_void_p,
+    ctypes.POINTER(ctypes.c_size_t),
+    ctypes.c_size_t,
+    ctypes.POINTER(Mesh),
+)
+
+
+# ImportOptions.backend
+IMPORT_BACKEND_AUTO = 0
+IMPORT_BACKEND_NATIVE = 1
+IMPORT_BACKEND_FBXSDK = 2
+
+
+class ImportOptions(ctypes.Structure):
+    _fields_ = [
+        ("indexed_attributes", ctypes.c_bool),
+        ("backend", ctypes.c_int),
+    ]
+
+
+class ImportCallbacks(ctypes.Structure):
+    _fields_ = [
+        ("user_data", ctypes.c_void_p),
+        ("on_material", ImportMaterialCallback),
+        ("on_object", ImportObjectCallback),
+        ("on_mesh", ImportMeshCallback),
+    ]
+
+
+# ImportObjectCallbackのparent (ルート直下)
+IMPORT_NO_PARENT = ctypes.c_size_t(-1).value
+
+
+class ExportProgress(ctypes.Structure):
+    _fields_ = [
+        ("phase", ctypes.c_int),
+        ("items_done", ctypes.c_size_t),
+        ("item_count", ctypes.c_size_t),
+        ("bytes_written", ctypes.c_uint64),
+        ("bytes_total", ctypes.c_uint64),
+    ]
+
+    def __repr__(self):
+        fields = ",\n".join(
+            f"{field}: {getattr(self, field)}" for field, _ in self._fields_
+        )
+        return f"{self.__class__.__name__}({fields})"
+
+
+# ExportProgress.phase
+EXPORT_PHASE_PENDING = 0
+EXPORT_PHASE_PREPARING = 1
+EXPORT_PHASE_BUILDING = 2
+EXPORT_PHASE_WRITING = 3
+EXPORT_PHASE_FINISHED = 4
+EXPORT_PHASE_FAILED = 5
+EXPORT_PHASE_CANCELLED = 6
+
+# IOStats.phasesの添字
+STATS_PHASE_MATERIALS = 0
+STATS_PHASE_NODES = 1
+STATS_PHASE_MESHES = 2
+STATS_PHASE_LAYERS = 3
+STATS_PHASE_SERIALIZE = 4
+STATS_PHASE_COPY_OUT = 5
+STATS_PHASE_COUNT = 6
+STATS_PHASE_NAMES = ("materials", "nodes", "meshes", "layers", "serialize", "copy_out")
+
+
+class PhaseStats(ctypes.Structure):
+    _fields_ = [
+        ("wall_seconds", ctypes.c_double),
+        ("cpu_seconds", ctypes.c_double),
+    ]
+
+
+class IOStats(ctypes.Structure):
+    _fields_ = [
+        ("phases", PhaseStats * STATS_PHASE_COUNT),
+        ("wall_seconds", ctypes.c_double),
+        ("cpu_seconds", ctypes.c_double),
+        ("node_count", ctypes.c_size_t),
+        ("mesh_count", ctypes.c_size_t),
+        ("corner_count", ctypes.c_size_t),
+        ("material_count", ctypes.c_size_t),
+        ("bytes_read", ctypes.c_uint64),
+        ("bytes_written", ctypes.c_uint64),
+        ("peak_allocated_bytes", ctypes.c_uint64),
+        ("succeeded", ctypes.c_bool),
+    ]
+
+    def __repr__(self):
+        lines = [
+            f"{'ok' if self.succeeded else 'failed'} in {self.wall_seconds:.3f}s"
+            f" (cpu {self.cpu_seconds:.3f}s),"
+            f" {self.node_count} nodes, {self.mesh_count} meshes,"
+            f" {self.corner_count} corners, {self.material_count} materials,"
+            f" read {self.bytes_read} B, written {self.bytes_written} B,"
+            f" peak {self.peak_allocated_bytes / (1 << 20):.1f} MiB"
+        ]
+        for name, phase in zip(STATS_PHASE_NAMES, self.phases):
+            lines.append(
+                f"  {name}: {phase.wall_seconds:.3f}s (cpu {phase.cpu_seconds:.3f}s)"
+            )
+        return "\n".join(lines)
+
+# IOData.backend
+IO_BACKEND_FBXSDK = 0
+IO_BACKEND_NATIVE = 1
+
+# IOData.array_compression (ネイティブライタのみ)
+ARRAY_COMPRESSION_DEFLATE = 0
+ARRAY_COMPRESSION_STORE = 1
+
+# compute_normalsの計算方法
+NORMAL_MODE_FLAT = 0
+NORMAL_MODE_SMOOTH_ANGLE = 1
+NORMAL_MODE_SMOOTH_AREA = 2
+NORMAL_MODE_AUTO_SMOOTH = 3
+
+# Mesh.scalar_type (SCALAR_FLOAT32ならvertices, uv, normalはfloatを詰めた配列)
+SCALAR_FLOAT64 = 0
+SCALAR_FLOAT32 = 1
+
+# メッシュビルダーに渡すバッファの成分の型
+COMPONENT_FLOAT32 = 0
+COMPONENT_FLOAT64 = 1
+COMPONENT_INT32 = 2
+COMPONENT_UINT32 = 3
+
+
+
+def buffer_address(buffer) -> ctypes.c_void_p:
+    """バッファ (array.array, numpy配列, ctypesの配列やポインタ) の先頭アドレス"""
+    if isinstance(buffer, ctypes._Pointer):
+        return ctypes.cast(buffer, ctypes.c_void_p)
+    if memoryview(buffer).nbytes == 0:
+        return ctypes.c_void_p()
+    return ctypes.c_void_p(ctypes.addressof(ctypes.c_char.from_buffer(buffer)))
+
+
+class MeshBuilder:
+    """バッファをコピーせずにネイティブ側でMeshを組み立てる
+    渡したバッファは参照されることがあるので、書き出しが終わるまでこのオブジェクトを保持すること
+    """
+
+    def __init__(self, lib: ctypes.CDLL, name: str, scalar_type: int) -> None:
+        self.__lib = lib
+        self.__handle = lib.create_mesh_builder(name.encode("utf-8"), scalar_type)
+        self.__buffers = []
+
+    def __del__(self):
+        if self.__handle:
+            self.__lib.delete_mesh_builder(self.__handle)
+
+    def __set(self, fn, *args, buffer, count, stride, component_type) -> bool:
+        # ネイティブ側が参照し続ける場合があるのでバッファを保持しておく
+        self.__buffers.append(buffer)
+        return fn(
+            self.__handle,
+            *args,
+            buffer_address(buffer),
+            count,
+            stride,
+            component_type,
+        )
+
+    def setPositions(
+        self, buffer, count: int, stride: int = 0, component_type=COMPONENT_FLOAT32
+    ) -> bool:
+        return self.__set(
+            self.__lib.mesh_builder_set_positions,
+            buffer=buffer,
+            count=count,
+            stride=stride,
+            component_type=component_type,
+        )
+
+    def setIndices(
+        self, buffer, count: int, stride: int = 0, component_type=COMPONENT_INT32
+    ) -> bool:
+        return self.__set(
+            self.__lib.mesh_builder_set_indices,
+            buffer=buffer,
+            count=count,
+            stride=stride,
+            component_type=component_type,
+        )
+
+    def setPolys(
+        self, buffer, count: int, stride: int = 0, component_type=COMPONENT_INT32
+    ) -> bool:
+        return self.__set(
+            self.__lib.mesh_builder_set_polys,
+            buffer=buffer,
+            count=count,
+            stride=stride,
+            component_type=component_type,
+        )
+
+    def setMaterialIndices(
+        self, buffer, count: int, stride: int = 0, component_type=COMPONENT_INT32
+    ) -> bool:
+        return self.__set(
+            self.__lib.mesh_builder_set_material_indices,
+            buffer=buffer,
+            count=count,
+            stride=stride,
+            component_type=component_type,
+        )
+
+    def addUV(
+        self,
+        name: str,
+        buffer,
+        count: int,
+        stride: int = 0,
+        component_type=COMPONENT_FLOAT32,
+    ) -> bool:
+        return self.__set(
+            self.__lib.mesh_builder_add_uv_set,
+            name.encode("utf-8"),
+            buffer=buffer,
+            count=count,
+            stride=stride,
+            component_type=component_type,
+        )
+
+    def addNormal(
+        self,
+        name: str,
+        buffer,
+        count: int,
+        stride: int = 0,
+        component_type=COMPONENT_FLOAT32,
+    ) -> bool:
+        return self.__set(
+            self.__lib.mesh_builder_add_normal_set,
+            name.encode("utf-8"),
+            buffer=buffer,
+            count=count,
+            stride=stride,
+            component_type=component_type,
+        )
+
+    def computeNormals(
+        self, name: str, mode: int, crease_angle: float = 0.0
+    ) -> bool:
+        return self.__lib.mesh_builder_compute_normals(
+            self.__handle, name.encode("utf-8"), mode, crease_angle
+        )
+
+    def setSmooth(self, is_smooth: bool, smooth_angle: float = 0.0) -> None:
+        self.__lib.mesh_builder_set_smooth(self.__handle, is_smooth, smooth_angle)
+
+    def getMesh(self) -> Mesh | None:
+        ptr = self.__lib.mesh_builder_get_mesh(self.__handle)
+        return ptr.contents if ptr else None
+
+
+LIB_NAME = "halFBXIO4B.dll" if os.name == "nt" else "libhalFBXIO4B.so"
+
+
+class ExportJob:
+    """バックグラウンドのスレッドで実行中の書き出し
+    書き出すデータ (とそれを組み立てたオブジェクト) は終わるまでkeep_aliveで保持する
+    """
+
+    def __init__(self, lib: ctypes.CDLL, session: int, filepath: str, export_data: IOData, keep_alive) -> None:
+        self.__lib = lib
+        self.__data = export_data
+        self.__keep_alive = keep_alive
+        self.__handle = lib.session_start_export_fbx(
+            session, filepath.encode("utf-8"), ctypes.byref(export_data)
+        )
+
+    def __del__(self):
+        if self.__handle:
+            self.__lib.delete_export_job(self.__handle)
+            self.__handle = None
+
+    def isValid(self) -> bool:
+        return bool(self.__handle)
+
+    def progress(self) -> ExportProgress:
+        progress = ExportProgress()
+        if self.__handle:
+            self.__lib.get_export_progress(self.__handle, ctypes.byref(progress))
+        else:
+            progress.phase = EXPORT_PHASE_FAILED
+        return progress
+
+    def isDone(self) -> bool:
+        return self.progress().phase >= EXPORT_PHASE_FINISHED
+
+    def cancel(self) -> None:
+        if self.__handle:
+            self.__lib.cancel_export(self.__handle)
+
+    def wait(self) -> bool:
+        """終わるまで待ち、書き出しに成功したかどうかを返す"""
+        if not self.__handle:
+            return False
+        return self.__lib.wait_export(self.__handle)
+
+    def stats(self) -> IOStats | None:
+        """終わった書き出しの統計 (終わっていなければNone)
+
+        書き出しは別のスレッドで行うので、CLib.get_last_statsではなくこちらで取得する
+        """
+        stats = IOStats()
+        if not self.__handle or not self.__lib.get_export_job_stats(
+            self.__handle, ctypes.byref(stats)
+        ):
+            return None
+        return stats
+
+
 class CLib(Singleton):
     def __init__(self) -> None:
         self.__lib = ctypes.CDLL(
-            os.path.dirname(os.path.abspath(__file__)) + "/lib/halFBXIO4B.dll"
+            os.path.dirname(os.path.abspath(__file__)) + "/lib/" + LIB_NAME
         )
         self.__init_functions()
+        # FbxManagerを呼び出しの間で使い回す (DLLのアンロード中に破棄しないよう解放しない)
+        # Singletonでも__init__は呼ぶたびに実行されるので、最初の1回だけ作る
+        if getattr(self, "_CLib__session", None) is None:
+            self.__session = self.__lib.create_io_session(0)
 
     def __init_functions(self):
         self.__lib.export_fbx.argtypes = [ctypes.c_char_p, ctypes.POINTER(IOData)]
         self.__lib.export_fbx.restype = ctypes.c_bool
+        self.__lib.start_export_fbx.argtypes = [ctypes.c_char_p, ctypes.POINTER(IOData)]
+        self.__lib.start_export_fbx.restype = ctypes.c_void_p
+        self.__lib.get_export_progress.argtypes = [
+            ctypes.c_void_p,
+            ctypes.POINTER(ExportProgress),
+        ]
+        self.__lib.get_export_progress.restype = None
+        self.__lib.cancel_export.argtypes = [ctypes.c_void_p]
+        self.__lib.cancel_export.restype = None
+        self.__lib.wait_export.argtypes = [ctypes.c_void_p]
+        self.__lib.wait_export.restype = ctypes.c_bool
+        self.__lib.delete_export_job.argtypes = [ctypes.c_void_p]
+        self.__lib.delete_export_job.restype = None
+        self.__lib.get_export_job_stats.argtypes = [
+            ctypes.c_void_p,
+            ctypes.POINTER(IOStats),
+        ]
+        self.__lib.get_export_job_stats.restype = ctypes.c_bool
+        self.__lib.get_last_stats.argtypes = [ctypes.POINTER(IOStats)]
+        self.__lib.get_last_stats.restype = ctypes.c_bool
+        self.__lib.create_io_session.argtypes = [ctypes.c_size_t]
+        self.__lib.create_io_session.restype = ctypes.c_void_p
+        self.__lib.delete_io_session.argtypes = [ctypes.c_void_p]
+        self.__lib.delete_io_session.restype = None
+        self.__lib.session_import_fbx.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+        self.__lib.session_import_fbx.restype = ctypes.POINTER(IOData)
+        self.__lib.session_import_fbx_with_options.argtypes = [
+            ctypes.c_void_p,
+            ctypes.c_char_p,
+            ctypes.POINTER(ImportOptions),
+        ]
+        self.__lib.session_import_fbx_with_options.restype = ctypes.POINTER(IOData)
+        self.__lib.session_import_fbx_stream.argtypes = [
+            ctypes.c_void_p,
+            ctypes.c_char_p,
+            ctypes.POINTER(ImportCallbacks),
+        ]
+        self.__lib.session_import_fbx_stream.restype = ctypes.c_bool
+        self.__lib.session_import_fbx_stream_with_options.argtypes = [
+            ctypes.c_void_p,
+            ctypes.c_char_p,
+            ctypes.POINTER(ImportCallbacks),
+            ctypes.POINTER(ImportOptions),
+        ]
+        self.__lib.session_import_fbx_stream_with_options.restype = ctypes.c_bool
+        self.__lib.session_export_fbx.argtypes = [
+            ctypes.c_void_p,
+            ctypes.c_char_p,
+            ctypes.POINTER(IOData),
+        ]
+        self.__lib.session_export_fbx.restype = ctypes.c_bool
+        self.__lib.session_start_export_fbx.argtypes = [
+            ctypes.c_void_p,
+            ctypes.c_char_p,
+            ctypes.POINTER(IOData),
+        ]
+        self.__lib.session_start_export_fbx.restype = ctypes.c_void_p
         self.__lib.vnrm_from_pnrm.argtypes = [
             ctypes.POINTER(ctypes.c_uint),
             ctypes.c_size_t,
@@ -205,18 +638,143 @@ class CLib(Singleton):
             ctypes.POINTER(Vector4),
         ]
         self.__lib.vnrm_from_pnrm.restype = None
+        self.__lib.fix_normal_rot.argtypes = [
+            ctypes.POINTER(Vector4),
+            ctypes.c_size_t,
+        ]
+        self.__lib.fix_normal_rot.restype = None
+        self.__lib.compute_normals.argtypes = [
+            ctypes.POINTER(Mesh),
+            ctypes.c_int,
+            ctypes.c_double,
+            ctypes.POINTER(Normal),
+        ]
+        self.__lib.compute_normals.restype = ctypes.c_bool
         self.__lib.import_fbx.argtypes = [ctypes.c_char_p]
         self.__lib.import_fbx.restype = ctypes.POINTER(IOData)
+        self.__lib.import_fbx_with_options.argtypes = [
+            ctypes.c_char_p,
+            ctypes.POINTER(ImportOptions),
+        ]
+        self.__lib.import_fbx_with_options.restype = ctypes.POINTER(IOData)
+        self.__lib.import_fbx_stream.argtypes = [
+            ctypes.c_char_p,
+            ctypes.POINTER(ImportCallbacks),
+        ]
+        self.__lib.import_fbx_stream.restype = ctypes.c_bool
+        self.__lib.import_fbx_stream_with_options.argtypes = [
+            ctypes.c_char_p,
+            ctypes.POINTER(ImportCallbacks),
+            ctypes.POINTER(ImportOptions),
+        ]
+        self.__lib.import_fbx_stream_with_options.restype = ctypes.c_bool
         self.__lib.delete_iodata.argtypes = [ctypes.POINTER(IOData)]
         self.__lib.delete_iodata.restype = None
 
-    def import_fbx(self, filepath: str) -> IOData:
-        ptr: ctypes.POINTER = self.__lib.import_fbx(filepath.encode("utf-8"))
+        self.__lib.create_mesh_builder.argtypes = [ctypes.c_char_p, ctypes.c_int]
+        self.__lib.create_mesh_builder.restype = ctypes.c_void_p
+        buffer_args = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_int]
+        for fn in (
+            self.__lib.mesh_builder_set_positions,
+            self.__lib.mesh_builder_set_indices,
+            self.__lib.mesh_builder_set_polys,
+            self.__lib.mesh_builder_set_material_indices,
+        ):
+            fn.argtypes = [ctypes.c_void_p] + buffer_args
+            fn.restype = ctypes.c_bool
+        for fn in (
+            self.__lib.mesh_builder_add_uv_set,
+            self.__lib.mesh_builder_add_normal_set,
+        ):
+            fn.argtypes = [ctypes.c_void_p, ctypes.c_char_p] + buffer_args
+            fn.restype = ctypes.c_bool
+        self.__lib.mesh_builder_compute_normals.argtypes = [
+            ctypes.c_void_p,
+            ctypes.c_char_p,
+            ctypes.c_int,
+            ctypes.c_double,
+        ]
+        self.__lib.mesh_builder_compute_normals.restype = ctypes.c_bool
+        self.__lib.mesh_builder_set_smooth.argtypes = [
+            ctypes.c_void_p,
+            ctypes.c_bool,
+            ctypes.c_double,
+        ]
+        self.__lib.mesh_builder_set_smooth.restype = None
+        self.__lib.mesh_builder_get_mesh.argtypes = [ctypes.c_void_p]
+        self.__lib.mesh_builder_get_mesh.restype = ctypes.POINTER(Mesh)
+        self.__lib.delete_mesh_builder.argtypes = [ctypes.c_void_p]
+        self.__lib.delete_mesh_builder.restype = None
+
+    def import_fbx(
+        self,
+        filepath: str,
+        indexed_attributes: bool = False,
+        backend: int = IMPORT_BACKEND_AUTO,
+    ) -> IOData:
+        """indexed_attributesならUV・法線は値とポリゴン頂点ごとの番号 (indices) で返す
+        backendはIMPORT_BACKEND_* (既定はバイナリFBX 7.xのみネイティブで読む)
+        """
+        options = ImportOptions(indexed_attributes, backend)
+        ptr: ctypes.POINTER = self.__lib.session_import_fbx_with_options(
+            self.__session, filepath.encode("utf-8"), ctypes.byref(options)
+        )
         return ptr.contents
 
+    def import_fbx_stream(
+        self,
+        filepath: str,
+        on_material,
+        on_object,
+        on_mesh,
+        indexed_attributes: bool = False,
+        backend: int = IMPORT_BACKEND_AUTO,
+    ) -> bool:
+        """読み込んだ順にコールバックを呼ぶ
+
+        on_material(index, material), on_object(index, parent, object),
+        on_mesh(object_indices, mesh) の順に呼ばれる。parentはルート直下ならNone。
+        渡した構造体はコールバックの中でだけ使う (meshは戻ると解放される)
+        indexed_attributesならUV・法線は値とポリゴン頂点ごとの番号 (indices) で渡す
+        backendはimport_fbxと同じ
+        """
+        callbacks = ImportCallbacks(
+            None,
+            ImportMaterialCallback(lambda _, i, mat: on_material(i, mat.contents)),
+            ImportObjectCallback(
+                lambda _, i, parent, obj: on_object(
+                    i, None if parent == IMPORT_NO_PARENT else parent, obj.contents
+                )
+            ),
+            ImportMeshCallback(
+                lambda _, objs, count, mesh: on_mesh(
+                    [objs[i] for i in range(count)], mesh.contents
+                )
+            ),
+        )
+        options = ImportOptions(indexed_attributes, backend)
+        return self.__lib.session_import_fbx_stream_with_options(
+            self.__session,
+            filepath.encode("utf-8"),
+            ctypes.byref(callbacks),
+            ctypes.byref(options),
+        )
+
     def export_fbx(self, filepath: str, export_data: IOData) -> str:
         export_data_ptr = ctypes.pointer(export_data)
-        return self.__lib.export_fbx(filepath.encode("utf-8"), export_data_ptr)
+        return self.__lib.session_export_fbx(
+            self.__session, filepath.encode("utf-8"), export_data_ptr
+        )
+
+    def start_export_fbx(self, filepath: str, export_data: IOData, keep_alive=None) -> ExportJob:
+        return ExportJob(self.__lib, self.__session, filepath, export_data, keep_alive)
+
+    def get_last_stats(self) -> IOStats | None:
+        """このスレッドで最後に終わった書き出し・読み込みの統計 (まだ無ければNone)"""
+        stats = IOStats()
+        if not self.__lib.get_last_stats(ctypes.byref(stats)):
+            return None
+        return stats
 
     def delete_iodata(self, ptr: ctypes.POINTER) -> None:
         self.__lib.delete_iodata(ptr)
@@ -235,6 +793,35 @@ class CLib(Singleton):
         )
         return list(out_vertex_normals_array)
 
+    def computeNormals(
+        self, name: str, mesh: Mesh, mode: int, crease_angle: float = 0.0
+    ) -> Normal | None:
+        normal = Normal(
+            name=name.encode("utf-8"),
+            name_length=len(name),
+            normal=(Vector4 * mesh.index_count)(),
+        )
+        if not self.__lib.compute_normals(
+            ctypes.byref(mesh), mode, crease_angle, ctypes.byref(normal)
+        ):
+            return None
+        self.__lib.fix_normal_rot(normal.normal, mesh.index_count)
+        return normal
+
+    def setNormals(self, mesh: Mesh, normals: list[Normal]) -> None:
+        mesh.normal_sets = (Normal * len(normals))(*normals)
+        mesh.normal_set_count = len(normals)
+
+    def fix_normal_rot(self, normals: list[Vector4]) -> list[Vector4]:
+        normals_array = (Vector4 * len(normals))(*normals)
+        self.__lib.fix_normal_rot(normals_array, len(normals))
+        return list(normals_array)
+
+    def createMeshBuilder(
+        self, name: str, scalar_type: int = SCALAR_FLOAT32
+    ) -> MeshBuilder:
+        return MeshBuilder(self.__lib, name, scalar_type)
+
     def createObject(
         self,
         name: str,
@@ -242,7 +829,9 @@ class CLib(Singleton):
         children: list[Object],
         mesh: Mesh | None,
         material_slots: list[ctypes.POINTER],
+        animation_matrices: ctypes.Array[ctypes.c_double] | None = None,  # フレームごとのlocal_matrix
     ) -> Object:
+        frame_count = len(animation_matrices) // 16 if animation_matrices else 0
         return Object(
             name=name.encode("utf-8"),
             name_length=len(name),
@@ -254,6 +843,8 @@ class CLib(Singleton):
                 *material_slots
             ),
             material_slot_count=len(material_slots),
+            animation_matrices=animation_matrices if frame_count > 0 else None,
+            animation_frame_count=frame_count,
         )
 
     def createExportData(
@@ -262,14 +853,62 @@ class CLib(Singleton):
         is_ascii: bool,
         unit_scale: float,
         materials: ctypes.Array[Material],  # Arrayじゃないとアドレスが変わる
+        backend: int = IO_BACKEND_FBXSDK,
+        merge_materials: bool = False,
+        array_compression: int = ARRAY_COMPRESSION_DEFLATE,
+        compression_level: int = 0,  # 0なら既定 (6)
+        cache_dir: str | None = None,  # 書き出しキャッシュの置き場所 (ネイティブのみ)
+        weld_corner_attributes: bool = False,  # 法線・UVの同じ値をまとめる
+        optimize_vertex_cache: bool = False,  # ポリゴンを頂点キャッシュ向けに並べ替える
+        lod_ratios: list[float] | None = None,  # LOD1から順の残す三角形数の割合
+        frame_rate: float = 0.0,  # アニメーションの1秒あたりのフレーム数 (0なら30)
+        animation_start: float = 0.0,  # 最初のフレームの時刻 (秒)
+        key_tolerance: float = 0.0,  # キー削減の許容誤差の倍率 (0なら1、負なら減らさない)
+        max_influences: int = 0,  # 頂点ごとに残すボーンの影響の数 (0なら減らさない)
+        weight_bits: int = 0,  # スキンの重みを量子化するビット数 (0ならしない)
     ) -> IOData:
         print('is_ascii:', is_ascii)
+        lod_ratios = lod_ratios or []
         return IOData(
             root=ctypes.pointer(root),
             is_ascii=is_ascii,
             unit_scale=unit_scale,
             materials=materials,
             material_count=len(materials),
+            backend=backend,
+            merge_materials=merge_materials,
+            array_compression=array_compression,
+            compression_level=compression_level,
+            cache_dir=cache_dir.encode("utf-8") if cache_dir else None,
+            weld_corner_attributes=weld_corner_attributes,
+            optimize_vertex_cache=optimize_vertex_cache,
+            lod_ratios=(ctypes.c_double * len(lod_ratios))(*lod_ratios),
+            lod_count=len(lod_ratios),
+            frame_rate=frame_rate,
+            animation_start=animation_start,
+            key_tolerance=key_tolerance,
+            max_influences=max_influences,
+            weight_bits=weight_bits,
+        )
+
+    def createSkin(
+        self,
+        bone_count: int,
+        bind_matrices: ctypes.Array[ctypes.c_double],  # ボーンごとのバインド時のワールド行列
+        mesh_bind_matrix: list[float],
+        influence_offsets: ctypes.Array[ctypes.c_uint],  # 頂点数 + 1
+        influence_bones: ctypes.Array[ctypes.c_uint],
+        influence_weights: ctypes.Array[ctypes.c_float],
+    ) -> Skin:
+        # ボーンはツリーを組み立てた後でないとアドレスが決まらないので、後からbonesに入れる
+        return Skin(
+            bones=(ctypes.POINTER(Object) * bone_count)(),
+            bone_count=bone_count,
+            bind_matrices=bind_matrices,
+            mesh_bind_matrix=(ctypes.c_double * 16)(*mesh_bind_matrix),
+            influence_offsets=influence_offsets,
+            influence_bones=influence_bones,
+            influence_weights=influence_weights,
         )
 
     def createMesh(
@@ -282,6 +921,7 @@ class CLib(Singleton):
         polys: list[int],
         mat_indices: list[int],
         is_smooth: bool,
+        smooth_angle: float = 0.0,
     ) -> Mesh:
         return Mesh(
             name=name.encode("utf-8"),
@@ -298,6 +938,7 @@ class CLib(Singleton):
             normal_sets=(Normal * len(normals))(*normals),
             normal_set_count=len(normals),
             is_smooth=is_smooth,
+            smooth_angle=smooth_angle,
         )
 
     def createMaterial(
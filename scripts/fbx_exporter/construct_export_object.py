@@ -1,9 +1,13 @@
 # Copyright 2023 HALBY
 # This software is released under the MIT License, see LICENSE.
 
+import array
 import bpy
 import itertools
-from .clib import IOData, Material, Mesh, UV, Normal, Object, CLib, Vector2, Vector4
+import numpy
+from .clib import IOData, Material, Mesh, UV, Normal, Object, Skin, CLib, Vector2, Vector4, IO_BACKEND_FBXSDK
+from .clib import NORMAL_MODE_FLAT, NORMAL_MODE_SMOOTH_ANGLE, NORMAL_MODE_AUTO_SMOOTH
+from .clib import MeshBuilder, ARRAY_COMPRESSION_DEFLATE
 import pprint
 import ctypes
 
@@ -11,24 +15,100 @@ class ConstructIOObject:
     def __init__(self, objs: list[bpy.types.Object]) -> None:
         self.__clib = CLib()
         self.objs = objs
+        # 書き出しが終わるまでメッシュのバッファを保持しておく
+        self.__builders: list[MeshBuilder] = []
+        # リンク複製は評価後のメッシュも共有するので1回だけ変換する
+        self.__meshes: dict[int, Mesh | None] = {}
+        # 書き出しが終わるまでフレームごとの行列を保持しておく
+        self.__animations: dict[str, ctypes.Array[ctypes.c_double]] = {}
+        # スキンを書き出す場合の設定と、書き出しが終わるまで保持するスキン
+        self.__export_skin = False
+        self.__skins: dict[int, Skin] = {}
+        # ボーンを後から引くための、スキンごとのアーマチュア名とボーン名の並び
+        self.__skin_bones: list[tuple[Skin, str, list[str]]] = []
+        # アーマチュアのオブジェクト名ごとの子の先頭にあるボーンの根の数
+        self.__bone_roots: dict[str, int] = {}
 
-    def importData(self, path: str) -> None:
-        idata = self.__clib.import_fbx(path)
+    def importData(self, path: str, indexed_attributes: bool = False) -> None:
+        # 読み込み中にデータブロックを作るので、シーン全体のコピーは持たない
+        # (メッシュはノードの作成時に空で作り、中身が読み込まれ次第埋める)
+        bmats: dict[int, bpy.types.Material] = {}
+        bmeshes: dict[int, bpy.types.Mesh] = {}
+        bobjs: list[bpy.types.Object] = []
 
-        mats_ptr: ctypes.POINTER = idata.materials
-        imats: list[Material] = []
-        for i in range(idata.material_count):
-            imats.append(mats_ptr[i])
-        self.__importMats(imats)
+        def on_material(index: int, imat: Material) -> None:
+            bmats[ctypes.addressof(imat)] = self.__importMat(imat)
 
-        objs_ptr: ctypes.POINTER = idata.root
-        self.__importObjsRecursive(objs_ptr)
+        def on_object(index: int, parent: int | None, iobj: Object) -> None:
+            bmesh = None
+            if iobj.mesh:
+                key = ctypes.addressof(iobj.mesh.contents)
+                bmesh = bmeshes.get(key)
+                if bmesh is None:
+                    bmesh = bpy.data.meshes.new(iobj.mesh.contents.name.decode("utf-8"))
+                    bmeshes[key] = bmesh
+                    for i in range(iobj.material_slot_count):
+                        slot = iobj.material_slots[i]
+                        bmesh.materials.append(
+                            bmats.get(ctypes.addressof(slot.contents)) if slot else None
+                        )
+            bobj = bpy.data.objects.new(iobj.name.decode("utf-8"), bmesh)
+            bpy.context.collection.objects.link(bobj)
+            if parent is not None:
+                bobj.parent = bobjs[parent]
+            m = iobj.local_matrix
+            # 最後の要素が0の行列は読み込み側が埋めていないので、単位行列のままにする
+            if m[15] == 0.0:
+                print(f"halFBXIO4B import: degenerate matrix for {bobj.name}")
+            else:
+                bobj.matrix_local = [m[i * 4 : i * 4 + 4] for i in range(4)]
+            bobjs.append(bobj)
 
-        self.__clib.delete_iodata(ctypes.pointer(idata))
+        def on_mesh(object_indices: list[int], imesh: Mesh) -> None:
+            self.__importMesh(imesh, bobjs[object_indices[0]].data)
 
-    def getExportData(self, is_ascii: bool) -> IOData:
+        self.__clib.import_fbx_stream(path, on_material, on_object, on_mesh, indexed_attributes)
+
+    def getExportData(
+        self,
+        is_ascii: bool,
+        backend: int = IO_BACKEND_FBXSDK,
+        merge_materials: bool = False,
+        array_compression: int = ARRAY_COMPRESSION_DEFLATE,
+        compression_level: int = 0,
+        cache_dir: str | None = None,
+        weld_corner_attributes: bool = False,
+        optimize_vertex_cache: bool = False,
+        lod_ratios: list[float] | None = None,
+        bake_animation: bool = False,
+        key_tolerance: float = 0.0,
+        export_skin: bool = False,
+        max_influences: int = 0,
+        weight_bits: int = 0,
+    ) -> IOData:
+        scene = bpy.context.scene
+        frame_rate = scene.render.fps / scene.render.fps_base
+        if bake_animation:
+            self.__animations = self.__sampleAnimations(self.objs)
         mat_pairs = self.__createMatPairs(self.objs)
-        objs = self.__getObjs(self.objs, mat_pairs)
+
+        # スキンはバインド時 (レスト位置) のメッシュとボーンを書き出す
+        self.__export_skin = export_skin
+        posed = []
+        if export_skin:
+            posed = [
+                arm for arm in bpy.data.armatures if arm.pose_position != "REST"
+            ]
+            for arm in posed:
+                arm.pose_position = "REST"
+            bpy.context.view_layer.update()
+        try:
+            objs = self.__getObjs(self.objs, mat_pairs)
+        finally:
+            for arm in posed:
+                arm.pose_position = "POSE"
+            if posed:
+                bpy.context.view_layer.update()
         object = self.__clib.createObject(
             name="root",
             local_matrix=[1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1],
@@ -36,12 +116,55 @@ class ConstructIOObject:
             mesh=None,
             material_slots=[],  # Use the converted material_slots
         )
-        scene = bpy.context.scene
+        self.__resolveBones(object)
         unit_scale = scene.unit_settings.scale_length
         materials = mat_pairs[1]
-        export_data = self.__clib.createExportData(object, is_ascii, unit_scale, materials)
+        export_data = self.__clib.createExportData(
+            object,
+            is_ascii,
+            unit_scale,
+            materials,
+            backend,
+            merge_materials,
+            array_compression,
+            compression_level,
+            cache_dir,
+            weld_corner_attributes,
+            optimize_vertex_cache,
+            lod_ratios,
+            frame_rate,
+            scene.frame_start / frame_rate,
+            key_tolerance,
+            max_influences,
+            weight_bits,
+        )
         return export_data
 
+    def __sampleAnimations(
+        self, bobjs: list[bpy.types.Object]
+    ) -> dict[str, ctypes.Array[ctypes.c_double]]:
+        # フレームを1つずつ進めて全てのオブジェクトのmatrix_localを記録する
+        # (キーの削減とカーブへの分解はネイティブで並列に行う)
+        scene = bpy.context.scene
+        allbobjs: list[bpy.types.Object] = []
+        pending = list(bobjs)
+        while pending:
+            bobj = pending.pop()
+            allbobjs.append(bobj)
+            pending.extend(bobj.children)
+
+        samples = {bobj.name: array.array("d") for bobj in allbobjs}
+        current = scene.frame_current
+        for frame in range(scene.frame_start, scene.frame_end + 1):
+            scene.frame_set(frame)
+            for bobj in allbobjs:
+                samples[bobj.name].extend(itertools.chain.from_iterable(bobj.matrix_local))
+        scene.frame_set(current)
+        return {
+            name: (ctypes.c_double * len(values)).from_buffer(values)
+            for name, values in samples.items()
+        }
+
     def __getObjs(
         self,
         bobjs: list[bpy.types.Object],
@@ -53,11 +176,21 @@ class ConstructIOObject:
             m: list[list[float]] = bobj.matrix_local
             matrix_local = list(itertools.chain.from_iterable(m))
             children: list[Object] = self.__getObjs(list(bobj.children), mat_pairs)
+            if self.__export_skin and bobj.type == "ARMATURE":
+                # ボーンはアーマチュアの子の先頭に置く
+                bones = self.__getBones(bobj)
+                self.__bone_roots[name] = len(bones)
+                children = bones + children
             mesh_data = None
             if bobj.type == "MESH":
                 depsgraph = bpy.context.evaluated_depsgraph_get()
                 bmesh = bobj.evaluated_get(depsgraph).data
-                mesh_data = self.__createMesh(bmesh)
+                key = bmesh.as_pointer()
+                if key not in self.__meshes:
+                    self.__meshes[key] = self.__createMesh(bmesh)
+                    if self.__export_skin and self.__meshes[key] is not None:
+                        self.__createSkin(bobj, bmesh, self.__meshes[key])
+                mesh_data = self.__meshes[key]
             mat_slots: list[ctypes._Pointer[Material]] = []
             for slot in bobj.material_slots:
                 bmat: bpy.types.Material = slot.material
@@ -66,11 +199,95 @@ class ConstructIOObject:
 
             objs.append(
                 self.__clib.createObject(
-                    name, matrix_local, children, mesh_data, mat_slots
+                    name, matrix_local, children, mesh_data, mat_slots,
+                    self.__animations.get(name),
                 )
             )
         return objs
 
+    def __getBones(self, barm: bpy.types.Object) -> list[Object]:
+        # レスト位置のボーンを親からの相対の行列を持つオブジェクトにする
+        def create(bone: bpy.types.Bone) -> Object:
+            m = bone.matrix_local
+            if bone.parent is not None:
+                m = bone.parent.matrix_local.inverted() @ m
+            return self.__clib.createObject(
+                bone.name,
+                list(itertools.chain.from_iterable(m)),
+                [create(child) for child in bone.children],
+                None,
+                [],
+            )
+
+        return [create(bone) for bone in barm.data.bones if bone.parent is None]
+
+    def __createSkin(self, bobj: bpy.types.Object, bmesh: bpy.types.Mesh, mesh: Mesh) -> None:
+        # 最初のアーマチュアモディファイアのボーンと頂点グループの重みをスキンにする
+        barm = next(
+            (
+                modifier.object
+                for modifier in bobj.modifiers
+                if modifier.type == "ARMATURE" and modifier.object is not None
+            ),
+            None,
+        )
+        if barm is None or not bobj.vertex_groups:
+            return
+        bones = list(barm.data.bones)
+        bone_indices = {bone.name: i for i, bone in enumerate(bones)}
+        group_bones = [bone_indices.get(group.name, -1) for group in bobj.vertex_groups]
+
+        offsets = array.array("I", [0]) * (len(bmesh.vertices) + 1)
+        influence_bones = array.array("I")
+        influence_weights = array.array("f")
+        for vertex in bmesh.vertices:
+            for group in vertex.groups:
+                bone = group_bones[group.group] if group.group < len(group_bones) else -1
+                if bone >= 0 and group.weight > 0.0:
+                    influence_bones.append(bone)
+                    influence_weights.append(group.weight)
+            offsets[vertex.index + 1] = len(influence_bones)
+        if not influence_bones:
+            return
+
+        bind = array.array("d")
+        for bone in bones:
+            bind.extend(itertools.chain.from_iterable(barm.matrix_world @ bone.matrix_local))
+        skin = self.__clib.createSkin(
+            len(bones),
+            (ctypes.c_double * len(bind)).from_buffer(bind),
+            list(itertools.chain.from_iterable(bobj.matrix_world)),
+            (ctypes.c_uint * len(offsets)).from_buffer(offsets),
+            (ctypes.c_uint * len(influence_bones)).from_buffer(influence_bones),
+            (ctypes.c_float * len(influence_weights)).from_buffer(influence_weights),
+        )
+        self.__skins[ctypes.addressof(mesh)] = skin
+        self.__skin_bones.append((skin, barm.name, [bone.name for bone in bones]))
+        mesh.skin = ctypes.pointer(skin)
+
+    def __resolveBones(self, root: Object) -> None:
+        # ツリーを組み立てると子は配列にコピーされるので、組み立て後のボーンを引く
+        bone_objects: dict[str, dict[str, ctypes._Pointer[Object]]] = {}
+
+        def visit(obj: Object, armature: str | None) -> None:
+            name = obj.name.decode("utf-8")
+            root_count = self.__bone_roots.get(name, 0) if armature is None else obj.child_count
+            for i in range(obj.child_count):
+                child = obj.children[i]
+                owner = armature
+                if owner is None and i < root_count:
+                    owner = name
+                if owner is not None:
+                    bone_objects.setdefault(owner, {})[child.name.decode("utf-8")] = ctypes.pointer(child)
+                visit(child, owner)
+
+        visit(root, None)
+        for skin, armature, names in self.__skin_bones:
+            bones = bone_objects.get(armature, {})
+            for i, name in enumerate(names):
+                if name in bones:
+                    skin.bones[i] = bones[name]
+
     def __createMatPairs(
         self, bobjs: list[bpy.types.Object]
     ) -> tuple[list[bpy.types.Material], ctypes.Array[Material]]:
@@ -96,78 +313,50 @@ class ConstructIOObject:
             emats[bmats.index(bmat)] = emat
         return (bmats, emats)
 
-    def __createMesh(self, bmesh: bpy.types.Mesh) -> Mesh:
-        polys: list[int] = []
-        indices: list[int] = []
-        mat_indices: list[int] = []
-        index = 0
-        is_smooth = bmesh.use_auto_smooth
-        poly_index = 0
-        for polygon in bmesh.polygons:
-            polys.append(index)
-            mat_indices.append(polygon.material_index - 1)
-            poly_index += 1
-            for vert in polygon.vertices:
-                indices.append(vert)
-                index += 1
-
-        normals: list[Normal] = self.__createNormals(bmesh, indices, polys)
-
-        uvs: list[UV] = []
-        for uv_layer in bmesh.uv_layers:
-            uv = [Vector2(uv.vector.x, uv.vector.y) for uv in uv_layer.uv]
-            uvs.append(
-                self.__clib.createUV(
-                    uv_layer.name,
-                    uv,
-                )
-            )
-
-        vertices: list[Vector4] = []
-        for vertex in bmesh.vertices:
-            vertices.append(Vector4(vertex.co.x, vertex.co.y, vertex.co.z, 1))
-
-        mesh = self.__clib.createMesh(
-            bmesh.name, vertices, normals, uvs, indices, polys, mat_indices, is_smooth
-        )
+    def __createMesh(self, bmesh: bpy.types.Mesh) -> Mesh | None:
+        # foreach_getで取り出したバッファをそのままネイティブに渡して組み立てる
+        vertex_count = len(bmesh.vertices)
+        loop_count = len(bmesh.loops)
+        poly_count = len(bmesh.polygons)
+        builder = self.__clib.createMeshBuilder(bmesh.name)
+        self.__builders.append(builder)
 
-        return mesh
+        positions = array.array("f", [0.0]) * (vertex_count * 3)
+        bmesh.vertices.foreach_get("co", positions)
+        indices = array.array("i", [0]) * loop_count
+        bmesh.loops.foreach_get("vertex_index", indices)
+        polys = array.array("i", [0]) * poly_count
+        bmesh.polygons.foreach_get("loop_start", polys)
+        mat_indices = array.array("i", [0]) * poly_count
+        bmesh.polygons.foreach_get("material_index", mat_indices)
 
-    def __createNormals(
-        self, bmesh: bpy.types.Mesh, indices: list[int], polys: list[int]
-    ) -> list[Normal]:
-        normals: list[Normal] = []
-
-        if len(bmesh.corner_normals) > 0:  # 頂点法線の場合
-            normal_vecs: list[Vector4] = []
-            for corner_normal in bmesh.corner_normals:
-                normal_vecs.append(
-                    Vector4(corner_normal.x, corner_normal.y, corner_normal.z, 1)
-                )
-            normal = self.__clib.createNormal("Normal", normal_vecs)
-            normals.append(normal)
-
-        elif len(bmesh.polygon_normals) > 0:  # 面法線の場合
-            poly_normals: list[Vector4] = []
-            for polygon_normal in bmesh.polygon_normals:
-                poly_normals.append(
-                    Vector4(
-                        polygon_normal.vector.x,
-                        polygon_normal.vector.y,
-                        polygon_normal.vector.z,
-                        1,
-                    )
-                )
-            vertex_normals = self.__clib.vnrm_from_pnrm(indices, polys, poly_normals)
-            normal_vecs: list[Vector4] = []
-            for vertex_normal in vertex_normals:
-                normal_vecs.append(
-                    Vector4(vertex_normal.x, vertex_normal.y, vertex_normal.z, 1)
-                )
-            normal = self.__clib.createNormal("Normal", normal_vecs)
-            normals.append(normal)
+        builder.setPositions(positions, vertex_count)
+        builder.setIndices(indices, loop_count)
+        builder.setPolys(polys, poly_count)
+        builder.setMaterialIndices(mat_indices, poly_count)
+        for uv_layer in bmesh.uv_layers:
+            uvs = array.array("f", [0.0]) * (loop_count * 2)
+            uv_layer.data.foreach_get("uv", uvs)
+            builder.addUV(uv_layer.name, uvs, loop_count)
+        builder.setSmooth(bmesh.use_auto_smooth, bmesh.auto_smooth_angle)
 
-        return normals
+        # カスタム分割法線はそのまま書き出す (Z-upからY-upへ (x, z, -y) に変換する)
+        if loop_count > 0 and bmesh.has_custom_normals:
+            corner_normals = numpy.empty(loop_count * 3, dtype=numpy.float32)
+            bmesh.corner_normals.foreach_get("vector", corner_normals)
+            normals = numpy.ascontiguousarray(corner_normals.reshape(-1, 3)[:, [0, 2, 1]])
+            normals[:, 2] *= -1.0
+            builder.addNormal("Normal", normals, loop_count)
+        # それ以外の頂点法線はネイティブで計算する (自動スムーズ、スムーズ、フラット)
+        elif loop_count > 0:
+            if bmesh.use_auto_smooth:
+                mode = NORMAL_MODE_AUTO_SMOOTH
+            elif any(polygon.use_smooth for polygon in bmesh.polygons):
+                mode = NORMAL_MODE_SMOOTH_ANGLE
+            else:
+                mode = NORMAL_MODE_FLAT
+            builder.computeNormals("Normal", mode, bmesh.auto_smooth_angle)
+        return builder.getMesh()
 
     def __createMatFromShader(self, name: str) -> Material:
         mat = bpy.data.materials[name]
@@ -199,43 +388,54 @@ class ConstructIOObject:
             emissive=Vector4(emissive[0], emissive[1], emissive[2], 1),
         )
 
-    def __importMats(self, imats: list[Material]):
-        for imat in imats:
-            name = imat.name
-            bmat = bpy.data.materials.new(imat.name)
-            bmat.use_nodes = True
-            p_bsdf: bpy.types.Node = bmat.node_tree.nodes["Principled BSDF"]
-            p_bsdf.inputs["Base Color"].default_value = (
-                imat.basecolor.x,
-                imat.basecolor.y,
-                imat.basecolor.z,
-                mat.basecolor.w,
-            )
-            p_bsdf.inputs["Metallic"].default_value = imat.metallic
-            p_bsdf.inputs["Roughness"].default_value = imat.roughness
-            p_bsdf.inputs["Emission"].default_value = (
-                imat.emissive.x,
-                imat.emissive.y,
-                imat.emissive.z,
-                imat.emissive.w,
-            )
-            p_bsdf.inputs["Alpha"].default_value = imat.basecolor.w
+    def __importMat(self, imat: Material) -> bpy.types.Material:
+        surf = imat.standard_surface
+        bmat = bpy.data.materials.new(imat.name.decode("utf-8"))
+        bmat.use_nodes = True
+        p_bsdf: bpy.types.Node = bmat.node_tree.nodes["Principled BSDF"]
+        p_bsdf.inputs["Base Color"].default_value = (
+            surf.base_color.x,
+            surf.base_color.y,
+            surf.base_color.z,
+            surf.base_color.w,
+        )
+        p_bsdf.inputs["Metallic"].default_value = surf.metalness
+        p_bsdf.inputs["Roughness"].default_value = surf.specular_roughness
+        p_bsdf.inputs["Alpha"].default_value = surf.opacity
+        return bmat
 
-    def __importObjsRecursive(self, node: ctypes.POINTER):
-        if node is None:
-            return
-        iobj = node.contents
-        bobj = bpy.data.objects.new(iobj.name, None)
-        bpy.context.collection.objects.link(bobj)
-        bobj.matrix_local = iobj.matrix_local
-        if iobj.mesh is not None:
-            self.__importMesh(iobj.mesh, bobj)
-        pass
-
-    def __importMesh(self, imesh: ctypes.POINTER, bobj: bpy.types.Object):
-        mesh = imesh.contents
-        bmesh = bpy.data.meshes.new(mesh.name)
-        bmesh.from_pydata(mesh.vertices, [], mesh.polygons)
+    def __importMesh(self, imesh: Mesh, bmesh: bpy.types.Mesh) -> None:
+        # imeshはコールバックから戻ると解放されるので、ここで全てコピーする
+        verts = [
+            (v.x, v.y, v.z) for v in imesh.vertices[: imesh.vertex_count]
+        ]
+        indices = imesh.indices[: imesh.index_count]
+        starts = imesh.polys[: imesh.poly_count] + [imesh.index_count]
+        faces = [indices[starts[i] : starts[i + 1]] for i in range(imesh.poly_count)]
+        bmesh.from_pydata(verts, [], faces)
+
+        if imesh.material_indices and imesh.poly_count > 0:
+            bmesh.polygons.foreach_set(
+                "material_index", imesh.material_indices[: imesh.poly_count]
+            )
+        for i in range(imesh.uv_set_count):
+            iuv = imesh.uv_sets[i]
+            layer = bmesh.uv_layers.new(name=iuv.name.decode("utf-8"))
+            if imesh.index_count > 0 and iuv.indices:
+                # 値とポリゴン頂点ごとの番号で読み込んだ場合はnumpyでまとめて展開する
+                values = numpy.ctypeslib.as_array(
+                    ctypes.cast(iuv.uv, ctypes.POINTER(ctypes.c_double)),
+                    shape=(iuv.value_count, 2),
+                )
+                uv_indices = numpy.ctypeslib.as_array(
+                    iuv.indices, shape=(imesh.index_count,)
+                )
+                layer.data.foreach_set(
+                    "uv", values[uv_indices].astype(numpy.float32).ravel()
+                )
+            elif imesh.index_count > 0:
+                uvs = ctypes.cast(
+                    iuv.uv, ctypes.POINTER(ctypes.c_double * (2 * imesh.index_count))
+                ).contents
+                layer.data.foreach_set("uv", uvs[:])
         bmesh.update()
-        bobj.data = bmesh
-        pass
@@ -3,7 +3,7 @@
 
 import bpy
 from .construct_export_object import ConstructIOObject
-from .clib import CLib
+from .clib import CLib, ExportJob, IO_BACKEND_FBXSDK, ARRAY_COMPRESSION_DEFLATE
 
 
 class Exporter:
@@ -11,21 +11,35 @@ class Exporter:
         self.__clib = CLib()
         pass
 
-    def export(self, objs: list[bpy.types.Object], is_ascii: bool, filepath: str, ext: str):
+    def export(self, objs: list[bpy.types.Object], is_ascii: bool, filepath: str, ext: str, backend: int = IO_BACKEND_FBXSDK, merge_materials: bool = False, array_compression: int = ARRAY_COMPRESSION_DEFLATE, compression_level: int = 0, cache_dir: str | None = None, weld_corner_attributes: bool = False, optimize_vertex_cache: bool = False, lod_ratios: list[float] | None = None, bake_animation: bool = False, key_tolerance: float = 0.0, export_skin: bool = False, max_influences: int = 0, weight_bits: int = 0):
         filepath = bpy.path.ensure_ext(filepath, ext)
 
         eo = ConstructIOObject(objs)
-        data = eo.getExportData(is_ascii)
+        data = eo.getExportData(is_ascii, backend, merge_materials, array_compression, compression_level, cache_dir, weld_corner_attributes, optimize_vertex_cache, lod_ratios, bake_animation, key_tolerance, export_skin, max_influences, weight_bits)
         result = self.__clib.export_fbx(filepath, data)
 
         print(result)
+        self.logStats()
+
+    def startExport(self, objs: list[bpy.types.Object], is_ascii: bool, filepath: str, ext: str, backend: int = IO_BACKEND_FBXSDK, merge_materials: bool = False, array_compression: int = ARRAY_COMPRESSION_DEFLATE, compression_level: int = 0, cache_dir: str | None = None, weld_corner_attributes: bool = False, optimize_vertex_cache: bool = False, lod_ratios: list[float] | None = None, bake_animation: bool = False, key_tolerance: float = 0.0, export_skin: bool = False, max_influences: int = 0, weight_bits: int = 0) -> ExportJob:
+        """書き出すデータを組み立て、ファイルへの書き出しはバックグラウンドで開始する"""
+        filepath = bpy.path.ensure_ext(filepath, ext)
+
+        eo = ConstructIOObject(objs)
+        data = eo.getExportData(is_ascii, backend, merge_materials, array_compression, compression_level, cache_dir, weld_corner_attributes, optimize_vertex_cache, lod_ratios, bake_animation, key_tolerance, export_skin, max_influences, weight_bits)
+        return self.__clib.start_export_fbx(filepath, data, keep_alive=eo)
+
+    def logStats(self, job: ExportJob | None = None) -> None:
+        """最後の書き出し (jobがあればその書き出し) の段階ごとの時間と件数をコンソールに出力する"""
+        stats = job.stats() if job is not None else self.__clib.get_last_stats()
+        print(f"halFBXIO4B export: {stats}")
 
 class Importer:
     def __init__(self) -> None:
         self.__clib = CLib()
         pass
 
-    def importData(self, path: str) -> None:
+    def importData(self, path: str, indexed_attributes: bool = False) -> None:
         eo = ConstructIOObject([])
-        eo.importData(path)
-        pass
+        eo.importData(path, indexed_attributes)
+        print(f"halFBXIO4B import: {self.__clib.get_last_stats()}")
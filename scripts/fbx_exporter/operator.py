@@ -2,10 +2,32 @@
 # This software is released under the MIT License, see LICENSE.
 
 from operator import is_
+import os
+import tempfile
 import bpy
 import bpy_extras
-from bpy.props import StringProperty, EnumProperty
+from bpy.props import StringProperty, EnumProperty, BoolProperty, IntProperty, FloatProperty
 from .importer_exporter import Exporter, Importer
+from .clib import (
+    IO_BACKEND_FBXSDK,
+    IO_BACKEND_NATIVE,
+    ARRAY_COMPRESSION_DEFLATE,
+    ARRAY_COMPRESSION_STORE,
+    EXPORT_PHASE_FINISHED,
+    EXPORT_PHASE_CANCELLED,
+    EXPORT_PHASE_PREPARING,
+    EXPORT_PHASE_BUILDING,
+    EXPORT_PHASE_WRITING,
+)
+
+# 書き出しキャッシュの置き場所 (Blenderを再起動しても使えるように一時ディレクトリに置く)
+EXPORT_CACHE_DIR = os.path.join(tempfile.gettempdir(), "halFBXIO4B_cache")
+
+EXPORT_PHASE_LABELS = {
+    EXPORT_PHASE_PREPARING: "メッシュを変換中",
+    EXPORT_PHASE_BUILDING: "シーンを構築中",
+    EXPORT_PHASE_WRITING: "書き出し中",
+}
 
 class halFBXExporterOperator(bpy.types.Operator, bpy_extras.io_utils.ExportHelper):
     """This appears in the tooltip of the operator and in the generated docs"""
@@ -36,6 +58,110 @@ class halFBXExporterOperator(bpy.types.Operator, bpy_extras.io_utils.ExportHelpe
         default='binary',
     )
 
+    backend: EnumProperty(
+        name="書き出し方式",
+        description="",
+        items=(
+            ('fbxsdk', "FBX SDK", "Export with the FBX SDK"),
+            ('native', "Native", "Stream binary FBX directly without the FBX SDK"),
+        ),
+        default='fbxsdk',
+    )
+
+    merge_materials: BoolProperty(
+        name="同一マテリアルの統合",
+        description="Merge materials whose surface parameters are identical",
+        default=False,
+    )
+
+    array_compression: EnumProperty(
+        name="配列の圧縮",
+        description="Compression of large arrays (native binary export only)",
+        items=(
+            ('deflate', "Deflate", "Compress large arrays with zlib on all cores"),
+            ('store', "Store", "Write arrays uncompressed (fast, for scratch exports)"),
+        ),
+        default='deflate',
+    )
+
+    compression_level: IntProperty(
+        name="圧縮レベル",
+        description="zlib compression level (1 = fastest, 9 = smallest)",
+        min=1,
+        max=9,
+        default=6,
+    )
+
+    use_export_cache: BoolProperty(
+        name="書き出しキャッシュ",
+        description="Reuse converted geometry of unchanged meshes and skip writing when the scene is unchanged (native binary export only)",
+        default=False,
+    )
+
+    weld_corner_attributes: BoolProperty(
+        name="法線・UVの共有",
+        description="Store each distinct normal and UV once and reference it by index (IndexToDirect)",
+        default=False,
+    )
+
+    optimize_vertex_cache: BoolProperty(
+        name="頂点キャッシュ向けの並べ替え",
+        description="Reorder polygons so that shared vertices are reused while they are still in the GPU vertex cache",
+        default=False,
+    )
+
+    lod_count: IntProperty(
+        name="LODの数",
+        description="Number of simplified levels to add under each mesh object as an LOD group (0 = no LODs)",
+        min=0,
+        max=4,
+        default=0,
+    )
+
+    lod_reduction: FloatProperty(
+        name="LODごとの割合",
+        description="Fraction of triangles kept by each LOD relative to the previous level",
+        min=0.05,
+        max=0.95,
+        default=0.5,
+    )
+
+    bake_animation: BoolProperty(
+        name="アニメーションのベイク",
+        description="Sample the local transforms of every frame in the scene range and export them as linear key curves",
+        default=False,
+    )
+
+    key_tolerance: FloatProperty(
+        name="キー削減の許容誤差",
+        description="Multiplier on the default key reduction tolerances (0.0001 units / 0.01 degrees); 0 keeps every frame",
+        min=0.0,
+        max=100.0,
+        default=1.0,
+    )
+
+    export_skin: BoolProperty(
+        name="スキンの書き出し",
+        description="Export armature bones and vertex group weights as skin clusters with a bind pose",
+        default=False,
+    )
+
+    max_influences: IntProperty(
+        name="頂点ごとの影響の最大数",
+        description="Keep only the strongest bone influences per vertex and renormalize them; 0 keeps every influence",
+        min=0,
+        max=32,
+        default=4,
+    )
+
+    weight_bits: IntProperty(
+        name="重みの量子化ビット数",
+        description="Quantize skin weights to this many bits while keeping each vertex summing to one; 0 disables quantization",
+        min=0,
+        max=16,
+        default=0,
+    )
+
     def draw(self, context: bpy.types.Context):
         layout = self.layout
         layout.label(text="FBX SDKを使用してFBXファイルをエクスポートします。")
@@ -43,14 +169,96 @@ class halFBXExporterOperator(bpy.types.Operator, bpy_extras.io_utils.ExportHelpe
         box = layout.box()
         box.label(text="保存形式:")
         box.prop(self, "save_format")
+        box.prop(self, "backend")
+        box.prop(self, "merge_materials")
+        box.prop(self, "weld_corner_attributes")
+        box.prop(self, "optimize_vertex_cache")
+        box.prop(self, "lod_count")
+        if self.lod_count > 0:
+            box.prop(self, "lod_reduction")
+        box.prop(self, "bake_animation")
+        if self.bake_animation:
+            box.prop(self, "key_tolerance")
+        box.prop(self, "export_skin")
+        if self.export_skin:
+            box.prop(self, "max_influences")
+            box.prop(self, "weight_bits")
+        if self.backend == 'native' and self.save_format == 'binary':
+            box.prop(self, "array_compression")
+            if self.array_compression == 'deflate':
+                box.prop(self, "compression_level")
+            box.prop(self, "use_export_cache")
 
     def execute(self, context: bpy.types.Context):
         objs = context.selected_objects
         filepath: str = self.filepath
         ext = self.filename_ext
         is_ascii = self.save_format == 'ascii'
-        self.exporter.export(objs, is_ascii, filepath, ext)
+        backend = IO_BACKEND_NATIVE if self.backend == 'native' else IO_BACKEND_FBXSDK
+        # ネイティブの書き出しはバイナリのみ (ライブラリ側でも失敗する)
+        if is_ascii and backend == IO_BACKEND_NATIVE:
+            self.report({'ERROR'}, "ASCII形式はFBX SDKの書き出し方式でのみ書き出せます。")
+            return {'CANCELLED'}
+        compression = ARRAY_COMPRESSION_STORE if self.array_compression == 'store' else ARRAY_COMPRESSION_DEFLATE
+        cache_dir = EXPORT_CACHE_DIR if self.use_export_cache else None
+        lod_ratios = [self.lod_reduction ** (i + 1) for i in range(self.lod_count)]
+        # 0はネイティブ側では既定の倍率なので、全フレームを残す場合は負の値を渡す
+        key_tolerance = self.key_tolerance if self.key_tolerance > 0.0 else -1.0
+
+        # 書き出しはバックグラウンドで行い、UIを止めずに進捗を表示する (Escで中断)
+        self._job = self.exporter.startExport(
+            objs, is_ascii, filepath, ext, backend, self.merge_materials, compression, self.compression_level, cache_dir,
+            self.weld_corner_attributes, self.optimize_vertex_cache, lod_ratios,
+            self.bake_animation, key_tolerance, self.export_skin, self.max_influences, self.weight_bits
+        )
+        if not self._job.isValid():
+            self.report({'ERROR'}, "書き出しを開始できませんでした。")
+            return {'CANCELLED'}
+        if context.window is None:
+            return self.__finish(context, self._job.wait())
+
+        wm = context.window_manager
+        self._timer = wm.event_timer_add(0.1, window=context.window)
+        wm.progress_begin(0, 1000)
+        wm.modal_handler_add(self)
+        return {'RUNNING_MODAL'}
+
+    def modal(self, context: bpy.types.Context, event: bpy.types.Event):
+        if event.type == 'ESC':
+            self._job.cancel()
+        if event.type != 'TIMER':
+            return {'RUNNING_MODAL'}
+
+        progress = self._job.progress()
+        if progress.phase >= EXPORT_PHASE_FINISHED:
+            return self.__finish(context, self._job.wait())
+
+        if progress.bytes_total > 0:
+            ratio = progress.bytes_written / progress.bytes_total
+        elif progress.item_count > 0:
+            ratio = progress.items_done / progress.item_count
+        else:
+            ratio = 0.0
+        context.window_manager.progress_update(int(ratio * 1000))
+        label = EXPORT_PHASE_LABELS.get(progress.phase, "準備中")
+        context.workspace.status_text_set(f"FBX {label}: {ratio * 100:.0f}% (Escで中断)")
+        return {'RUNNING_MODAL'}
 
+    def __finish(self, context: bpy.types.Context, result: bool):
+        phase = self._job.progress().phase
+        self.exporter.logStats(self._job)
+        self._job = None
+        if context.window is not None:
+            wm = context.window_manager
+            wm.event_timer_remove(self._timer)
+            wm.progress_end()
+            context.workspace.status_text_set(None)
+        if phase == EXPORT_PHASE_CANCELLED:
+            self.report({'WARNING'}, "書き出しを中断しました。")
+            return {'CANCELLED'}
+        if not result:
+            self.report({'ERROR'}, "書き出しに失敗しました。")
+            return {'CANCELLED'}
         return {'FINISHED'}
 
 class halFBXImporterOperator(bpy.types.Operator, bpy_extras.io_utils.ImportHelper):